@@ -0,0 +1,99 @@
+/**
+ * Selfoss RSS reader micro updater
+ *
+ *   Copyright (C) 2013 Vladimir Ermakov <vooon341@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "selfoss_mupdate.h"
+#include <dlfcn.h>
+#include <limits.h>
+#include <unistd.h>
+
+/*
+ * --alloc-profile: malloc traffic per pipeline stage and source.
+ *
+ * The counting allocator is an LD_PRELOAD shim (allocprof_shim.c), so a
+ * normal run has no wrapper on malloc at all; what stays in the updater
+ * are alloc_stage() markers, a NULL hook test per stage change.  The
+ * option re-executes the updater with the shim preloaded from the
+ * directory of the binary, then the markers are wired to it and the
+ * tables are printed at exit.
+ */
+
+#define ALLOCPROF_SO		PROGNAME "-allocprof.so"
+#define ALLOCPROF_ENV		"SELFOSS_MUPDATE_ALLOCPROF"
+
+void (*alloc_stage_hook)(int stage, int source_id);
+static void (*alloc_report_hook)(FILE *fl);
+
+static void alloc_profile_report(void)
+{
+	alloc_report_hook(stdout);
+}
+
+/* returns only on failure or with the shim loaded */
+int alloc_profile_init(char *argv[])
+{
+	char exe[PATH_MAX], *so, *p, *preload;
+	ssize_t n;
+
+	alloc_stage_hook = (void (*)(int, int)) dlsym(RTLD_DEFAULT, "mupdate_allocprof_stage");
+	alloc_report_hook = (void (*)(FILE *)) dlsym(RTLD_DEFAULT, "mupdate_allocprof_report");
+	if (alloc_stage_hook != NULL && alloc_report_hook != NULL) {
+		atexit(alloc_profile_report);
+		return 0;
+	}
+	alloc_stage_hook = NULL;
+
+	if (getenv(ALLOCPROF_ENV) != NULL) {
+		warnx("%s not loaded", ALLOCPROF_SO);
+		return -1;
+	}
+
+	n = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+	if (n < 0) {
+		warn("readlink(/proc/self/exe)");
+		return -1;
+	}
+	exe[n] = '\0';
+	p = strrchr(exe, '/');
+	if (p != NULL)
+		*p = '\0';
+
+	if (asprintf(&so, "%s/%s", exe, ALLOCPROF_SO) < 0)
+		err(1, "out of memory");
+	if (access(so, R_OK) < 0) {
+		warn("%s", so);
+		free(so);
+		return -1;
+	}
+
+	preload = getenv("LD_PRELOAD");
+	if (preload != NULL && *preload != '\0') {
+		if (asprintf(&p, "%s:%s", so, preload) < 0)
+			err(1, "out of memory");
+		free(so);
+		so = p;
+	}
+
+	setenv("LD_PRELOAD", so, 1);
+	setenv(ALLOCPROF_ENV, "1", 1);
+	free(so);
+
+	execv("/proc/self/exe", argv);
+	warn("execv(/proc/self/exe)");
+	return -1;
+}
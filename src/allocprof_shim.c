@@ -0,0 +1,346 @@
+/**
+ * Selfoss RSS reader micro updater
+ *
+ *   Copyright (C) 2013 Vladimir Ermakov <vooon341@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * LD_PRELOAD shim of --alloc-profile, built as
+ * selfoss_mupdate-allocprof.so and never linked into the updater.
+ *
+ * Replaces malloc and friends (glibc interposition, libc internal
+ * callers included) and forwards to __libc_malloc.  Every block gets a
+ * 16 byte header with its size, stage and source, so frees are charged
+ * to the stage and source that allocated, whichever thread frees.
+ * The updater sets the thread's current stage through
+ * mupdate_allocprof_stage() at the alloc_stage() markers.
+ */
+
+#include "selfoss_mupdate.h"
+#include <malloc.h>
+
+#define HDR_SIZE		16
+#define HDR_MAGIC		0xa10c
+#define PROF_SOURCES		4096	/* power of 2 */
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+struct alloc_hdr {
+	uint64_t size;
+	int32_t source;
+	uint8_t stage;
+	uint8_t align_shift;	/* header at block + (1 << align_shift) - 16 */
+	uint16_t magic;
+};
+
+struct alloc_counters {
+	int id;			/* source id, 0 - free slot */
+	unsigned long calls;
+	unsigned long frees;
+	unsigned long long bytes;
+	long long live;
+	long long peak;
+};
+
+static const char *stage_names[ALLOC_N_STAGES] = {
+	"other", "fetch", "parse", "iconv", "sanitize", "write"
+};
+
+static struct alloc_counters stages[ALLOC_N_STAGES];
+static struct alloc_counters sources[PROF_SOURCES];
+static struct alloc_counters sources_overflow;
+
+static __thread int cur_stage __attribute__((tls_model("initial-exec")));
+static __thread int cur_source __attribute__((tls_model("initial-exec")));
+
+/* -*- accounting -*- */
+
+static struct alloc_counters *source_slot(int id)
+{
+	unsigned i, n;
+
+	if (id <= 0)
+		return &sources_overflow;
+
+	for (i = id & (PROF_SOURCES - 1), n = 0; n < PROF_SOURCES;
+			i = (i + 1) & (PROF_SOURCES - 1), n++) {
+		/* lost the race for a free slot: may be ours now */
+		if (sources[i].id == 0)
+			__sync_bool_compare_and_swap(&sources[i].id, 0, id);
+		if (sources[i].id == id)
+			return &sources[i];
+	}
+
+	return &sources_overflow;
+}
+
+static void account_alloc(struct alloc_counters *c, size_t size)
+{
+	long long live, peak;
+
+	__sync_fetch_and_add(&c->calls, 1);
+	__sync_fetch_and_add(&c->bytes, size);
+	live = __sync_add_and_fetch(&c->live, size);
+
+	while ((peak = c->peak) < live &&
+			!__sync_bool_compare_and_swap(&c->peak, peak, live))
+		;
+}
+
+static void account_free(struct alloc_counters *c, size_t size)
+{
+	__sync_fetch_and_add(&c->frees, 1);
+	__sync_fetch_and_sub(&c->live, size);
+}
+
+static void *block_init(void *block, size_t size, unsigned align_shift)
+{
+	struct alloc_hdr *h;
+	char *user;
+
+	if (block == NULL)
+		return NULL;
+
+	user = (char *) block + (1 << align_shift);
+	h = (struct alloc_hdr *) (user - HDR_SIZE);
+	h->size = size;
+	h->source = cur_source;
+	h->stage = cur_stage;
+	h->align_shift = align_shift;
+	h->magic = HDR_MAGIC;
+
+	account_alloc(&stages[h->stage], size);
+	account_alloc(source_slot(h->source), size);
+
+	return user;
+}
+
+static struct alloc_hdr *block_hdr(void *ptr)
+{
+	struct alloc_hdr *h = (struct alloc_hdr *) ((char *) ptr - HDR_SIZE);
+
+	return (h->magic == HDR_MAGIC) ? h : NULL;
+}
+
+static void *block_start(struct alloc_hdr *h)
+{
+	return (char *) h + HDR_SIZE - (1 << h->align_shift);
+}
+
+static void block_release(struct alloc_hdr *h)
+{
+	account_free(&stages[h->stage], h->size);
+	account_free(source_slot(h->source), h->size);
+	h->magic = 0;
+}
+
+/* -*- interposed -*- */
+
+void *malloc(size_t size)
+{
+	if (size > SIZE_MAX - HDR_SIZE)
+		return NULL;
+	return block_init(__libc_malloc(size + HDR_SIZE), size, 4);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	if (size && nmemb > (SIZE_MAX - HDR_SIZE) / size)
+		return NULL;
+	return block_init(__libc_calloc(1, nmemb * size + HDR_SIZE), nmemb * size, 4);
+}
+
+void free(void *ptr)
+{
+	struct alloc_hdr *h;
+
+	if (ptr == NULL)
+		return;
+
+	h = block_hdr(ptr);
+	if (h == NULL) {
+		/* not ours, allocated before the shim was loaded */
+		__libc_free(ptr);
+		return;
+	}
+
+	block_release(h);
+	__libc_free(block_start(h));
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	struct alloc_hdr *h;
+	void *block, *user;
+
+	if (ptr == NULL)
+		return malloc(size);
+	if (size == 0) {
+		free(ptr);
+		return NULL;
+	}
+
+	h = block_hdr(ptr);
+	if (h == NULL)
+		return __libc_realloc(ptr, size);
+
+	/* aligned blocks move, realloc keeps no alignment anyway */
+	if (h->align_shift != 4) {
+		user = malloc(size);
+		if (user != NULL) {
+			memcpy(user, ptr, (h->size < size) ? h->size : size);
+			free(ptr);
+		}
+		return user;
+	}
+
+	if (size > SIZE_MAX - HDR_SIZE)
+		return NULL;
+
+	/* charged as free of the old block and a new allocation */
+	block_release(h);
+	block = __libc_realloc(block_start(h), size + HDR_SIZE);
+	if (block == NULL) {
+		/* old block is still there */
+		h->magic = HDR_MAGIC;
+		account_alloc(&stages[h->stage], h->size);
+		account_alloc(source_slot(h->source), h->size);
+		return NULL;
+	}
+
+	return block_init(block, size, 4);
+}
+
+void *reallocarray(void *ptr, size_t nmemb, size_t size)
+{
+	if (size && nmemb > SIZE_MAX / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return realloc(ptr, nmemb * size);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+	unsigned shift = 4;
+
+	while ((1UL << shift) < alignment)
+		shift++;
+	if (shift > 24 || size > SIZE_MAX - (1UL << shift))
+		return NULL;
+
+	return block_init(__libc_memalign(1UL << shift, size + (1UL << shift)), size, shift);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	void *p;
+
+	if (alignment < sizeof(void *) || (alignment & (alignment - 1)))
+		return EINVAL;
+
+	p = memalign(alignment, size);
+	if (p == NULL)
+		return ENOMEM;
+
+	*memptr = p;
+	return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+	return memalign(alignment, size);
+}
+
+void *valloc(size_t size)
+{
+	return memalign(4096, size);
+}
+
+void *pvalloc(size_t size)
+{
+	return memalign(4096, (size + 4095) & ~(size_t) 4095);
+}
+
+size_t malloc_usable_size(void *ptr)
+{
+	struct alloc_hdr *h;
+
+	if (ptr == NULL)
+		return 0;
+
+	h = block_hdr(ptr);
+	return (h != NULL) ? h->size : 0;
+}
+
+/* -*- updater interface -*- */
+
+void mupdate_allocprof_stage(int stage, int source_id)
+{
+	cur_stage = (stage >= 0 && stage < ALLOC_N_STAGES) ? stage : ALLOC_OTHER;
+	if (source_id >= 0)
+		cur_source = source_id;
+}
+
+static int counters_cmp(const void *a, const void *b)
+{
+	const struct alloc_counters *ca = a, *cb = b;
+
+	return (ca->bytes < cb->bytes) - (ca->bytes > cb->bytes);
+}
+
+static void counters_print(FILE *fl, const char *name, const struct alloc_counters *c)
+{
+	fprintf(fl, "%-10s %12lu %12lu %14llu %12lld %12lld\n",
+			name, c->calls, c->frees, c->bytes, c->live, c->peak);
+}
+
+void mupdate_allocprof_report(FILE *fl)
+{
+	struct alloc_counters *list;
+	char name[16];
+	size_t i, n = 0;
+
+	/* snapshot first, the report allocates too */
+	list = __libc_malloc(sizeof(sources));
+	if (list != NULL) {
+		for (i = 0; i < PROF_SOURCES; i++)
+			if (sources[i].id != 0)
+				list[n++] = sources[i];
+		qsort(list, n, sizeof(*list), counters_cmp);
+	}
+
+	fprintf(fl, "alloc profile by stage:\n");
+	fprintf(fl, "%-10s %12s %12s %14s %12s %12s\n",
+			"stage", "allocs", "frees", "bytes", "live", "peak live");
+	for (i = 0; i < ALLOC_N_STAGES; i++)
+		counters_print(fl, stage_names[i], &stages[i]);
+
+	fprintf(fl, "alloc profile by source:\n");
+	fprintf(fl, "%-10s %12s %12s %14s %12s %12s\n",
+			"source", "allocs", "frees", "bytes", "live", "peak live");
+	for (i = 0; i < n; i++) {
+		snprintf(name, sizeof(name), "#%d", list[i].id);
+		counters_print(fl, name, &list[i]);
+	}
+	counters_print(fl, "none", &sources_overflow);
+
+	__libc_free(list);
+}
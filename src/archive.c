@@ -0,0 +1,355 @@
+/**
+ * Selfoss RSS reader micro updater
+ *
+ *   Copyright (C) 2013 Vladimir Ermakov <vooon341@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "selfoss_mupdate.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+ * Fetch archive for --record / --replay.
+ *
+ * One append-only file per run, WARC-like records:
+ *
+ *   MUPDATE/1.0\r\n
+ *   Source-Id: 12\r\n
+ *   Target-URI: http://...\r\n
+ *   Date: 2013-05-18T10:00:00Z\r\n
+ *   Fetch-Time-Ms: 123.456\r\n
+ *   Fetch-Result: 0\r\n
+ *   [Fetch-Error: ...\r\n]
+ *   Headers-Length: N\r\n
+ *   Content-Length: M\r\n
+ *   \r\n
+ *   <N bytes of response headers><M bytes of body>\r\n\r\n
+ *
+ * and a text index next to it (.idx): "<source id> <offset> <length>\n".
+ */
+
+#define ARCHIVE_MAGIC		"MUPDATE/1.0"
+#define ARCHIVE_SUFFIX		".warc"
+#define INDEX_SUFFIX		".idx"
+
+struct archive_entry {
+	int source_id;
+	off_t offset;
+	size_t length;
+};
+
+static pthread_mutex_t archive_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* record */
+static FILE *archive_fp;
+static FILE *index_fp;
+
+/* replay */
+static int replay_fd = -1;
+static struct archive_entry *replay_index;
+static size_t replay_n;
+
+/* -*- record -*- */
+
+int archive_record_open(const char *dir)
+{
+	char path[PATH_MAX];
+	char tbuf[32];
+	time_t now = time(NULL);
+	struct tm tm;
+	int n;
+
+	gmtime_r(&now, &tm);
+	strftime(tbuf, sizeof(tbuf), "%Y%m%d-%H%M%S", &tm);
+
+	n = snprintf(path, sizeof(path), "%s/mupdate-%s-%d" ARCHIVE_SUFFIX,
+			dir, tbuf, (int) getpid());
+	if (n >= sizeof(path))
+		errx(1, "archive path too long");
+
+	archive_fp = fopen(path, "wx");
+	if (archive_fp == NULL) {
+		warn("fopen(%s)", path);
+		return -1;
+	}
+
+	strcpy(path + n - strlen(ARCHIVE_SUFFIX), INDEX_SUFFIX);
+	index_fp = fopen(path, "wx");
+	if (index_fp == NULL) {
+		warn("fopen(%s)", path);
+		fclose(archive_fp);
+		archive_fp = NULL;
+		return -1;
+	}
+
+	debug("recording to %s", path);
+	return 0;
+}
+
+/* fetch stage: append job fetch result */
+void archive_record(const struct feed_job *job)
+{
+	char tbuf[32];
+	time_t now;
+	struct tm tm;
+	off_t offset;
+	long length;
+
+	if (archive_fp == NULL)
+		return;
+
+	now = time(NULL);
+	gmtime_r(&now, &tm);
+	strftime(tbuf, sizeof(tbuf), "%Y-%m-%dT%H:%M:%SZ", &tm);
+
+	pthread_mutex_lock(&archive_lock);
+
+	offset = ftello(archive_fp);
+
+	fprintf(archive_fp, ARCHIVE_MAGIC "\r\n");
+	fprintf(archive_fp, "Source-Id: %d\r\n", job->src->id);
+	fprintf(archive_fp, "Target-URI: %s\r\n", job->src->url);
+	fprintf(archive_fp, "Date: %s\r\n", tbuf);
+	fprintf(archive_fp, "Fetch-Time-Ms: %.3f\r\n", job->fetch_ms);
+	fprintf(archive_fp, "Fetch-Result: %d\r\n", job->rc);
+	if (job->rc != 0)
+		fprintf(archive_fp, "Fetch-Error: %s\r\n", job->error);
+	fprintf(archive_fp, "Headers-Length: %zu\r\n", job->headers_sz);
+	fprintf(archive_fp, "Content-Length: %zu\r\n", job->body_sz);
+	fprintf(archive_fp, "\r\n");
+	if (job->headers_sz)
+		fwrite(job->headers, 1, job->headers_sz, archive_fp);
+	if (job->body_sz)
+		fwrite(job->body, 1, job->body_sz, archive_fp);
+	fprintf(archive_fp, "\r\n\r\n");
+
+	length = ftello(archive_fp) - offset;
+
+	/* index line only after complete record */
+	fflush(archive_fp);
+	fprintf(index_fp, "%d %lld %ld\n", job->src->id, (long long) offset, length);
+	fflush(index_fp);
+
+	if (ferror(archive_fp) || ferror(index_fp))
+		err(1, "archive write failed");
+
+	pthread_mutex_unlock(&archive_lock);
+}
+
+/* -*- replay -*- */
+
+static int archive_select(const struct dirent *de)
+{
+	size_t len = strlen(de->d_name);
+
+	return len > strlen(ARCHIVE_SUFFIX) &&
+		!strcmp(de->d_name + len - strlen(ARCHIVE_SUFFIX), ARCHIVE_SUFFIX);
+}
+
+/* path is an archive file or a directory, then latest archive is used */
+int archive_replay_open(const char *path)
+{
+	char apath[PATH_MAX];
+	struct stat st;
+	FILE *fp;
+	size_t allocated = 0;
+	struct archive_entry e;
+	long long offset;
+
+	if (stat(path, &st) < 0) {
+		warn("stat(%s)", path);
+		return -1;
+	}
+
+	if (S_ISDIR(st.st_mode)) {
+		struct dirent **list;
+		int n;
+
+		n = scandir(path, &list, archive_select, alphasort);
+		if (n <= 0) {
+			warnx("%s: no archives found", path);
+			return -1;
+		}
+
+		/* names carry timestamp, last one is the latest run */
+		snprintf(apath, sizeof(apath), "%s/%s", path, list[n - 1]->d_name);
+		while (n--)
+			free(list[n]);
+		free(list);
+	}
+	else
+		snprintf(apath, sizeof(apath), "%s", path);
+
+	replay_fd = open(apath, O_RDONLY);
+	if (replay_fd < 0) {
+		warn("open(%s)", apath);
+		return -1;
+	}
+
+	if (strlen(apath) > strlen(ARCHIVE_SUFFIX))
+		strcpy(apath + strlen(apath) - strlen(ARCHIVE_SUFFIX), INDEX_SUFFIX);
+
+	fp = fopen(apath, "r");
+	if (fp == NULL) {
+		warn("fopen(%s)", apath);
+		close(replay_fd);
+		replay_fd = -1;
+		return -1;
+	}
+
+	while (fscanf(fp, "%d %lld %zu\n", &e.source_id, &offset, &e.length) == 3) {
+		if (replay_n == allocated) {
+			allocated = (allocated) ? allocated * 2 : 64;
+			replay_index = realloc(replay_index, allocated * sizeof(*replay_index));
+			if (replay_index == NULL)
+				err(1, "out of memory");
+		}
+
+		e.offset = offset;
+		replay_index[replay_n++] = e;
+	}
+
+	fclose(fp);
+
+	debug("replay from %s: %zu records", apath, replay_n);
+	return 0;
+}
+
+bool archive_replaying(void)
+{
+	return replay_fd >= 0;
+}
+
+static struct archive_entry *archive_find(int source_id)
+{
+	size_t i;
+
+	/* latest record wins */
+	for (i = replay_n; i > 0; i--)
+		if (replay_index[i - 1].source_id == source_id)
+			return &replay_index[i - 1];
+
+	return NULL;
+}
+
+bool archive_replay_has(int source_id)
+{
+	return archive_find(source_id) != NULL;
+}
+
+static const char *record_field(const char *hdr, const char *name)
+{
+	const char *p;
+	size_t len = strlen(name);
+
+	for (p = hdr; p != NULL && *p; p = strstr(p, "\r\n"), p = (p) ? p + 2 : NULL) {
+		if (!strncmp(p, name, len) && p[len] == ':')
+			return p + len + 1 + strspn(p + len + 1, " ");
+	}
+
+	return NULL;
+}
+
+/* fetch stage replacement: load recorded fetch result */
+int archive_replay(struct feed_job *job)
+{
+	struct archive_entry *e;
+	const char *v;
+	char *rec, *data;
+	size_t headers_sz, body_sz;
+	ssize_t ret;
+	int rc;
+
+	e = archive_find(job->src->id);
+	if (e == NULL) {
+		job_error(job, "Replay Error: source not in archive");
+		return 1;
+	}
+
+	rec = malloc(e->length + 1);
+	if (rec == NULL)
+		err(1, "out of memory");
+
+	ret = pread(replay_fd, rec, e->length, e->offset);
+	if (ret != (ssize_t) e->length) {
+		job_error(job, "Replay Error: short read");
+		free(rec);
+		return 1;
+	}
+	rec[e->length] = '\0';
+
+	data = strstr(rec, "\r\n\r\n");
+	if (strncmp(rec, ARCHIVE_MAGIC "\r\n", strlen(ARCHIVE_MAGIC) + 2) || data == NULL) {
+		job_error(job, "Replay Error: bad record");
+		free(rec);
+		return 1;
+	}
+	data[2] = '\0';		/* terminate header block */
+	data += 4;
+
+	v = record_field(rec, "Fetch-Time-Ms");
+	job->fetch_ms = (v) ? strtod(v, NULL) : 0;
+	v = record_field(rec, "Fetch-Result");
+	rc = (v) ? atoi(v) : 1;
+	v = record_field(rec, "Headers-Length");
+	headers_sz = (v) ? strtoul(v, NULL, 10) : 0;
+	v = record_field(rec, "Content-Length");
+	body_sz = (v) ? strtoul(v, NULL, 10) : 0;
+
+	if (data + headers_sz + body_sz > rec + e->length) {
+		job_error(job, "Replay Error: truncated record");
+		free(rec);
+		return 1;
+	}
+
+	if (rc != 0) {
+		v = record_field(rec, "Fetch-Error");
+		job_error(job, "%.*s", (v) ? (int) strcspn(v, "\r") : 0, (v) ? v : "");
+	}
+	else {
+		job->body = malloc(body_sz + 1);
+		if (job->body == NULL)
+			err(1, "out of memory");
+
+		memcpy(job->body, data + headers_sz, body_sz);
+		job->body[body_sz] = '\0';
+		job->body_sz = body_sz;
+	}
+
+	debug2("source #%d: replayed %zu bytes, rc=%d", job->src->id, body_sz, rc);
+
+	free(rec);
+	return rc;
+}
+
+void archive_close(void)
+{
+	if (archive_fp != NULL)
+		fclose(archive_fp);
+	if (index_fp != NULL)
+		fclose(index_fp);
+	if (replay_fd >= 0)
+		close(replay_fd);
+
+	free(replay_index);
+	archive_fp = index_fp = NULL;
+	replay_fd = -1;
+	replay_index = NULL;
+	replay_n = 0;
+}
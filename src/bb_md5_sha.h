@@ -14,6 +14,7 @@
 #define FAST_FUNC
 #define ALWAYS_INLINE inline
 #define bb_bswap_64(x) bswap_64(x)
+#define ARRAY_SIZE(x) ((unsigned)(sizeof(x) / sizeof((x)[0])))
 
 /* --- platform.h --- */
 
@@ -72,7 +73,6 @@ typedef struct md5_ctx_t {
 	uint32_t hash[8];    /* 4 elements for md5, 5 for sha1, 8 for sha256 */
 } md5_ctx_t;
 
-#if 0
 typedef struct md5_ctx_t sha1_ctx_t;
 typedef struct md5_ctx_t sha256_ctx_t;
 typedef struct sha512_ctx_t {
@@ -80,13 +80,11 @@ typedef struct sha512_ctx_t {
 	uint64_t hash[8];
 	uint8_t wbuffer[128]; /* always correctly aligned for uint64_t */
 } sha512_ctx_t;
-#endif /* 0 */
 
 void md5_begin(md5_ctx_t *ctx) FAST_FUNC;
 void md5_hash(md5_ctx_t *ctx, const void *data, size_t length) FAST_FUNC;
 void md5_end(md5_ctx_t *ctx, void *resbuf) FAST_FUNC;
 
-#if 0
 void sha1_begin(sha1_ctx_t *ctx) FAST_FUNC;
 #define sha1_hash md5_hash
 void sha1_end(sha1_ctx_t *ctx, void *resbuf) FAST_FUNC;
@@ -96,7 +94,6 @@ void sha256_begin(sha256_ctx_t *ctx) FAST_FUNC;
 void sha512_begin(sha512_ctx_t *ctx) FAST_FUNC;
 void sha512_hash(sha512_ctx_t *ctx, const void *buffer, size_t len) FAST_FUNC;
 void sha512_end(sha512_ctx_t *ctx, void *resbuf) FAST_FUNC;
-#endif /* 0 */
 
 #endif /* BB_MD5_SHA_H */
 
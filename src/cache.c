@@ -0,0 +1,158 @@
+/**
+ * Selfoss RSS reader micro updater
+ *
+ *   Copyright (C) 2013 Vladimir Ermakov <vooon341@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "selfoss_mupdate.h"
+#include "bb_md5_sha.h"
+
+/*
+ * Sanitized content cache.
+ *
+ * Aggregators republish the same bodies under different guids, so the
+ * tidy pass result is stored in a side table keyed by
+ * sha256(policy version + policy file hash + sanitizer + raw content),
+ * the last two only when not the defaults. Workers only
+ * read it, the writer stores new entries and evicts least recently used
+ * ones when total size exceeds the limit.
+ */
+
+#define CACHE_EVICT_BATCH	64
+
+int cache_init(sqlite3 *db, sqlite3_int64 max_bytes)
+{
+	struct db_state *st = db_state_add(db);
+	int rc;
+
+	st->cache_max_bytes = max_bytes;
+	st->cache_bytes = 0;
+	if (st->cache_max_bytes == 0)
+		return SQLITE_OK;
+
+	rc = db_cache_create(db);
+	if (rc == SQLITE_OK)
+		rc = db_cache_total_size(db, &st->cache_bytes);
+
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "sanitize cache disabled: %s\n", sqlite3_errmsg(db));
+		st->cache_max_bytes = 0;
+	}
+
+	debug("cache: %lld bytes used, %lld max", st->cache_bytes, st->cache_max_bytes);
+
+	return rc;
+}
+
+static void cache_digest(const char *raw, unsigned char *digest)
+{
+	sha256_ctx_t ctx;
+	uint32_t version = SWAP_LE32(SANITIZE_POLICY_VERSION);
+	const unsigned char *policy = policy_digest();
+
+	sha256_begin(&ctx);
+	sha256_hash(&ctx, &version, sizeof(version));
+	if (policy != NULL)
+		sha256_hash(&ctx, policy, CACHE_DIGEST_SIZE);
+	if (strcmp(sanitize_engine(), "tidy") != 0)
+		sha256_hash(&ctx, sanitize_engine(), strlen(sanitize_engine()));
+	sha256_hash(&ctx, raw, strlen(raw));
+	sha256_end(&ctx, digest);
+}
+
+/* worker stage: sanitize_content() with cache lookup */
+int sanitize_content_cached(sqlite3 *rdb, char **content, struct cache_ref *ref)
+{
+	char *cached;
+	int rc;
+
+	ref->state = CACHE_NONE;
+
+	/* --tenants workers have no database handle, no cache either */
+	if (db_state(rdb)->cache_max_bytes == 0 || *content == NULL)
+		return sanitize_content(content);
+
+	cache_digest(*content, ref->digest);
+
+	rc = db_cache_get(rdb, ref->digest, sizeof(ref->digest), &cached);
+	if (rc == SQLITE_ROW) {
+		debug2("cache hit");
+		stats_inc(cache_hits);
+
+		free(*content);
+		*content = cached;
+		ref->state = CACHE_HIT;
+		return 0;
+	}
+
+	stats_inc(cache_misses);
+
+	rc = sanitize_content(content);
+	if (rc >= 0)
+		ref->state = CACHE_MISS;
+
+	return rc;
+}
+
+/* writer stage: called inside source transaction */
+void cache_store(sqlite3 *db, const char *content, struct cache_ref *ref)
+{
+	bool inserted = false;
+	int rc = SQLITE_OK;
+
+	if (ref->state == CACHE_MISS) {
+		/* same body sanitized by another worker or source of this run */
+		rc = db_cache_put(db, ref->digest, sizeof(ref->digest), content,
+				time(NULL), &inserted);
+		if (rc == SQLITE_OK && inserted)
+			db_state_add(db)->cache_bytes += strlen(content) + sizeof(ref->digest);
+	}
+
+	if (rc == SQLITE_OK && ref->state != CACHE_NONE && !inserted)
+		rc = db_cache_touch(db, ref->digest, sizeof(ref->digest), time(NULL));
+
+	if (rc != SQLITE_OK)
+		errx(1, "cache update failed: %s", sqlite3_errmsg(db));
+}
+
+/* writer stage: called between source transactions */
+void cache_evict(sqlite3 *db)
+{
+	struct db_state *st = db_state_add(db);
+	sqlite3_int64 freed_bytes;
+	int freed_rows, rc;
+
+	if (st->cache_max_bytes == 0 || st->cache_bytes <= st->cache_max_bytes)
+		return;
+
+	rc = db_exec(db, "BEGIN IMMEDIATE");
+	while (rc == SQLITE_OK && st->cache_bytes > st->cache_max_bytes) {
+		rc = db_cache_evict_oldest(db, CACHE_EVICT_BATCH, &freed_bytes, &freed_rows);
+		if (rc != SQLITE_OK || freed_rows == 0)
+			break;
+
+		st->cache_bytes -= freed_bytes;
+		stats_add(cache_evicted, freed_rows);
+		stats_add(cache_evicted_bytes, freed_bytes);
+	}
+
+	if (rc == SQLITE_OK)
+		rc = db_exec(db, "COMMIT");
+	if (rc != SQLITE_OK)
+		errx(1, "cache eviction failed: %s", sqlite3_errmsg(db));
+
+	debug("cache: %lld bytes after eviction", st->cache_bytes);
+}
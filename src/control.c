@@ -0,0 +1,360 @@
+/**
+ * Selfoss RSS reader micro updater
+ *
+ *   Copyright (C) 2013 Vladimir Ermakov <vooon341@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "selfoss_mupdate.h"
+#include <stdarg.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+ * Control socket of the resident updater, one command per connection:
+ *
+ *   refresh <source id>	update the source now, reply when committed
+ *   refresh due		start a scheduled pass now
+ *   stats			run statistics
+ *   reload			reopen the database, then a scheduled pass
+ *   quit			finish current work and exit
+ *
+ * Refreshed sources are handed to the fetch stage before any scheduled
+ * source (see pipeline_next_source()); when the updater is idle they
+ * start a pipeline of their own.
+ */
+
+#define CONTROL_LINE_MAX	128
+#define CONTROL_BACKLOG		16
+#define CONTROL_RECV_TIMEOUT	2	/* sec, for a client to send its line */
+
+static int control_sock = -1;
+static char *control_path;
+static const char *control_db_path;
+static sqlite3 *control_db;		/* control thread only */
+static pthread_t control_thread_id;
+
+static pthread_mutex_t control_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t control_cond = PTHREAD_COND_INITIALIZER;
+/* guarded by control_lock */
+static struct source **control_urgent;
+static size_t n_urgent, urgent_allocated;
+static unsigned control_events;
+
+static void control_post(unsigned ev, struct source *src)
+{
+	pthread_mutex_lock(&control_lock);
+	if (src != NULL) {
+		if (n_urgent == urgent_allocated) {
+			urgent_allocated = (urgent_allocated) ? urgent_allocated * 2 : 16;
+			control_urgent = realloc(control_urgent,
+					urgent_allocated * sizeof(*control_urgent));
+			if (control_urgent == NULL)
+				err(1, "out of memory");
+		}
+		control_urgent[n_urgent++] = src;
+	}
+	control_events |= ev;
+	pthread_cond_broadcast(&control_cond);
+	pthread_mutex_unlock(&control_lock);
+}
+
+static void control_write(int fd, const char *fmt, ...)
+{
+	char buf[512];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	if (len >= (int) sizeof(buf))
+		len = sizeof(buf) - 1;
+	if (write(fd, buf, len) < 0)
+		debug("reply: %s", strerror(errno));
+}
+
+static int control_db_open(void)
+{
+	int rc;
+
+	if (control_db != NULL)
+		sqlite3_close(control_db);
+
+	/* under --shard a refreshed source is leased from here */
+	rc = sqlite3_open_v2(control_db_path, &control_db,
+			(lease_active()) ? SQLITE_OPEN_READWRITE : SQLITE_OPEN_READONLY, NULL);
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "control: can't open database: %s\n", sqlite3_errmsg(control_db));
+		return rc;
+	}
+
+	sqlite3_busy_timeout(control_db, 10000);
+	return SQLITE_OK;
+}
+
+/* return true if fd now belongs to the queued source */
+static bool control_refresh(int fd, int source_id)
+{
+	sqlite3_stmt *stmt;
+	struct source *src;
+	int rc;
+
+	src = malloc(sizeof(*src));
+	if (src == NULL)
+		err(1, "out of memory");
+
+	rc = db_source_get_stmt(control_db, source_id, &stmt);
+	if (rc == SQLITE_OK)
+		rc = sqlite3_step(stmt);
+	if (rc != SQLITE_ROW) {
+		sqlite3_finalize(stmt);
+		control_write(fd, "error #%d: no such source\n", source_id);
+		free(src);
+		return false;
+	}
+
+	rc = source_load(control_db, stmt, src);
+	sqlite3_finalize(stmt);
+
+	if (rc != SQLITE_OK)
+		control_write(fd, "error #%d: %s\n", source_id, sqlite3_errmsg(control_db));
+	else if (src->handler == NULL)
+		control_write(fd, "error #%d: spout %s needs the PHP updater\n",
+				source_id, src->spout);
+	else if ((src->url = spout_get_url(src->handler, src->params)) == NULL)
+		control_write(fd, "error #%d: no url or bad json\n", source_id);
+	else if (!lease_claim_one(control_db, source_id))
+		control_write(fd, "skipped #%d: leased by another process\n", source_id);
+	else {
+		/* explicit refresh ignores backoff and shard, like -s, but
+		 * not a live lease of another process */
+		debug("source #%d queued", source_id);
+		src->reply_fd = fd;
+		control_post(CONTROL_URGENT, src);
+		return true;
+	}
+
+	source_free(src);
+	free(src);
+	return false;
+}
+
+static void control_stats(int fd)
+{
+	FILE *fl;
+	int fd2 = dup(fd);
+
+	if (fd2 < 0 || (fl = fdopen(fd2, "w")) == NULL) {
+		if (fd2 >= 0)
+			close(fd2);
+		return;
+	}
+
+	stats_print(fl);
+	fclose(fl);
+}
+
+static void control_handle(int fd)
+{
+	char line[CONTROL_LINE_MAX];
+	struct timeval tv = { CONTROL_RECV_TIMEOUT, 0 };
+	size_t len = 0;
+	ssize_t n;
+	int source_id;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	while (len < sizeof(line) - 1) {
+		n = read(fd, line + len, sizeof(line) - 1 - len);
+		if (n <= 0)
+			break;
+		len += n;
+		if (memchr(line, '\n', len) != NULL)
+			break;
+	}
+	line[len] = '\0';
+	line[strcspn(line, "\r\n")] = '\0';
+
+	debug("command: %s", line);
+
+	if (sscanf(line, "refresh %d", &source_id) == 1) {
+		if (control_refresh(fd, source_id))
+			return;
+	}
+	else if (!strcmp(line, "refresh due")) {
+		control_post(CONTROL_DUE, NULL);
+		control_write(fd, "ok\n");
+	}
+	else if (!strcmp(line, "stats"))
+		control_stats(fd);
+	else if (!strcmp(line, "reload")) {
+		control_db_open();
+		control_post(CONTROL_RELOAD, NULL);
+		control_write(fd, "ok\n");
+	}
+	else if (!strcmp(line, "quit")) {
+		control_post(CONTROL_QUIT, NULL);
+		control_write(fd, "ok\n");
+	}
+	else
+		control_write(fd, "error: unknown command\n");
+
+	close(fd);
+}
+
+static void *control_thread(void *arg)
+{
+	int fd;
+
+	for (;;) {
+		fd = accept(control_sock, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			/* socket shut down by control_close() */
+			break;
+		}
+
+		control_handle(fd);
+	}
+
+	return NULL;
+}
+
+/* -*- public -*- */
+
+int control_init(const char *path, const char *db_path)
+{
+	struct sockaddr_un addr;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		errx(1, "control socket path too long: %s", path);
+
+	control_db_path = db_path;
+	if (control_db_open() != SQLITE_OK)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	control_sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (control_sock < 0)
+		err(1, "socket()");
+
+	/* stale socket of a previous process */
+	unlink(path);
+
+	if (bind(control_sock, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+			listen(control_sock, CONTROL_BACKLOG) < 0) {
+		warn("control socket %s", path);
+		close(control_sock);
+		control_sock = -1;
+		return -1;
+	}
+
+	control_path = strdup(path);
+
+	if ((errno = pthread_create(&control_thread_id, NULL, control_thread, NULL)) != 0)
+		err(1, "pthread_create()");
+
+	debug("control socket %s", path);
+	return 0;
+}
+
+/* idle resident updater: sleep until an event or until (0 - forever) */
+unsigned control_wait(time_t until)
+{
+	struct timespec ts = { until, 0 };
+	unsigned ev;
+
+	pthread_mutex_lock(&control_lock);
+	while (control_events == 0 && n_urgent == 0) {
+		if (until == 0)
+			pthread_cond_wait(&control_cond, &control_lock);
+		else if (pthread_cond_timedwait(&control_cond, &control_lock, &ts) == ETIMEDOUT)
+			break;
+	}
+
+	ev = control_events;
+	if (n_urgent > 0)
+		ev |= CONTROL_URGENT;
+	control_events = 0;
+	pthread_mutex_unlock(&control_lock);
+
+	return ev;
+}
+
+/* fetch stage: refresh requests go first */
+struct source *control_next_source(void)
+{
+	struct source *src = NULL;
+
+	if (control_sock < 0)
+		return NULL;
+
+	pthread_mutex_lock(&control_lock);
+	if (n_urgent > 0) {
+		src = control_urgent[0];
+		memmove(control_urgent, control_urgent + 1, --n_urgent * sizeof(*control_urgent));
+	}
+	pthread_mutex_unlock(&control_lock);
+
+	return src;
+}
+
+/* writer stage: answer the client and free the queued source */
+void control_done(struct source *src, const char *fmt, ...)
+{
+	char buf[512];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	control_write(src->reply_fd, "%s\n", buf);
+	close(src->reply_fd);
+
+	source_free(src);
+	free(src);
+}
+
+void control_close(void)
+{
+	struct source *src;
+
+	if (control_sock < 0)
+		return;
+
+	shutdown(control_sock, SHUT_RDWR);
+	pthread_join(control_thread_id, NULL);
+	close(control_sock);
+	control_sock = -1;
+
+	unlink(control_path);
+	free(control_path);
+
+	while (n_urgent > 0) {
+		src = control_urgent[--n_urgent];
+		control_done(src, "error #%d: updater exiting", src->id);
+	}
+	free(control_urgent);
+
+	sqlite3_close(control_db);
+}
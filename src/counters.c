@@ -0,0 +1,157 @@
+/**
+ * Selfoss RSS reader micro updater
+ *
+ *   Copyright (C) 2013 Vladimir Ermakov <vooon341@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "selfoss_mupdate.h"
+#include <ctype.h>
+
+/*
+ * Materialized unread/total counters per source and per tag
+ * (mupdate_counters), so selfoss need not GROUP BY all items.
+ *
+ * Triggers on items keep them: inserts, deletes and read state changes,
+ * made by us or by selfoss, with or without --counters on this run.
+ * --counters creates the table and triggers; databases counted before
+ * the insert and delete triggers existed are recounted once.  Tags come
+ * from mupdate_source_tags, refreshed from sources.tags at the start of
+ * every run once the table exists.  --counters-verify finds and repairs
+ * anything else.
+ */
+
+/* "tech, news" -> ("tech"), ("news") */
+static int counters_load_tags(sqlite3 *db)
+{
+	sqlite3_stmt *stmt;
+	const char *tags, *p, *s, *e;
+	int rc, source_id;
+
+	rc = db_source_tags_clear(db);
+	if (rc == SQLITE_OK)
+		rc = db_source_tags_stmt(db, &stmt);
+	if (rc != SQLITE_OK)
+		return rc;
+
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		source_id = sqlite3_column_int(stmt, 0);
+		tags = (const char *) sqlite3_column_text(stmt, 1);
+
+		for (p = tags; p != NULL && *p != '\0'; p = (*e) ? e + 1 : e) {
+			e = strchrnul(p, ',');
+			for (s = p; s < e && isspace((unsigned char) *s); s++)
+				;
+			while (e > s && isspace((unsigned char) e[-1]))
+				e--;
+			if (e > s && db_source_tags_add(db, source_id, s, e - s) != SQLITE_OK)
+				errx(1, "SQL error: %s", sqlite3_errmsg(db));
+			e = strchrnul(e, ',');
+		}
+	}
+
+	if (rc != SQLITE_DONE) {
+		sqlite3_finalize(stmt);
+		return rc;
+	}
+
+	return sqlite3_finalize(stmt);
+}
+
+static int counters_rebuild(sqlite3 *db)
+{
+	int rc;
+
+	rc = db_counters_compute(db);
+	if (rc == SQLITE_OK)
+		rc = db_counters_replace(db);
+
+	return rc;
+}
+
+int counters_init(sqlite3 *db, bool enable)
+{
+	bool created, exists;
+	int rc;
+
+	if (!enable) {
+		rc = db_table_exists(db, "mupdate_counters", &exists);
+		if (rc != SQLITE_OK || !exists)
+			return rc;
+	}
+
+	rc = db_exec(db, "BEGIN IMMEDIATE");
+	if (rc == SQLITE_OK)
+		rc = db_counters_create(db, &created);
+	if (rc == SQLITE_OK)
+		rc = counters_load_tags(db);
+	if (rc == SQLITE_OK && created) {
+		debug("new counters triggers, counting existing items");
+		rc = counters_rebuild(db);
+	}
+	if (rc == SQLITE_OK)
+		rc = db_exec(db, "COMMIT");
+
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "unread counters disabled: %s\n", sqlite3_errmsg(db));
+		db_exec(db, "ROLLBACK");
+		return rc;
+	}
+
+	return SQLITE_OK;
+}
+
+/* recount from scratch, print differences and repair them.
+ * return number of differing rows, -1 on error */
+int counters_verify(sqlite3 *db, FILE *fl)
+{
+	sqlite3_stmt *stmt;
+	int rc, n_diff = 0;
+
+	rc = db_exec(db, "BEGIN IMMEDIATE");
+	if (rc == SQLITE_OK)
+		rc = db_counters_compute(db);
+	if (rc == SQLITE_OK)
+		rc = db_counters_diff_stmt(db, &stmt);
+
+	if (rc == SQLITE_OK) {
+		while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+			fprintf(fl, "%s %s: unread %lld, expected %lld; total %lld, expected %lld\n",
+					sqlite3_column_text(stmt, 0), sqlite3_column_text(stmt, 1),
+					sqlite3_column_int64(stmt, 2), sqlite3_column_int64(stmt, 4),
+					sqlite3_column_int64(stmt, 3), sqlite3_column_int64(stmt, 5));
+			n_diff++;
+		}
+
+		if (rc == SQLITE_DONE)
+			rc = sqlite3_finalize(stmt);
+		else
+			sqlite3_finalize(stmt);
+	}
+
+	if (rc == SQLITE_OK && n_diff > 0)
+		rc = db_counters_replace(db);
+	if (rc == SQLITE_OK)
+		rc = db_exec(db, "COMMIT");
+
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "counters verify: %s\n", sqlite3_errmsg(db));
+		db_exec(db, "ROLLBACK");
+		return -1;
+	}
+
+	fprintf(fl, "counters: %d rows differ%s\n", n_diff, (n_diff) ? ", repaired" : "");
+	return n_diff;
+}
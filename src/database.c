@@ -19,6 +19,76 @@
 
 #include "selfoss_mupdate.h"
 
+/* -*- per database state -*- */
+
+/*
+ * One process may update many databases (--tenants), so what fts_init()
+ * and friends found is kept per database file.  Entries are added by the
+ * main thread before the pipeline starts and only read by workers, which
+ * find theirs by the file name of their read-only handle.  A database
+ * opened again gets its old entry back, reset by the next *_init().
+ */
+
+static struct db_state **db_states;
+static size_t n_db_states;
+
+static struct db_state *db_state_find(sqlite3 *db)
+{
+	const char *path;
+	size_t i;
+
+	for (i = 0; i < n_db_states; i++)
+		if (db_states[i]->db == db)
+			return db_states[i];
+
+	path = sqlite3_db_filename(db, "main");
+	if (path == NULL || *path == '\0')
+		return NULL;
+
+	for (i = 0; i < n_db_states; i++)
+		if (strcmp(db_states[i]->path, path) == 0)
+			return db_states[i];
+
+	return NULL;
+}
+
+/* *_init() and the writer: entry of a writer handle, created if new */
+struct db_state *db_state_add(sqlite3 *db)
+{
+	struct db_state *st, **states;
+	const char *path;
+
+	st = db_state_find(db);
+	if (st != NULL) {
+		st->db = db;
+		return st;
+	}
+
+	path = sqlite3_db_filename(db, "main");
+	st = calloc(1, sizeof(*st));
+	states = realloc(db_states, (n_db_states + 1) * sizeof(*db_states));
+	if (st == NULL || states == NULL)
+		err(1, "out of memory");
+	st->db = db;
+	st->path = strdup((path != NULL) ? path : "");
+	if (st->path == NULL)
+		err(1, "out of memory");
+
+	db_states = states;
+	db_states[n_db_states++] = st;
+	return st;
+}
+
+/* nothing enabled for a database no *_init() has seen */
+const struct db_state *db_state(sqlite3 *db)
+{
+	static const struct db_state none;
+	const struct db_state *st;
+
+	st = (db != NULL) ? db_state_find(db) : NULL;
+	return (st != NULL) ? st : &none;
+}
+
 
 int db_item_exists(sqlite3 *db, char *uid, bool *result)
 {
@@ -49,7 +119,7 @@ int db_item_exists(sqlite3 *db, char *uid, bool *result)
 
 int db_item_add(sqlite3 *db, int source_id,
 		char *title, char *content, char *uid, char *link,
-		char *thumb, char *icon, struct tm *pub_tm)
+		char *thumb, char *icon, struct tm *pub_tm, bool unread)
 {
 	sqlite3_stmt *stmt;
 	char datetime[256];
@@ -67,7 +137,7 @@ int db_item_add(sqlite3 *db, int source_id,
 	int rc;
 
 	/* stored in localtime, convert */
-	t = timegm(pub_tm); ltm = *localtime(&t);
+	t = timegm(pub_tm); localtime_r(&t, &ltm);
 	dt_sz = strftime(datetime, sizeof(datetime), "%F %T", &ltm);
 
 	/* in schema icon & thumbnail can be NULL, but actual software sets "", not NULL */
@@ -78,7 +148,7 @@ int db_item_add(sqlite3 *db, int source_id,
 	if (rc == SQLITE_OK) rc = sqlite3_bind_text(stmt, 1, datetime, dt_sz, SQLITE_STATIC);
 	if (rc == SQLITE_OK) rc = sqlite3_bind_text(stmt, 2, title, -1, SQLITE_STATIC);
 	if (rc == SQLITE_OK) rc = sqlite3_bind_text(stmt, 3, content, -1, SQLITE_STATIC);
-	if (rc == SQLITE_OK) rc = sqlite3_bind_int (stmt, 4, 1); /* :unread */
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int (stmt, 4, unread);
 	if (rc == SQLITE_OK) rc = sqlite3_bind_int (stmt, 5, 0); /* :starred */
 	if (rc == SQLITE_OK) rc = sqlite3_bind_int (stmt, 6, source_id);
 	if (rc == SQLITE_OK) rc = sqlite3_bind_text(stmt, 7, thumb, -1, SQLITE_STATIC);
@@ -92,6 +162,22 @@ int db_item_add(sqlite3 *db, int source_id,
 	return sqlite3_finalize(stmt);
 }
 
+int db_item_set_thumbnail(sqlite3 *db, sqlite3_int64 item_id, const char *thumb)
+{
+	sqlite3_stmt *stmt;
+	char sql[] = "UPDATE items SET thumbnail=:thumbnail WHERE id=:id";
+	int rc;
+
+	rc = sqlite3_prepare_v2(db, sql, sizeof(sql), &stmt, NULL);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_text (stmt, 1, thumb, -1, SQLITE_STATIC);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int64(stmt, 2, item_id);
+
+	if (rc == SQLITE_OK)
+		rc = sqlite3_step(stmt);
+
+	return sqlite3_finalize(stmt);
+}
+
 int db_source_set_lastupdate(sqlite3 *db, int source_id, time_t lastupdate)
 {
 	sqlite3_stmt *stmt;
@@ -111,9 +197,25 @@ int db_source_set_lastupdate(sqlite3 *db, int source_id, time_t lastupdate)
 	return sqlite3_finalize(stmt);
 }
 
+int db_source_set_error(sqlite3 *db, int source_id, const char *error)
+{
+	sqlite3_stmt *stmt;
+	char sql[] = "UPDATE sources SET error=:error WHERE id=:id";
+	int rc;
+
+	rc = sqlite3_prepare_v2(db, sql, sizeof(sql), &stmt, NULL);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_text(stmt, 1, error, -1, SQLITE_STATIC);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int(stmt, 2, source_id);
+
+	if (rc == SQLITE_OK)
+		rc = sqlite3_step(stmt);
+
+	return sqlite3_finalize(stmt);
+}
+
 void db_source_stmt_to_data(sqlite3_stmt *stmt, int *source_id,
 		const char **title, const char **tags, const char **spout,
-		const char **params, const char **error)
+		const char **params, const char **error, time_t *lastupdate)
 {
 		*source_id =	sqlite3_column_int (stmt, 0);
 		*title =	sqlite3_column_text(stmt, 1);
@@ -121,17 +223,18 @@ void db_source_stmt_to_data(sqlite3_stmt *stmt, int *source_id,
 		*spout =	sqlite3_column_text(stmt, 3);
 		*params =	sqlite3_column_text(stmt, 4);
 		*error =	sqlite3_column_text(stmt, 5);
+		*lastupdate =	sqlite3_column_int64(stmt, 6);
 }
 
 int db_source_get_all_by_lastupdate_stmt(sqlite3 *db, sqlite3_stmt **stmt)
 {
-	char sql[] = "SELECT id, title, tags, spout, params, error FROM sources ORDER BY lastupdate ASC";
+	char sql[] = "SELECT id, title, tags, spout, params, error, lastupdate FROM sources ORDER BY lastupdate ASC";
 	return sqlite3_prepare_v2(db, sql, sizeof(sql), stmt, NULL);
 }
 
 int db_source_get_stmt(sqlite3 *db, int source_id, sqlite3_stmt **stmt)
 {
-	char sql[] = "SELECT id, title, tags, spout, params, error FROM sources WHERE id=:id";
+	char sql[] = "SELECT id, title, tags, spout, params, error, lastupdate FROM sources WHERE id=:id";
 	int rc;
 
 	rc = sqlite3_prepare_v2(db, sql, sizeof(sql), stmt, NULL);
@@ -142,7 +245,7 @@ int db_source_get_stmt(sqlite3 *db, int source_id, sqlite3_stmt **stmt)
 
 int db_source_get(sqlite3 *db, int source_id,
 		const char **title, const char **tags, const char **spout,
-		const char **params, const char **error)
+		const char **params, const char **error, time_t *lastupdate)
 {
 	sqlite3_stmt *stmt;
 	int rc, sid;
@@ -152,7 +255,7 @@ int db_source_get(sqlite3 *db, int source_id,
 		rc = sqlite3_step(stmt);
 
 	if (rc == SQLITE_ROW) {
-		db_source_stmt_to_data(stmt, &sid, title, tags, spout, params, error);
+		db_source_stmt_to_data(stmt, &sid, title, tags, spout, params, error, lastupdate);
 		debug3("source: #%d title: %s tags: %s spout: %s params: %s error: %s",
 				source_id, *title, *tags, *spout, *params, *error);
 	}
@@ -165,3 +268,1210 @@ int db_source_get(sqlite3 *db, int source_id,
 	return sqlite3_finalize(stmt);
 }
 
+int db_exec(sqlite3 *db, const char *sql)
+{
+	char *errmsg = NULL;
+	int rc;
+
+	rc = sqlite3_exec(db, sql, NULL, NULL, &errmsg);
+	if (rc != SQLITE_OK) {
+		debug("%s: %s", sql, errmsg);
+		sqlite3_free(errmsg);
+	}
+
+	return rc;
+}
+
+
+/* -*- per-source updater state -*- */
+
+int db_source_state_create(sqlite3 *db)
+{
+	sqlite3_stmt *stmt;
+	char sql_check[] = "SELECT fetch_ms FROM mupdate_source_state LIMIT 0";
+	int rc;
+
+	rc = db_exec(db, "CREATE TABLE IF NOT EXISTS mupdate_source_state ("
+			"source INTEGER PRIMARY KEY, "
+			"failures INTEGER NOT NULL DEFAULT 0, "
+			"next_attempt INTEGER NOT NULL DEFAULT 0, "
+			"fetch_ms REAL NOT NULL DEFAULT 0)");
+	if (rc != SQLITE_OK)
+		return rc;
+
+	/* table created by older version */
+	rc = sqlite3_prepare_v2(db, sql_check, sizeof(sql_check), &stmt, NULL);
+	sqlite3_finalize(stmt);
+	if (rc != SQLITE_OK)
+		rc = db_exec(db, "ALTER TABLE mupdate_source_state "
+				"ADD COLUMN fetch_ms REAL NOT NULL DEFAULT 0");
+
+	return rc;
+}
+
+int db_source_state_get(sqlite3 *db, int source_id, int *failures,
+		time_t *next_attempt, double *fetch_ms)
+{
+	sqlite3_stmt *stmt;
+	char sql[] = "SELECT failures, next_attempt, fetch_ms FROM mupdate_source_state WHERE source=:source";
+	int rc;
+
+	*failures = 0;
+	*next_attempt = 0;
+	*fetch_ms = 0;
+
+	rc = sqlite3_prepare_v2(db, sql, sizeof(sql), &stmt, NULL);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int(stmt, 1, source_id);
+
+	if (rc == SQLITE_OK)
+		rc = sqlite3_step(stmt);
+
+	if (rc == SQLITE_ROW) {
+		*failures = sqlite3_column_int(stmt, 0);
+		*next_attempt = sqlite3_column_int64(stmt, 1);
+		*fetch_ms = sqlite3_column_double(stmt, 2);
+	}
+	else if (rc != SQLITE_DONE) {
+		sqlite3_finalize(stmt);
+		debug3("failed");
+		return -1;
+	}
+
+	return sqlite3_finalize(stmt);
+}
+
+int db_source_state_set(sqlite3 *db, int source_id, int failures,
+		time_t next_attempt, double fetch_ms)
+{
+	sqlite3_stmt *stmt;
+	char sql[] = "INSERT OR REPLACE INTO mupdate_source_state "
+		"(source, failures, next_attempt, fetch_ms) "
+		"VALUES (:source, :failures, :next_attempt, :fetch_ms)";
+	int rc;
+
+	rc = sqlite3_prepare_v2(db, sql, sizeof(sql), &stmt, NULL);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int  (stmt, 1, source_id);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int  (stmt, 2, failures);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int64(stmt, 3, next_attempt);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_double(stmt, 4, fetch_ms);
+
+	if (rc == SQLITE_OK)
+		rc = sqlite3_step(stmt);
+
+	return sqlite3_finalize(stmt);
+}
+
+/* -*- permanent redirects -*- */
+
+int db_redirect_create(sqlite3 *db)
+{
+	return db_exec(db, "CREATE TABLE IF NOT EXISTS mupdate_redirect ("
+			"source INTEGER PRIMARY KEY, "
+			"url TEXT NOT NULL, "
+			"target TEXT NOT NULL, "
+			"hops INTEGER NOT NULL, "
+			"checked INTEGER NOT NULL)");
+}
+
+/* SQLITE_ROW with malloc'ed url and target, SQLITE_DONE if none */
+int db_redirect_get(sqlite3 *db, int source_id, char **url, char **target,
+		int *hops, time_t *checked)
+{
+	sqlite3_stmt *stmt;
+	char sql[] = "SELECT url, target, hops, checked FROM mupdate_redirect WHERE source=:source";
+	int rc;
+
+	*url = NULL;
+	*target = NULL;
+
+	rc = sqlite3_prepare_v2(db, sql, sizeof(sql), &stmt, NULL);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int(stmt, 1, source_id);
+
+	if (rc == SQLITE_OK)
+		rc = sqlite3_step(stmt);
+
+	if (rc == SQLITE_ROW) {
+		*url = strdup((const char *) sqlite3_column_text(stmt, 0));
+		*target = strdup((const char *) sqlite3_column_text(stmt, 1));
+		if (*url == NULL || *target == NULL)
+			err(1, "out of memory");
+		*hops = sqlite3_column_int(stmt, 2);
+		*checked = sqlite3_column_int64(stmt, 3);
+	}
+
+	sqlite3_finalize(stmt);
+	return rc;
+}
+
+int db_redirect_set(sqlite3 *db, int source_id, const char *url, const char *target,
+		int hops, time_t checked)
+{
+	sqlite3_stmt *stmt;
+	char sql[] = "INSERT OR REPLACE INTO mupdate_redirect "
+		"(source, url, target, hops, checked) "
+		"VALUES (:source, :url, :target, :hops, :checked)";
+	int rc;
+
+	rc = sqlite3_prepare_v2(db, sql, sizeof(sql), &stmt, NULL);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int  (stmt, 1, source_id);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_text (stmt, 2, url, -1, SQLITE_STATIC);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_text (stmt, 3, target, -1, SQLITE_STATIC);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int  (stmt, 4, hops);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int64(stmt, 5, checked);
+
+	if (rc == SQLITE_OK)
+		rc = sqlite3_step(stmt);
+
+	return sqlite3_finalize(stmt);
+}
+
+int db_redirect_delete(sqlite3 *db, int source_id)
+{
+	sqlite3_stmt *stmt;
+	char sql[] = "DELETE FROM mupdate_redirect WHERE source=:source";
+	int rc;
+
+	rc = sqlite3_prepare_v2(db, sql, sizeof(sql), &stmt, NULL);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int(stmt, 1, source_id);
+
+	if (rc == SQLITE_OK)
+		rc = sqlite3_step(stmt);
+
+	return sqlite3_finalize(stmt);
+}
+
+/* -*- sanitized content cache -*- */
+
+int db_cache_create(sqlite3 *db)
+{
+	int rc;
+
+	rc = db_exec(db, "CREATE TABLE IF NOT EXISTS mupdate_sanitize_cache ("
+			"digest BLOB PRIMARY KEY, "
+			"content TEXT NOT NULL, "
+			"size INTEGER NOT NULL, "
+			"atime INTEGER NOT NULL)");
+	if (rc == SQLITE_OK)
+		rc = db_exec(db, "CREATE INDEX IF NOT EXISTS mupdate_sanitize_cache_atime "
+				"ON mupdate_sanitize_cache (atime)");
+
+	return rc;
+}
+
+/* return SQLITE_ROW and malloc'ed content on hit, SQLITE_DONE on miss */
+int db_cache_get(sqlite3 *db, const void *digest, size_t digest_sz, char **content)
+{
+	sqlite3_stmt *stmt;
+	char sql[] = "SELECT content FROM mupdate_sanitize_cache WHERE digest=:digest";
+	int rc;
+
+	*content = NULL;
+
+	rc = sqlite3_prepare_v2(db, sql, sizeof(sql), &stmt, NULL);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_blob(stmt, 1, digest, digest_sz, SQLITE_STATIC);
+
+	if (rc == SQLITE_OK)
+		rc = sqlite3_step(stmt);
+
+	if (rc == SQLITE_ROW) {
+		*content = strdup((const char *) sqlite3_column_text(stmt, 0));
+		if (*content == NULL)
+			err(1, "out of memory");
+	}
+
+	sqlite3_finalize(stmt);
+	return rc;
+}
+
+/* inserted - false if the digest was already there, row left as is */
+int db_cache_put(sqlite3 *db, const void *digest, size_t digest_sz,
+		const char *content, time_t atime, bool *inserted)
+{
+	sqlite3_stmt *stmt;
+	char sql[] = "INSERT OR IGNORE INTO mupdate_sanitize_cache "
+		"(digest, content, size, atime) "
+		"VALUES (:digest, :content, :size, :atime)";
+	size_t sz = strlen(content);
+	int rc;
+
+	*inserted = false;
+
+	rc = sqlite3_prepare_v2(db, sql, sizeof(sql), &stmt, NULL);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_blob (stmt, 1, digest, digest_sz, SQLITE_STATIC);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_text (stmt, 2, content, sz, SQLITE_STATIC);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int64(stmt, 3, sz + digest_sz);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int64(stmt, 4, atime);
+
+	if (rc == SQLITE_OK)
+		rc = sqlite3_step(stmt);
+
+	if (rc == SQLITE_DONE)
+		*inserted = sqlite3_changes(db) > 0;
+
+	return sqlite3_finalize(stmt);
+}
+
+int db_cache_touch(sqlite3 *db, const void *digest, size_t digest_sz, time_t atime)
+{
+	sqlite3_stmt *stmt;
+	char sql[] = "UPDATE mupdate_sanitize_cache SET atime=:atime WHERE digest=:digest";
+	int rc;
+
+	rc = sqlite3_prepare_v2(db, sql, sizeof(sql), &stmt, NULL);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int64(stmt, 1, atime);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_blob (stmt, 2, digest, digest_sz, SQLITE_STATIC);
+
+	if (rc == SQLITE_OK)
+		rc = sqlite3_step(stmt);
+
+	return sqlite3_finalize(stmt);
+}
+
+int db_cache_total_size(sqlite3 *db, sqlite3_int64 *bytes)
+{
+	sqlite3_stmt *stmt;
+	char sql[] = "SELECT COALESCE(SUM(size), 0) FROM mupdate_sanitize_cache";
+	int rc;
+
+	rc = sqlite3_prepare_v2(db, sql, sizeof(sql), &stmt, NULL);
+	if (rc == SQLITE_OK)
+		rc = sqlite3_step(stmt);
+
+	if (rc == SQLITE_ROW)
+		*bytes = sqlite3_column_int64(stmt, 0);
+	else {
+		sqlite3_finalize(stmt);
+		return -1;
+	}
+
+	return sqlite3_finalize(stmt);
+}
+
+/* drop n_rows least recently used entries */
+int db_cache_evict_oldest(sqlite3 *db, int n_rows,
+		sqlite3_int64 *freed_bytes, int *freed_rows)
+{
+	sqlite3_stmt *stmt;
+	char sql_sum[] = "SELECT COALESCE(SUM(size), 0), COUNT(*) FROM "
+		"(SELECT size FROM mupdate_sanitize_cache ORDER BY atime ASC LIMIT :n)";
+	char sql_del[] = "DELETE FROM mupdate_sanitize_cache WHERE digest IN "
+		"(SELECT digest FROM mupdate_sanitize_cache ORDER BY atime ASC LIMIT :n)";
+	int rc;
+
+	rc = sqlite3_prepare_v2(db, sql_sum, sizeof(sql_sum), &stmt, NULL);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int(stmt, 1, n_rows);
+
+	if (rc == SQLITE_OK)
+		rc = sqlite3_step(stmt);
+
+	if (rc == SQLITE_ROW) {
+		*freed_bytes = sqlite3_column_int64(stmt, 0);
+		*freed_rows = sqlite3_column_int(stmt, 1);
+	}
+	else {
+		sqlite3_finalize(stmt);
+		return -1;
+	}
+
+	rc = sqlite3_finalize(stmt);
+	if (rc != SQLITE_OK)
+		return rc;
+
+	rc = sqlite3_prepare_v2(db, sql_del, sizeof(sql_del), &stmt, NULL);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int(stmt, 1, n_rows);
+
+	if (rc == SQLITE_OK)
+		rc = sqlite3_step(stmt);
+
+	return sqlite3_finalize(stmt);
+}
+
+/* -*- shard leases -*- */
+
+int db_lease_create(sqlite3 *db)
+{
+	return db_exec(db, "CREATE TABLE IF NOT EXISTS mupdate_lease ("
+			"source INTEGER PRIMARY KEY, "
+			"owner TEXT NOT NULL, "
+			"expires INTEGER NOT NULL)");
+}
+
+/* *result: 1 - lease exists and expired, 0 - no lease or still valid */
+int db_lease_expired(sqlite3 *db, int source_id, time_t now, bool *result)
+{
+	sqlite3_stmt *stmt;
+	char sql[] = "SELECT expires <= :now FROM mupdate_lease WHERE source=:source";
+	int rc;
+
+	*result = false;
+
+	rc = sqlite3_prepare_v2(db, sql, sizeof(sql), &stmt, NULL);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int64(stmt, 1, now);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int  (stmt, 2, source_id);
+
+	if (rc == SQLITE_OK)
+		rc = sqlite3_step(stmt);
+
+	if (rc == SQLITE_ROW)
+		*result = sqlite3_column_int(stmt, 0);
+	else if (rc != SQLITE_DONE) {
+		sqlite3_finalize(stmt);
+		return -1;
+	}
+
+	return sqlite3_finalize(stmt);
+}
+
+/* take lease unless other owner holds a valid one */
+int db_lease_claim(sqlite3 *db, int source_id, const char *owner,
+		time_t now, time_t expires, bool *claimed)
+{
+	sqlite3_stmt *stmt;
+	char sql[] = "INSERT OR REPLACE INTO mupdate_lease (source, owner, expires) "
+		"SELECT :source, :owner, :expires WHERE NOT EXISTS "
+		"(SELECT 1 FROM mupdate_lease WHERE source=:source "
+		"AND owner!=:owner AND expires>:now)";
+	int rc;
+
+	*claimed = false;
+
+	rc = sqlite3_prepare_v2(db, sql, sizeof(sql), &stmt, NULL);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int  (stmt, 1, source_id);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_text (stmt, 2, owner, -1, SQLITE_STATIC);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int64(stmt, 3, expires);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int64(stmt, 4, now);
+
+	if (rc == SQLITE_OK)
+		rc = sqlite3_step(stmt);
+
+	if (rc == SQLITE_DONE)
+		*claimed = sqlite3_changes(db) > 0;
+
+	return sqlite3_finalize(stmt);
+}
+
+/* *held: 1 - owner still has the lease, expired or not */
+int db_lease_held(sqlite3 *db, int source_id, const char *owner, bool *held)
+{
+	sqlite3_stmt *stmt;
+	char sql[] = "SELECT 1 FROM mupdate_lease WHERE source=:source AND owner=:owner";
+	int rc;
+
+	*held = false;
+
+	rc = sqlite3_prepare_v2(db, sql, sizeof(sql), &stmt, NULL);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int (stmt, 1, source_id);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_text(stmt, 2, owner, -1, SQLITE_STATIC);
+
+	if (rc == SQLITE_OK)
+		rc = sqlite3_step(stmt);
+
+	if (rc == SQLITE_ROW)
+		*held = true;
+	else if (rc != SQLITE_DONE) {
+		sqlite3_finalize(stmt);
+		return -1;
+	}
+
+	return sqlite3_finalize(stmt);
+}
+
+/* extend every lease the owner still has */
+int db_lease_renew(sqlite3 *db, const char *owner, time_t expires, int *renewed)
+{
+	sqlite3_stmt *stmt;
+	char sql[] = "UPDATE mupdate_lease SET expires=:expires WHERE owner=:owner";
+	int rc;
+
+	*renewed = 0;
+
+	rc = sqlite3_prepare_v2(db, sql, sizeof(sql), &stmt, NULL);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int64(stmt, 1, expires);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_text (stmt, 2, owner, -1, SQLITE_STATIC);
+
+	if (rc == SQLITE_OK)
+		rc = sqlite3_step(stmt);
+
+	if (rc == SQLITE_DONE)
+		*renewed = sqlite3_changes(db);
+
+	return sqlite3_finalize(stmt);
+}
+
+int db_lease_release(sqlite3 *db, int source_id, const char *owner)
+{
+	sqlite3_stmt *stmt;
+	char sql[] = "DELETE FROM mupdate_lease WHERE source=:source AND owner=:owner";
+	int rc;
+
+	rc = sqlite3_prepare_v2(db, sql, sizeof(sql), &stmt, NULL);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int (stmt, 1, source_id);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_text(stmt, 2, owner, -1, SQLITE_STATIC);
+
+	if (rc == SQLITE_OK)
+		rc = sqlite3_step(stmt);
+
+	return sqlite3_finalize(stmt);
+}
+
+/* -*- retention -*- */
+
+int db_items_datetime_index_create(sqlite3 *db)
+{
+	return db_exec(db, "CREATE INDEX IF NOT EXISTS mupdate_items_datetime "
+			"ON items (datetime)");
+}
+
+/* ids of the current purge batch, shared by the index maintainers */
+int db_purge_batch_create(sqlite3 *db)
+{
+	return db_exec(db, "CREATE TEMP TABLE IF NOT EXISTS mupdate_purge_batch "
+			"(id INTEGER PRIMARY KEY)");
+}
+
+/* select up to limit unstarred items older than cutoff ("%F %T" localtime) */
+int db_purge_batch_select(sqlite3 *db, const char *cutoff, int limit, int *selected)
+{
+	sqlite3_stmt *stmt;
+	char sql[] = "INSERT INTO temp.mupdate_purge_batch "
+		"SELECT id FROM items WHERE datetime<:cutoff AND starred=0 LIMIT :limit";
+	int rc;
+
+	*selected = 0;
+
+	rc = db_exec(db, "DELETE FROM temp.mupdate_purge_batch");
+	if (rc != SQLITE_OK)
+		return rc;
+
+	rc = sqlite3_prepare_v2(db, sql, sizeof(sql), &stmt, NULL);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_text(stmt, 1, cutoff, -1, SQLITE_STATIC);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int (stmt, 2, limit);
+
+	if (rc == SQLITE_OK)
+		rc = sqlite3_step(stmt);
+
+	if (rc == SQLITE_DONE)
+		*selected = sqlite3_changes(db);
+
+	return sqlite3_finalize(stmt);
+}
+
+int db_purge_batch_delete(sqlite3 *db, int *deleted)
+{
+	int rc;
+
+	rc = db_exec(db, "DELETE FROM items WHERE id IN "
+			"(SELECT id FROM temp.mupdate_purge_batch)");
+	*deleted = (rc == SQLITE_OK) ? sqlite3_changes(db) : 0;
+
+	return rc;
+}
+
+int db_table_exists(sqlite3 *db, const char *name, bool *exists)
+{
+	sqlite3_stmt *stmt;
+	char sql[] = "SELECT 1 FROM sqlite_master WHERE name=:name";
+	int rc;
+
+	*exists = false;
+
+	rc = sqlite3_prepare_v2(db, sql, sizeof(sql), &stmt, NULL);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+
+	if (rc == SQLITE_OK)
+		rc = sqlite3_step(stmt);
+
+	if (rc == SQLITE_ROW)
+		*exists = true;
+	else if (rc != SQLITE_DONE) {
+		sqlite3_finalize(stmt);
+		return rc;
+	}
+
+	return sqlite3_finalize(stmt);
+}
+
+/* read single integer PRAGMA, e.g. freelist_count */
+int db_pragma_get_int(sqlite3 *db, const char *pragma, int *value)
+{
+	sqlite3_stmt *stmt;
+	char sql[64];
+	int rc;
+
+	snprintf(sql, sizeof(sql), "PRAGMA %s", pragma);
+
+	rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+	if (rc == SQLITE_OK)
+		rc = sqlite3_step(stmt);
+
+	if (rc == SQLITE_ROW)
+		*value = sqlite3_column_int(stmt, 0);
+	else {
+		sqlite3_finalize(stmt);
+		return -1;
+	}
+
+	return sqlite3_finalize(stmt);
+}
+
+
+/* -*- full text index -*- */
+
+/* external content table: only the index is stored, text stays in items */
+int db_fts_create(sqlite3 *db, bool *created)
+{
+	bool exists;
+	int rc;
+
+	rc = db_table_exists(db, "mupdate_items_fts", &exists);
+	*created = !exists;
+
+	if (rc == SQLITE_OK && *created)
+		rc = db_exec(db, "CREATE VIRTUAL TABLE mupdate_items_fts USING fts5 "
+				"(title, content, content='items', content_rowid='id')");
+
+	return rc;
+}
+
+/* *exists: 1 - index there and fts5 available to use it */
+int db_fts_exists(sqlite3 *db, bool *exists)
+{
+	int rc;
+
+	rc = db_table_exists(db, "mupdate_items_fts", exists);
+	if (rc == SQLITE_OK && *exists)
+		rc = db_exec(db, "SELECT rowid FROM mupdate_items_fts LIMIT 0");
+
+	return rc;
+}
+
+int db_fts_insert(sqlite3 *db, sqlite3_int64 rowid, const char *title, const char *content)
+{
+	sqlite3_stmt *stmt;
+	char sql[] = "INSERT INTO mupdate_items_fts (rowid, title, content) "
+		"VALUES (:rowid, :title, :content)";
+	int rc;
+
+	rc = sqlite3_prepare_v2(db, sql, sizeof(sql), &stmt, NULL);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int64(stmt, 1, rowid);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_text(stmt, 2, title, -1, SQLITE_STATIC);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_text(stmt, 3, content, -1, SQLITE_STATIC);
+
+	if (rc == SQLITE_OK)
+		rc = sqlite3_step(stmt);
+
+	return sqlite3_finalize(stmt);
+}
+
+/* must run before the rows leave items: fts5 needs the old text */
+int db_fts_delete_purged(sqlite3 *db)
+{
+	return db_exec(db, "INSERT INTO mupdate_items_fts "
+			"(mupdate_items_fts, rowid, title, content) "
+			"SELECT 'delete', id, title, content FROM items "
+			"WHERE id IN (SELECT id FROM temp.mupdate_purge_batch)");
+}
+
+int db_fts_rebuild(sqlite3 *db)
+{
+	return db_exec(db, "INSERT INTO mupdate_items_fts (mupdate_items_fts) "
+			"VALUES ('rebuild')");
+}
+
+/* run query, return number of rows and time spent */
+int db_count_query(sqlite3 *db, const char *sql, const char *arg,
+		long *count, double *ms)
+{
+	sqlite3_stmt *stmt;
+	struct timespec t0, t1;
+	int rc;
+
+	*count = 0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_text(stmt, 1, arg, -1, SQLITE_STATIC);
+
+	if (rc == SQLITE_OK)
+		while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+			(*count)++;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	*ms = (t1.tv_sec - t0.tv_sec) * 1000.0 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+
+	if (rc != SQLITE_DONE) {
+		sqlite3_finalize(stmt);
+		return rc;
+	}
+
+	return sqlite3_finalize(stmt);
+}
+
+
+/* -*- unread counters -*- */
+
+/* *created: 1 - insert and delete triggers are new, counts must be redone */
+int db_counters_create(sqlite3 *db, bool *created)
+{
+	bool exists;
+	int rc;
+
+	rc = db_table_exists(db, "mupdate_counters_insert", &exists);
+	*created = !exists;
+
+	if (rc == SQLITE_OK)
+		rc = db_exec(db, "CREATE TABLE IF NOT EXISTS mupdate_counters ("
+				"kind TEXT NOT NULL, "		/* 'source' or 'tag' */
+				"key TEXT NOT NULL, "
+				"unread INTEGER NOT NULL DEFAULT 0, "
+				"total INTEGER NOT NULL DEFAULT 0, "
+				"PRIMARY KEY (kind, key)) WITHOUT ROWID");
+	if (rc == SQLITE_OK)
+		rc = db_exec(db, "CREATE TABLE IF NOT EXISTS mupdate_source_tags ("
+				"source INTEGER NOT NULL, "
+				"tag TEXT NOT NULL, "
+				"PRIMARY KEY (source, tag)) WITHOUT ROWID");
+	/* selfoss marks items read itself, follow it */
+	if (rc == SQLITE_OK)
+		rc = db_exec(db, "CREATE TRIGGER IF NOT EXISTS mupdate_counters_unread "
+				"AFTER UPDATE OF unread ON items "
+				"WHEN old.unread IS NOT new.unread "
+				"BEGIN "
+				"UPDATE mupdate_counters SET unread=unread+(new.unread-old.unread) "
+				"WHERE (kind='source' AND key=CAST(new.source AS TEXT)) "
+				"OR (kind='tag' AND key IN "
+				"(SELECT tag FROM mupdate_source_tags WHERE source=new.source)); "
+				"END");
+	/* and items added or deleted by anyone, not only by --counters runs */
+	if (rc == SQLITE_OK)
+		rc = db_exec(db, "CREATE TRIGGER IF NOT EXISTS mupdate_counters_insert "
+				"AFTER INSERT ON items "
+				"BEGIN "
+				"INSERT INTO mupdate_counters (kind, key, unread, total) "
+				"VALUES ('source', CAST(new.source AS TEXT), new.unread, 1) "
+				"ON CONFLICT (kind, key) DO UPDATE SET "
+				"unread=unread+excluded.unread, total=total+1; "
+				"INSERT INTO mupdate_counters (kind, key, unread, total) "
+				"SELECT 'tag', tag, new.unread, 1 FROM mupdate_source_tags "
+				"WHERE source=new.source "
+				"ON CONFLICT (kind, key) DO UPDATE SET "
+				"unread=unread+excluded.unread, total=total+1; "
+				"END");
+	if (rc == SQLITE_OK)
+		rc = db_exec(db, "CREATE TRIGGER IF NOT EXISTS mupdate_counters_delete "
+				"AFTER DELETE ON items "
+				"BEGIN "
+				"UPDATE mupdate_counters SET unread=unread-old.unread, total=total-1 "
+				"WHERE (kind='source' AND key=CAST(old.source AS TEXT)) "
+				"OR (kind='tag' AND key IN "
+				"(SELECT tag FROM mupdate_source_tags WHERE source=old.source)); "
+				"END");
+
+	return rc;
+}
+
+int db_source_tags_clear(sqlite3 *db)
+{
+	return db_exec(db, "DELETE FROM mupdate_source_tags");
+}
+
+int db_source_tags_add(sqlite3 *db, int source_id, const char *tag, int tag_len)
+{
+	sqlite3_stmt *stmt;
+	char sql[] = "INSERT OR IGNORE INTO mupdate_source_tags (source, tag) "
+		"VALUES (:source, :tag)";
+	int rc;
+
+	rc = sqlite3_prepare_v2(db, sql, sizeof(sql), &stmt, NULL);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int (stmt, 1, source_id);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_text(stmt, 2, tag, tag_len, SQLITE_STATIC);
+
+	if (rc == SQLITE_OK)
+		rc = sqlite3_step(stmt);
+
+	return sqlite3_finalize(stmt);
+}
+
+int db_source_tags_stmt(sqlite3 *db, sqlite3_stmt **stmt)
+{
+	char sql[] = "SELECT id, tags FROM sources";
+	return sqlite3_prepare_v2(db, sql, sizeof(sql), stmt, NULL);
+}
+
+/* counts from scratch into temp.mupdate_counters_expected */
+int db_counters_compute(sqlite3 *db)
+{
+	int rc;
+
+	rc = db_exec(db, "CREATE TEMP TABLE IF NOT EXISTS mupdate_counters_expected ("
+			"kind TEXT NOT NULL, key TEXT NOT NULL, "
+			"unread INTEGER NOT NULL, total INTEGER NOT NULL, "
+			"PRIMARY KEY (kind, key))");
+	if (rc == SQLITE_OK)
+		rc = db_exec(db, "DELETE FROM temp.mupdate_counters_expected");
+	if (rc == SQLITE_OK)
+		rc = db_exec(db, "INSERT INTO temp.mupdate_counters_expected "
+				"SELECT 'source', CAST(source AS TEXT), sum(unread), count(*) "
+				"FROM items GROUP BY source");
+	if (rc == SQLITE_OK)
+		rc = db_exec(db, "INSERT INTO temp.mupdate_counters_expected "
+				"SELECT 'tag', t.tag, sum(i.unread), count(*) "
+				"FROM items i JOIN mupdate_source_tags t ON t.source=i.source "
+				"GROUP BY t.tag");
+
+	return rc;
+}
+
+/* rows of mupdate_counters that differ from the computed ones */
+int db_counters_diff_stmt(sqlite3 *db, sqlite3_stmt **stmt)
+{
+	char sql[] = "SELECT e.kind, e.key, IFNULL(c.unread, 0), IFNULL(c.total, 0), "
+		"e.unread, e.total "
+		"FROM temp.mupdate_counters_expected e "
+		"LEFT JOIN mupdate_counters c ON c.kind=e.kind AND c.key=e.key "
+		"WHERE c.unread IS NOT e.unread OR c.total IS NOT e.total "
+		"UNION ALL "
+		"SELECT c.kind, c.key, c.unread, c.total, 0, 0 "
+		"FROM mupdate_counters c "
+		"LEFT JOIN temp.mupdate_counters_expected e ON c.kind=e.kind AND c.key=e.key "
+		"WHERE e.kind IS NULL AND (c.unread!=0 OR c.total!=0)";
+	return sqlite3_prepare_v2(db, sql, sizeof(sql), stmt, NULL);
+}
+
+int db_counters_replace(sqlite3 *db)
+{
+	int rc;
+
+	rc = db_exec(db, "DELETE FROM mupdate_counters");
+	if (rc == SQLITE_OK)
+		rc = db_exec(db, "INSERT INTO mupdate_counters "
+				"SELECT kind, key, unread, total FROM temp.mupdate_counters_expected");
+
+	return rc;
+}
+
+
+/* -*- link dedup -*- */
+
+int db_items_links_since_stmt(sqlite3 *db, const char *since, sqlite3_stmt **stmt)
+{
+	char sql[] = "SELECT link, uid, source FROM items WHERE datetime>=:since";
+	int rc;
+
+	rc = sqlite3_prepare_v2(db, sql, sizeof(sql), stmt, NULL);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_text(*stmt, 1, since, -1, SQLITE_TRANSIENT);
+
+	return rc;
+}
+
+int db_items_text_since_stmt(sqlite3 *db, const char *since, sqlite3_stmt **stmt)
+{
+	char sql[] = "SELECT id, source, title, content FROM items WHERE datetime>=:since";
+	int rc;
+
+	rc = sqlite3_prepare_v2(db, sql, sizeof(sql), stmt, NULL);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_text(*stmt, 1, since, -1, SQLITE_TRANSIENT);
+
+	return rc;
+}
+
+int db_simhash_create(sqlite3 *db, bool *created)
+{
+	bool exists;
+	int rc;
+
+	rc = db_table_exists(db, "mupdate_simhash", &exists);
+	*created = !exists;
+
+	if (rc == SQLITE_OK)
+		rc = db_exec(db, "CREATE TABLE IF NOT EXISTS mupdate_simhash ("
+				"id INTEGER PRIMARY KEY, "	/* items.id */
+				"source INTEGER NOT NULL, "
+				"fp INTEGER NOT NULL, "
+				"seen INTEGER NOT NULL)");
+	if (rc == SQLITE_OK)
+		rc = db_exec(db, "CREATE INDEX IF NOT EXISTS mupdate_simhash_seen "
+				"ON mupdate_simhash (seen)");
+	if (rc == SQLITE_OK)
+		rc = db_exec(db, "CREATE TABLE IF NOT EXISTS mupdate_near_dups ("
+				"source INTEGER PRIMARY KEY, "
+				"suppressed INTEGER NOT NULL DEFAULT 0, "
+				"last INTEGER NOT NULL DEFAULT 0)");
+	if (rc == SQLITE_OK)
+		rc = db_exec(db, "CREATE TABLE IF NOT EXISTS mupdate_near_dup_items ("
+				"uid TEXT PRIMARY KEY, "
+				"source INTEGER NOT NULL, "
+				"seen INTEGER NOT NULL)");
+
+	return rc;
+}
+
+int db_simhash_add(sqlite3 *db, sqlite3_int64 id, int source_id, uint64_t fp, time_t seen)
+{
+	sqlite3_stmt *stmt;
+	char sql[] = "INSERT OR REPLACE INTO mupdate_simhash (id, source, fp, seen) "
+		"VALUES (:id, :source, :fp, :seen)";
+	int rc;
+
+	rc = sqlite3_prepare_v2(db, sql, sizeof(sql), &stmt, NULL);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int64(stmt, 1, id);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int(stmt, 2, source_id);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int64(stmt, 3, (sqlite3_int64) fp);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int64(stmt, 4, seen);
+
+	if (rc == SQLITE_OK)
+		rc = sqlite3_step(stmt);
+
+	return sqlite3_finalize(stmt);
+}
+
+static int db_simhash_expire_table(sqlite3 *db, const char *table, time_t since)
+{
+	sqlite3_stmt *stmt;
+	char sql[128];
+	int rc;
+
+	snprintf(sql, sizeof(sql), "DELETE FROM %s WHERE seen<:since", table);
+
+	rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int64(stmt, 1, since);
+
+	if (rc == SQLITE_OK)
+		rc = sqlite3_step(stmt);
+
+	return sqlite3_finalize(stmt);
+}
+
+int db_simhash_expire(sqlite3 *db, time_t since)
+{
+	int rc;
+
+	rc = db_simhash_expire_table(db, "mupdate_simhash", since);
+	if (rc == SQLITE_OK)
+		rc = db_simhash_expire_table(db, "mupdate_near_dup_items", since);
+
+	return rc;
+}
+
+int db_simhash_stmt(sqlite3 *db, sqlite3_stmt **stmt)
+{
+	char sql[] = "SELECT fp, source FROM mupdate_simhash";
+
+	return sqlite3_prepare_v2(db, sql, sizeof(sql), stmt, NULL);
+}
+
+int db_near_dups_add(sqlite3 *db, int source_id, int n)
+{
+	sqlite3_stmt *stmt;
+	char sql[] = "INSERT INTO mupdate_near_dups (source, suppressed, last) "
+		"VALUES (:source, :n, strftime('%s', 'now')) "
+		"ON CONFLICT (source) DO UPDATE SET "
+		"suppressed=suppressed+excluded.suppressed, last=excluded.last";
+	int rc;
+
+	rc = sqlite3_prepare_v2(db, sql, sizeof(sql), &stmt, NULL);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int(stmt, 1, source_id);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int(stmt, 2, n);
+
+	if (rc == SQLITE_OK)
+		rc = sqlite3_step(stmt);
+
+	return sqlite3_finalize(stmt);
+}
+
+/* added - false if the item was suppressed by an earlier run */
+int db_near_dup_item_add(sqlite3 *db, const char *uid, int source_id, time_t seen,
+		bool *added)
+{
+	sqlite3_stmt *stmt;
+	char sql[] = "INSERT OR IGNORE INTO mupdate_near_dup_items (uid, source, seen) "
+		"VALUES (:uid, :source, :seen)";
+	int rc;
+
+	*added = false;
+
+	rc = sqlite3_prepare_v2(db, sql, sizeof(sql), &stmt, NULL);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_text (stmt, 1, uid, -1, SQLITE_STATIC);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int  (stmt, 2, source_id);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int64(stmt, 3, seen);
+
+	if (rc == SQLITE_OK)
+		rc = sqlite3_step(stmt);
+
+	if (rc == SQLITE_DONE)
+		*added = sqlite3_changes(db) > 0;
+
+	return sqlite3_finalize(stmt);
+}
+
+int db_near_dup_item_exists(sqlite3 *db, const char *uid, bool *exists)
+{
+	sqlite3_stmt *stmt;
+	char sql[] = "SELECT 1 FROM mupdate_near_dup_items WHERE uid=:uid";
+	int rc;
+
+	*exists = false;
+
+	rc = sqlite3_prepare_v2(db, sql, sizeof(sql), &stmt, NULL);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_text(stmt, 1, uid, -1, SQLITE_STATIC);
+
+	if (rc == SQLITE_OK)
+		rc = sqlite3_step(stmt);
+
+	if (rc == SQLITE_ROW)
+		*exists = true;
+	else if (rc != SQLITE_DONE) {
+		sqlite3_finalize(stmt);
+		return -1;
+	}
+
+	return sqlite3_finalize(stmt);
+}
+
+/* -*- spool ingest -*- */
+
+int db_spool_create(sqlite3 *db)
+{
+	return db_exec(db, "CREATE TABLE IF NOT EXISTS mupdate_spool ("
+			"id TEXT PRIMARY KEY, "
+			"offset INTEGER NOT NULL, "
+			"ingested INTEGER NOT NULL)");
+}
+
+/* bytes of spool id already ingested, 0 if never seen */
+int db_spool_offset_get(sqlite3 *db, const char *id, sqlite3_int64 *offset)
+{
+	sqlite3_stmt *stmt;
+	char sql[] = "SELECT offset FROM mupdate_spool WHERE id=:id";
+	int rc;
+
+	*offset = 0;
+
+	rc = sqlite3_prepare_v2(db, sql, sizeof(sql), &stmt, NULL);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_text(stmt, 1, id, -1, SQLITE_STATIC);
+
+	if (rc == SQLITE_OK)
+		rc = sqlite3_step(stmt);
+
+	if (rc == SQLITE_ROW)
+		*offset = sqlite3_column_int64(stmt, 0);
+	else if (rc != SQLITE_DONE) {
+		sqlite3_finalize(stmt);
+		debug3("failed");
+		return -1;
+	}
+
+	return sqlite3_finalize(stmt);
+}
+
+int db_spool_offset_set(sqlite3 *db, const char *id, sqlite3_int64 offset)
+{
+	sqlite3_stmt *stmt;
+	char sql[] = "INSERT OR REPLACE INTO mupdate_spool (id, offset, ingested) "
+		"VALUES (:id, :offset, strftime('%s', 'now'))";
+	int rc;
+
+	rc = sqlite3_prepare_v2(db, sql, sizeof(sql), &stmt, NULL);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_text(stmt, 1, id, -1, SQLITE_STATIC);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int64(stmt, 2, offset);
+
+	if (rc == SQLITE_OK)
+		rc = sqlite3_step(stmt);
+
+	return sqlite3_finalize(stmt);
+}
+
+/* -*- run journal -*- */
+
+int db_journal_create(sqlite3 *db)
+{
+	int rc;
+
+	rc = db_exec(db, "CREATE TABLE IF NOT EXISTS mupdate_run ("
+			"id INTEGER PRIMARY KEY AUTOINCREMENT, "
+			"shard TEXT NOT NULL, "
+			"pid INTEGER NOT NULL, "
+			"started INTEGER NOT NULL, "
+			"finished INTEGER, "
+			"resumed INTEGER NOT NULL DEFAULT 0)");
+	if (rc == SQLITE_OK)
+		rc = db_exec(db, "CREATE TABLE IF NOT EXISTS mupdate_run_sources ("
+				"run INTEGER NOT NULL, "
+				"source INTEGER NOT NULL, "
+				"position INTEGER NOT NULL, "
+				"state INTEGER NOT NULL DEFAULT 0, "
+				"items INTEGER NOT NULL DEFAULT 0, "
+				"fetch_ms REAL NOT NULL DEFAULT 0, "
+				"committed INTEGER, "
+				"PRIMARY KEY (run, source))");
+
+	return rc;
+}
+
+int db_journal_run_add(sqlite3 *db, const char *shard, int pid, sqlite3_int64 *run)
+{
+	sqlite3_stmt *stmt;
+	char sql[] = "INSERT INTO mupdate_run (shard, pid, started) "
+		"VALUES (:shard, :pid, strftime('%s', 'now'))";
+	int rc;
+
+	rc = sqlite3_prepare_v2(db, sql, sizeof(sql), &stmt, NULL);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_text(stmt, 1, shard, -1, SQLITE_STATIC);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int(stmt, 2, pid);
+
+	if (rc == SQLITE_OK)
+		rc = sqlite3_step(stmt);
+
+	*run = sqlite3_last_insert_rowid(db);
+
+	return sqlite3_finalize(stmt);
+}
+
+int db_journal_plan_add(sqlite3 *db, sqlite3_int64 run, int position, int source_id)
+{
+	sqlite3_stmt *stmt;
+	char sql[] = "INSERT OR IGNORE INTO mupdate_run_sources (run, source, position) "
+		"VALUES (:run, :source, :position)";
+	int rc;
+
+	rc = sqlite3_prepare_v2(db, sql, sizeof(sql), &stmt, NULL);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int64(stmt, 1, run);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int(stmt, 2, source_id);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int(stmt, 3, position);
+
+	if (rc == SQLITE_OK)
+		rc = sqlite3_step(stmt);
+
+	return sqlite3_finalize(stmt);
+}
+
+int db_journal_source_done(sqlite3 *db, sqlite3_int64 run, int source_id,
+		int state, int items, double fetch_ms)
+{
+	sqlite3_stmt *stmt;
+	char sql[] = "UPDATE mupdate_run_sources SET state=:state, items=:items, "
+		"fetch_ms=:fetch_ms, committed=strftime('%s', 'now') "
+		"WHERE run=:run AND source=:source";
+	int rc;
+
+	rc = sqlite3_prepare_v2(db, sql, sizeof(sql), &stmt, NULL);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int(stmt, 1, state);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int(stmt, 2, items);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_double(stmt, 3, fetch_ms);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int64(stmt, 4, run);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int(stmt, 5, source_id);
+
+	if (rc == SQLITE_OK)
+		rc = sqlite3_step(stmt);
+
+	return sqlite3_finalize(stmt);
+}
+
+int db_journal_run_finish(sqlite3 *db, sqlite3_int64 run)
+{
+	sqlite3_stmt *stmt;
+	char sql[] = "UPDATE mupdate_run SET finished=strftime('%s', 'now') WHERE id=:run";
+	int rc;
+
+	rc = sqlite3_prepare_v2(db, sql, sizeof(sql), &stmt, NULL);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int64(stmt, 1, run);
+
+	if (rc == SQLITE_OK)
+		rc = sqlite3_step(stmt);
+
+	return sqlite3_finalize(stmt);
+}
+
+int db_journal_run_resumed(sqlite3 *db, sqlite3_int64 run, int pid)
+{
+	sqlite3_stmt *stmt;
+	char sql[] = "UPDATE mupdate_run SET pid=:pid, resumed=resumed+1 WHERE id=:run";
+	int rc;
+
+	rc = sqlite3_prepare_v2(db, sql, sizeof(sql), &stmt, NULL);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int(stmt, 1, pid);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int64(stmt, 2, run);
+
+	if (rc == SQLITE_OK)
+		rc = sqlite3_step(stmt);
+
+	return sqlite3_finalize(stmt);
+}
+
+/* unfinished runs of the shard can not be resumed anymore */
+int db_journal_run_abandon(sqlite3 *db, const char *shard)
+{
+	sqlite3_stmt *stmt;
+	char sql[] = "UPDATE mupdate_run SET finished=0 WHERE shard=:shard AND finished IS NULL";
+	int rc;
+
+	rc = sqlite3_prepare_v2(db, sql, sizeof(sql), &stmt, NULL);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_text(stmt, 1, shard, -1, SQLITE_STATIC);
+
+	if (rc == SQLITE_OK)
+		rc = sqlite3_step(stmt);
+
+	return sqlite3_finalize(stmt);
+}
+
+/* latest unfinished run of the shard, 0 if none */
+int db_journal_run_unfinished(sqlite3 *db, const char *shard, sqlite3_int64 *run)
+{
+	sqlite3_stmt *stmt;
+	char sql[] = "SELECT id FROM mupdate_run WHERE shard=:shard AND finished IS NULL "
+		"ORDER BY id DESC LIMIT 1";
+	int rc;
+
+	*run = 0;
+
+	rc = sqlite3_prepare_v2(db, sql, sizeof(sql), &stmt, NULL);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_text(stmt, 1, shard, -1, SQLITE_STATIC);
+
+	if (rc == SQLITE_OK)
+		rc = sqlite3_step(stmt);
+
+	if (rc == SQLITE_ROW)
+		*run = sqlite3_column_int64(stmt, 0);
+	else if (rc != SQLITE_DONE) {
+		sqlite3_finalize(stmt);
+		debug3("failed");
+		return -1;
+	}
+
+	return sqlite3_finalize(stmt);
+}
+
+int db_journal_pending_stmt(sqlite3 *db, sqlite3_int64 run, sqlite3_stmt **stmt)
+{
+	char sql[] = "SELECT source FROM mupdate_run_sources "
+		"WHERE run=:run AND state=0 ORDER BY position";
+	int rc;
+
+	rc = sqlite3_prepare_v2(db, sql, sizeof(sql), stmt, NULL);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int64(*stmt, 1, run);
+
+	return rc;
+}
+
+/* keep the latest runs of the shard */
+int db_journal_expire(sqlite3 *db, const char *shard, int keep)
+{
+	sqlite3_stmt *stmt;
+	char sql[] = "DELETE FROM mupdate_run WHERE shard=:shard AND id NOT IN "
+		"(SELECT id FROM mupdate_run WHERE shard=:shard ORDER BY id DESC LIMIT :keep)";
+	int rc;
+
+	rc = sqlite3_prepare_v2(db, sql, sizeof(sql), &stmt, NULL);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_text(stmt, 1, shard, -1, SQLITE_STATIC);
+	if (rc == SQLITE_OK) rc = sqlite3_bind_int(stmt, 2, keep);
+
+	if (rc == SQLITE_OK)
+		rc = sqlite3_step(stmt);
+
+	rc = sqlite3_finalize(stmt);
+	if (rc == SQLITE_OK)
+		rc = db_exec(db, "DELETE FROM mupdate_run_sources WHERE run NOT IN "
+				"(SELECT id FROM mupdate_run)");
+
+	return rc;
+}
@@ -0,0 +1,759 @@
+/**
+ * Selfoss RSS reader micro updater
+ *
+ *   Copyright (C) 2013 Vladimir Ermakov <vooon341@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "selfoss_mupdate.h"
+#include <ctype.h>
+#include <iconv.h>
+
+#include "nxml.h"
+#include "mrss.h"
+#include "bb_md5_sha.h"
+
+
+/* -*- content preparation -*- */
+
+/* nxml internal, modifies tmp, return new str  */
+char *__nxml_trim(char *);
+
+static void trim_replace(char **field)
+{
+	char *p;
+	if (!(field && *field)) return;
+	p = __nxml_trim(*field);
+	free(*field);
+	*field = p;
+}
+
+static void iconv_replace(iconv_t cd, char **field)
+{
+	char *in, *out, *buf;
+	size_t in_sz, out_sz;
+	size_t _in_sz, _out_sz, ret_sz;
+
+	if (cd == (iconv_t) -1 || *field == NULL)
+		return;
+
+	alloc_stage(ALLOC_ICONV, -1);
+	in_sz = strlen(*field);
+
+	/* NOTE: optimization for cp1251/koi8-r -> utf-8 */
+	out_sz = in_sz * 2;
+
+	for (;;) {
+		if ((buf = calloc(out_sz + 1, 1)) == NULL)
+			err(1, "out of memory\n");
+
+		in = *field;
+		out = buf;
+		_in_sz = in_sz;
+		_out_sz = out_sz;
+
+		iconv(cd, NULL, NULL, NULL, NULL);
+		ret_sz = iconv(cd, &in, &_in_sz, &out, &_out_sz);
+		if (ret_sz != -1 || errno != E2BIG)
+			break;
+
+		debug("E2BIG. in_sz=%zu", _in_sz);
+		free(buf);
+		out_sz *= 2;
+	}
+
+	if (ret_sz == -1) {
+		/* declared charset is wrong for this field */
+		debug("iconv(): %s, repairing as UTF-8", strerror(errno));
+		free(buf);
+		buf = utf8_repair(*field, in_sz, utf8_guess_charset(*field, in_sz), NULL);
+	}
+
+	free(*field);
+	*field = buf;
+	alloc_stage(ALLOC_PARSE, -1);
+}
+
+/* encoding="..." from the XML declaration, false if none */
+static bool xml_declared_encoding(const char *body, size_t sz, char *enc, size_t enc_sz)
+{
+	const char *p, *end, *q;
+	char quote;
+
+	if (sz >= 3 && memcmp(body, "\xef\xbb\xbf", 3) == 0) {
+		body += 3;
+		sz -= 3;
+	}
+	if (sz < 5 || memcmp(body, "<?xml", 5) != 0)
+		return false;
+
+	end = memmem(body, (sz < 256) ? sz : 256, "?>", 2);
+	if (end == NULL)
+		return false;
+
+	p = memmem(body, end - body, "encoding", 8);
+	if (p == NULL)
+		return false;
+
+	for (p += 8; p < end && (*p == ' ' || *p == '=' || *p == '\t'); p++)
+		;
+	if (p == end || (*p != '"' && *p != '\''))
+		return false;
+
+	quote = *p++;
+	q = memchr(p, quote, end - p);
+	if (q == NULL || q == p || q - p >= enc_sz)
+		return false;
+
+	memcpy(enc, p, q - p);
+	enc[q - p] = '\0';
+
+	return true;
+}
+
+/*
+ * Bodies are checked before parsing: invalid UTF-8 must not reach the
+ * database (selfoss JSON output breaks on it).  Declared legacy charsets
+ * are trusted unless the body is valid UTF-8 anyway; a UTF-8 or missing
+ * declaration on a non UTF-8 body is repaired here.
+ *
+ * Returns true if the body is UTF-8 and the declaration is to be ignored.
+ */
+static bool body_utf8_prepare(struct feed_job *job)
+{
+	const char *charset;
+	char enc[64];
+	bool declared;
+	char *fixed;
+	size_t sz;
+
+	declared = xml_declared_encoding(job->body, job->body_sz, enc, sizeof(enc));
+
+	/* wide encodings are never valid UTF-8, leave them to the parser */
+	if (declared && (strncasecmp(enc, "utf-16", 6) == 0 ||
+			strncasecmp(enc, "utf-32", 6) == 0 ||
+			strncasecmp(enc, "ucs", 3) == 0))
+		return false;
+
+	if (utf8_valid(job->body, job->body_sz)) {
+		if (declared && strcasecmp(enc, "utf-8") != 0)
+			debug("declared %s, body is valid UTF-8", enc);
+		return true;
+	}
+
+	if (declared && strcasecmp(enc, "utf-8") != 0 && strcasecmp(enc, "utf8") != 0)
+		return false;
+
+	alloc_stage(ALLOC_ICONV, -1);
+	charset = utf8_guess_charset(job->body, job->body_sz);
+	fixed = utf8_repair(job->body, job->body_sz, charset, &sz);
+	alloc_stage(ALLOC_PARSE, -1);
+	debug("body is not UTF-8 (declared %s), repaired as %s",
+			(declared) ? enc : "nothing", charset);
+	stats_inc(bodies_repaired);
+
+	free(job->body);
+	job->body = fixed;
+	job->body_sz = sz;
+
+	return true;
+}
+
+/* -*- Feed process -*- */
+
+static size_t simplepie_get_id(mrss_t *rss, mrss_item_t *item, char *buf, size_t sz)
+{
+	if (item->guid != NULL) {
+		strncpy(buf, item->guid, sz - 1);
+		debug2("choose guid%s: %s", (item->guid_isPermaLink) ? " [permalink]" : "", item->guid);
+	}
+	else if (item->link != NULL) {
+		strncpy(buf, item->link, sz - 1);
+		debug2("choose link: %s", item->link);
+	}
+	else if (item->enclosure_url != NULL) {
+		strncpy(buf, item->enclosure_url, sz - 1);
+		debug2("choose encloseure url: %s", item->enclosure_url);
+	}
+	else if (item->title != NULL) {
+		strncpy(buf, item->title, sz - 1);
+		debug2("choose title: %s", item->title);
+	}
+	else {
+		fprintf(stderr, "%s BUG\n", __func__);
+		return 0;
+	}
+
+	return strnlen(buf, sz);
+}
+
+/* same choice as simplepie_get_id(), only the chosen field is decoded */
+static size_t view_get_id(const struct feed_view *fv, const struct item_view *iv,
+		char *buf, size_t sz)
+{
+	static const char *names[] = { "guid", "link", "encloseure url", "title" };
+	const struct xml_span *fields[] = { &iv->guid, &iv->link, &iv->enclosure_url, &iv->title };
+	size_t i, len;
+
+	for (i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+		len = itemview_text(fv, *fields[i], buf, sz);
+		if (len != 0) {
+			debug2("choose %s: %s", names[i], buf);
+			return len;
+		}
+	}
+
+	fprintf(stderr, "%s BUG\n", __func__);
+	return 0;
+}
+
+/* simplepie id of sz bytes to selfoss uid */
+static size_t selfoss_getId(const char *sp_buf, size_t sz, char *buf_256)
+{
+	if (sz > IDSIZE) {
+		md5_ctx_t ctx;
+		char digest[16];
+
+		md5_begin(&ctx);
+		md5_hash(&ctx, sp_buf, sz);
+		md5_end(&ctx, &digest);
+
+		sz = snprintf(buf_256, IDSIZE + 1,
+				"%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x",
+				digest[0], digest[1], digest[2], digest[3],
+				digest[4], digest[5], digest[6], digest[7],
+				digest[8], digest[9], digest[10], digest[11],
+				digest[12], digest[13], digest[14], digest[15]);
+	}
+	else {
+		memcpy(buf_256, sp_buf, sz);
+		buf_256[sz] = '\0';
+	}
+
+	debug("sz=%zu, id: %s", sz, buf_256);
+
+	return sz;
+}
+
+static void feed_item_free(struct feed_item *fi)
+{
+	free(fi->title);
+	free(fi->content);
+	free(fi->link);
+	free(fi->thumb_url);
+	free(fi);
+}
+
+void feed_job_free(struct feed_job *job)
+{
+	struct feed_item *fi, *next;
+
+	for (fi = job->items; fi != NULL; fi = next) {
+		next = fi->next;
+		feed_item_free(fi);
+	}
+
+	free(job->headers);
+	free(job->body);
+	free(job->redirect);
+	free(job);
+}
+
+static void item_debug(const mrss_item_t *item)
+{
+	debug ("\t\ttitle: %s", item->title);
+	debug2("\t\tdescription: %s", item->description);
+	debug2("\t\tlink: %s", item->link);
+	debug2("\t\tguid: %s", item->guid);
+	debug2("\t\tenclosure_url: %s", item->enclosure_url);
+	debug ("\t\tpub date: %s", item->pubDate);
+}
+
+static struct feed_options feed_opts;
+
+void feed_init(const struct feed_options *opts)
+{
+	feed_opts = *opts;
+}
+
+/*
+ * Cut over-long HTML before sanitize, Tidy time grows with it.  The cut
+ * is moved back out of a tag, an entity and a UTF-8 sequence; elements
+ * left open are closed by the sanitizer.
+ */
+static bool description_truncate(char *html, size_t max)
+{
+	size_t cut, tag = 0, i;
+	bool in_tag = false;
+	char quote = '\0';
+
+	if (max == 0 || strlen(html) <= max)
+		return false;
+
+	/* '>' in a quoted attribute value does not end the tag */
+	for (i = 0; i < max; i++) {
+		if (quote != '\0') {
+			if (html[i] == quote)
+				quote = '\0';
+		}
+		else if (!in_tag) {
+			/* a plain '<' in text opens nothing */
+			if (html[i] == '<' && (isalpha((unsigned char) html[i + 1]) ||
+					html[i + 1] == '/' || html[i + 1] == '!' || html[i + 1] == '?')) {
+				in_tag = true;
+				tag = i;
+			}
+		}
+		else if (html[i] == '"' || html[i] == '\'')
+			quote = html[i];
+		else if (html[i] == '>')
+			in_tag = false;
+	}
+
+	cut = (in_tag) ? tag : max;
+
+	for (i = cut; i > 0 && cut - i < 12; i--) {
+		if (html[i - 1] == ';' || isspace((unsigned char) html[i - 1]))
+			break;
+		if (html[i - 1] == '&') {
+			cut = i - 1;
+			break;
+		}
+	}
+
+	while (cut > 0 && ((unsigned char) html[cut] & 0xc0) == 0x80)
+		cut--;
+
+	html[cut] = '\0';
+	return true;
+}
+
+/* early duplicate check, the writer checks again */
+static int item_known(sqlite3 *rdb, struct feed_job *job, char *uid, bool *exists)
+{
+	int rc;
+
+	if (tenant_active())
+		return tenant_item_exists(job, uid, exists);
+
+	rc = db_item_exists(rdb, uid, exists);
+	if (rc == SQLITE_OK && !*exists)
+		rc = simhash_known(rdb, uid, exists);
+
+	return rc;
+}
+
+/*
+ * Item not in the database: duplicate filters and sanitize.
+ * Prepared strings are stolen from item.  Returns NULL if skipped.
+ */
+static struct feed_item *item_prepare(sqlite3 *rdb, struct feed_job *job,
+		mrss_item_t *rssitem, const char *uid, size_t n, struct tm *item_tm)
+{
+	struct feed_item *fi;
+	struct cache_ref cref;
+	bool dup;
+	uint64_t fp, link_hash;
+	int rc;
+
+	/* before sanitize, duplicates are skipped */
+	link_hash = linkdup_hash(rssitem->link, uid);
+	dup = linkdup_check(job->src->id, link_hash, rssitem->link);
+	if (dup && !linkdup_marking())
+		return NULL;
+
+	if (rssitem->pubDate != NULL)
+		strptime(rssitem->pubDate, "%a, %d %b %Y %H:%M:%S %z", item_tm);
+
+	sanitize_text_only(&rssitem->title);
+	trim_replace(&rssitem->title);
+	if (rssitem->title == NULL || strlen(rssitem->title) < 2) {
+		free(rssitem->title);
+		rssitem->title = strdup("[ NO TITLE ]");
+	}
+
+	if (rssitem->description != NULL &&
+			description_truncate(rssitem->description, feed_opts.max_description)) {
+		debug("description of item #%zu cut to %zu bytes", n, strlen(rssitem->description));
+		job->descriptions_capped++;
+	}
+
+	alloc_stage(ALLOC_SANITIZE, -1);
+	rc = sanitize_content_cached(rdb, &rssitem->description, &cref);
+	alloc_stage(ALLOC_PARSE, -1);
+	if (rc > 1) {
+		fprintf(stderr, "content sanitized with errors! item #%zu '%s' (rc=%d)\n",
+				n, rssitem->title, rc);
+	}
+	else if (rc >= 0) {
+		debug("sanitize ok #%zu '%s'", n, rssitem->title);
+	}
+	else {
+		fprintf(stderr, "content sanitization failed! skip item #%zu '%s'\n",
+				n, rssitem->title);
+		return NULL;
+	}
+
+	/* after sanitize: compared is the text selfoss will show */
+	fp = simhash_item(rssitem->title, rssitem->description);
+
+	fi = calloc(1, sizeof(*fi));
+	if (fi == NULL)
+		err(1, "out of memory");
+
+	/* only the uid, the writer records it as suppressed */
+	if (simhash_check(job->src->id, fp)) {
+		memcpy(fi->uid, uid, sizeof(fi->uid));
+		fi->near_dup = true;
+		return fi;
+	}
+
+	/* steal prepared strings, mrss_free() skips NULL fields */
+	fi->title = rssitem->title;
+	fi->content = rssitem->description;
+	fi->link = rssitem->link;
+	rssitem->title = NULL;
+	rssitem->description = NULL;
+	rssitem->link = NULL;
+
+	memcpy(fi->uid, uid, sizeof(fi->uid));
+	fi->pub_tm = *item_tm;
+	fi->cache = cref;
+	fi->duplicate = dup;
+	fi->link_hash = link_hash;
+	fi->simhash = fp;
+
+	if (job->src->handler != NULL && job->src->handler->map_item != NULL)
+		job->src->handler->map_item(fi, rssitem);
+	/* thumb_url is fetched after the writer stored the item, see thumbnail.c */
+
+	return fi;
+}
+
+/*
+ * UTF-8 body read through item views: ids come straight from the body,
+ * strings are made only for items not in the database yet.
+ */
+static void feed_process_views(sqlite3 *rdb, struct feed_job *job, const struct feed_view *fv)
+{
+	struct feed_item **tail = &job->items;
+	char sp_buf[4096];
+	char uid_buf[IDSIZE + 1];
+	time_t item_time;
+	struct tm item_tm;
+	size_t n, sz;
+	bool exists;
+	int rc;
+
+	item_time = time(NULL);
+	gmtime_r(&item_time, &item_tm);
+	if (itemview_text(fv, fv->pub_date, sp_buf, sizeof(sp_buf)) != 0)
+		strptime(sp_buf, "%a, %d %b %Y %H:%M:%S %z", &item_tm);
+
+	debug ("Generic:");
+	debug ("\tsource: #%d", job->src->id);
+	debug ("\tfile url: %s", job->src->url);
+	debug ("\titem views: %zu", fv->n_items);
+
+	debug("Items:");
+	for (n = 0; n < fv->n_items; n++) {
+		const struct item_view *iv = &fv->items[n];
+		struct feed_item *fi;
+		mrss_item_t item;
+
+		if (feed_opts.max_items && n == feed_opts.max_items) {
+			job->items_capped = fv->n_items - n;
+			debug("%d items over --max-items skipped", job->items_capped);
+			break;
+		}
+
+		debug ("\tItem %zu:", n);
+
+		sz = view_get_id(fv, iv, sp_buf, sizeof(sp_buf));
+		selfoss_getId(sp_buf, sz, uid_buf);
+		rc = item_known(rdb, job, uid_buf, &exists);
+		if (rc != SQLITE_OK)
+			errx(1, "sqlite fail");
+		if (exists) {
+			debug("item alredy exists. skipped");
+			continue;
+		}
+
+		memset(&item, 0, sizeof(item));
+		item.title = itemview_strdup(fv, iv->title);
+		item.description = itemview_strdup(fv, iv->description);
+		item.link = itemview_strdup(fv, iv->link);
+		item.guid = itemview_strdup(fv, iv->guid);
+		item.pubDate = itemview_strdup(fv, iv->pub_date);
+		item.enclosure_url = itemview_strdup(fv, iv->enclosure_url);
+		item.enclosure_type = itemview_strdup(fv, iv->enclosure_type);
+		item_debug(&item);
+
+		fi = item_prepare(rdb, job, &item, uid_buf, n, &item_tm);
+		if (fi != NULL) {
+			*tail = fi;
+			tail = &fi->next;
+			job->n_items++;
+		}
+
+		free(item.title);
+		free(item.description);
+		free(item.link);
+		free(item.guid);
+		free(item.pubDate);
+		free(item.enclosure_url);
+		free(item.enclosure_type);
+	}
+}
+
+/* anything else goes through libmrss */
+static int feed_process_mrss(sqlite3 *rdb, struct feed_job *job, bool body_utf8)
+{
+	mrss_t *rssdata;
+	mrss_error_t mret;
+	mrss_item_t *rssitem;
+	iconv_t iconv_cd;
+	time_t item_time;
+	struct tm item_tm;
+	struct feed_item **tail = &job->items;
+	char sp_buf[4096];
+	size_t n, sz;
+	int rc;
+
+	mret = mrss_parse_buffer(job->body, job->body_sz, &rssdata);
+
+	/* body not needed anymore, free it early */
+	free(job->body);
+	job->body = NULL;
+
+	if (mret) {
+		job_error(job, "MRSS Error: %s", mrss_strerror(mret));
+		return 1;
+	}
+
+	if (!body_utf8 && rssdata->encoding != NULL && \
+			strcasecmp(rssdata->encoding, "utf-8") != 0) {
+
+		iconv_cd = iconv_open("utf-8", rssdata->encoding);
+		if (iconv_cd == (iconv_t) -1) {
+			job_error(job, "iconv_open(utf-8, %s): %s",
+				rssdata->encoding, strerror(errno));
+			mrss_free(rssdata);
+			return 1;
+		}
+
+		debug("Iconv hack enabled");
+	}
+	else
+		iconv_cd = (iconv_t) -1;
+
+	iconv_replace(iconv_cd, &rssdata->title);
+	iconv_replace(iconv_cd, &rssdata->description);
+	iconv_replace(iconv_cd, &rssdata->link);
+	iconv_replace(iconv_cd, &rssdata->image_title);
+	iconv_replace(iconv_cd, &rssdata->image_url);
+	iconv_replace(iconv_cd, &rssdata->image_link);
+	iconv_replace(iconv_cd, &rssdata->image_description);
+
+	item_time = time(NULL);
+	gmtime_r(&item_time, &item_tm);
+	if (rssdata->pubDate != NULL)
+		strptime(rssdata->pubDate, "%a, %d %b %Y %H:%M:%S %z", &item_tm);
+
+	debug ("Generic:");
+	debug ("\tsource: #%d", job->src->id);
+	debug ("\tfile url: %s", job->src->url);
+	debug ("\tencoding: %s", rssdata->encoding);
+	debug2("\tsize: %zu", rssdata->size);
+	debug2("\ttype: %d", rssdata->version);
+	debug ("Channel:");
+	debug ("\ttitle: %s", rssdata->title);
+	debug ("\tdescription: %s", rssdata->description);
+	debug ("\tlink: %s", rssdata->link);
+	debug ("\tpub date: %s", rssdata->pubDate);
+	debug2("Image:");
+	debug2("\ttitle: %s", rssdata->image_title);
+	debug2("\tdescription: %s", rssdata->image_description);
+	debug2("\turl: %s", rssdata->image_url);
+	debug2("\tlink: %s", rssdata->image_link);
+	debug2("\tW x H: %d x %d", rssdata->image_width, rssdata->image_height);
+
+	debug("Items:");
+	for (rssitem = rssdata->item, n = 0;
+		rssitem != NULL;
+		rssitem = rssitem->next, n++) {
+
+		struct feed_item *fi;
+		char uid_buf[IDSIZE + 1];
+		bool exists;
+
+		if (feed_opts.max_items && n == feed_opts.max_items) {
+			for (; rssitem != NULL; rssitem = rssitem->next)
+				job->items_capped++;
+			debug("%d items over --max-items skipped", job->items_capped);
+			break;
+		}
+
+		/* id fields first, description only for new items */
+		iconv_replace(iconv_cd, &rssitem->guid);
+		iconv_replace(iconv_cd, &rssitem->link);
+		iconv_replace(iconv_cd, &rssitem->enclosure_url);
+		iconv_replace(iconv_cd, &rssitem->title);
+
+		debug ("\tItem %zu:", n);
+
+		sz = simplepie_get_id(rssdata, rssitem, sp_buf, sizeof(sp_buf));
+		selfoss_getId(sp_buf, sz, uid_buf);
+		rc = item_known(rdb, job, uid_buf, &exists);
+		if (rc != SQLITE_OK)
+			errx(1, "sqlite fail");
+		if (exists) {
+			debug("item alredy exists. skipped");
+			continue;
+		}
+
+		iconv_replace(iconv_cd, &rssitem->description);
+		item_debug(rssitem);
+
+		fi = item_prepare(rdb, job, rssitem, uid_buf, n, &item_tm);
+		if (fi != NULL) {
+			*tail = fi;
+			tail = &fi->next;
+			job->n_items++;
+		}
+	}
+
+	if (iconv_cd != (iconv_t) -1)
+		iconv_close(iconv_cd);
+	mrss_free(rssdata);
+
+	return 0;
+}
+
+/* worker stage: parse fetched body, prepare new items for the writer.
+ * rdb used only for the early duplicate check, the writer checks again. */
+int feed_process(sqlite3 *rdb, struct feed_job *job)
+{
+	struct feed_view fv;
+	bool body_utf8;
+
+	body_utf8 = body_utf8_prepare(job);
+
+	if (body_utf8 && itemview_scan(&fv, job->body, job->body_sz) == 0) {
+		feed_process_views(rdb, job, &fv);
+		itemview_free(&fv);
+
+		free(job->body);
+		job->body = NULL;
+		return 0;
+	}
+
+	return feed_process_mrss(rdb, job, body_utf8);
+}
+
+/* -*- item view self-check -*- */
+
+/* common item forms, fields must come out as libmrss gives them */
+static const char *const view_check_feeds[] = {
+	"<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+	"<rss version=\"2.0\"><channel><title>c</title>"
+	"<item><title><![CDATA[Tom & Jerry <3]]></title>"
+	"<description><![CDATA[<p>Hello &amp; <b>world</b></p>]]></description>"
+	"<link>http://example.com/1</link><guid>g1</guid></item>"
+	"<item><title>A &amp; B</title>"
+	"<description>&lt;p&gt;escaped &amp;amp; markup&lt;/p&gt;</description>"
+	"<link>http://example.com/2?a=1&amp;b=2</link><guid>g2</guid></item>"
+	"<item><title>x<!-- note --></title>"
+	"<description><!-- <p>not this</p> --><![CDATA[<i>this</i>]]></description>"
+	"<link>http://example.com/3</link><guid>g3</guid></item>"
+	"</channel></rss>\n",
+
+	"<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+	"<feed xmlns=\"http://www.w3.org/2005/Atom\"><title>c</title>"
+	"<entry><title type=\"html\"><![CDATA[<b>bold</b> title]]></title>"
+	"<content type=\"html\"><![CDATA[<p>a</p><p>b</p>]]></content>"
+	"<link href=\"http://example.com/4\"/><id>g4</id></entry>"
+	"</feed>\n",
+	NULL
+};
+
+static int view_check_field(FILE *fl, int feed, size_t item, const char *name,
+		const char *mrss, char *view)
+{
+	int diff;
+
+	diff = strcmp((mrss) ? mrss : "", (view) ? view : "") != 0;
+	if (diff)
+		fprintf(fl, "feed %d item %zu %s:\n\tlibmrss: %s\n\tview:    %s\n",
+				feed, item, name, (mrss) ? mrss : "", (view) ? view : "");
+
+	free(view);
+	return diff;
+}
+
+/* --feed-view-check: item views against libmrss on the samples above */
+int feed_view_check(FILE *fl)
+{
+	struct feed_view fv;
+	mrss_t *rssdata;
+	mrss_item_t *rssitem;
+	const struct item_view *iv;
+	char *body;
+	size_t n, len;
+	int i, n_fields = 0, n_diff = 0;
+
+	for (i = 0; view_check_feeds[i] != NULL; i++) {
+		len = strlen(view_check_feeds[i]);
+
+		/* libmrss may write into its buffer */
+		body = strdup(view_check_feeds[i]);
+		if (body == NULL)
+			err(1, "out of memory");
+		if (mrss_parse_buffer(body, len, &rssdata) != MRSS_OK)
+			errx(1, "feed view check: libmrss can not parse sample %d", i);
+		free(body);
+
+		if (itemview_scan(&fv, view_check_feeds[i], len) != 0)
+			errx(1, "feed view check: no item view of sample %d", i);
+
+		for (n = 0, rssitem = rssdata->item; rssitem != NULL || n < fv.n_items;
+				n++, rssitem = (rssitem) ? rssitem->next : NULL) {
+			if (rssitem == NULL || n >= fv.n_items) {
+				fprintf(fl, "feed %d: %s has more items\n", i,
+						(rssitem != NULL) ? "libmrss" : "view");
+				n_diff++;
+				break;
+			}
+
+			iv = &fv.items[n];
+			n_diff += view_check_field(fl, i, n, "title", rssitem->title,
+					itemview_strdup(&fv, iv->title));
+			n_diff += view_check_field(fl, i, n, "description", rssitem->description,
+					itemview_strdup(&fv, iv->description));
+			n_diff += view_check_field(fl, i, n, "link", rssitem->link,
+					itemview_strdup(&fv, iv->link));
+			n_diff += view_check_field(fl, i, n, "guid", rssitem->guid,
+					itemview_strdup(&fv, iv->guid));
+			n_fields += 4;
+		}
+
+		itemview_free(&fv);
+		mrss_free(rssdata);
+	}
+
+	fprintf(fl, "feed view check: %d fields compared, %d differences\n", n_fields, n_diff);
+
+	return (n_diff == 0) ? 0 : -1;
+}
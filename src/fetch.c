@@ -0,0 +1,423 @@
+/**
+ * Selfoss RSS reader micro updater
+ *
+ *   Copyright (C) 2013 Vladimir Ermakov <vooon341@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "selfoss_mupdate.h"
+#include <limits.h>
+#include <unistd.h>
+#include <curl/curl.h>
+
+#include "bb_md5_sha.h"
+
+/* abort transfer slower than this for low_speed_time */
+#define LOW_SPEED_LIMIT		32	/* bytes/sec */
+#define MAX_REDIRECTS		10
+#define THUMBNAIL_TIMEOUT	60		/* sec */
+#define THUMBNAIL_MAX_BODY	(4 << 20)	/* bytes */
+
+static struct fetch_options fetch_opts;
+
+struct body_buf {
+	char *bp;
+	size_t size;
+	size_t allocated;
+	size_t max;		/* 0 - unlimited */
+	bool capped;		/* transfer aborted at max */
+};
+
+static size_t body_write_cb(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+	struct body_buf *b = userdata;
+	size_t sz = size * nmemb;
+
+	if (b->max && b->size + sz > b->max) {
+		b->capped = true;
+		return 0; /* curl abort transfer */
+	}
+
+	if (b->size + sz + 1 > b->allocated) {
+		size_t nsz = (b->allocated) ? b->allocated : 16384;
+		char *np;
+
+		while (nsz < b->size + sz + 1)
+			nsz *= 2;
+
+		np = realloc(b->bp, nsz);
+		if (np == NULL)
+			return 0; /* curl abort transfer */
+
+		b->bp = np;
+		b->allocated = nsz;
+	}
+
+	memcpy(b->bp + b->size, ptr, sz);
+	b->size += sz;
+	b->bp[b->size] = '\0';
+
+	return sz;
+}
+
+static int fetch_file(const char *path, struct body_buf *b,
+		char *errbuf, size_t errbuf_sz)
+{
+	FILE *fp;
+	char buf[16384];
+	size_t sz;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		snprintf(errbuf, errbuf_sz, "fopen(%s): %s", path, strerror(errno));
+		return 1;
+	}
+
+	while ((sz = fread(buf, 1, sizeof(buf), fp)) > 0) {
+		if (body_write_cb(buf, 1, sz, b) != sz) {
+			fclose(fp);
+			if (b->capped)
+				return 1;
+			err(1, "out of memory");
+		}
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+/*
+ * HSTS and Alt-Svc caches under the data dir.  Every handle reads the
+ * files when set up and curl rewrites them (tmp file and rename) on
+ * cleanup, so parallel fetches never see a torn file; at worst an entry
+ * learned by one of them waits for the next run.
+ */
+static void fetch_setopt_caches(CURL *curl)
+{
+#if LIBCURL_VERSION_NUM >= 0x074a00
+	if (fetch_opts.hsts_file != NULL) {
+		curl_easy_setopt(curl, CURLOPT_HSTS_CTRL, (long) CURLHSTS_ENABLE);
+		curl_easy_setopt(curl, CURLOPT_HSTS, fetch_opts.hsts_file);
+	}
+#endif
+#if LIBCURL_VERSION_NUM >= 0x074001
+	if (fetch_opts.altsvc_file != NULL) {
+		curl_easy_setopt(curl, CURLOPT_ALTSVC_CTRL,
+				(long) (CURLALTSVC_H1 | CURLALTSVC_H2 | CURLALTSVC_H3));
+		curl_easy_setopt(curl, CURLOPT_ALTSVC, fetch_opts.altsvc_file);
+	}
+#endif
+}
+
+/*
+ * Redirects are followed here, not by curl, to see the status of every
+ * hop: *moved gets the target of the leading 301/308 hops, if any and
+ * only if the fetch succeeded; a chain into an error is not remembered.
+ * The handle is kept across hops, so the connection is reused.
+ */
+static int fetch_http(const char *url, struct body_buf *b, struct body_buf *h,
+		time_t deadline, char **moved, int *moved_hops,
+		char *errbuf, size_t errbuf_sz)
+{
+	CURL *curl;
+	CURLcode ccode;
+	char curl_errbuf[CURL_ERROR_SIZE] = "";
+	char *location, *next, *cur_url = NULL;
+	bool permanent = true;
+	long code;
+	int hops;
+
+	curl = curl_easy_init();
+	if (curl == NULL)
+		errx(1, "curl_easy_init() failed");
+
+	curl_easy_setopt(curl, CURLOPT_URL, url);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, body_write_cb);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, b);
+	if (h != NULL) {
+		curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, body_write_cb);
+		curl_easy_setopt(curl, CURLOPT_HEADERDATA, h);
+	}
+	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, curl_errbuf);
+	curl_easy_setopt(curl, CURLOPT_USERAGENT, PROGNAME "/" MY_VERSION);
+	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 0L);
+	curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+	curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+	/* required for multi-threaded use */
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+	fetch_setopt_caches(curl);
+
+	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, fetch_opts.connect_timeout);
+	curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, (long) LOW_SPEED_LIMIT);
+	curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, fetch_opts.low_speed_time);
+	if (deadline) {
+		/* transfer must not outlive the run */
+		long left = deadline - time(NULL);
+		curl_easy_setopt(curl, CURLOPT_TIMEOUT, (left > 0) ? left : 1L);
+	}
+	/* refused early when Content-Length says so */
+	if (b->max)
+		curl_easy_setopt(curl, CURLOPT_MAXFILESIZE_LARGE, (curl_off_t) b->max);
+
+	for (hops = 0; ; hops++) {
+		ccode = curl_easy_perform(curl);
+		if (ccode != CURLE_OK)
+			break;
+
+		code = 0;
+		location = NULL;
+		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+		if (code >= 300 && code < 400)
+			curl_easy_getinfo(curl, CURLINFO_REDIRECT_URL, &location);
+		if (location == NULL)
+			break;
+
+		if (hops == MAX_REDIRECTS) {
+			ccode = CURLE_TOO_MANY_REDIRECTS;
+			break;
+		}
+		if (strncmp(location, "http://", 7) && strncmp(location, "https://", 8)) {
+			ccode = CURLE_UNSUPPORTED_PROTOCOL;
+			snprintf(curl_errbuf, sizeof(curl_errbuf), "redirect to %s", location);
+			break;
+		}
+
+		/* location belongs to the handle, gone with the next request */
+		next = strdup(location);
+		if (next == NULL)
+			err(1, "out of memory");
+
+		debug2("%s: %ld to %s", (cur_url) ? cur_url : url, code, next);
+		stats_inc(redirect_hops);
+
+		if (permanent && (code == 301 || code == 308)) {
+			free(*moved);
+			*moved = strdup(next);
+			if (*moved == NULL)
+				err(1, "out of memory");
+			(*moved_hops)++;
+		}
+		else
+			permanent = false;
+
+		free(cur_url);
+		cur_url = next;
+		curl_easy_setopt(curl, CURLOPT_URL, cur_url);
+
+		/* redirect response body and headers are not the feed's */
+		b->size = 0;
+		if (h != NULL)
+			h->size = 0;
+	}
+
+	if (ccode == CURLE_FILESIZE_EXCEEDED)
+		b->capped = true;
+	if (ccode != CURLE_OK) {
+		snprintf(errbuf, errbuf_sz, "Fetch Error: %s",
+				(*curl_errbuf) ? curl_errbuf : curl_easy_strerror(ccode));
+		free(*moved);
+		*moved = NULL;
+		*moved_hops = 0;
+	}
+
+	curl_easy_cleanup(curl);
+	free(cur_url);
+
+	return ccode != CURLE_OK;
+}
+
+static const char *thumbnail_ext(const char *content_type)
+{
+	if (content_type == NULL)
+		return NULL;
+	if (!strncasecmp(content_type, "image/jpeg", 10))
+		return "jpg";
+	if (!strncasecmp(content_type, "image/png", 9))
+		return "png";
+	if (!strncasecmp(content_type, "image/gif", 9))
+		return "gif";
+	return NULL;
+}
+
+/* thumbnail stage: store image to thumbnails dir as md5(url).ext,
+ * return malloc'ed file name (value for items.thumbnail) */
+char *fetch_thumbnail(const char *url, time_t deadline)
+{
+	struct body_buf b = { NULL, 0, 0, THUMBNAIL_MAX_BODY };
+	char path[PATH_MAX], tmp_path[PATH_MAX];
+	char name[64], hex[33];
+	unsigned char digest[16];
+	const char *ext;
+	char *content_type = NULL;
+	long timeout = THUMBNAIL_TIMEOUT;
+	md5_ctx_t ctx;
+	CURL *curl;
+	CURLcode ccode;
+	FILE *fp;
+	int i;
+
+	if (fetch_opts.thumbnails_dir == NULL || url == NULL ||
+			(strncmp(url, "http://", 7) && strncmp(url, "https://", 8)))
+		return NULL;
+
+	md5_begin(&ctx);
+	md5_hash(&ctx, url, strlen(url));
+	md5_end(&ctx, digest);
+	for (i = 0; i < 16; i++)
+		sprintf(hex + i * 2, "%02x", digest[i]);
+
+	curl = curl_easy_init();
+	if (curl == NULL)
+		errx(1, "curl_easy_init() failed");
+
+	curl_easy_setopt(curl, CURLOPT_URL, url);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, body_write_cb);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &b);
+	curl_easy_setopt(curl, CURLOPT_USERAGENT, PROGNAME "/" MY_VERSION);
+	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+	curl_easy_setopt(curl, CURLOPT_MAXREDIRS, (long) MAX_REDIRECTS);
+	curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+	fetch_setopt_caches(curl);
+	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, fetch_opts.connect_timeout);
+	curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, (long) LOW_SPEED_LIMIT);
+	curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, fetch_opts.low_speed_time);
+	if (deadline && deadline - time(NULL) < timeout)
+		timeout = (deadline > time(NULL)) ? deadline - time(NULL) : 1L;
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT, timeout);
+	curl_easy_setopt(curl, CURLOPT_MAXFILESIZE_LARGE, (curl_off_t) b.max);
+
+	ccode = curl_easy_perform(curl);
+	if (ccode == CURLE_OK)
+		curl_easy_getinfo(curl, CURLINFO_CONTENT_TYPE, &content_type);
+
+	ext = thumbnail_ext(content_type);
+	if (ccode != CURLE_OK || ext == NULL || b.size == 0) {
+		debug("thumbnail %s: %s", url,
+				(b.capped || ccode == CURLE_FILESIZE_EXCEEDED) ? "image too large" :
+				(ccode != CURLE_OK) ? curl_easy_strerror(ccode) : "not an image");
+		curl_easy_cleanup(curl);
+		free(b.bp);
+		return NULL;
+	}
+
+	curl_easy_cleanup(curl);
+
+	snprintf(name, sizeof(name), "%s.%s", hex, ext);
+	snprintf(path, sizeof(path), "%s/%s", fetch_opts.thumbnails_dir, name);
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%lx.tmp", path, (unsigned long) pthread_self());
+
+	fp = fopen(tmp_path, "w");
+	if (fp == NULL || fwrite(b.bp, 1, b.size, fp) != b.size) {
+		warn("thumbnail %s", tmp_path);
+		if (fp != NULL) {
+			fclose(fp);
+			unlink(tmp_path);
+		}
+		free(b.bp);
+		return NULL;
+	}
+
+	free(b.bp);
+
+	if (fclose(fp) != 0 || rename(tmp_path, path) < 0) {
+		warn("thumbnail %s", path);
+		unlink(tmp_path);
+		return NULL;
+	}
+
+	stats_inc(thumbnails);
+	debug2("thumbnail %s -> %s", url, name);
+
+	return strdup(name);
+}
+
+void fetch_init(const struct fetch_options *opts)
+{
+	fetch_opts = *opts;
+	curl_global_init(CURL_GLOBAL_ALL);
+}
+
+void fetch_cleanup(void)
+{
+	curl_global_cleanup();
+}
+
+static double elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000.0 +
+		(now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+/* fetch stage: download feed (or read local file) into malloc'ed
+ * NUL-terminated job->body, on error message stored in job->error */
+int fetch_feed(struct feed_job *job, time_t deadline)
+{
+	struct body_buf b = { NULL, 0, 0 };
+	struct body_buf h = { NULL, 0, 0 };
+	const char *url = job->src->url;
+	struct timespec start;
+	int rc;
+
+	b.max = fetch_opts.max_body;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (!strncmp(url, "http://", 7) || !strncmp(url, "https://", 8)) {
+		/* source moved permanently, see redirect.c */
+		if (job->src->fetch_url != NULL) {
+			url = job->src->fetch_url;
+			job->redirect_used = true;
+			stats_add(redirects_avoided, job->src->redirect_hops);
+		}
+		else
+			job->redirect_checked = true;
+
+		rc = fetch_http(url, &b, (fetch_opts.keep_headers) ? &h : NULL,
+				deadline, &job->redirect, &job->redirect_hops,
+				job->error, sizeof(job->error));
+	}
+	else
+		rc = fetch_file(url, &b, job->error, sizeof(job->error));
+
+	if (b.capped) {
+		job_error(job, "Fetch Error: feed larger than %zu KiB (--max-body)",
+				fetch_opts.max_body >> 10);
+		job->body_capped = true;
+	}
+
+	if (rc == 0 && b.size == 0) {
+		job_error(job, "Fetch Error: empty body");
+		rc = 1;
+	}
+
+	if (rc != 0) {
+		free(b.bp);
+		b.bp = NULL;
+		b.size = 0;
+	}
+
+	job->fetch_ms = elapsed_ms(&start);
+
+	debug("%s: rc=%d size=%zu time=%.0f ms", url, rc, b.size, job->fetch_ms);
+
+	job->body = b.bp;
+	job->body_sz = b.size;
+	job->headers = h.bp;
+	job->headers_sz = h.size;
+	return rc;
+}
@@ -0,0 +1,133 @@
+/**
+ * Selfoss RSS reader micro updater
+ *
+ *   Copyright (C) 2013 Vladimir Ermakov <vooon341@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "selfoss_mupdate.h"
+
+/*
+ * Optional FTS5 index over items.title and items.content.
+ *
+ * External content table, so the text is not stored twice.  The writer
+ * indexes every item in the transaction that inserts it and purge drops
+ * rows from the index before deleting them.  --fts creates the index;
+ * once it exists every run keeps it up to date, with or without --fts,
+ * since a 'delete' of rows it never indexed corrupts it.  Items inserted
+ * or deleted by selfoss itself are not seen here, --fts-rebuild fixes that.
+ */
+
+int fts_init(sqlite3 *db, bool enable)
+{
+	struct db_state *st = db_state_add(db);
+	bool created, exists;
+	int rc;
+
+	st->fts = false;
+	if (!enable) {
+		rc = db_fts_exists(db, &exists);
+		if (rc != SQLITE_OK) {
+			fprintf(stderr, "full text index not maintained, --fts-rebuild it: %s\n",
+					sqlite3_errmsg(db));
+			return rc;
+		}
+		st->fts = exists;
+		return SQLITE_OK;
+	}
+
+	rc = db_fts_create(db, &created);
+	if (rc != SQLITE_OK) {
+		/* sqlite built without fts5 */
+		fprintf(stderr, "full text index disabled: %s\n", sqlite3_errmsg(db));
+		return rc;
+	}
+
+	/* index of existing items, only once */
+	if (created) {
+		debug("new full text index, indexing existing items");
+		rc = fts_rebuild(db);
+		if (rc != SQLITE_OK)
+			return rc;
+	}
+
+	st->fts = true;
+	return SQLITE_OK;
+}
+
+/* writer stage, inside the item transaction */
+void fts_item_added(sqlite3 *db, sqlite3_int64 rowid, const char *title, const char *content)
+{
+	if (!db_state(db)->fts)
+		return;
+
+	if (db_fts_insert(db, rowid, title, content) != SQLITE_OK)
+		errx(1, "full text index: %s", sqlite3_errmsg(db));
+}
+
+/* purge stage, for the rows of temp.mupdate_purge_batch */
+int fts_purge_batch(sqlite3 *db)
+{
+	return (db_state(db)->fts) ? db_fts_delete_purged(db) : SQLITE_OK;
+}
+
+int fts_rebuild(sqlite3 *db)
+{
+	int rc;
+
+	rc = db_exec(db, "BEGIN IMMEDIATE");
+	if (rc == SQLITE_OK)
+		rc = db_fts_rebuild(db);
+	if (rc == SQLITE_OK)
+		rc = db_exec(db, "COMMIT");
+	else
+		db_exec(db, "ROLLBACK");
+
+	if (rc != SQLITE_OK)
+		fprintf(stderr, "full text index rebuild: %s\n", sqlite3_errmsg(db));
+
+	return rc;
+}
+
+/* selfoss search (LIKE over title and content) against the index */
+int fts_bench(sqlite3 *db, const char *term, FILE *fl)
+{
+	char *like;
+	long n_like, n_fts;
+	double ms_like, ms_fts;
+	int rc;
+
+	if (asprintf(&like, "%%%s%%", term) < 0)
+		err(1, "out of memory");
+
+	rc = db_count_query(db, "SELECT id FROM items "
+			"WHERE title LIKE :q OR content LIKE :q", like, &n_like, &ms_like);
+	free(like);
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "LIKE query: %s\n", sqlite3_errmsg(db));
+		return rc;
+	}
+	fprintf(fl, "LIKE scan:\t%ld items, %.1f ms\n", n_like, ms_like);
+
+	rc = db_count_query(db, "SELECT rowid FROM mupdate_items_fts "
+			"WHERE mupdate_items_fts MATCH :q", term, &n_fts, &ms_fts);
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "MATCH query: %s\n", sqlite3_errmsg(db));
+		return rc;
+	}
+	fprintf(fl, "fts5 MATCH:\t%ld items, %.1f ms\n", n_fts, ms_fts);
+
+	return SQLITE_OK;
+}
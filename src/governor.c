@@ -0,0 +1,263 @@
+/**
+ * Selfoss RSS reader micro updater
+ *
+ *   Copyright (C) 2013 Vladimir Ermakov <vooon341@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "selfoss_mupdate.h"
+#include <unistd.h>
+
+/*
+ * Memory pressure governor (--mem-budget).
+ *
+ * All fetch threads are created up front, the governor decides how many
+ * feeds may be in flight: a fetch thread takes a slot before fetching,
+ * the job keeps it through parsing and until the writer has stored it,
+ * so the fetched body and the parsed items both count.  The queues
+ * between stages are bounded by the same limit.  Once a second it samples "some avg10" of
+ * /proc/pressure/memory and /proc/pressure/cpu (kernels without PSI:
+ * only our RSS from /proc/self/statm) and our RSS against the budget.
+ * Over budget or under memory pressure the limit is halved, under CPU
+ * pressure it drops by one; with headroom it grows by one up to -j.
+ * avg10 lags, so after a cut the next one waits GOVERNOR_SETTLE ticks.
+ * A pass starts at one feed, a small router never overshoots first.
+ */
+
+#define GOVERNOR_INTERVAL	1	/* sec */
+#define GOVERNOR_SETTLE		5	/* ticks after a shrink */
+#define GOVERNOR_MEM_HIGH	10.0	/* % of time stalled on memory */
+#define GOVERNOR_MEM_LOW	1.0
+#define GOVERNOR_CPU_HIGH	50.0	/* % of time waiting for a cpu */
+#define GOVERNOR_CPU_LOW	20.0
+
+#define PSI_MEMORY		"/proc/pressure/memory"
+#define PSI_CPU			"/proc/pressure/cpu"
+
+struct governor_sample {
+	size_t rss;
+	double mem;		/* < 0 - no PSI */
+	double cpu;
+};
+
+static size_t gov_budget;	/* 0 - not governing */
+static int gov_limit, gov_max, gov_active;
+static int gov_settle;
+static bool gov_running;
+static struct queue *gov_queues[2];
+static pthread_t gov_thread;
+static pthread_mutex_t gov_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gov_cond = PTHREAD_COND_INITIALIZER;	/* limit or active changed */
+static pthread_cond_t gov_stop = PTHREAD_COND_INITIALIZER;
+
+/* -*- sampling -*- */
+
+/* "some avg10=1.23 avg60=..." */
+static double psi_read(const char *path)
+{
+	char line[128];
+	double avg10 = -1;
+	FILE *fl;
+
+	fl = fopen(path, "re");
+	if (fl == NULL)
+		return -1;
+
+	while (fgets(line, sizeof(line), fl) != NULL)
+		if (sscanf(line, "some avg10=%lf", &avg10) == 1)
+			break;
+
+	fclose(fl);
+	return avg10;
+}
+
+/* resident set in bytes, 0 if unknown */
+static size_t rss_read(void)
+{
+	unsigned long size, resident;
+	FILE *fl;
+	int n;
+
+	fl = fopen("/proc/self/statm", "re");
+	if (fl == NULL)
+		return 0;
+
+	n = fscanf(fl, "%lu %lu", &size, &resident);
+	fclose(fl);
+
+	return (n == 2) ? resident * sysconf(_SC_PAGESIZE) : 0;
+}
+
+static void governor_sample(struct governor_sample *s)
+{
+	s->rss = rss_read();
+	s->mem = psi_read(PSI_MEMORY);
+	s->cpu = psi_read(PSI_CPU);
+
+	if (s->rss >> 10 > run_stats.rss_peak)
+		run_stats.rss_peak = s->rss >> 10;
+}
+
+/* -*- limit -*- */
+
+/* caller holds gov_lock */
+static void governor_set(int limit, const char *why, const struct governor_sample *s)
+{
+	int i;
+
+	if (limit < 1)
+		limit = 1;
+	if (limit > gov_max)
+		limit = gov_max;
+	if (limit == gov_limit)
+		return;
+
+	debug("governor: %d -> %d feeds in flight, %s (rss %zu MiB of %zu, memory %.1f%%, cpu %.1f%%)",
+			gov_limit, limit, why, s->rss >> 20, gov_budget >> 20, s->mem, s->cpu);
+
+	if (limit < gov_limit) {
+		stats_inc(governor_shrinks);
+		gov_settle = GOVERNOR_SETTLE;
+	}
+	else
+		stats_inc(governor_grows);
+
+	gov_limit = limit;
+	for (i = 0; i < 2; i++)
+		queue_set_limit(gov_queues[i], limit);
+
+	pthread_cond_broadcast(&gov_cond);
+}
+
+static void governor_tick(void)
+{
+	struct governor_sample s;
+
+	governor_sample(&s);
+
+	pthread_mutex_lock(&gov_lock);
+	if (gov_settle > 0)
+		gov_settle--;
+
+	if (gov_settle > 0)
+		;	/* previous cut not visible in avg10 yet */
+	else if (s.rss > gov_budget)
+		governor_set(gov_limit / 2, "over budget", &s);
+	else if (s.mem >= GOVERNOR_MEM_HIGH)
+		governor_set(gov_limit / 2, "memory pressure", &s);
+	else if (s.cpu >= GOVERNOR_CPU_HIGH)
+		governor_set(gov_limit - 1, "cpu pressure", &s);
+	else if (s.rss < gov_budget / 4 * 3 && s.mem < GOVERNOR_MEM_LOW
+			&& s.cpu < GOVERNOR_CPU_LOW)
+		governor_set(gov_limit + 1, "headroom", &s);
+	pthread_mutex_unlock(&gov_lock);
+}
+
+static void *governor_thread(void *arg)
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(&gov_lock);
+	while (gov_running) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += GOVERNOR_INTERVAL;
+		pthread_cond_timedwait(&gov_stop, &gov_lock, &ts);
+		if (!gov_running)
+			break;
+
+		pthread_mutex_unlock(&gov_lock);
+		governor_tick();
+		pthread_mutex_lock(&gov_lock);
+	}
+	pthread_mutex_unlock(&gov_lock);
+
+	return NULL;
+}
+
+/* -*- public -*- */
+
+/* pipeline_run(), budget 0 leaves the pipeline at full width */
+void governor_start(size_t budget, int n_workers, struct queue *work_q, struct queue *write_q)
+{
+	struct governor_sample s;
+
+	if (budget == 0)
+		return;
+
+	governor_sample(&s);
+	if (s.rss == 0 && s.mem < 0) {
+		warnx("governor: neither %s nor /proc/self/statm readable, --mem-budget ignored",
+				PSI_MEMORY);
+		return;
+	}
+	if (s.mem < 0)
+		debug("governor: no PSI, watching rss only");
+
+	gov_budget = budget;
+	gov_max = n_workers;
+	gov_limit = 1;
+	gov_active = 0;
+	gov_settle = 0;
+	gov_queues[0] = work_q;
+	gov_queues[1] = write_q;
+	queue_set_limit(work_q, 1);
+	queue_set_limit(write_q, 1);
+
+	debug("governor: budget %zu MiB, 1 of %d feeds in flight", budget >> 20, n_workers);
+
+	gov_running = true;
+	if ((errno = pthread_create(&gov_thread, NULL, governor_thread, NULL)) != 0)
+		err(1, "pthread_create()");
+}
+
+void governor_stop(void)
+{
+	if (gov_budget == 0)
+		return;
+
+	pthread_mutex_lock(&gov_lock);
+	gov_running = false;
+	pthread_cond_broadcast(&gov_stop);
+	pthread_cond_broadcast(&gov_cond);
+	pthread_mutex_unlock(&gov_lock);
+
+	pthread_join(gov_thread, NULL);
+	gov_budget = 0;
+}
+
+/* fetch thread, before starting a feed; waits while the limit is reached */
+void governor_enter(void)
+{
+	if (gov_budget == 0)
+		return;
+
+	pthread_mutex_lock(&gov_lock);
+	while (gov_active >= gov_limit && gov_running)
+		pthread_cond_wait(&gov_cond, &gov_lock);
+	gov_active++;
+	pthread_mutex_unlock(&gov_lock);
+}
+
+/* writer, once the job is stored or dropped */
+void governor_leave(void)
+{
+	if (gov_budget == 0)
+		return;
+
+	pthread_mutex_lock(&gov_lock);
+	gov_active--;
+	pthread_cond_broadcast(&gov_cond);
+	pthread_mutex_unlock(&gov_lock);
+}
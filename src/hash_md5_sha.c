@@ -472,8 +472,6 @@ void FAST_FUNC md5_end(md5_ctx_t *ctx, void *resbuf)
 	memcpy(resbuf, ctx->hash, sizeof(ctx->hash[0]) * 4);
 }
 
-#if 0
-
 /*
  * SHA1 part is:
  * Copyright 2007 Rob Landley <rob@landley.net>
@@ -898,6 +896,3 @@ void FAST_FUNC sha512_end(sha512_ctx_t *ctx, void *resbuf)
 	}
 	memcpy(resbuf, ctx->hash, sizeof(ctx->hash));
 }
-
-#endif /* 0 */
-
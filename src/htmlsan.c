@@ -0,0 +1,677 @@
+/**
+ * Selfoss RSS reader micro updater
+ *
+ *   Copyright (C) 2013 Vladimir Ermakov <vooon341@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "selfoss_mupdate.h"
+#include "entities.h"
+
+/*
+ * Native whitelist sanitizer, --sanitizer native.
+ *
+ * One pass over the input: a small HTML tokenizer feeds a stack of open
+ * elements, allowed ones are written out as XHTML, everything inside a
+ * disallowed element is dropped (as walk_and_remove() drops subtrees).
+ * Unclosed elements are closed at the end, stray end tags are ignored,
+ * and the common implied ends are done (p before a block, li, dt/dd,
+ * tr, td/th).  Text and attribute values are re-escaped, character
+ * references are kept as they are; attribute filters of the policy see
+ * the decoded value.
+ *
+ * The policy is the same as for tidy (policy.c), looked up by name.
+ */
+
+#define HTMLSAN_MAX_DEPTH	256	/* deeper elements are lost, content kept if allowed */
+#define HTMLSAN_NAME_MAX	16	/* longer names are truncated in the stack */
+
+enum tag_flags {
+	TAG_VOID	= 1 << 0,	/* no content, no end tag */
+	TAG_RAWTEXT	= 1 << 1,	/* content is text up to </name> */
+	TAG_TRANSPARENT	= 1 << 2,	/* tag dropped, content kept */
+	TAG_BLOCK	= 1 << 3,	/* closes an open p */
+};
+
+static const struct {
+	const char *name;
+	int flags;
+} known_tags[] = {
+	{ "area",	TAG_VOID },
+	{ "base",	TAG_VOID },
+	{ "br",		TAG_VOID },
+	{ "col",	TAG_VOID },
+	{ "embed",	TAG_VOID },
+	{ "hr",		TAG_VOID | TAG_BLOCK },
+	{ "img",	TAG_VOID },
+	{ "input",	TAG_VOID },
+	{ "link",	TAG_VOID },
+	{ "meta",	TAG_VOID },
+	{ "param",	TAG_VOID },
+	{ "source",	TAG_VOID },
+	{ "track",	TAG_VOID },
+	{ "wbr",	TAG_VOID },
+	{ "iframe",	TAG_RAWTEXT },
+	{ "noembed",	TAG_RAWTEXT },
+	{ "noframes",	TAG_RAWTEXT },
+	{ "noscript",	TAG_RAWTEXT },
+	{ "script",	TAG_RAWTEXT },
+	{ "style",	TAG_RAWTEXT },
+	{ "textarea",	TAG_RAWTEXT },
+	{ "title",	TAG_RAWTEXT },
+	{ "xmp",	TAG_RAWTEXT },
+	/* as tidy: body only output, font dropped, center made a div */
+	{ "html",	TAG_TRANSPARENT },
+	{ "body",	TAG_TRANSPARENT },
+	{ "font",	TAG_TRANSPARENT },
+	{ "center",	TAG_TRANSPARENT | TAG_BLOCK },
+	{ "address",	TAG_BLOCK },
+	{ "blockquote",	TAG_BLOCK },
+	{ "div",	TAG_BLOCK },
+	{ "dl",		TAG_BLOCK },
+	{ "h1",		TAG_BLOCK },
+	{ "h2",		TAG_BLOCK },
+	{ "h3",		TAG_BLOCK },
+	{ "h4",		TAG_BLOCK },
+	{ "h5",		TAG_BLOCK },
+	{ "h6",		TAG_BLOCK },
+	{ "ol",		TAG_BLOCK },
+	{ "p",		TAG_BLOCK },
+	{ "pre",	TAG_BLOCK },
+	{ "table",	TAG_BLOCK },
+	{ "ul",		TAG_BLOCK },
+	{ NULL, 0 }
+};
+
+/* scope limits for implied ends */
+static const char *const p_scope[] = { "table", "td", "th", "button", NULL };
+static const char *const list_scope[] = { "ul", "ol", NULL };
+static const char *const dl_scope[] = { "dl", NULL };
+static const char *const table_scope[] = { "table", NULL };
+static const char *const row_scope[] = { "tr", "table", NULL };
+
+struct open_elem {
+	char name[HTMLSAN_NAME_MAX];	/* lower case */
+	int tag;			/* policy slot, -1 - not written */
+};
+
+struct htmlsan {
+	const char *p, *end;
+
+	char *out;
+	size_t len, allocated;
+
+	struct open_elem stack[HTMLSAN_MAX_DEPTH];
+	int depth;
+	int skip_depth;		/* > 0 - inside the dropped element stack[skip_depth - 1] */
+
+	/* skip_depth HTMLSAN_MAX_DEPTH + 1 - inside a dropped element past the stack */
+	char overflow_name[HTMLSAN_NAME_MAX];
+	int overflow_nest;
+};
+
+/* -*- output -*- */
+
+static void out_reserve(struct htmlsan *hs, size_t n)
+{
+	if (hs->len + n + 1 <= hs->allocated)
+		return;
+
+	while (hs->len + n + 1 > hs->allocated)
+		hs->allocated *= 2;
+	hs->out = realloc(hs->out, hs->allocated);
+	if (hs->out == NULL)
+		err(1, "out of memory");
+}
+
+static void out_str(struct htmlsan *hs, const char *s, size_t n)
+{
+	out_reserve(hs, n);
+	memcpy(hs->out + hs->len, s, n);
+	hs->len += n;
+}
+
+#define out_lit(hs, s)	out_str(hs, s, sizeof(s) - 1)
+
+static void out_name(struct htmlsan *hs, const char *name)
+{
+	out_str(hs, name, strlen(name));
+}
+
+/*
+ * length of "&name;", "&#123;" or "&#x1f;" at s, 0 if not a reference the
+ * entity decoder knows; the policy checks decoded values, so anything it
+ * leaves alone must not be decoded by the browser either
+ */
+static size_t charref_len(const char *s, const char *end)
+{
+	const char *p = s + 1;
+	char ref[48], decoded[48];
+	size_t len;
+
+	if (p < end && *p == '#') {
+		p++;
+		if (p < end && (*p == 'x' || *p == 'X'))
+			p++;
+	}
+	while (p < end && p - s < 40 && ((*p >= 'a' && *p <= 'z') ||
+				(*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9')))
+		p++;
+
+	if (p >= end || *p != ';' || p - s < 2)
+		return 0;
+
+	len = p - s + 1;
+	memcpy(ref, s, len);
+	ref[len] = '\0';
+	decode_html_entities_utf8(decoded, ref);
+
+	return strcmp(decoded, ref) != 0 ? len : 0;
+}
+
+/* text or attribute value, markup characters escaped */
+static void out_escaped(struct htmlsan *hs, const char *s, size_t n, bool attr)
+{
+	const char *end = s + n, *run = s;
+	size_t ref;
+
+	out_reserve(hs, n);
+
+	for (; s < end; s++) {
+		if (*s == '&') {
+			if ((ref = charref_len(s, end)) > 0) {
+				s += ref - 1;
+				continue;
+			}
+		}
+		else if (*s != '<' && *s != '>' && (*s != '"' || !attr))
+			continue;
+
+		out_str(hs, run, s - run);
+		switch (*s) {
+			case '<': out_lit(hs, "&lt;"); break;
+			case '>': out_lit(hs, "&gt;"); break;
+			case '"': out_lit(hs, "&quot;"); break;
+			default: out_lit(hs, "&amp;"); break;
+		}
+		run = s + 1;
+	}
+
+	out_str(hs, run, end - run);
+}
+
+/* -*- tokenizer helpers -*- */
+
+static bool is_space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f';
+}
+
+static bool is_name_char(char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+		(c >= '0' && c <= '9') || c == '-' || c == ':' || c == '_';
+}
+
+static bool is_alpha(char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+/* lower case copy, truncated to the stack name size */
+static size_t read_name(struct htmlsan *hs, char *lname, const char **name)
+{
+	size_t len, i;
+
+	*name = hs->p;
+	while (hs->p < hs->end && is_name_char(*hs->p))
+		hs->p++;
+	len = hs->p - *name;
+
+	for (i = 0; i < len && i < HTMLSAN_NAME_MAX - 1; i++)
+		lname[i] = ((*name)[i] >= 'A' && (*name)[i] <= 'Z') ? (*name)[i] + 'a' - 'A' : (*name)[i];
+	lname[i] = '\0';
+
+	return len;
+}
+
+static int tag_flags(const char *lname)
+{
+	int i;
+
+	for (i = 0; known_tags[i].name != NULL; i++)
+		if (strcmp(known_tags[i].name, lname) == 0)
+			return known_tags[i].flags;
+
+	return 0;
+}
+
+static bool name_in(const char *name, const char *const *list)
+{
+	for (; *list != NULL; list++)
+		if (strcmp(name, *list) == 0)
+			return true;
+
+	return false;
+}
+
+/* past the first occurrence of s, case-insensitive; false - not found, at end */
+static bool skip_past(struct htmlsan *hs, const char *s)
+{
+	size_t n = strlen(s);
+
+	for (; hs->p + n <= hs->end; hs->p++) {
+		if (strncasecmp(hs->p, s, n) == 0) {
+			hs->p += n;
+			return true;
+		}
+	}
+
+	hs->p = hs->end;
+	return false;
+}
+
+/* -*- element stack -*- */
+
+static void elem_close_top(struct htmlsan *hs)
+{
+	struct open_elem *e = &hs->stack[--hs->depth];
+
+	/* an ancestor ends the dropped element past the stack, too */
+	if (hs->skip_depth > HTMLSAN_MAX_DEPTH)
+		hs->skip_depth = 0;
+
+	if (hs->skip_depth > 0) {
+		if (hs->depth < hs->skip_depth)
+			hs->skip_depth = 0;
+		return;
+	}
+
+	if (e->tag >= 0) {
+		out_lit(hs, "</");
+		out_name(hs, policy_tag_name(e->tag));
+		out_lit(hs, ">");
+	}
+}
+
+static void elem_close_to(struct htmlsan *hs, int i)
+{
+	while (hs->depth > i)
+		elem_close_top(hs);
+}
+
+/* innermost open element, not looking past a scope limit; -1 if none */
+static int elem_find(struct htmlsan *hs, const char *name, const char *const *scope)
+{
+	int i;
+
+	for (i = hs->depth - 1; i >= 0; i--) {
+		if (strcmp(hs->stack[i].name, name) == 0)
+			return i;
+		if (scope != NULL && name_in(hs->stack[i].name, scope))
+			break;
+	}
+
+	return -1;
+}
+
+/* end tags implied by this start tag */
+static void elem_implied_ends(struct htmlsan *hs, const char *lname, int flags)
+{
+	int i = -1;
+
+	if (flags & TAG_BLOCK)
+		i = elem_find(hs, "p", p_scope);
+	else if (strcmp(lname, "li") == 0)
+		i = elem_find(hs, "li", list_scope);
+	else if (strcmp(lname, "dt") == 0 || strcmp(lname, "dd") == 0) {
+		if ((i = elem_find(hs, "dd", dl_scope)) < 0)
+			i = elem_find(hs, "dt", dl_scope);
+	}
+	else if (strcmp(lname, "tr") == 0)
+		i = elem_find(hs, "tr", table_scope);
+	else if (strcmp(lname, "td") == 0 || strcmp(lname, "th") == 0) {
+		if ((i = elem_find(hs, "td", row_scope)) < 0)
+			i = elem_find(hs, "th", row_scope);
+	}
+
+	if (i >= 0)
+		elem_close_to(hs, i);
+}
+
+/* -*- tags -*- */
+
+static bool attr_value_ok(int attr, const char *value, size_t len)
+{
+	char buf[512], *raw, *decoded;
+	bool ok;
+
+	/* references never decode longer than they are */
+	raw = (len * 2 + 2 <= sizeof(buf)) ? buf : malloc(len * 2 + 2);
+	if (raw == NULL)
+		err(1, "out of memory");
+	memcpy(raw, value, len);
+	raw[len] = '\0';
+
+	decoded = raw;
+	if (memchr(raw, '&', len) != NULL) {
+		decoded = raw + len + 1;
+		decode_html_entities_utf8(decoded, raw);
+	}
+	ok = policy_value_ok(attr, decoded);
+
+	if (raw != buf)
+		free(raw);
+	return ok;
+}
+
+/* to the end of the tag, allowed attributes are written if write */
+static bool attrs(struct htmlsan *hs, int tag, bool write)
+{
+	const char *name, *value;
+	size_t name_len, value_len;
+	uint64_t seen = 0;
+	char quote;
+	int attr;
+
+	for (;;) {
+		while (hs->p < hs->end && is_space(*hs->p))
+			hs->p++;
+		if (hs->p == hs->end)
+			return false;
+		if (*hs->p == '>') {
+			hs->p++;
+			return false;
+		}
+		if (*hs->p == '/') {
+			hs->p++;
+			if (hs->p < hs->end && *hs->p == '>') {
+				hs->p++;
+				return true;	/* self closing */
+			}
+			continue;
+		}
+
+		name = hs->p;
+		while (hs->p < hs->end && !is_space(*hs->p) && *hs->p != '=' &&
+				*hs->p != '>' && *hs->p != '/')
+			hs->p++;
+		name_len = hs->p - name;
+		if (name_len == 0) {
+			hs->p++;	/* stray '=' */
+			continue;
+		}
+
+		while (hs->p < hs->end && is_space(*hs->p))
+			hs->p++;
+
+		value = "";
+		value_len = 0;
+		if (hs->p < hs->end && *hs->p == '=') {
+			hs->p++;
+			while (hs->p < hs->end && is_space(*hs->p))
+				hs->p++;
+
+			value = hs->p;
+			if (hs->p < hs->end && (*hs->p == '"' || *hs->p == '\'')) {
+				quote = *hs->p++;
+				value = hs->p;
+				while (hs->p < hs->end && *hs->p != quote)
+					hs->p++;
+				value_len = hs->p - value;
+				if (hs->p < hs->end)
+					hs->p++;
+			}
+			else {
+				while (hs->p < hs->end && !is_space(*hs->p) && *hs->p != '>')
+					hs->p++;
+				value_len = hs->p - value;
+			}
+		}
+
+		if (!write)
+			continue;
+
+		attr = policy_attr_by_name(tag, name, name_len);
+		if (attr < 0 || (seen & (1ULL << attr))) {
+			debug2("drop %s attr %.*s", policy_tag_name(tag), (int) name_len, name);
+			continue;
+		}
+		seen |= 1ULL << attr;
+
+		if (!attr_value_ok(attr, value, value_len)) {
+			debug2("drop %s attr %.*s [bad proto]", policy_tag_name(tag),
+					(int) name_len, name);
+			continue;
+		}
+
+		out_lit(hs, " ");
+		out_name(hs, policy_attr_name(attr));
+		out_lit(hs, "=\"");
+		out_escaped(hs, value, value_len, true);
+		out_lit(hs, "\"");
+	}
+}
+
+static void start_tag(struct htmlsan *hs)
+{
+	struct open_elem *e;
+	const char *name, *text;
+	char lname[HTMLSAN_NAME_MAX], end_tag[HTMLSAN_NAME_MAX + 2];
+	bool write, self_closing, found;
+	size_t len;
+	int flags, tag, i;
+
+	len = read_name(hs, lname, &name);
+	flags = tag_flags(lname);
+	tag = policy_tag_by_name(name, len);
+
+	/* head is dropped with its content, but may be left open */
+	if (strcmp(lname, "body") == 0 && (i = elem_find(hs, "head", NULL)) >= 0)
+		elem_close_to(hs, i);
+
+	if (hs->skip_depth == 0)
+		elem_implied_ends(hs, lname, flags);
+
+	write = (hs->skip_depth == 0 && tag >= 0 && !(flags & TAG_TRANSPARENT) &&
+			((flags & (TAG_VOID | TAG_RAWTEXT)) || hs->depth < HTMLSAN_MAX_DEPTH));
+
+	if (write) {
+		out_lit(hs, "<");
+		out_name(hs, policy_tag_name(tag));
+	}
+	else if (hs->skip_depth == 0 && !(flags & TAG_TRANSPARENT))
+		debug2("drop node %s", lname);
+
+	self_closing = attrs(hs, tag, write);
+
+	if (flags & (TAG_VOID | TAG_TRANSPARENT)) {
+		if (write)
+			out_lit(hs, " />");
+		return;
+	}
+
+	if (write)
+		out_lit(hs, ">");
+
+	if (flags & TAG_RAWTEXT) {
+		/* never markup inside, written as text if the tag is allowed */
+		snprintf(end_tag, sizeof(end_tag), "</%s", lname);
+		text = hs->p;
+		found = skip_past(hs, end_tag);
+		if (write) {
+			out_escaped(hs, text, hs->p - text - ((found) ? strlen(end_tag) : 0), false);
+			out_lit(hs, "</");
+			out_name(hs, policy_tag_name(tag));
+			out_lit(hs, ">");
+		}
+		if (found)
+			skip_past(hs, ">");
+		return;
+	}
+
+	if (!self_closing && hs->depth == HTMLSAN_MAX_DEPTH) {
+		/* no slot, but a dropped element still takes its content along */
+		if (hs->skip_depth == 0 && tag < 0) {
+			memcpy(hs->overflow_name, lname, sizeof(hs->overflow_name));
+			hs->overflow_nest = 1;
+			hs->skip_depth = HTMLSAN_MAX_DEPTH + 1;
+		}
+		else if (hs->skip_depth > HTMLSAN_MAX_DEPTH &&
+				strcmp(lname, hs->overflow_name) == 0)
+			hs->overflow_nest++;
+	}
+
+	if (self_closing || hs->depth == HTMLSAN_MAX_DEPTH) {
+		if (write) {
+			out_lit(hs, "</");
+			out_name(hs, policy_tag_name(tag));
+			out_lit(hs, ">");
+		}
+		return;
+	}
+
+	e = &hs->stack[hs->depth++];
+	memcpy(e->name, lname, sizeof(e->name));
+	e->tag = (write) ? tag : -1;
+
+	if (hs->skip_depth == 0 && !write)
+		hs->skip_depth = hs->depth;
+}
+
+static void end_tag(struct htmlsan *hs)
+{
+	const char *name;
+	char lname[HTMLSAN_NAME_MAX];
+	int i;
+
+	read_name(hs, lname, &name);
+	skip_past(hs, ">");
+
+	if (tag_flags(lname) & (TAG_VOID | TAG_TRANSPARENT))
+		return;
+
+	if (hs->skip_depth > HTMLSAN_MAX_DEPTH && strcmp(lname, hs->overflow_name) == 0) {
+		if (--hs->overflow_nest == 0)
+			hs->skip_depth = 0;
+		return;
+	}
+
+	i = elem_find(hs, lname, NULL);
+	if (i >= 0)
+		elem_close_to(hs, i);
+}
+
+/* at '<' */
+static void markup(struct htmlsan *hs)
+{
+	const char *p = hs->p + 1;
+
+	if (p < hs->end && *p == '!') {
+		if (hs->end - p >= 3 && memcmp(p, "!--", 3) == 0) {
+			hs->p += 4;
+			skip_past(hs, "-->");
+		}
+		else if (hs->end - p >= 8 && memcmp(p, "![CDATA[", 8) == 0) {
+			hs->p += 9;
+			skip_past(hs, "]]>");
+		}
+		else
+			skip_past(hs, ">");
+	}
+	else if (p < hs->end && *p == '?')
+		skip_past(hs, ">");
+	else if (p + 1 < hs->end && *p == '/' && is_alpha(p[1])) {
+		hs->p += 2;
+		end_tag(hs);
+	}
+	else if (p < hs->end && *p == '/')
+		skip_past(hs, ">");	/* </> and </ 1>, bogus comments */
+	else if (p < hs->end && is_alpha(*p)) {
+		hs->p++;
+		start_tag(hs);
+	}
+	else {
+		/* plain '<' in text */
+		if (hs->skip_depth == 0)
+			out_lit(hs, "&lt;");
+		hs->p++;
+	}
+}
+
+/* -*- public -*- */
+
+/* new NUL terminated string; mem - bytes this pass had allocated */
+char *htmlsan(const char *html, size_t len, size_t *out_len, size_t *mem)
+{
+	struct htmlsan *hs;
+	const char *text;
+	char *out;
+
+	hs = calloc(1, sizeof(*hs));
+	if (hs == NULL)
+		err(1, "out of memory");
+
+	hs->p = html;
+	hs->end = html + len;
+
+	/* escaping grows text a little, dropped markup shrinks it more */
+	hs->allocated = len + len / 8 + 64;
+	hs->out = malloc(hs->allocated);
+	if (hs->out == NULL)
+		err(1, "out of memory");
+
+	while (hs->p < hs->end) {
+		text = hs->p;
+		hs->p = memchr(hs->p, '<', hs->end - hs->p);
+		if (hs->p == NULL)
+			hs->p = hs->end;
+
+		if (hs->skip_depth == 0)
+			out_escaped(hs, text, hs->p - text, false);
+
+		if (hs->p < hs->end)
+			markup(hs);
+	}
+
+	elem_close_to(hs, 0);
+	hs->out[hs->len] = '\0';
+
+	if (out_len != NULL)
+		*out_len = hs->len;
+	if (mem != NULL)
+		*mem = sizeof(*hs) + hs->allocated;
+
+	out = hs->out;
+	free(hs);
+	return out;
+}
+
+/* sanitize_content() for --sanitizer native */
+int htmlsan_content(char **content)
+{
+	char *out;
+
+	out = htmlsan((*content != NULL) ? *content : "",
+			(*content != NULL) ? strlen(*content) : 0, NULL, NULL);
+
+	debug3("source: len=%zu '%s'", (*content != NULL) ? strlen(*content) : 0, *content);
+	debug3("result: len=%zu '%s'", strlen(out), out);
+
+	free(*content);
+	*content = out;
+
+	return 0;
+}
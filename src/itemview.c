@@ -0,0 +1,572 @@
+/**
+ * Selfoss RSS reader micro updater
+ *
+ *   Copyright (C) 2013 Vladimir Ermakov <vooon341@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "selfoss_mupdate.h"
+
+/*
+ * Zero-copy item views.
+ *
+ * A single pass over a UTF-8 body records where the fields of every
+ * RSS 0.9x/1.0/2.0 item or Atom entry are, nothing is copied or
+ * decoded.  feed_process() decodes only the fields selfoss_getId()
+ * looks at and materializes the rest for new items.
+ *
+ * Field choice follows libmrss: first unprefixed child wins, Atom
+ * id/content/summary/published/updated map to guid/description/pubDate,
+ * <link rel="enclosure"> to the enclosure.  Anything the scanner is not
+ * sure about (unknown root, internal DTD subset, broken nesting) makes
+ * it give up, and the caller falls back to libmrss.
+ */
+
+#define VIEW_MAX_DEPTH		64
+
+enum view_format {
+	VIEW_NONE = 0,
+	VIEW_RSS,		/* rss/channel/item */
+	VIEW_RDF,		/* rdf:RDF/item */
+	VIEW_ATOM		/* feed/entry */
+};
+
+struct view_scan {
+	const char *body;
+	const char *end;
+	enum view_format format;
+	int item_depth;		/* depth of item elements */
+	struct xml_span stack[VIEW_MAX_DEPTH];	/* element names */
+	int depth;
+
+	struct item_view *item;	/* open item, NULL outside */
+	struct xml_span *field;	/* open element being captured */
+	int field_depth;
+};
+
+/* -*- helpers -*- */
+
+static inline bool is_xml_space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static inline bool is_name_end(char c)
+{
+	return is_xml_space(c) || c == '>' || c == '/';
+}
+
+static inline struct xml_span span_make(const struct view_scan *vs, const char *p, size_t len)
+{
+	struct xml_span sp = { p - vs->body, len };
+	return sp;
+}
+
+static inline bool span_is(const struct view_scan *vs, struct xml_span sp, const char *name)
+{
+	size_t len = strlen(name);
+	return sp.len == len && !memcmp(vs->body + sp.off, name, len);
+}
+
+static const char *skip_past(const char *p, const char *end, const char *tok)
+{
+	size_t len = strlen(tok);
+
+	p = memmem(p, end - p, tok, len);
+	return (p != NULL) ? p + len : NULL;
+}
+
+/* -*- scanner -*- */
+
+static struct item_view *view_item_add(struct feed_view *fv)
+{
+	if (fv->n_items == fv->allocated) {
+		size_t n = (fv->allocated) ? fv->allocated * 2 : 32;
+		struct item_view *p = realloc(fv->items, n * sizeof(*p));
+		if (p == NULL)
+			err(1, "out of memory");
+		fv->items = p;
+		fv->allocated = n;
+	}
+
+	memset(&fv->items[fv->n_items], 0, sizeof(fv->items[0]));
+	return &fv->items[fv->n_items++];
+}
+
+/* root element decides the format and where items are */
+static int view_root(struct view_scan *vs, struct xml_span name)
+{
+	if (span_is(vs, name, "rss")) {
+		vs->format = VIEW_RSS;
+		vs->item_depth = 3;
+	}
+	else if (span_is(vs, name, "rdf:RDF")) {
+		vs->format = VIEW_RDF;
+		vs->item_depth = 2;
+	}
+	else if (span_is(vs, name, "feed")) {
+		vs->format = VIEW_ATOM;
+		vs->item_depth = 2;
+	}
+	else
+		return -1;
+
+	return 0;
+}
+
+/* value span of attribute name in a start tag, false if absent */
+static bool view_attr(const struct view_scan *vs, const char *attrs, const char *attrs_end,
+		const char *name, struct xml_span *value)
+{
+	size_t len = strlen(name);
+	const char *p = attrs, *q;
+	char quote;
+	bool match;
+
+	while (p < attrs_end) {
+		while (p < attrs_end && is_xml_space(*p))
+			p++;
+		q = p;
+		while (p < attrs_end && *p != '=' && !is_xml_space(*p))
+			p++;
+		if (p == q)
+			break;
+
+		match = (p - q == len && !memcmp(q, name, len));
+
+		while (p < attrs_end && (is_xml_space(*p) || *p == '='))
+			p++;
+		if (p == attrs_end || (*p != '"' && *p != '\''))
+			break;
+
+		quote = *p++;
+		q = memchr(p, quote, attrs_end - p);
+		if (q == NULL)
+			break;
+
+		if (match) {
+			*value = span_make(vs, p, q - p);
+			return true;
+		}
+		p = q + 1;
+	}
+
+	return false;
+}
+
+
+static inline struct xml_span *first(struct xml_span *sp)
+{
+	return (sp->len == 0) ? sp : NULL;
+}
+
+/* item child start tag, returns the field to capture */
+static struct xml_span *view_child(struct view_scan *vs, struct xml_span name,
+		const char *attrs, const char *attrs_end)
+{
+	struct item_view *iv = vs->item;
+	struct xml_span rel;
+
+	if (vs->format != VIEW_ATOM) {
+		if (span_is(vs, name, "title"))
+			return first(&iv->title);
+		if (span_is(vs, name, "link"))
+			return first(&iv->link);
+		if (span_is(vs, name, "description"))
+			return first(&iv->description);
+		if (span_is(vs, name, "guid"))
+			return first(&iv->guid);
+		if (span_is(vs, name, "pubDate"))
+			return first(&iv->pub_date);
+		if (span_is(vs, name, "enclosure") && iv->enclosure_url.len == 0) {
+			view_attr(vs, attrs, attrs_end, "url", &iv->enclosure_url);
+			view_attr(vs, attrs, attrs_end, "type", &iv->enclosure_type);
+		}
+		return NULL;
+	}
+
+	if (span_is(vs, name, "title"))
+		return first(&iv->title);
+	if (span_is(vs, name, "id"))
+		return first(&iv->guid);
+
+	/* content over summary, published over updated, in any order */
+	if (span_is(vs, name, "content") && !iv->has_content) {
+		iv->has_content = true;
+		iv->description.len = 0;
+		return &iv->description;
+	}
+	if (span_is(vs, name, "summary") && !iv->has_content)
+		return first(&iv->description);
+	if (span_is(vs, name, "published") && !iv->has_published) {
+		iv->has_published = true;
+		iv->pub_date.len = 0;
+		return &iv->pub_date;
+	}
+	if (span_is(vs, name, "updated") && !iv->has_published)
+		return first(&iv->pub_date);
+
+	if (span_is(vs, name, "link")) {
+		if (!view_attr(vs, attrs, attrs_end, "rel", &rel) || span_is(vs, rel, "alternate")) {
+			if (iv->link.len == 0)
+				view_attr(vs, attrs, attrs_end, "href", &iv->link);
+		}
+		else if (span_is(vs, rel, "enclosure") && iv->enclosure_url.len == 0) {
+			view_attr(vs, attrs, attrs_end, "href", &iv->enclosure_url);
+			view_attr(vs, attrs, attrs_end, "type", &iv->enclosure_type);
+		}
+	}
+
+	return NULL;
+}
+
+static int view_start_tag(struct view_scan *vs, struct feed_view *fv, const char **pp)
+{
+	const char *p = *pp + 1, *name_end, *q;
+	struct xml_span name, *field = NULL;
+	bool empty;
+
+	for (name_end = p; name_end < vs->end && !is_name_end(*name_end); name_end++)
+		;
+	if (name_end == p || name_end == vs->end)
+		return -1;
+	name = span_make(vs, p, name_end - p);
+
+	/* end of tag, quoted values may contain '>' */
+	for (q = name_end; q < vs->end && *q != '>'; q++) {
+		if (*q == '"' || *q == '\'') {
+			q = memchr(q + 1, *q, vs->end - q - 1);
+			if (q == NULL)
+				return -1;
+		}
+	}
+	if (q == vs->end)
+		return -1;
+
+	empty = (q[-1] == '/');
+	*pp = q + 1;
+
+	if (vs->depth == 0) {
+		if (vs->format != VIEW_NONE || view_root(vs, name) < 0)
+			return -1;
+	}
+	else if (vs->field != NULL)
+		;	/* markup inside a captured field */
+	else if (vs->item != NULL) {
+		if (vs->depth == vs->item_depth)
+			field = view_child(vs, name, name_end, (empty) ? q - 1 : q);
+	}
+	else if (vs->depth == vs->item_depth - 1 &&
+			span_is(vs, name, (vs->format == VIEW_ATOM) ? "entry" : "item")) {
+		if (!empty)
+			vs->item = view_item_add(fv);
+	}
+	else if (vs->format == VIEW_RSS && vs->depth == 2 && span_is(vs, name, "pubDate"))
+		field = first(&fv->pub_date);
+
+	if (empty)
+		return 0;
+
+	if (field != NULL) {
+		field->off = *pp - vs->body;
+		vs->field = field;
+		vs->field_depth = vs->depth;
+	}
+
+	if (vs->depth == VIEW_MAX_DEPTH)
+		return -1;
+	vs->stack[vs->depth++] = name;
+
+	return 0;
+}
+
+static int view_end_tag(struct view_scan *vs, const char **pp)
+{
+	const char *p = *pp + 2, *name_end, *q;
+	struct xml_span *open;
+
+	for (name_end = p; name_end < vs->end && !is_name_end(*name_end); name_end++)
+		;
+	q = memchr(name_end, '>', vs->end - name_end);
+	if (q == NULL || vs->depth == 0)
+		return -1;
+
+	open = &vs->stack[--vs->depth];
+	if (name_end - p != open->len || memcmp(p, vs->body + open->off, open->len))
+		return -1;
+
+	if (vs->field != NULL && vs->depth == vs->field_depth) {
+		vs->field->len = (*pp - vs->body) - vs->field->off;
+		vs->field = NULL;
+	}
+	if (vs->item != NULL && vs->depth == vs->item_depth - 1)
+		vs->item = NULL;
+
+	*pp = q + 1;
+	return 0;
+}
+
+/* markup declarations, comments, CDATA and PIs carry no structure */
+static int view_skip_special(struct view_scan *vs, const char **pp)
+{
+	const char *p = *pp, *q;
+	size_t left = vs->end - p;
+
+	if (left >= 4 && !memcmp(p, "<!--", 4))
+		q = skip_past(p + 4, vs->end, "-->");
+	else if (left >= 9 && !memcmp(p, "<![CDATA[", 9))
+		q = skip_past(p + 9, vs->end, "]]>");
+	else if (left >= 2 && p[1] == '?')
+		q = skip_past(p + 2, vs->end, "?>");
+	else if (left >= 9 && !memcmp(p, "<!DOCTYPE", 9)) {
+		q = memchr(p, '>', left);
+		/* an internal subset may declare entities */
+		if (q != NULL && memchr(p, '[', q - p) != NULL)
+			return -1;
+		if (q != NULL)
+			q++;
+	}
+	else
+		return -1;
+
+	if (q == NULL)
+		return -1;
+
+	*pp = q;
+	return 0;
+}
+
+/* returns 0 if the body is an RSS/Atom document the views cover */
+int itemview_scan(struct feed_view *fv, const char *body, size_t sz)
+{
+	struct view_scan vs;
+	const char *p;
+	int rc = 0;
+
+	memset(fv, 0, sizeof(*fv));
+	if (sz > UINT32_MAX)
+		return -1;
+
+	memset(&vs, 0, sizeof(vs));
+	vs.body = body;
+	vs.end = body + sz;
+	fv->body = body;
+
+	for (p = body; rc == 0 && p < vs.end; ) {
+		if (*p != '<') {
+			p = memchr(p, '<', vs.end - p);
+			if (p == NULL)
+				break;
+			continue;
+		}
+
+		if (p + 1 == vs.end)
+			rc = -1;
+		else if (p[1] == '!' || p[1] == '?')
+			rc = view_skip_special(&vs, &p);
+		else if (p[1] == '/')
+			rc = view_end_tag(&vs, &p);
+		else
+			rc = view_start_tag(&vs, fv, &p);
+	}
+
+	if (rc == 0 && (vs.format == VIEW_NONE || vs.depth != 0))
+		rc = -1;
+
+	if (rc < 0) {
+		debug2("item views not usable, scan stopped at %zu", (size_t)(p - body));
+		itemview_free(fv);
+		return -1;
+	}
+
+	debug2("item views: %zu items", fv->n_items);
+	return 0;
+}
+
+void itemview_free(struct feed_view *fv)
+{
+	free(fv->items);
+	fv->items = NULL;
+	fv->n_items = fv->allocated = 0;
+}
+
+/* -*- decoding -*- */
+
+static size_t utf8_put(char *out, uint32_t cp)
+{
+	if (cp < 0x80) {
+		out[0] = cp;
+		return 1;
+	}
+	if (cp < 0x800) {
+		out[0] = 0xc0 | (cp >> 6);
+		out[1] = 0x80 | (cp & 0x3f);
+		return 2;
+	}
+	if (cp < 0x10000) {
+		out[0] = 0xe0 | (cp >> 12);
+		out[1] = 0x80 | ((cp >> 6) & 0x3f);
+		out[2] = 0x80 | (cp & 0x3f);
+		return 3;
+	}
+	out[0] = 0xf0 | (cp >> 18);
+	out[1] = 0x80 | ((cp >> 12) & 0x3f);
+	out[2] = 0x80 | ((cp >> 6) & 0x3f);
+	out[3] = 0x80 | (cp & 0x3f);
+	return 4;
+}
+
+/* XML predefined or character reference at p, 0 if not one */
+static size_t xml_ref(const char *p, const char *end, char *out, size_t *out_len)
+{
+	const char *semi;
+	uint32_t cp = 0;
+	size_t len;
+	char *e;
+
+	semi = memchr(p, ';', (end - p < 12) ? end - p : 12);
+	if (semi == NULL)
+		return 0;
+	len = semi - p + 1;
+
+	if (p[1] == '#') {
+		if (len < 4)
+			return 0;
+		errno = 0;
+		if (p[2] == 'x')
+			cp = strtoul(p + 3, &e, 16);
+		else
+			cp = strtoul(p + 2, &e, 10);
+		if (e != semi || errno || cp == 0 || cp > 0x10ffff ||
+				(cp >= 0xd800 && cp <= 0xdfff))
+			return 0;
+		*out_len = utf8_put(out, cp);
+		return len;
+	}
+
+	if (len == 4 && !memcmp(p, "&lt;", 4))
+		*out = '<';
+	else if (len == 4 && !memcmp(p, "&gt;", 4))
+		*out = '>';
+	else if (len == 5 && !memcmp(p, "&amp;", 5))
+		*out = '&';
+	else if (len == 6 && !memcmp(p, "&quot;", 6))
+		*out = '"';
+	else if (len == 6 && !memcmp(p, "&apos;", 6))
+		*out = '\'';
+	else
+		return 0;
+
+	*out_len = 1;
+	return len;
+}
+
+/* child elements, e.g. atom type="xhtml" content */
+/* child elements outside CDATA sections and comments */
+static bool has_elements(const char *p, const char *end)
+{
+	while (p != NULL && (p = memchr(p, '<', end - p)) != NULL) {
+		if (end - p >= 9 && !memcmp(p, "<![CDATA[", 9))
+			p = skip_past(p + 9, end, "]]>");
+		else if (end - p >= 4 && !memcmp(p, "<!--", 4))
+			p = skip_past(p + 4, end, "-->");
+		else if (end - p < 2 || p[1] != '!')
+			return true;
+		else
+			p++;
+	}
+
+	return false;
+}
+
+/*
+ * Decoded text of a span into buf: references decoded, CDATA unwrapped,
+ * comments dropped, whitespace trimmed.  Content with child elements is
+ * markup already and copied as is.  Never longer than the span itself.
+ */
+size_t itemview_text(const struct feed_view *fv, struct xml_span sp, char *buf, size_t sz)
+{
+	const char *p = fv->body + sp.off, *end = p + sp.len, *q;
+	char ref[4];
+	size_t o = 0, n, ref_len;
+	bool raw;
+
+	if (sz == 0)
+		return 0;
+
+	while (p < end && is_xml_space(*p))
+		p++;
+	raw = has_elements(p, end);
+
+	while (p < end && o < sz - 1) {
+		if (raw) {
+			n = end - p;
+			if (n > sz - 1 - o)
+				n = sz - 1 - o;
+			memcpy(buf + o, p, n);
+			o += n;
+			p += n;
+		}
+		else if (*p == '<' && end - p >= 9 && !memcmp(p, "<![CDATA[", 9)) {
+			p += 9;
+			q = memmem(p, end - p, "]]>", 3);
+			n = ((q != NULL) ? q : end) - p;
+			if (n > sz - 1 - o)
+				n = sz - 1 - o;
+			memcpy(buf + o, p, n);
+			o += n;
+			p = (q != NULL) ? q + 3 : end;
+		}
+		else if (*p == '<' && end - p >= 4 && !memcmp(p, "<!--", 4)) {
+			q = skip_past(p + 4, end, "-->");
+			p = (q != NULL) ? q : end;
+		}
+		else if (*p == '&' && (n = xml_ref(p, end, ref, &ref_len)) != 0) {
+			if (ref_len > sz - 1 - o)
+				break;
+			memcpy(buf + o, ref, ref_len);
+			o += ref_len;
+			p += n;
+		}
+		else
+			buf[o++] = *p++;
+	}
+
+	while (o > 0 && is_xml_space(buf[o - 1]))
+		o--;
+	buf[o] = '\0';
+
+	return o;
+}
+
+/* malloc()ed decoded span, NULL if absent or empty */
+char *itemview_strdup(const struct feed_view *fv, struct xml_span sp)
+{
+	char *s;
+
+	if (sp.len == 0)
+		return NULL;
+
+	s = malloc(sp.len + 1);
+	if (s == NULL)
+		err(1, "out of memory");
+
+	if (itemview_text(fv, sp, s, sp.len + 1) == 0) {
+		free(s);
+		return NULL;
+	}
+
+	return s;
+}
@@ -0,0 +1,262 @@
+/**
+ * Selfoss RSS reader micro updater
+ *
+ *   Copyright (C) 2013 Vladimir Ermakov <vooon341@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "selfoss_mupdate.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/file.h>
+
+/*
+ * Run journal and overlap lock.
+ *
+ * Every pass writes its ordered source plan to mupdate_run_sources
+ * before fetching; the writer marks a source committed or failed in the
+ * same transaction as its items and lastupdate, so the journal never
+ * claims more than the database has.  A pass that ends normally gets
+ * mupdate_run.finished set.  A killed one stays unfinished, and
+ * --resume continues its plan from the first source still pending
+ * instead of starting over.
+ *
+ * Runs on one database exclude each other with flock() on
+ * <db>.mupdate-lock, held for the whole process.  Sharded runs hold it
+ * shared plus <db>.mupdate-lock-<k>-<n> exclusive, so shards run side
+ * by side (leases keep them apart) but never with a full run or with
+ * themselves.  The kernel drops the locks of a killed process.
+ */
+
+#define JOURNAL_KEEP_RUNS	10
+
+enum journal_state {
+	JOURNAL_PENDING = 0,
+	JOURNAL_COMMITTED,
+	JOURNAL_FAILED
+};
+
+static int lock_fd = -1, shard_lock_fd = -1;
+static char journal_shard[32];
+static sqlite3_int64 journal_run;	/* 0 - no pass journaled */
+static sqlite3_int64 resume_run;	/* unfinished run --resume continues */
+
+static int lock_file(const char *path, int op)
+{
+	char buf[32];
+	int fd, n;
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		warn("open(%s)", path);
+		return -2;
+	}
+
+	if (flock(fd, op | LOCK_NB) < 0) {
+		n = pread(fd, buf, sizeof(buf) - 1, 0);
+		buf[(n > 0) ? n : 0] = '\0';
+		buf[strcspn(buf, "\n")] = '\0';
+		warnx("another run holds %s (pid %s)", path, (*buf) ? buf : "?");
+		close(fd);
+		return -1;
+	}
+
+	/* shared holders overwrite each other, any of them will do */
+	n = snprintf(buf, sizeof(buf), "%d\n", (int) getpid());
+	if (ftruncate(fd, 0) < 0 || pwrite(fd, buf, n, 0) != n)
+		debug("%s: pid not written", path);
+
+	return fd;
+}
+
+/* take the overlap lock, -1 if another run has it */
+int journal_lock(const char *db_path, int shard_k, int shard_n)
+{
+	char path[PATH_MAX];
+
+	if (shard_n > 0)
+		snprintf(journal_shard, sizeof(journal_shard), "%d/%d", shard_k, shard_n);
+
+	snprintf(path, sizeof(path), "%s.mupdate-lock", db_path);
+	lock_fd = lock_file(path, (shard_n > 0) ? LOCK_SH : LOCK_EX);
+	if (lock_fd == -1)
+		return -1;
+
+	if (shard_n > 0) {
+		snprintf(path, sizeof(path), "%s.mupdate-lock-%d-%d", db_path, shard_k, shard_n);
+		shard_lock_fd = lock_file(path, LOCK_EX);
+		if (shard_lock_fd == -1)
+			return -1;
+	}
+
+	/* lock file not creatable, e.g. read-only directory */
+	if (lock_fd == -2 || shard_lock_fd == -2)
+		debug("running without overlap lock");
+
+	return 0;
+}
+
+/* --tenants: exclusive lock of one more database, fd for the caller to
+ * close, -1 if another run has it, -2 if running without lock */
+int journal_lock_tenant(const char *db_path)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s.mupdate-lock", db_path);
+	return lock_file(path, LOCK_EX);
+}
+
+int journal_init(sqlite3 *db, bool resume)
+{
+	int rc;
+
+	rc = db_journal_create(db);
+	if (rc == SQLITE_OK && resume)
+		rc = db_journal_run_unfinished(db, journal_shard, &resume_run);
+	if (rc != SQLITE_OK)
+		errx(1, "SQL error: %s", sqlite3_errmsg(db));
+
+	if (resume && resume_run == 0)
+		fprintf(stderr, "no interrupted run to resume, starting a new one\n");
+	else if (resume)
+		debug("resuming run %lld", (long long) resume_run);
+
+	return rc;
+}
+
+/*
+ * --resume: keep only sources the interrupted run still had pending,
+ * in its order.  Sources added since wait for the next run.
+ */
+void journal_resume(sqlite3 *db, struct source *sources, size_t *n_sources)
+{
+	sqlite3_stmt *stmt;
+	struct source *list;
+	size_t i, n = 0;
+	int rc, id;
+
+	if (resume_run == 0)
+		return;
+
+	list = calloc(*n_sources + 1, sizeof(*list));
+	if (list == NULL)
+		err(1, "out of memory");
+
+	rc = db_journal_pending_stmt(db, resume_run, &stmt);
+	if (rc != SQLITE_OK)
+		errx(1, "SQL error: %s", sqlite3_errmsg(db));
+
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		id = sqlite3_column_int(stmt, 0);
+		for (i = 0; i < *n_sources; i++) {
+			if (sources[i].id == id && sources[i].url != NULL) {
+				list[n++] = sources[i];
+				sources[i].url = NULL;	/* moved */
+				break;
+			}
+		}
+	}
+
+	sqlite3_finalize(stmt);
+	if (rc != SQLITE_DONE)
+		errx(1, "SQL error: %s", sqlite3_errmsg(db));
+
+	/* not pending: done by the interrupted run, or new */
+	for (i = 0; i < *n_sources; i++) {
+		if (sources[i].url != NULL) {
+			debug2("source #%d not pending in run %lld, skipped",
+					sources[i].id, (long long) resume_run);
+			source_free(&sources[i]);
+		}
+	}
+
+	debug("run %lld: %zu of %zu sources pending", (long long) resume_run, n, *n_sources);
+
+	memcpy(sources, list, n * sizeof(*list));
+	*n_sources = n;
+	free(list);
+}
+
+/* journal the plan of a pass, sources in the order they are fetched */
+void journal_begin(sqlite3 *db, const struct source *sources, size_t n)
+{
+	size_t i;
+	int rc;
+
+	rc = db_exec(db, "BEGIN IMMEDIATE");
+
+	if (resume_run != 0) {
+		/* plan is already there, pending rows are what is left */
+		journal_run = resume_run;
+		resume_run = 0;
+		if (rc == SQLITE_OK)
+			rc = db_journal_run_resumed(db, journal_run, getpid());
+	}
+	else {
+		/* older interrupted runs can not be resumed after this one */
+		if (rc == SQLITE_OK)
+			rc = db_journal_run_abandon(db, journal_shard);
+		if (rc == SQLITE_OK)
+			rc = db_journal_run_add(db, journal_shard, getpid(), &journal_run);
+		for (i = 0; rc == SQLITE_OK && i < n; i++)
+			rc = db_journal_plan_add(db, journal_run, i, sources[i].id);
+		if (rc == SQLITE_OK)
+			rc = db_journal_expire(db, journal_shard, JOURNAL_KEEP_RUNS);
+	}
+
+	if (rc == SQLITE_OK)
+		rc = db_exec(db, "COMMIT");
+	if (rc != SQLITE_OK)
+		errx(1, "journal: %s", sqlite3_errmsg(db));
+
+	debug("run %lld: %zu sources planned", (long long) journal_run, n);
+}
+
+/* writer stage, inside the source transaction */
+void journal_source_done(sqlite3 *db, const struct feed_job *job)
+{
+	int rc;
+
+	if (journal_run == 0)
+		return;
+
+	rc = db_journal_source_done(db, journal_run, job->src->id,
+			(job->rc == 0) ? JOURNAL_COMMITTED : JOURNAL_FAILED,
+			job->n_new, job->fetch_ms);
+	if (rc != SQLITE_OK)
+		errx(1, "journal: %s", sqlite3_errmsg(db));
+}
+
+/* pass ended without being killed, deferred sources stay pending */
+void journal_end(sqlite3 *db)
+{
+	if (journal_run == 0)
+		return;
+
+	if (db_journal_run_finish(db, journal_run) != SQLITE_OK)
+		errx(1, "journal: %s", sqlite3_errmsg(db));
+
+	journal_run = 0;
+}
+
+void journal_unlock(void)
+{
+	if (shard_lock_fd >= 0)
+		close(shard_lock_fd);
+	if (lock_fd >= 0)
+		close(lock_fd);
+	lock_fd = shard_lock_fd = -1;
+}
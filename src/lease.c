@@ -0,0 +1,176 @@
+/**
+ * Selfoss RSS reader micro updater
+ *
+ *   Copyright (C) 2013 Vladimir Ermakov <vooon341@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "selfoss_mupdate.h"
+#include <unistd.h>
+
+/*
+ * Source sharding for several updater processes on one database.
+ *
+ * Sources are split by a hash of their id (--shard k/n). Before
+ * fetching, a process takes a lease on every source it is going to
+ * update, in one short transaction; the writer drops the lease in the
+ * source commit. A lease left behind by a crashed process expires, and
+ * then any shard takes such an orphaned source over.
+ *
+ * A run may outlast --lease-time, so the writer extends the leases it
+ * still has every third of it, and does not commit a source whose
+ * lease went to another process meanwhile.
+ */
+
+static int shard_k, shard_n;		/* shard_n == 0 - sharding disabled */
+static time_t lease_time;
+static time_t lease_renewed;		/* writer only */
+static char lease_owner[128];
+
+int lease_init(sqlite3 *db, int k, int n, time_t lease_sec)
+{
+	char host[64] = "localhost";
+	int rc;
+
+	shard_k = k;
+	shard_n = n;
+	lease_time = lease_sec;
+
+	if (shard_n == 0)
+		return SQLITE_OK;
+
+	gethostname(host, sizeof(host) - 1);
+	snprintf(lease_owner, sizeof(lease_owner), "%s:%d", host, (int) getpid());
+
+	rc = db_lease_create(db);
+	if (rc != SQLITE_OK)
+		errx(1, "SQL error: %s", sqlite3_errmsg(db));
+
+	debug("shard %d/%d, lease owner %s", shard_k, shard_n, lease_owner);
+	return rc;
+}
+
+bool lease_active(void)
+{
+	return shard_n > 0;
+}
+
+static uint32_t shard_hash(uint32_t x)
+{
+	/* murmur3 finalizer */
+	x ^= x >> 16;
+	x *= 0x85ebca6b;
+	x ^= x >> 13;
+	x *= 0xc2b2ae35;
+	x ^= x >> 16;
+	return x;
+}
+
+/* should this process look at the source at all */
+bool lease_wanted(sqlite3 *db, int source_id)
+{
+	bool orphaned;
+
+	if (shard_n == 0 || shard_hash(source_id) % shard_n == shard_k)
+		return true;
+
+	if (db_lease_expired(db, source_id, time(NULL), &orphaned) != SQLITE_OK)
+		errx(1, "SQL error: %s", sqlite3_errmsg(db));
+
+	if (orphaned)
+		debug("source #%d: lease of shard %u expired, taking over",
+				source_id, shard_hash(source_id) % shard_n);
+
+	return orphaned;
+}
+
+/* call inside transaction */
+bool lease_claim(sqlite3 *db, int source_id)
+{
+	time_t now = time(NULL);
+	bool claimed;
+
+	if (shard_n == 0)
+		return true;
+
+	if (db_lease_claim(db, source_id, lease_owner, now, now + lease_time,
+				&claimed) != SQLITE_OK)
+		errx(1, "SQL error: %s", sqlite3_errmsg(db));
+
+	lease_renewed = now;
+	return claimed;
+}
+
+/* control thread: lease of a refreshed source, in a transaction of its own */
+bool lease_claim_one(sqlite3 *db, int source_id)
+{
+	time_t now = time(NULL);
+	bool claimed = false;
+	int rc;
+
+	if (shard_n == 0)
+		return true;
+
+	rc = db_exec(db, "BEGIN IMMEDIATE");
+	if (rc == SQLITE_OK)
+		rc = db_lease_claim(db, source_id, lease_owner, now, now + lease_time, &claimed);
+	if (rc == SQLITE_OK)
+		rc = db_exec(db, "COMMIT");
+
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "source #%d: lease: %s\n", source_id, sqlite3_errmsg(db));
+		db_exec(db, "ROLLBACK");
+		return false;
+	}
+
+	return claimed;
+}
+
+/* writer stage, inside source transaction: false if the lease is gone */
+bool lease_held(sqlite3 *db, int source_id)
+{
+	time_t now = time(NULL);
+	bool held;
+	int renewed;
+
+	if (shard_n == 0)
+		return true;
+
+	if (now - lease_renewed >= lease_time / 3) {
+		if (db_lease_renew(db, lease_owner, now + lease_time, &renewed) != SQLITE_OK)
+			errx(1, "SQL error: %s", sqlite3_errmsg(db));
+		lease_renewed = now;
+		debug("%d leases renewed", renewed);
+	}
+
+	if (db_lease_held(db, source_id, lease_owner, &held) != SQLITE_OK)
+		errx(1, "SQL error: %s", sqlite3_errmsg(db));
+
+	if (!held)
+		fprintf(stderr, "source #%d: lease taken over by another process, not stored\n",
+				source_id);
+
+	return held;
+}
+
+/* writer stage, inside source transaction */
+void lease_release(sqlite3 *db, int source_id)
+{
+	if (shard_n == 0)
+		return;
+
+	if (db_lease_release(db, source_id, lease_owner) != SQLITE_OK)
+		errx(1, "SQL error: %s", sqlite3_errmsg(db));
+}
@@ -0,0 +1,349 @@
+/**
+ * Selfoss RSS reader micro updater
+ *
+ *   Copyright (C) 2013 Vladimir Ermakov <vooon341@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "selfoss_mupdate.h"
+#include <ctype.h>
+
+/*
+ * Cross-source duplicate detection by canonical link.
+ *
+ * Links are reduced to host/path?query: no scheme, lower case host
+ * without "www." and default port, no fragment, no trailing slash, no
+ * tracking parameters.  Feedburner proxy links are replaced by the guid
+ * (items.uid) when that is an URL.  The index keeps a 64-bit hash and
+ * the source of every canonical link stored in the window; it is built
+ * from items at start and extended by the writer after each source
+ * commit, so a deferred or failed source leaves nothing behind.  Workers
+ * look up to skip sanitizing, the writer looks again for stories
+ * committed since.
+ *
+ * Only another source's link is a duplicate, and site root links are
+ * never, many feeds link every item to the front page.
+ */
+
+#define LINKDUP_URL_MAX		1024
+
+struct linkdup_entry {
+	uint64_t hash;			/* 0 - empty slot */
+	int source;
+};
+
+static int linkdup_days;		/* 0 - disabled */
+static bool linkdup_mark;		/* insert as read instead of skipping */
+static pthread_mutex_t linkdup_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct linkdup_entry *linkdup_tab;	/* guarded by linkdup_lock */
+static size_t linkdup_size, linkdup_count;
+
+static const char *tracking_params[] = {
+	"utm_", "fbclid", "gclid", "yclid", "mc_cid", "mc_eid",
+	"_hsenc", "_hsmi", "ncid", "ocid",
+	NULL
+};
+
+static bool is_tracking_param(const char *p, size_t len)
+{
+	size_t i, n;
+
+	for (i = 0; tracking_params[i] != NULL; i++) {
+		n = strlen(tracking_params[i]);
+		/* "utm_" is a prefix, others whole names */
+		if (tracking_params[i][n - 1] == '_') {
+			if (len >= n && !strncasecmp(p, tracking_params[i], n))
+				return true;
+		}
+		else if (len == n && !strncasecmp(p, tracking_params[i], n))
+			return true;
+	}
+
+	return false;
+}
+
+static bool is_feedburner(const char *host, size_t len)
+{
+	return (len == strlen("feedproxy.google.com") &&
+			!strncmp(host, "feedproxy.google.com", len)) ||
+		(len == strlen("feeds.feedburner.com") &&
+			!strncmp(host, "feeds.feedburner.com", len));
+}
+
+/* return length of canonical form in out, 0 if link unusable */
+static size_t link_canonical(const char *link, char *out, size_t out_sz, bool *feedburner)
+{
+	const char *p, *host, *host_end, *path, *q, *end, *param, *param_end;
+	size_t n = 0, host_len, name_len;
+	bool first = true;
+
+#define PUT(c)		do { if (n + 1 < out_sz) out[n++] = (c); } while (0)
+
+	*feedburner = false;
+	if (link == NULL)
+		return 0;
+
+	p = strstr(link, "://");
+	if (p == NULL)
+		return 0;
+	host = p + 3;
+
+	/* userinfo is never part of a story link */
+	host_end = host + strcspn(host, "/?#");
+	p = memchr(host, '@', host_end - host);
+	if (p != NULL)
+		host = p + 1;
+
+	if (host_end - host > 4 && !strncasecmp(host, "www.", 4))
+		host += 4;
+
+	path = host_end;
+	p = memchr(host, ':', host_end - host);
+	if (p != NULL && ((host_end - p == 3 && !strncmp(p, ":80", 3)) ||
+				(host_end - p == 4 && !strncmp(p, ":443", 4))))
+		host_end = p;
+
+	for (p = host; p < host_end; p++)
+		PUT(tolower((unsigned char) *p));
+	*feedburner = is_feedburner(out, n);
+	host_len = n;
+
+	/* path without trailing slashes */
+	end = path + strcspn(path, "?#");
+	while (end > path && end[-1] == '/')
+		end--;
+	for (p = path; p < end; p++)
+		PUT(*p);
+
+	/* query without tracking parameters */
+	q = strchr(path, '?');
+	if (q != NULL && (p = strchr(path, '#')) != NULL && p < q)
+		q = NULL;
+	if (q != NULL) {
+		end = q + 1 + strcspn(q + 1, "#");
+		for (param = q + 1; param < end; param = param_end + 1) {
+			param_end = param + strcspn(param, "&#");
+			if (param_end > end)
+				param_end = end;
+			name_len = strcspn(param, "=&#");
+			if (name_len > (size_t) (param_end - param))
+				name_len = param_end - param;
+
+			if (param_end > param && !is_tracking_param(param, name_len)) {
+				PUT((first) ? '?' : '&');
+				first = false;
+				for (p = param; p < param_end; p++)
+					PUT(*p);
+			}
+			if (param_end == end)
+				break;
+		}
+	}
+
+#undef PUT
+
+	/* site root */
+	if (n == host_len)
+		return 0;
+
+	out[n] = '\0';
+	return n;
+}
+
+/* FNV-1a */
+static uint64_t link_hash(const char *s, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char) s[i];
+		h *= 0x100000001b3ULL;
+	}
+
+	return (h) ? h : 1;
+}
+
+/* uid as stored in items, the guid when the feed has one */
+static uint64_t item_link_hash(const char *link, const char *uid)
+{
+	char buf[LINKDUP_URL_MAX];
+	size_t len;
+	bool feedburner;
+
+	len = link_canonical(link, buf, sizeof(buf), &feedburner);
+
+	/* proxied link, real one usually in guid */
+	if (feedburner && uid != NULL) {
+		bool dummy;
+		size_t glen = link_canonical(uid, buf, sizeof(buf), &dummy);
+		if (glen > 0)
+			len = glen;
+	}
+
+	return (len > 0) ? link_hash(buf, len) : 0;
+}
+
+/* -*- hash table, linkdup_lock held -*- */
+
+static struct linkdup_entry *linkdup_slot(uint64_t hash)
+{
+	size_t i = hash & (linkdup_size - 1);
+
+	while (linkdup_tab[i].hash != 0 && linkdup_tab[i].hash != hash)
+		i = (i + 1) & (linkdup_size - 1);
+
+	return &linkdup_tab[i];
+}
+
+static void linkdup_grow(void)
+{
+	struct linkdup_entry *old = linkdup_tab;
+	size_t old_size = linkdup_size, i;
+
+	linkdup_size = (linkdup_size) ? linkdup_size * 2 : 4096;
+	linkdup_tab = calloc(linkdup_size, sizeof(*linkdup_tab));
+	if (linkdup_tab == NULL)
+		err(1, "out of memory");
+
+	for (i = 0; i < old_size; i++)
+		if (old[i].hash != 0)
+			*linkdup_slot(old[i].hash) = old[i];
+
+	free(old);
+}
+
+/* return source already holding hash, or 0 after adding it */
+static int linkdup_insert(uint64_t hash, int source_id)
+{
+	struct linkdup_entry *e;
+
+	if ((linkdup_count + 1) * 2 > linkdup_size)
+		linkdup_grow();
+
+	e = linkdup_slot(hash);
+	if (e->hash != 0)
+		return e->source;
+
+	e->hash = hash;
+	e->source = source_id;
+	linkdup_count++;
+	return 0;
+}
+
+/* -*- public -*- */
+
+int linkdup_init(sqlite3 *db, int days, bool mark)
+{
+	sqlite3_stmt *stmt;
+	time_t since;
+	struct tm ltm;
+	char since_str[32];
+	uint64_t hash;
+	int rc;
+
+	linkdup_days = days;
+	linkdup_mark = mark;
+	if (linkdup_days == 0)
+		return SQLITE_OK;
+
+	pthread_mutex_lock(&linkdup_lock);
+	free(linkdup_tab);
+	linkdup_tab = NULL;
+	linkdup_size = linkdup_count = 0;
+	linkdup_grow();
+
+	/* items.datetime is localtime, see db_item_add() */
+	since = time(NULL) - (time_t) days * 24 * 60 * 60;
+	localtime_r(&since, &ltm);
+	strftime(since_str, sizeof(since_str), "%F %T", &ltm);
+
+	rc = db_items_links_since_stmt(db, since_str, &stmt);
+	if (rc == SQLITE_OK) {
+		while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+			hash = item_link_hash((const char *) sqlite3_column_text(stmt, 0),
+					(const char *) sqlite3_column_text(stmt, 1));
+			if (hash != 0)
+				linkdup_insert(hash, sqlite3_column_int(stmt, 2));
+		}
+
+		if (rc == SQLITE_DONE)
+			rc = sqlite3_finalize(stmt);
+		else
+			sqlite3_finalize(stmt);
+	}
+	pthread_mutex_unlock(&linkdup_lock);
+
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "link dedup disabled: %s\n", sqlite3_errmsg(db));
+		linkdup_days = 0;
+		return rc;
+	}
+
+	debug("link index: %zu links since %s", linkdup_count, since_str);
+	return SQLITE_OK;
+}
+
+bool linkdup_marking(void)
+{
+	return linkdup_mark;
+}
+
+/* hash to check and later index, 0 - disabled or no usable link */
+uint64_t linkdup_hash(const char *link, const char *uid)
+{
+	if (linkdup_days == 0)
+		return 0;
+
+	return item_link_hash(link, uid);
+}
+
+/* worker and writer stage: true if another source already has this story */
+bool linkdup_check(int source_id, uint64_t hash, const char *link)
+{
+	struct linkdup_entry *e;
+	int holder;
+
+	if (hash == 0)
+		return false;
+
+	pthread_mutex_lock(&linkdup_lock);
+	e = linkdup_slot(hash);
+	holder = (e->hash != 0) ? e->source : 0;
+	pthread_mutex_unlock(&linkdup_lock);
+
+	if (holder != 0 && holder != source_id) {
+		debug("link %s already from source #%d", link, holder);
+		stats_inc(items_link_dups);
+		return true;
+	}
+
+	return false;
+}
+
+/* writer stage: after the source transaction committed */
+void linkdup_items_added(const struct feed_job *job)
+{
+	struct feed_item *fi;
+
+	if (linkdup_days == 0)
+		return;
+
+	pthread_mutex_lock(&linkdup_lock);
+	for (fi = job->items; fi != NULL; fi = fi->next)
+		if (fi->id != 0 && fi->link_hash != 0)
+			linkdup_insert(fi->link_hash, job->src->id);
+	pthread_mutex_unlock(&linkdup_lock);
+}
@@ -0,0 +1,397 @@
+/**
+ * Selfoss RSS reader micro updater
+ *
+ *   Copyright (C) 2013 Vladimir Ermakov <vooon341@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "selfoss_mupdate.h"
+#include <stdarg.h>
+#include <unistd.h>
+
+/*
+ * Asynchronous debug log.
+ *
+ * Every thread formats into its own single-producer ring, the flusher
+ * thread drains all rings, orders records by time and writes them in
+ * large chunks.  Producers never block: a full ring drops the record
+ * and the loss is reported later.
+ *
+ * Consecutive repeats from one call site are limited to LOG_REPEAT_BURST
+ * per second, the rest are counted and reported as one line.
+ * Records longer than LOG_LINE_MAX are truncated unless --log-payloads
+ * is given.
+ */
+
+#define LOG_LINE_MAX		256
+#define LOG_RING_SIZE		2048		/* records, power of 2 */
+#define LOG_REPEAT_BURST	5		/* per call site per second */
+#define LOG_FLUSH_INTERVAL	10		/* msec */
+#define LOG_MAX_OVERRIDES	16
+
+int __debug_level = 0;
+int __log_level_max = 0;
+
+struct log_rec {
+	struct timespec ts;
+	const char *func;
+	int line;
+	int thread;
+	char *big;			/* full payload, if requested */
+	char text[LOG_LINE_MAX];
+};
+
+struct log_ring {
+	struct log_ring *next;
+	int id;
+	unsigned head;			/* written by producer */
+	unsigned tail;			/* written by flusher */
+	unsigned snap;			/* flusher: head at drain start */
+	unsigned long dropped;
+
+	/* repeat suppression, producer only */
+	const char *last_func;
+	int last_line;
+	time_t window;
+	unsigned repeats;
+	unsigned long suppressed;
+
+	struct log_rec rec[LOG_RING_SIZE];
+};
+
+static struct {
+	const char *name;
+	int level;
+} log_overrides[LOG_MAX_OVERRIDES];
+static int n_log_overrides;
+
+static bool log_payloads;
+static struct timespec log_start;
+
+static pthread_mutex_t log_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct log_ring *log_rings;
+static int log_n_rings;
+static __thread struct log_ring *log_my_ring;
+
+static pthread_t log_flusher;
+static volatile bool log_running, log_stop;
+
+/* -*- levels -*- */
+
+/* "feed=3,sanitize=1" or plain "2" */
+int log_set_levels(const char *spec)
+{
+	char *s, *tok, *save, *eq;
+
+	s = strdup(spec);
+	if (s == NULL)
+		err(1, "out of memory");
+
+	for (tok = strtok_r(s, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		eq = strchr(tok, '=');
+		if (eq == NULL) {
+			__debug_level = atoi(tok);
+			continue;
+		}
+
+		if (n_log_overrides == LOG_MAX_OVERRIDES) {
+			free(s);
+			return -1;
+		}
+
+		*eq = '\0';
+		log_overrides[n_log_overrides].name = strdup(tok);
+		log_overrides[n_log_overrides].level = atoi(eq + 1);
+		n_log_overrides++;
+	}
+
+	free(s);
+	return 0;
+}
+
+/* subsystem is the source file name: "src/feed.c" -> "feed" */
+int log_subsys_level(struct log_subsys *ss)
+{
+	const char *base = strrchr(ss->file, '/');
+	size_t len;
+	int i, level = __debug_level;
+
+	base = (base) ? base + 1 : ss->file;
+	len = strcspn(base, ".");
+
+	for (i = 0; i < n_log_overrides; i++)
+		if (strlen(log_overrides[i].name) == len &&
+				!strncmp(log_overrides[i].name, base, len))
+			level = log_overrides[i].level;
+
+	ss->level = level;
+	return level;
+}
+
+/* -*- producer -*- */
+
+static struct log_ring *log_ring_get(void)
+{
+	struct log_ring *r = log_my_ring;
+
+	if (r != NULL)
+		return r;
+
+	r = calloc(1, sizeof(*r));
+	if (r == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&log_rings_lock);
+	r->id = log_n_rings++;
+	r->next = log_rings;
+	log_rings = r;
+	pthread_mutex_unlock(&log_rings_lock);
+
+	log_my_ring = r;
+	return r;
+}
+
+static void log_push(struct log_ring *r, const char *func, int line,
+		const char *fmt, va_list ap)
+{
+	unsigned h = r->head;
+	struct log_rec *rec;
+	va_list ap2;
+	int len;
+
+	if (h - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == LOG_RING_SIZE) {
+		__atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	rec = &r->rec[h & (LOG_RING_SIZE - 1)];
+	clock_gettime(CLOCK_MONOTONIC, &rec->ts);
+	rec->func = func;
+	rec->line = line;
+	rec->thread = r->id;
+	rec->big = NULL;
+
+	va_copy(ap2, ap);
+	len = vsnprintf(rec->text, sizeof(rec->text), fmt, ap2);
+	va_end(ap2);
+
+	if (len >= (int) sizeof(rec->text)) {
+		if (log_payloads && vasprintf(&rec->big, fmt, ap) < 0)
+			rec->big = NULL;
+		if (rec->big == NULL)
+			snprintf(rec->text + sizeof(rec->text) - 32, 32,
+					"... [+%d bytes]", len - (int) sizeof(rec->text) + 32);
+	}
+
+	__atomic_store_n(&r->head, h + 1, __ATOMIC_RELEASE);
+}
+
+static void log_push_fmt(struct log_ring *r, const char *func, int line,
+		const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	log_push(r, func, line, fmt, ap);
+	va_end(ap);
+}
+
+void log_write(const char *func, int line, const char *fmt, ...)
+{
+	struct log_ring *r;
+	time_t now;
+	va_list ap;
+
+	r = (log_running) ? log_ring_get() : NULL;
+	if (r == NULL) {
+		/* before log_init() or after log_shutdown() */
+		va_start(ap, fmt);
+		fprintf(stderr, "%s.%03d: ", func, line);
+		vfprintf(stderr, fmt, ap);
+		fputc('\n', stderr);
+		va_end(ap);
+		return;
+	}
+
+	now = time(NULL);
+	if (func == r->last_func && line == r->last_line && now == r->window) {
+		if (++r->repeats > LOG_REPEAT_BURST) {
+			r->suppressed++;
+			return;
+		}
+	}
+	else {
+		if (r->suppressed > 0)
+			log_push_fmt(r, r->last_func, r->last_line,
+					"last message repeated %lu more times", r->suppressed);
+		r->last_func = func;
+		r->last_line = line;
+		r->window = now;
+		r->repeats = 1;
+		r->suppressed = 0;
+	}
+
+	va_start(ap, fmt);
+	log_push(r, func, line, fmt, ap);
+	va_end(ap);
+}
+
+/* -*- flusher -*- */
+
+static int log_rec_cmp(const void *a, const void *b)
+{
+	const struct log_rec *x = *(struct log_rec * const *) a;
+	const struct log_rec *y = *(struct log_rec * const *) b;
+
+	if (x->ts.tv_sec != y->ts.tv_sec)
+		return (x->ts.tv_sec < y->ts.tv_sec) ? -1 : 1;
+	if (x->ts.tv_nsec != y->ts.tv_nsec)
+		return (x->ts.tv_nsec < y->ts.tv_nsec) ? -1 : 1;
+	return 0;
+}
+
+static void log_out(const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(STDERR_FILENO, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return;
+		buf += n;
+		len -= n;
+	}
+}
+
+static void log_drain(void)
+{
+	static struct log_rec **recs;
+	static size_t recs_allocated;
+	static char buf[65536];
+	struct log_ring *r, *rings;
+	size_t n = 0, pos = 0, i;
+	unsigned long dropped;
+	unsigned t;
+	int len;
+
+	pthread_mutex_lock(&log_rings_lock);
+	rings = log_rings;
+	if (recs_allocated < (size_t) log_n_rings * LOG_RING_SIZE) {
+		recs_allocated = (size_t) log_n_rings * LOG_RING_SIZE;
+		recs = realloc(recs, recs_allocated * sizeof(*recs));
+		if (recs == NULL)
+			err(1, "out of memory");
+	}
+	pthread_mutex_unlock(&log_rings_lock);
+
+	/* rings are only added at the list head and never removed */
+	for (r = rings; r != NULL; r = r->next) {
+		r->snap = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		for (t = r->tail; t != r->snap; t++)
+			recs[n++] = &r->rec[t & (LOG_RING_SIZE - 1)];
+	}
+
+	qsort(recs, n, sizeof(*recs), log_rec_cmp);
+
+	for (i = 0; i < n; i++) {
+		struct log_rec *rec = recs[i];
+		long ms = (rec->ts.tv_sec - log_start.tv_sec) * 1000 +
+			(rec->ts.tv_nsec - log_start.tv_nsec) / 1000000;
+
+		if (sizeof(buf) - pos < LOG_LINE_MAX + 64) {
+			log_out(buf, pos);
+			pos = 0;
+		}
+
+		pos += snprintf(buf + pos, sizeof(buf) - pos, "%ld.%03ld [%d] %s.%03d: ",
+				ms / 1000, ms % 1000, rec->thread, rec->func, rec->line);
+
+		if (rec->big != NULL) {
+			log_out(buf, pos);
+			log_out(rec->big, strlen(rec->big));
+			log_out("\n", 1);
+			free(rec->big);
+			pos = 0;
+		}
+		else
+			pos += snprintf(buf + pos, sizeof(buf) - pos, "%s\n", rec->text);
+	}
+	log_out(buf, pos);
+
+	for (r = rings; r != NULL; r = r->next) {
+		__atomic_store_n(&r->tail, r->snap, __ATOMIC_RELEASE);
+
+		dropped = __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED);
+		if (dropped > 0) {
+			len = snprintf(buf, sizeof(buf), "log: thread %d dropped %lu records\n",
+					r->id, dropped);
+			log_out(buf, len);
+		}
+	}
+}
+
+static void *log_flush_thread(void *arg)
+{
+	struct timespec ts = { 0, LOG_FLUSH_INTERVAL * 1000000L };
+
+	while (!log_stop) {
+		nanosleep(&ts, NULL);
+		log_drain();
+	}
+
+	return NULL;
+}
+
+/* -*- public -*- */
+
+void log_init(bool payloads)
+{
+	int i;
+
+	log_payloads = payloads;
+
+	__log_level_max = __debug_level;
+	for (i = 0; i < n_log_overrides; i++)
+		if (log_overrides[i].level > __log_level_max)
+			__log_level_max = log_overrides[i].level;
+
+	/* nothing to log, no flusher */
+	if (__log_level_max == 0 || LOG_MAX_LEVEL == 0)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &log_start);
+
+	if ((errno = pthread_create(&log_flusher, NULL, log_flush_thread, NULL)) != 0)
+		err(1, "pthread_create()");
+
+	log_running = true;
+	atexit(log_shutdown);
+}
+
+/* also runs from atexit(), so errx() keeps the tail of the log */
+void log_shutdown(void)
+{
+	if (!log_running)
+		return;
+
+	log_running = false;
+	log_stop = true;
+	pthread_join(log_flusher, NULL);
+	log_drain();
+
+	/* rings stay allocated: other threads may still be running */
+}
@@ -0,0 +1,503 @@
+/**
+ * Selfoss RSS reader micro updater
+ *
+ *   Copyright (C) 2013 Vladimir Ermakov <vooon341@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "selfoss_mupdate.h"
+
+/*
+ * Update pipeline:
+ *
+ *   fetch threads --[work_q]--> parse/sanitize workers --[write_q]--> writer
+ *
+ * The writer (caller thread) is the only user of the read-write sqlite
+ * handle, workers use their own read-only handles for the early duplicate
+ * check. Queues are bounded, so slow stages throttle fast ones.
+ */
+
+/* failed sources are retried after BACKOFF_BASE * 2^(failures - 1) */
+#define BACKOFF_BASE		(15 * 60)
+#define BACKOFF_MAX		(24 * 60 * 60)
+
+struct pipeline {
+	const char *db_path;
+	time_t deadline;
+	struct source *sources;
+	size_t n_sources;
+	size_t next_source;	/* guarded by lock */
+
+	struct queue work_q;
+	struct queue write_q;
+
+	pthread_mutex_t lock;
+	int fetchers_alive;	/* guarded by lock */
+	int workers_alive;	/* guarded by lock */
+};
+
+static struct source *pipeline_next_source(struct pipeline *pl)
+{
+	struct source *src;
+
+	/* control socket requests jump the queue */
+	src = control_next_source();
+	if (src != NULL)
+		return src;
+
+	pthread_mutex_lock(&pl->lock);
+	if (pl->next_source < pl->n_sources)
+		src = &pl->sources[pl->next_source++];
+	pthread_mutex_unlock(&pl->lock);
+
+	return src;
+}
+
+/* last one out closes the door */
+static void pipeline_stage_exit(struct pipeline *pl, int *alive, struct queue *out)
+{
+	bool last;
+
+	pthread_mutex_lock(&pl->lock);
+	last = (--(*alive) == 0);
+	pthread_mutex_unlock(&pl->lock);
+
+	if (last)
+		queue_close(out);
+}
+
+static bool deadline_reached(struct pipeline *pl)
+{
+	return pl->deadline && time(NULL) >= pl->deadline;
+}
+
+/* -*- stages -*- */
+
+/* a governed job holds its slot until the writer is done with it */
+static void pipeline_job_free(struct feed_job *job)
+{
+	if (job->governed)
+		governor_leave();
+
+	feed_job_free(job);
+}
+
+static void *fetch_thread(void *arg)
+{
+	struct pipeline *pl = arg;
+	struct source *src;
+
+	while ((src = pipeline_next_source(pl)) != NULL) {
+		struct feed_job *job;
+
+		job = calloc(1, sizeof(*job));
+		if (job == NULL)
+			err(1, "out of memory");
+
+		job->src = src;
+		if (deadline_reached(pl))
+			job->deferred = true;
+		else if (archive_replaying()) {
+			governor_enter();
+			job->governed = true;
+			alloc_stage(ALLOC_FETCH, src->id);
+			job->rc = archive_replay(job);
+			alloc_stage(ALLOC_OTHER, 0);
+		}
+		else {
+			governor_enter();
+			job->governed = true;
+			alloc_stage(ALLOC_FETCH, src->id);
+			job->rc = fetch_feed(job, pl->deadline);
+			alloc_stage(ALLOC_OTHER, 0);
+			/* transfer cut by deadline, not a feed failure */
+			if (job->rc != 0 && deadline_reached(pl))
+				job->deferred = true;
+			else
+				archive_record(job);
+
+			free(job->headers);
+			job->headers = NULL;
+		}
+
+		if (!queue_push(&pl->work_q, job))
+			pipeline_job_free(job);
+	}
+
+	pipeline_stage_exit(pl, &pl->fetchers_alive, &pl->work_q);
+	return NULL;
+}
+
+static void *worker_thread(void *arg)
+{
+	struct pipeline *pl = arg;
+	struct feed_job *job;
+	sqlite3 *rdb;
+	int rc;
+
+	/* --tenants: no single database, see tenant_item_exists() */
+	rdb = NULL;
+	if (pl->db_path != NULL) {
+		rc = sqlite3_open_v2(pl->db_path, &rdb, SQLITE_OPEN_READONLY, NULL);
+		if (rc != SQLITE_OK)
+			errx(1, "Can't open database: %s", sqlite3_errmsg(rdb));
+		sqlite3_busy_timeout(rdb, 10000);
+	}
+
+	while ((job = queue_pop(&pl->work_q)) != NULL) {
+		if (!job->deferred && deadline_reached(pl))
+			job->deferred = true;
+		if (job->rc == 0 && !job->deferred) {
+			alloc_stage(ALLOC_PARSE, job->src->id);
+			job->rc = feed_process(rdb, job);
+			alloc_stage(ALLOC_OTHER, 0);
+		}
+
+		if (!queue_push(&pl->write_q, job))
+			pipeline_job_free(job);
+	}
+
+	sqlite3_close(rdb);
+
+	pipeline_stage_exit(pl, &pl->workers_alive, &pl->write_q);
+	return NULL;
+}
+
+static double fetch_ms_average(double avg, double ms)
+{
+	return (avg > 0) ? (avg * 3 + ms) / 4 : ms;
+}
+
+/* new items and source state, caller holds the transaction */
+static void store_items(sqlite3 *db, struct feed_job *job)
+{
+	struct feed_item *fi;
+	int source_id = job->src->id;
+	int rc;
+
+	for (fi = job->items; fi != NULL; fi = fi->next) {
+		bool exists;
+
+		/* items list is shared by --tenants subscribers */
+		fi->id = 0;
+
+		if (fi->near_dup) {
+			simhash_item_suppressed(db, job, fi->uid);
+			continue;
+		}
+
+		if (purge_item_expired(&fi->pub_tm)) {
+			debug2("item older than items lifetime, skipped");
+			stats_inc(items_expired);
+			continue;
+		}
+
+		/* item may come from another source or an earlier dup in this feed */
+		rc = db_item_exists(db, fi->uid, &exists);
+		if (rc != SQLITE_OK)
+			errx(1, "sqlite fail");
+		if (exists) {
+			debug("item alredy exists. skipped");
+			continue;
+		}
+
+		/* same story committed by another source since the worker looked */
+		if (!fi->duplicate && linkdup_check(source_id, fi->link_hash, fi->link)) {
+			if (!linkdup_marking())
+				continue;
+			fi->duplicate = true;
+		}
+
+		/* near duplicate committed by another source since */
+		if (simhash_check(source_id, fi->simhash)) {
+			simhash_item_suppressed(db, job, fi->uid);
+			continue;
+		}
+
+		cache_store(db, fi->content, &fi->cache);
+
+		rc = db_item_add(db, source_id,
+				fi->title, fi->content, fi->uid, fi->link,
+				NULL, NULL, &fi->pub_tm, !fi->duplicate);
+		if (rc != SQLITE_OK)
+			errx(1, "failed to add new item (title: %s) to source %d",
+					fi->title, source_id);
+
+		fi->id = sqlite3_last_insert_rowid(db);
+		fts_item_added(db, fi->id, fi->title, fi->content);
+		simhash_item_added(db, fi->id, source_id, fi->simhash);
+
+		stats_inc(items_new);
+		job->n_new++;
+		if (!fi->duplicate)
+			job->n_new_unread++;
+	}
+
+	simhash_suppressed(db, source_id, job->n_near_dups);
+
+	rc = db_source_set_lastupdate(db, source_id, job->fetched);
+	if (rc != SQLITE_OK)
+		errx(1, "db_source_update(db, %d, 0) NOT OK", source_id);
+
+	lease_release(db, source_id);
+
+	/* clear previous failure */
+	if (job->src->error != NULL && *job->src->error != '\0')
+		rc = db_source_set_error(db, source_id, "");
+	if (rc == SQLITE_OK)
+		rc = db_source_state_set(db, source_id, 0, 0,
+				fetch_ms_average(job->src->fetch_ms, job->fetch_ms));
+	if (rc != SQLITE_OK)
+		errx(1, "failed to update state of source %d", source_id);
+}
+
+static time_t source_backoff(int failures)
+{
+	time_t delay = BACKOFF_BASE;
+
+	while (--failures > 0 && delay < BACKOFF_MAX)
+		delay *= 2;
+
+	return (delay < BACKOFF_MAX) ? delay : BACKOFF_MAX;
+}
+
+/* record error in sources.error (shown by selfoss) and schedule retry,
+ * caller holds the transaction */
+static void store_failure(sqlite3 *db, struct feed_job *job)
+{
+	struct source *src = job->src;
+	char error[sizeof(job->error) + 64];
+	char tbuf[32];
+	time_t now = time(NULL), next_attempt;
+	struct tm ltm;
+	int failures = src->failures + 1;
+	int rc;
+
+	if (*job->error == '\0')
+		job_error(job, "unknown error");
+
+	next_attempt = now + source_backoff(failures);
+	localtime_r(&next_attempt, &ltm);
+	strftime(tbuf, sizeof(tbuf), "%F %T", &ltm);
+
+	fprintf(stderr, "source #%d: %s\n", src->id, job->error);
+	snprintf(error, sizeof(error), "%s (failed %d times, next attempt after %s)",
+			job->error, failures, tbuf);
+
+	rc = db_source_set_error(db, src->id, error);
+	if (rc == SQLITE_OK)
+		rc = db_source_state_set(db, src->id, failures, next_attempt, src->fetch_ms);
+	if (rc == SQLITE_OK)
+		lease_release(db, src->id);
+	if (rc != SQLITE_OK)
+		errx(1, "failed to record error of source %d: %s", src->id, sqlite3_errmsg(db));
+
+	debug("source #%d: %d failures, backoff until %s", src->id, failures, tbuf);
+}
+
+/* one transaction per source */
+static void writer_commit(sqlite3 *db, struct feed_job *job)
+{
+	if (db_exec(db, "BEGIN IMMEDIATE") != SQLITE_OK)
+		errx(1, "BEGIN: %s", sqlite3_errmsg(db));
+
+	/* the other process fetched it too, its result wins */
+	if (!lease_held(db, job->src->id)) {
+		if (db_exec(db, "ROLLBACK") != SQLITE_OK)
+			errx(1, "ROLLBACK: %s", sqlite3_errmsg(db));
+		job->lease_lost = true;
+		return;
+	}
+
+	pipeline_store(db, job);
+	journal_source_done(db, job);
+
+	if (db_exec(db, "COMMIT") != SQLITE_OK)
+		errx(1, "COMMIT: %s", sqlite3_errmsg(db));
+
+	if (job->rc == 0) {
+		linkdup_items_added(job);
+		simhash_items_added(job);
+		thumbnail_request(db, job);
+		cache_evict(db);
+		/* retention work interleaved with sources, short transactions */
+		purge_step(db);
+	}
+}
+
+/* -*- public -*- */
+
+/* writer stage result of a job, also used by spool ingest */
+void pipeline_store(sqlite3 *db, struct feed_job *job)
+{
+	if (job->rc == 0)
+		store_items(db, job);
+	else
+		store_failure(db, job);
+
+	redirect_store(db, job);
+}
+
+static void report_deferred(sqlite3 *db, struct source **deferred, size_t n)
+{
+	size_t i;
+
+	if (n == 0)
+		return;
+
+	fprintf(stderr, "deadline reached, %zu sources deferred:", n);
+	for (i = 0; i < n; i++)
+		fprintf(stderr, " #%d", deferred[i]->id);
+	fprintf(stderr, "\n");
+
+	if (!lease_active())
+		return;
+
+	/* let other shards have them */
+	if (db_exec(db, "BEGIN IMMEDIATE") != SQLITE_OK)
+		errx(1, "BEGIN: %s", sqlite3_errmsg(db));
+	for (i = 0; i < n; i++)
+		lease_release(db, deferred[i]->id);
+	if (db_exec(db, "COMMIT") != SQLITE_OK)
+		errx(1, "COMMIT: %s", sqlite3_errmsg(db));
+}
+
+int pipeline_run(sqlite3 *db, const char *db_path,
+		struct source *sources, size_t n_sources,
+		const struct pipeline_options *opts)
+{
+	struct pipeline pl;
+	struct feed_job *job;
+	struct source **deferred;
+	size_t n_deferred = 0;
+	pthread_t *threads;
+	int n_workers = opts->n_workers;
+	int i, fetch_rc = 1;
+
+	if (n_workers < 1)
+		n_workers = 1;
+
+	/* n_sources may be 0 with control socket requests only */
+	deferred = calloc(n_sources + 1, sizeof(*deferred));
+	if (deferred == NULL)
+		err(1, "out of memory");
+
+	memset(&pl, 0, sizeof(pl));
+	pl.db_path = db_path;
+	pl.deadline = opts->deadline;
+	pl.sources = sources;
+	pl.n_sources = n_sources;
+	pl.fetchers_alive = n_workers;
+	pl.workers_alive = n_workers;
+
+	/* queue depth bounds items in flight between stages */
+	queue_init(&pl.work_q, n_workers * 2);
+	queue_init(&pl.write_q, n_workers * 2);
+	pthread_mutex_init(&pl.lock, NULL);
+
+	debug("%zu sources, %d workers", n_sources, n_workers);
+
+	/* narrows the pipeline under memory pressure, before threads start */
+	governor_start(opts->mem_budget, n_workers, &pl.work_q, &pl.write_q);
+	if (opts->thumbnails)
+		thumbnail_start(n_workers, opts->deadline);
+
+	threads = calloc(n_workers * 2, sizeof(pthread_t));
+	if (threads == NULL)
+		err(1, "out of memory");
+
+	if (db != NULL)
+		sqlite3_busy_timeout(db, 10000);
+
+	for (i = 0; i < n_workers; i++) {
+		if ((errno = pthread_create(&threads[i], NULL, fetch_thread, &pl)) != 0)
+			err(1, "pthread_create()");
+		if ((errno = pthread_create(&threads[n_workers + i], NULL, worker_thread, &pl)) != 0)
+			err(1, "pthread_create()");
+	}
+
+	/* writer stage, every source is committed as a whole or deferred */
+	while ((job = queue_pop(&pl.write_q)) != NULL) {
+		if (job->deferred && job->src->reply_fd >= 0) {
+			/* leased by control_refresh(), would be renewed forever */
+			lease_release(db, job->src->id);
+			control_done(job->src, "deferred #%d: run deadline reached", job->src->id);
+			pipeline_job_free(job);
+			continue;
+		}
+
+		if (job->deferred) {
+			deferred[n_deferred++] = job->src;
+			stats_inc(sources_deferred);
+			pipeline_job_free(job);
+			continue;
+		}
+
+		/* remote fetch host: results go to the spool, not the database */
+		alloc_stage(ALLOC_WRITE, job->src->id);
+		if (spool_emitting())
+			spool_emit(job);
+		else if (tenant_active())
+			tenant_store(job);
+		else
+			writer_commit(db, job);
+		alloc_stage(ALLOC_OTHER, 0);
+
+		if (job->lease_lost) {
+			stats_inc(sources_lease_lost);
+			if (job->src->reply_fd >= 0)
+				control_done(job->src, "skipped #%d: leased by another process",
+						job->src->id);
+			pipeline_job_free(job);
+			continue;
+		}
+
+		if (job->rc == 0)
+			stats_inc(sources_ok);
+		else
+			stats_inc(sources_failed);
+		stats_caps(job);
+
+		if (job->src->reply_fd >= 0) {
+			if (job->rc == 0)
+				control_done(job->src, "ok #%d: %d new items",
+						job->src->id, job->n_new);
+			else
+				control_done(job->src, "error #%d: %s",
+						job->src->id, job->error);
+		}
+
+		fetch_rc = job->rc;
+		pipeline_job_free(job);
+
+		thumbnail_apply();
+	}
+
+	for (i = 0; i < n_workers * 2; i++)
+		pthread_join(threads[i], NULL);
+
+	governor_stop();
+	thumbnail_stop();
+
+	report_deferred(db, deferred, n_deferred);
+
+	free(deferred);
+	free(threads);
+	pthread_mutex_destroy(&pl.lock);
+	queue_destroy(&pl.write_q);
+	queue_destroy(&pl.work_q);
+
+	return fetch_rc;
+}
@@ -0,0 +1,474 @@
+/**
+ * Selfoss RSS reader micro updater
+ *
+ *   Copyright (C) 2013 Vladimir Ermakov <vooon341@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "selfoss_mupdate.h"
+#include "bb_md5_sha.h"
+#include "tidy.h"
+
+/*
+ * Sanitizer policy.
+ *
+ * A policy file is a list of directives, one per line, '#' comments:
+ *
+ *   tags <tag>...			allowed elements, others are dropped with content
+ *   attrs <tag>|* <attr>...		attributes allowed on <tag> (also allows the
+ *					tag), or on every allowed tag
+ *   deny-prefix <attr> <prefix>...	drop <attr> whose value starts with <prefix>
+ *   schemes <attr> <scheme>...		if given, only these URL schemes (and
+ *					relative URLs) are kept in <attr>
+ *
+ * Names, prefixes and schemes are matched case-insensitively.  Values
+ * are checked as a browser reads a URL: leading control characters and
+ * spaces stripped, TAB, LF and CR removed anywhere.  The built-in policy below is
+ * the list of selfoss/helpers/ContentLoader.php sanitizeContent().
+ *
+ * Tidy has no public name to id lookup, so ids are resolved on first
+ * sight by name and cached in tables indexed by TidyTagId/TidyAttrId;
+ * after that every check is an array load and a mask test.  The tables
+ * are filled from several workers, but a slot only ever goes from
+ * unknown to its single final value.
+ */
+
+#define POLICY_MAX_TAGS		250	/* slots are uint8_t, see SLOT_* */
+#define POLICY_MAX_ATTRS	64	/* per tag masks are uint64_t */
+#define POLICY_MAX_PREFIXES	8
+
+#define TAG_INDEX_SIZE		512	/* name hash tables, power of 2, */
+#define ATTR_INDEX_SIZE		128	/* at least twice the maximum */
+
+#define SLOT_UNKNOWN		0
+#define SLOT_NONE		0xff	/* not in the policy */
+
+static const char default_policy[] =
+	"tags div p ul li a img dl dt h1 h2 h3 h4 h5 h6 ol br table tr td\n"
+	"tags blockquote pre ins del th thead tbody b i strong em tt\n"
+	"attrs * alt title src name rel href\n"
+	"deny-prefix href javascript\n";
+
+struct policy_tag {
+	char *name;
+	uint64_t attrs;
+};
+
+struct policy_attr {
+	char *name;
+	char *deny_prefix[POLICY_MAX_PREFIXES];
+	int n_deny_prefix;
+	char *schemes[POLICY_MAX_PREFIXES];
+	int n_schemes;
+};
+
+/* read-only after policy_load() */
+static struct policy_tag tags[POLICY_MAX_TAGS];
+static int n_tags;
+static struct policy_attr attrs[POLICY_MAX_ATTRS];
+static int n_attrs;
+static uint64_t global_attrs;
+static unsigned char policy_hash[CACHE_DIGEST_SIZE];
+static bool policy_is_default = true;
+
+/* name lookup, open addressing: slot + 1, 0 - empty */
+static uint8_t tag_index[TAG_INDEX_SIZE];
+static uint8_t attr_index[ATTR_INDEX_SIZE];
+
+/* slot + 1, SLOT_UNKNOWN or SLOT_NONE */
+static uint8_t tag_slots[N_TIDY_TAGS];
+static uint8_t attr_slots[N_TIDY_ATTRIBS];
+
+/* -*- parse -*- */
+
+/* directives only, one space between words: hashed and compared */
+static char *policy_normalize(const char *text)
+{
+	char *out, *wrp;
+	const char *p;
+	bool line_empty = true, space = false;
+
+	out = malloc(strlen(text) + 2);
+	if (out == NULL)
+		err(1, "out of memory");
+	wrp = out;
+
+	for (p = text; *p; p++) {
+		if (*p == '#') {
+			p += strcspn(p, "\n");
+			if (*p == '\0')
+				break;
+		}
+
+		if (*p == '\n') {
+			if (!line_empty)
+				*wrp++ = '\n';
+			line_empty = true;
+			space = false;
+		}
+		else if (*p == ' ' || *p == '\t' || *p == '\r') {
+			space = !line_empty;
+		}
+		else {
+			if (space)
+				*wrp++ = ' ';
+			*wrp++ = (*p >= 'A' && *p <= 'Z') ? *p + 'a' - 'A' : *p;
+			line_empty = space = false;
+		}
+	}
+	if (!line_empty)
+		*wrp++ = '\n';
+	*wrp = '\0';
+
+	return out;
+}
+
+static uint32_t name_hash(const char *name, size_t len)
+{
+	uint32_t h = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ (unsigned char) (name[i] | 0x20)) * 16777619u;
+
+	return h;
+}
+
+static bool name_eq(const char *policy_name, const char *name, size_t len)
+{
+	return strncasecmp(policy_name, name, len) == 0 && policy_name[len] == '\0';
+}
+
+static int tag_find(const char *name, size_t len)
+{
+	uint32_t i;
+
+	for (i = name_hash(name, len) & (TAG_INDEX_SIZE - 1); tag_index[i] != 0;
+			i = (i + 1) & (TAG_INDEX_SIZE - 1))
+		if (name_eq(tags[tag_index[i] - 1].name, name, len))
+			return tag_index[i] - 1;
+
+	return -1;
+}
+
+static int attr_find(const char *name, size_t len)
+{
+	uint32_t i;
+
+	for (i = name_hash(name, len) & (ATTR_INDEX_SIZE - 1); attr_index[i] != 0;
+			i = (i + 1) & (ATTR_INDEX_SIZE - 1))
+		if (name_eq(attrs[attr_index[i] - 1].name, name, len))
+			return attr_index[i] - 1;
+
+	return -1;
+}
+
+static int tag_get(const char *name, int lineno)
+{
+	uint32_t i;
+	int t = tag_find(name, strlen(name));
+
+	if (t >= 0)
+		return t;
+
+	if (n_tags == POLICY_MAX_TAGS)
+		errx(1, "policy line %d: more than %d tags", lineno, POLICY_MAX_TAGS);
+
+	tags[n_tags].name = strdup(name);
+	tags[n_tags].attrs = 0;
+
+	for (i = name_hash(name, strlen(name)) & (TAG_INDEX_SIZE - 1); tag_index[i] != 0;
+			i = (i + 1) & (TAG_INDEX_SIZE - 1))
+		;
+	tag_index[i] = n_tags + 1;
+
+	return n_tags++;
+}
+
+static int attr_get(const char *name, int lineno)
+{
+	uint32_t i;
+	int a = attr_find(name, strlen(name));
+
+	if (a >= 0)
+		return a;
+
+	if (n_attrs == POLICY_MAX_ATTRS)
+		errx(1, "policy line %d: more than %d attributes", lineno, POLICY_MAX_ATTRS);
+
+	memset(&attrs[n_attrs], 0, sizeof(attrs[n_attrs]));
+	attrs[n_attrs].name = strdup(name);
+
+	for (i = name_hash(name, strlen(name)) & (ATTR_INDEX_SIZE - 1); attr_index[i] != 0;
+			i = (i + 1) & (ATTR_INDEX_SIZE - 1))
+		;
+	attr_index[i] = n_attrs + 1;
+
+	return n_attrs++;
+}
+
+static void policy_add_list(char **list, int *n, const char *word, int lineno)
+{
+	if (*n == POLICY_MAX_PREFIXES)
+		errx(1, "policy line %d: more than %d values", lineno, POLICY_MAX_PREFIXES);
+
+	list[(*n)++] = strdup(word);
+}
+
+/* normalized text: lower case, single spaces, no comments */
+static void policy_parse(char *text)
+{
+	char *line, *save_line, *word, *save_word;
+	char *directive, *target;
+	int lineno = 0, t, a;
+
+	for (line = strtok_r(text, "\n", &save_line); line != NULL;
+			line = strtok_r(NULL, "\n", &save_line)) {
+		lineno++;
+		directive = strtok_r(line, " ", &save_word);
+
+		if (strcmp(directive, "tags") == 0) {
+			while ((word = strtok_r(NULL, " ", &save_word)) != NULL)
+				tag_get(word, lineno);
+			continue;
+		}
+
+		target = strtok_r(NULL, " ", &save_word);
+		if (target == NULL)
+			errx(1, "policy line %d: %s without arguments", lineno, directive);
+
+		if (strcmp(directive, "attrs") == 0) {
+			t = (strcmp(target, "*") == 0) ? -1 : tag_get(target, lineno);
+
+			while ((word = strtok_r(NULL, " ", &save_word)) != NULL) {
+				a = attr_get(word, lineno);
+				if (t < 0)
+					global_attrs |= 1ULL << a;
+				else
+					tags[t].attrs |= 1ULL << a;
+			}
+		}
+		else if (strcmp(directive, "deny-prefix") == 0) {
+			a = attr_get(target, lineno);
+			while ((word = strtok_r(NULL, " ", &save_word)) != NULL)
+				policy_add_list(attrs[a].deny_prefix, &attrs[a].n_deny_prefix, word, lineno);
+		}
+		else if (strcmp(directive, "schemes") == 0) {
+			a = attr_get(target, lineno);
+			while ((word = strtok_r(NULL, " ", &save_word)) != NULL)
+				policy_add_list(attrs[a].schemes, &attrs[a].n_schemes, word, lineno);
+		}
+		else
+			errx(1, "policy line %d: unknown directive %s", lineno, directive);
+	}
+}
+
+static char *read_file(const char *path)
+{
+	FILE *fl;
+	char *text;
+	long sz;
+
+	fl = fopen(path, "r");
+	if (fl == NULL)
+		return NULL;
+
+	if (fseek(fl, 0, SEEK_END) < 0 || (sz = ftell(fl)) < 0 || fseek(fl, 0, SEEK_SET) < 0) {
+		fclose(fl);
+		return NULL;
+	}
+
+	text = calloc(sz + 1, 1);
+	if (text == NULL)
+		err(1, "out of memory");
+
+	if (fread(text, 1, sz, fl) != (size_t) sz) {
+		free(text);
+		text = NULL;
+	}
+
+	fclose(fl);
+	return text;
+}
+
+/* -*- public -*- */
+
+/* at startup, before workers. path NULL - built-in policy */
+int policy_load(const char *path)
+{
+	char *text, *norm, *default_norm;
+	sha256_ctx_t ctx;
+	int i;
+
+	if (path != NULL) {
+		text = read_file(path);
+		if (text == NULL) {
+			warn("sanitizer policy %s", path);
+			return -1;
+		}
+	}
+	else
+		text = strdup(default_policy);
+
+	norm = policy_normalize(text);
+	default_norm = policy_normalize(default_policy);
+	policy_is_default = (strcmp(norm, default_norm) == 0);
+	free(default_norm);
+	free(text);
+
+	sha256_begin(&ctx);
+	sha256_hash(&ctx, norm, strlen(norm));
+	sha256_end(&ctx, policy_hash);
+
+	policy_parse(norm);
+	free(norm);
+
+	for (i = 0; i < n_tags; i++)
+		tags[i].attrs |= global_attrs;
+
+	debug("sanitizer policy %s: %d tags, %d attributes, hash %02x%02x%02x%02x",
+			(path != NULL) ? path : "built-in", n_tags, n_attrs,
+			policy_hash[0], policy_hash[1], policy_hash[2], policy_hash[3]);
+
+	return 0;
+}
+
+/* mixed into sanitized content cache keys, NULL for the built-in policy
+ * so existing caches stay valid */
+const unsigned char *policy_digest(void)
+{
+	return (policy_is_default) ? NULL : policy_hash;
+}
+
+/* for sanitizers without tidy ids: tag slot or -1 if not allowed */
+int policy_tag_by_name(const char *name, size_t len)
+{
+	return tag_find(name, len);
+}
+
+/* attribute slot or -1 if not allowed on this tag */
+int policy_attr_by_name(int tag, const char *name, size_t len)
+{
+	int a = attr_find(name, len);
+
+	return (a >= 0 && (tags[tag].attrs & (1ULL << a))) ? a : -1;
+}
+
+const char *policy_tag_name(int tag)
+{
+	return tags[tag].name;
+}
+
+const char *policy_attr_name(int attr)
+{
+	return attrs[attr].name;
+}
+
+int policy_attr_count(void)
+{
+	return n_attrs;
+}
+
+/* tag slot or -1 if the element is not allowed */
+int policy_tag(int tid, const char *name)
+{
+	uint8_t slot;
+	int t;
+
+	if (tid <= 0 || tid >= N_TIDY_TAGS)
+		return -1;	/* unknown to tidy, never allowed */
+
+	slot = __atomic_load_n(&tag_slots[tid], __ATOMIC_RELAXED);
+	if (slot == SLOT_UNKNOWN) {
+		t = (name != NULL) ? tag_find(name, strlen(name)) : -1;
+		slot = (t >= 0) ? t + 1 : SLOT_NONE;
+		__atomic_store_n(&tag_slots[tid], slot, __ATOMIC_RELAXED);
+	}
+
+	return (slot == SLOT_NONE) ? -1 : slot - 1;
+}
+
+/* attribute slot or -1 if not allowed on this tag */
+int policy_attr(int tag, int aid, const char *name)
+{
+	uint8_t slot;
+	int a;
+
+	if (aid <= 0 || aid >= N_TIDY_ATTRIBS)
+		return -1;
+
+	slot = __atomic_load_n(&attr_slots[aid], __ATOMIC_RELAXED);
+	if (slot == SLOT_UNKNOWN) {
+		a = (name != NULL) ? attr_find(name, strlen(name)) : -1;
+		slot = (a >= 0) ? a + 1 : SLOT_NONE;
+		__atomic_store_n(&attr_slots[aid], slot, __ATOMIC_RELAXED);
+	}
+
+	if (slot == SLOT_NONE || !(tags[tag].attrs & (1ULL << (slot - 1))))
+		return -1;
+
+	return slot - 1;
+}
+
+/* value check of an allowed attribute */
+/* WHATWG URL parsing: "java\tscript:" is "javascript:" to a browser */
+static char *url_strip(const char *value)
+{
+	char *url, *u;
+
+	while (*value != '\0' && (unsigned char) *value <= ' ')
+		value++;
+
+	url = u = malloc(strlen(value) + 1);
+	if (url == NULL)
+		err(1, "out of memory");
+
+	for (; *value != '\0'; value++)
+		if (*value != '\t' && *value != '\n' && *value != '\r')
+			*u++ = *value;
+	*u = '\0';
+
+	return url;
+}
+
+bool policy_value_ok(int attr, const char *value)
+{
+	const struct policy_attr *pa = &attrs[attr];
+	bool ok = true;
+	char *url;
+	size_t n;
+	int i;
+
+	if (value == NULL || (pa->n_deny_prefix == 0 && pa->n_schemes == 0))
+		return true;
+
+	url = url_strip(value);
+
+	for (i = 0; i < pa->n_deny_prefix && ok; i++)
+		if (strncasecmp(url, pa->deny_prefix[i], strlen(pa->deny_prefix[i])) == 0)
+			ok = false;
+
+	/* scheme: letters, digits, + - . before the first ':' */
+	n = strspn(url, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789+-.");
+	if (ok && pa->n_schemes > 0 && url[n] == ':' && n > 0) {
+		ok = false;
+		for (i = 0; i < pa->n_schemes && !ok; i++)
+			if (strlen(pa->schemes[i]) == n && strncasecmp(url, pa->schemes[i], n) == 0)
+				ok = true;
+	}
+
+	free(url);
+	return ok;
+}
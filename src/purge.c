@@ -0,0 +1,134 @@
+/**
+ * Selfoss RSS reader micro updater
+ *
+ *   Copyright (C) 2013 Vladimir Ermakov <vooon341@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "selfoss_mupdate.h"
+
+/*
+ * Item retention, same rule as selfoss update.php: unstarred items
+ * older than items_lifetime days are deleted, read or not.
+ *
+ * Deletes go in small batches, each in its own transaction between
+ * source commits, so the write lock is never held for long.
+ */
+
+static int purge_days;			/* 0 - disabled */
+static int purge_batch;
+static time_t purge_cutoff_t;
+static char purge_cutoff[32];
+static bool purge_done;
+static int purge_freelist_start;
+
+int purge_init(sqlite3 *db, int lifetime_days, int batch)
+{
+	struct tm ltm;
+	int rc;
+
+	purge_days = lifetime_days;
+	purge_batch = batch;
+	purge_done = (purge_days == 0);
+
+	if (purge_done)
+		return SQLITE_OK;
+
+	/* items.datetime stored in localtime, see db_item_add() */
+	purge_cutoff_t = time(NULL) - (time_t) purge_days * 24 * 60 * 60;
+	localtime_r(&purge_cutoff_t, &ltm);
+	strftime(purge_cutoff, sizeof(purge_cutoff), "%F %T", &ltm);
+
+	rc = db_items_datetime_index_create(db);
+	if (rc == SQLITE_OK)
+		rc = db_purge_batch_create(db);
+	if (rc == SQLITE_OK)
+		rc = db_pragma_get_int(db, "freelist_count", &purge_freelist_start);
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "purge disabled: %s\n", sqlite3_errmsg(db));
+		purge_done = true;
+	}
+
+	debug("purge items older than %s, batch %d", purge_cutoff, purge_batch);
+	return rc;
+}
+
+/* selfoss does not add items it would purge right away */
+bool purge_item_expired(struct tm *pub_tm)
+{
+	return purge_days > 0 && timegm(pub_tm) < purge_cutoff_t;
+}
+
+/* writer stage: one batch, return true if more to do */
+bool purge_step(sqlite3 *db)
+{
+	int selected, deleted = 0, rc;
+
+	if (purge_done)
+		return false;
+
+	rc = db_exec(db, "BEGIN IMMEDIATE");
+	if (rc == SQLITE_OK)
+		rc = db_purge_batch_select(db, purge_cutoff, purge_batch, &selected);
+	if (rc == SQLITE_OK)
+		rc = fts_purge_batch(db);
+	if (rc == SQLITE_OK)
+		rc = db_purge_batch_delete(db, &deleted);
+	if (rc == SQLITE_OK)
+		rc = db_exec(db, "COMMIT");
+	if (rc != SQLITE_OK)
+		errx(1, "purge failed: %s", sqlite3_errmsg(db));
+
+	stats_add(items_purged, deleted);
+	debug2("purged %d items", deleted);
+
+	if (selected < purge_batch)
+		purge_done = true;
+
+	return !purge_done;
+}
+
+/* finish remaining batches, optionally give free pages back to the fs */
+void purge_finish(sqlite3 *db, bool vacuum)
+{
+	int freelist = 0, before, auto_vacuum;
+
+	if (purge_days == 0)
+		return;
+
+	while (purge_step(db))
+		;
+
+	if (db_pragma_get_int(db, "freelist_count", &freelist) == SQLITE_OK &&
+			freelist > purge_freelist_start)
+		stats_add(pages_freed, freelist - purge_freelist_start);
+
+	if (!vacuum)
+		return;
+
+	/* 2 - INCREMENTAL, set by PRAGMA auto_vacuum + VACUUM once */
+	if (db_pragma_get_int(db, "auto_vacuum", &auto_vacuum) != SQLITE_OK ||
+			auto_vacuum != 2) {
+		fprintf(stderr, "incremental_vacuum needs auto_vacuum=INCREMENTAL, skipped\n");
+		return;
+	}
+
+	before = freelist;
+	if (db_exec(db, "PRAGMA incremental_vacuum") != SQLITE_OK)
+		fprintf(stderr, "incremental_vacuum: %s\n", sqlite3_errmsg(db));
+	else if (db_pragma_get_int(db, "freelist_count", &freelist) == SQLITE_OK &&
+			freelist < before)
+		stats_add(pages_vacuumed, before - freelist);
+}
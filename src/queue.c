@@ -0,0 +1,111 @@
+/**
+ * Selfoss RSS reader micro updater
+ *
+ *   Copyright (C) 2013 Vladimir Ermakov <vooon341@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "selfoss_mupdate.h"
+
+
+void queue_init(struct queue *q, size_t size)
+{
+	q->ring = calloc(size, sizeof(void *));
+	if (q->ring == NULL)
+		err(1, "out of memory");
+
+	q->size = size;
+	q->limit = size;
+	q->head = 0;
+	q->count = 0;
+	q->closed = false;
+
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->not_empty, NULL);
+	pthread_cond_init(&q->not_full, NULL);
+}
+
+void queue_destroy(struct queue *q)
+{
+	pthread_cond_destroy(&q->not_full);
+	pthread_cond_destroy(&q->not_empty);
+	pthread_mutex_destroy(&q->lock);
+	free(q->ring);
+	q->ring = NULL;
+}
+
+/* blocks while queue is full, return false if queue closed */
+bool queue_push(struct queue *q, void *data)
+{
+	bool ret = false;
+
+	pthread_mutex_lock(&q->lock);
+	while (q->count >= q->limit && !q->closed)
+		pthread_cond_wait(&q->not_full, &q->lock);
+
+	if (!q->closed) {
+		q->ring[(q->head + q->count) % q->size] = data;
+		q->count++;
+		ret = true;
+		pthread_cond_signal(&q->not_empty);
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return ret;
+}
+
+/* blocks while queue is empty, return NULL if closed and drained */
+void *queue_pop(struct queue *q)
+{
+	void *data = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	while (q->count == 0 && !q->closed)
+		pthread_cond_wait(&q->not_empty, &q->lock);
+
+	if (q->count > 0) {
+		data = q->ring[q->head];
+		q->head = (q->head + 1) % q->size;
+		q->count--;
+		pthread_cond_signal(&q->not_full);
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return data;
+}
+
+/* no more pushes, consumers drain remaining data */
+void queue_close(struct queue *q)
+{
+	pthread_mutex_lock(&q->lock);
+	q->closed = true;
+	pthread_cond_broadcast(&q->not_empty);
+	pthread_cond_broadcast(&q->not_full);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* capacity below the ring size, producers over it block until drained */
+void queue_set_limit(struct queue *q, size_t limit)
+{
+	if (limit < 1)
+		limit = 1;
+	if (limit > q->size)
+		limit = q->size;
+
+	pthread_mutex_lock(&q->lock);
+	q->limit = limit;
+	pthread_cond_broadcast(&q->not_full);
+	pthread_mutex_unlock(&q->lock);
+}
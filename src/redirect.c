@@ -0,0 +1,110 @@
+/**
+ * Selfoss RSS reader micro updater
+ *
+ *   Copyright (C) 2013 Vladimir Ermakov <vooon341@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "selfoss_mupdate.h"
+
+/*
+ * Permanent redirects (301, 308) of source urls.
+ *
+ * The fetch stage follows redirects itself and reports the target of the
+ * leading run of permanent hops; the writer keeps it in mupdate_redirect
+ * together with the url it was found for.  Later runs fetch the target
+ * directly while sources.params still has that url.  Every
+ * REDIRECT_REVALIDATE the chain is walked again from the url, and a
+ * failed fetch of a target drops it, so a moved-back feed is not lost.
+ */
+
+#define REDIRECT_REVALIDATE	(7 * 24 * 60 * 60)	/* sec */
+
+int redirect_init(sqlite3 *db)
+{
+	struct db_state *st = db_state_add(db);
+	int rc;
+
+	/* table exists, database writable */
+	rc = db_redirect_create(db);
+	st->redirect = (rc == SQLITE_OK);
+	if (!st->redirect)
+		fprintf(stderr, "redirects not remembered: %s\n", sqlite3_errmsg(db));
+
+	return rc;
+}
+
+/* source collection: fetch a stored target instead of src->url */
+void redirect_apply(sqlite3 *db, struct source *src)
+{
+	char *url, *target;
+	time_t checked;
+	int hops, rc;
+
+	if (!db_state(db)->redirect)
+		return;
+
+	rc = db_redirect_get(db, src->id, &url, &target, &hops, &checked);
+	if (rc == SQLITE_DONE)
+		return;
+	if (rc != SQLITE_ROW)
+		errx(1, "SQL error: %s", sqlite3_errmsg(db));
+
+	src->redirect_stored = true;
+
+	/* params edited since, or time to look again */
+	if (strcmp(url, src->url) != 0 || time(NULL) - checked >= REDIRECT_REVALIDATE) {
+		debug("source #%d: revalidating redirect to %s", src->id, target);
+		free(target);
+	}
+	else {
+		debug2("source #%d: %s moved to %s", src->id, url, target);
+		src->fetch_url = target;
+		src->redirect_hops = hops;
+		src->redirect_checked = checked;
+	}
+
+	free(url);
+}
+
+/* writer stage, inside the source transaction */
+void redirect_store(sqlite3 *db, const struct feed_job *job)
+{
+	const struct source *src = job->src;
+	int rc = SQLITE_OK;
+
+	if (!db_state(db)->redirect)
+		return;
+
+	if (job->redirect != NULL) {
+		/* from a stored target: chain grew, the url was not checked */
+		if (job->redirect_checked)
+			rc = db_redirect_set(db, src->id, src->url, job->redirect,
+					job->redirect_hops, time(NULL));
+		else
+			rc = db_redirect_set(db, src->id, src->url, job->redirect,
+					src->redirect_hops + job->redirect_hops, src->redirect_checked);
+		stats_inc(redirects_stored);
+		debug("source #%d: permanent redirect to %s", src->id, job->redirect);
+	}
+	else if ((job->redirect_checked && job->rc == 0 && src->redirect_stored) ||
+			(job->redirect_used && job->rc != 0)) {
+		rc = db_redirect_delete(db, src->id);
+		debug("source #%d: redirect forgotten", src->id);
+	}
+
+	if (rc != SQLITE_OK)
+		errx(1, "failed to update redirect of source %d: %s", src->id, sqlite3_errmsg(db));
+}
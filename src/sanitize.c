@@ -18,20 +18,24 @@
  */
 
 #include "selfoss_mupdate.h"
+#include <malloc.h>
 #include "tidy.h"
 #include "buffio.h"
+#include "entities.h"
 
 /* -*- tidy internal data manipulation. be carefull -*- */
 #include "tidy-int.h"
 
 /* -*- private -*- */
 
-static int configure_tidy(TidyDoc tdoc, TidyBuffer *out, TidyBuffer *err)
+static int configure_tidy(TidyDoc tdoc, TidyBuffer *out, TidyBuffer *err,
+		TidyAllocator *allocator)
 {
 	int rc;
 
-	tidyBufInit(out);
-	tidyBufInit(err);
+	/* NULL - default allocator */
+	tidyBufInitWithAllocator(out, allocator);
+	tidyBufInitWithAllocator(err, allocator);
 
 	rc = tidyOptSetBool(tdoc, TidyXhtmlOut, yes);
 	if (rc >= 0)
@@ -89,72 +93,22 @@ static void dump_node(TidyNode tnod, int indent)
 	}
 }
 
-static inline bool is_acceptable_content_tag(TidyTagId tid)
-{
-	/* tag list defined at selfoss/helpers/ContentLoader.php 179
-	 * in function sanitizeContent() */
-	return (
-			tid == TidyTag_DIV	||
-			tid == TidyTag_P	||
-			tid == TidyTag_UL	||
-			tid == TidyTag_LI	||
-			tid == TidyTag_A	||
-			tid == TidyTag_IMG	||
-			tid == TidyTag_DL	||
-			tid == TidyTag_DT	||
-			tid == TidyTag_H1	||
-			tid == TidyTag_H2	||
-			tid == TidyTag_H3	||
-			tid == TidyTag_H4	||
-			tid == TidyTag_H5	||
-			tid == TidyTag_H6	||
-			tid == TidyTag_OL	||
-			tid == TidyTag_BR	||
-			tid == TidyTag_TABLE	||
-			tid == TidyTag_TR	||
-			tid == TidyTag_TD	||
-			tid == TidyTag_BLOCKQUOTE	||
-			tid == TidyTag_PRE	||
-			tid == TidyTag_INS	||
-			tid == TidyTag_DEL	||
-			tid == TidyTag_TH	||
-			tid == TidyTag_THEAD	||
-			tid == TidyTag_TBODY	||
-			tid == TidyTag_B	||
-			tid == TidyTag_I	||
-			tid == TidyTag_STRONG	||
-			tid == TidyTag_EM	||
-			tid == TidyTag_TT
-	       );
-}
-
-static inline bool is_acceptable_content_attr(AttVal *attr)
-{
-	/* attrib list defined at selfoss/helpers/ContentLoader.php 175
-	 * in function sanitizeContent() */
-	return (
-			attrIsALT(attr)		||
-			attrIsTITLE(attr)	||
-			attrIsSRC(attr)		||
-			attrIsNAME(attr)	||
-			attrIsREL(attr)	||
-			attrIsHREF(attr)
-	       );
-}
-
-static void sanitize_attributes(TidyDocImpl* doc, Node* node)
+static void sanitize_attributes(TidyDocImpl* doc, Node* node, int tag)
 {
 	AttVal *attr, *next, *prev = NULL;
-	bool bad_href = false;
+	bool bad_value = false;
+	int pa;
 
 	for (attr = node->attributes; attr; attr = next) {
 		next = attr->next;
 
+		pa = policy_attr(tag, tidyAttrGetId(tidyImplToAttr(attr)),
+				tidyAttrName(tidyImplToAttr(attr)));
+
 		/* deny href="javascript: alert('powned')" */
-		bad_href = ( attrIsHREF(attr) && attr->value &&
-				!strncmp("javascript", attr->value , 10) );
+		bad_value = (pa >= 0 && !policy_value_ok(pa, attr->value));
 
-		if (bad_href || !is_acceptable_content_attr(attr) ) {
+		if (pa < 0 || bad_value) {
 			if (prev)
 				prev->next = next;
 			else
@@ -163,7 +117,7 @@ static void sanitize_attributes(TidyDocImpl* doc, Node* node)
 			debug2("drop %s attr %s%s",
 					tidyNodeGetName(tidyImplToNode(node)),
 					tidyAttrName(tidyImplToAttr(attr)),
-					(bad_href) ? " [bad proto]" : "");
+					(bad_value) ? " [bad proto]" : "");
 
 			TY_(FreeAttribute)(doc, attr);
 		}
@@ -177,6 +131,7 @@ static void walk_and_remove(TidyDoc tdoc, TidyNode tnod)
 	TidyNode child, next_child;
 	TidyTagId tid;
 	TidyNodeType nt;
+	int tag;
 
 	for (child = tidyGetChild(tnod);
 			child;
@@ -191,7 +146,8 @@ static void walk_and_remove(TidyDoc tdoc, TidyNode tnod)
 			Node *np = tidyNodeToImpl(child);
 
 			tid = tidyNodeGetId(child);
-			if (!is_acceptable_content_tag(tid)) {
+			tag = policy_tag(tid, tidyNodeGetName(child));
+			if (tag < 0) {
 				/* remove subtree */
 				debug2("drop node %s", tidyNodeGetName(child));
 
@@ -208,7 +164,7 @@ static void walk_and_remove(TidyDoc tdoc, TidyNode tnod)
 			}
 			else {
 				/* acceptable tag, now remove bad attributes */
-				sanitize_attributes(tidyDocToImpl(tdoc), np);
+				sanitize_attributes(tidyDocToImpl(tdoc), np, tag);
 			}
 		}
 
@@ -222,13 +178,13 @@ static int sanitize_nodes(TidyDoc tdoc)
 	TidyNode body = tidyGetBody(tdoc);
 
 	debug3("before:\n----------------------------------------");
-	if (__debug_level > 2) dump_node(body, 0);
+	if (log_enabled(3)) dump_node(body, 0);
 	debug3("----------------------------------------");
 
 	walk_and_remove(tdoc, body);
 
 	debug3("after:\n----------------------------------------");
-	if (__debug_level > 2) dump_node(body, 0);
+	if (log_enabled(3)) dump_node(body, 0);
 	debug3("----------------------------------------");
 
 	return 0;
@@ -297,7 +253,9 @@ void sanitize_text_only(char **field)
 	*field = ob;
 }
 
-int sanitize_content(char **content)
+static bool sanitize_native;
+
+static int tidy_sanitize(char **content, TidyAllocator *allocator)
 {
 	int rc;
 	TidyDoc tdoc;
@@ -305,8 +263,8 @@ int sanitize_content(char **content)
 	TidyBuffer outbuf;
 
 	/* tidy doc */
-	tdoc = tidyCreate();
-	rc = configure_tidy(tdoc, &outbuf, &errbuf);
+	tdoc = (allocator != NULL) ? tidyCreateWithAllocator(allocator) : tidyCreate();
+	rc = configure_tidy(tdoc, &outbuf, &errbuf, allocator);
 	if (rc >= 0)
 		rc = tidyParseString(tdoc, *content);
 	if (rc >= 0)
@@ -354,3 +312,537 @@ int sanitize_content(char **content)
 	return rc;
 }
 
+/* --sanitizer: tidy (default) or native, see htmlsan.c */
+int sanitize_select(const char *engine)
+{
+	if (strcmp(engine, "tidy") == 0)
+		sanitize_native = false;
+	else if (strcmp(engine, "native") == 0)
+		sanitize_native = true;
+	else
+		return -1;
+
+	return 0;
+}
+
+const char *sanitize_engine(void)
+{
+	return (sanitize_native) ? "native" : "tidy";
+}
+
+int sanitize_content(char **content)
+{
+	if (sanitize_native)
+		return htmlsan_content(content);
+
+	return tidy_sanitize(content, NULL);
+}
+
+/* -*- benchmark -*- */
+
+/* corpus file: HTML documents separated by NUL bytes */
+struct corpus {
+	char **docs;
+	size_t n;
+	size_t bytes;
+};
+
+static int corpus_load(const char *path, struct corpus *c)
+{
+	FILE *in;
+	char *doc = NULL;
+	size_t doc_sz = 0, allocated = 0;
+	ssize_t n;
+
+	memset(c, 0, sizeof(*c));
+
+	in = fopen(path, "r");
+	if (in == NULL) {
+		warn("%s", path);
+		return -1;
+	}
+
+	while ((n = getdelim(&doc, &doc_sz, '\0', in)) > 0) {
+		if (doc[0] == '\0')
+			continue;
+
+		if (c->n == allocated) {
+			allocated = (allocated) ? allocated * 2 : 256;
+			c->docs = realloc(c->docs, allocated * sizeof(*c->docs));
+			if (c->docs == NULL)
+				err(1, "out of memory");
+		}
+		c->docs[c->n] = strdup(doc);
+		if (c->docs[c->n] == NULL)
+			err(1, "out of memory");
+		c->bytes += strlen(doc);
+		c->n++;
+	}
+
+	free(doc);
+	fclose(in);
+
+	if (c->n == 0) {
+		warnx("%s: no documents", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void corpus_free(struct corpus *c)
+{
+	size_t i;
+
+	for (i = 0; i < c->n; i++)
+		free(c->docs[i]);
+	free(c->docs);
+}
+
+/* tidy allocator counting live heap bytes */
+struct count_allocator {
+	TidyAllocator base;	/* first, tidy passes &base back */
+	size_t cur, peak;
+};
+
+static void count_add(struct count_allocator *ca, void *block)
+{
+	ca->cur += malloc_usable_size(block);
+	if (ca->cur > ca->peak)
+		ca->peak = ca->cur;
+}
+
+static void *count_alloc(TidyAllocator *self, size_t n)
+{
+	void *block = malloc(n);
+
+	if (block == NULL)
+		err(1, "out of memory");
+	count_add((struct count_allocator *) self, block);
+	return block;
+}
+
+static void *count_realloc(TidyAllocator *self, void *block, size_t n)
+{
+	struct count_allocator *ca = (struct count_allocator *) self;
+
+	if (block != NULL)
+		ca->cur -= malloc_usable_size(block);
+	block = realloc(block, n);
+	if (block == NULL)
+		err(1, "out of memory");
+	count_add(ca, block);
+	return block;
+}
+
+static void count_free(TidyAllocator *self, void *block)
+{
+	if (block != NULL)
+		((struct count_allocator *) self)->cur -= malloc_usable_size(block);
+	free(block);
+}
+
+static void count_panic(TidyAllocator *self, ctmbstr msg)
+{
+	errx(1, "tidy: %s", msg);
+}
+
+static const TidyAllocatorVtbl count_vtbl = {
+	count_alloc,
+	count_realloc,
+	count_free,
+	count_panic
+};
+
+static double bench_elapsed(const struct timespec *t0)
+{
+	struct timespec t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+/* walk_and_remove() alone: the tree is modified, parse for every round */
+static int bench_walk(const struct corpus *c, FILE *fl)
+{
+	struct timespec t0, t_walk;
+	TidyBuffer errbuf, outbuf;
+	TidyDoc tdoc;
+	double walk_sec = 0;
+	long rounds;
+	size_t i;
+	int rc = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (rounds = 0; rounds == 0 || bench_elapsed(&t0) < 1.0; rounds++) {
+		for (i = 0; i < c->n && rc == 0; i++) {
+			tdoc = tidyCreate();
+			if (configure_tidy(tdoc, &outbuf, &errbuf, NULL) >= 0 &&
+					tidyParseString(tdoc, c->docs[i]) >= 0 &&
+					tidyCleanAndRepair(tdoc) >= 0) {
+				clock_gettime(CLOCK_MONOTONIC, &t_walk);
+				walk_and_remove(tdoc, tidyGetBody(tdoc));
+				walk_sec += bench_elapsed(&t_walk);
+			}
+			else {
+				warnx("document %zu: tidy failed", i);
+				rc = -1;
+			}
+
+			tidyBufFree(&errbuf);
+			tidyBufFree(&outbuf);
+			tidyRelease(tdoc);
+		}
+		if (rc < 0)
+			return rc;
+	}
+
+	fprintf(fl, "walk_and_remove:\t%.1f us/doc, %.1f MB/s\n",
+			walk_sec * 1e6 / (rounds * c->n), c->bytes * rounds / walk_sec / 1e6);
+	return 0;
+}
+
+static void bench_engine(const struct corpus *c, bool native, FILE *fl)
+{
+	struct count_allocator ca = { { &count_vtbl }, 0, 0 };
+	struct timespec t0;
+	size_t i, peak = 0, mem;
+	double sec = 0;
+	long rounds;
+	char *doc;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (rounds = 0; rounds == 0 || (sec = bench_elapsed(&t0)) < 1.0; rounds++) {
+		for (i = 0; i < c->n; i++) {
+			if (native) {
+				free(htmlsan(c->docs[i], strlen(c->docs[i]), NULL, NULL));
+				continue;
+			}
+			doc = strdup(c->docs[i]);
+			tidy_sanitize(&doc, NULL);
+			free(doc);
+		}
+	}
+
+	/* separate round, counting costs time */
+	for (i = 0; i < c->n; i++) {
+		if (native) {
+			free(htmlsan(c->docs[i], strlen(c->docs[i]), NULL, &mem));
+		}
+		else {
+			ca.cur = ca.peak = 0;
+			doc = strdup(c->docs[i]);
+			tidy_sanitize(&doc, &ca.base);
+			free(doc);
+			mem = ca.peak;
+		}
+		if (mem > peak)
+			peak = mem;
+	}
+
+	fprintf(fl, "%s:\t\t\t%.1f MB/s, peak %zu KiB per document\n",
+			(native) ? "native" : "tidy",
+			c->bytes * rounds / sec / 1e6, (peak + 1023) / 1024);
+}
+
+/* --sanitize-bench: walk_and_remove() alone, then both sanitizers */
+int sanitize_bench(const char *path, FILE *fl)
+{
+	struct corpus c;
+	int rc;
+
+	if (corpus_load(path, &c) < 0)
+		return -1;
+
+	fprintf(fl, "corpus:\t\t\t%zu documents, %zu bytes\n", c.n, c.bytes);
+
+	rc = bench_walk(&c, fl);
+	if (rc == 0) {
+		bench_engine(&c, false, fl);
+		bench_engine(&c, true, fl);
+	}
+
+	corpus_free(&c);
+	return rc;
+}
+
+/* comparable text: entities decoded, comments dropped, whitespace
+ * collapsed and dropped next to tags (tidy wraps and indents) */
+static char *diff_normalize(const char *html)
+{
+	char *decoded, *out, *rdp, *wrp;
+	bool space = false;
+
+	decoded = malloc(strlen(html) + 1);
+	if (decoded == NULL)
+		err(1, "out of memory");
+	decode_html_entities_utf8(decoded, html);
+
+	out = wrp = decoded;
+	for (rdp = decoded; *rdp; rdp++) {
+		if (strncmp(rdp, "<!--", 4) == 0) {
+			char *end = strstr(rdp + 4, "-->");
+
+			if (end == NULL)
+				break;
+			rdp = end + 2;
+			continue;
+		}
+
+		if (*rdp == ' ' || *rdp == '\t' || *rdp == '\n' || *rdp == '\r') {
+			space = true;
+			continue;
+		}
+
+		if (space && wrp > out && *rdp != '<' && wrp[-1] != '>')
+			*wrp++ = ' ';
+		space = false;
+		*wrp++ = *rdp;
+	}
+	*wrp = '\0';
+
+	return out;
+}
+
+/* --sanitize-diff: tidy and native output of every corpus document */
+int sanitize_diff(const char *path, FILE *fl)
+{
+	struct corpus c;
+	size_t i, same = 0, differ = 0, failed = 0;
+	char *tidy_out, *native_out, *a, *b;
+
+	if (corpus_load(path, &c) < 0)
+		return -1;
+
+	for (i = 0; i < c.n; i++) {
+		tidy_out = strdup(c.docs[i]);
+		if (tidy_out == NULL)
+			err(1, "out of memory");
+		if (tidy_sanitize(&tidy_out, NULL) < 0) {
+			failed++;
+			free(tidy_out);
+			continue;
+		}
+		native_out = htmlsan(c.docs[i], strlen(c.docs[i]), NULL, NULL);
+
+		a = diff_normalize(tidy_out);
+		b = diff_normalize(native_out);
+		if (strcmp(a, b) == 0)
+			same++;
+		else if (differ++ < 10)
+			fprintf(fl, "document %zu differs:\n  input:  %s\n  tidy:   %s\n  native: %s\n",
+					i, c.docs[i], a, b);
+
+		free(a);
+		free(b);
+		free(tidy_out);
+		free(native_out);
+	}
+
+	fprintf(fl, "%zu documents: %zu same, %zu differ, %zu failed in tidy\n",
+			c.n, same, differ, failed);
+
+	corpus_free(&c);
+	return 0;
+}
+
+/* -*- policy self-check -*- */
+
+/* lists of selfoss/helpers/ContentLoader.php sanitizeContent(), as they
+ * were hard-coded here before the policy */
+static const TidyTagId legacy_tags[] = {
+	TidyTag_DIV, TidyTag_P, TidyTag_UL, TidyTag_LI, TidyTag_A, TidyTag_IMG,
+	TidyTag_DL, TidyTag_DT, TidyTag_H1, TidyTag_H2, TidyTag_H3, TidyTag_H4,
+	TidyTag_H5, TidyTag_H6, TidyTag_OL, TidyTag_BR, TidyTag_TABLE, TidyTag_TR,
+	TidyTag_TD, TidyTag_BLOCKQUOTE, TidyTag_PRE, TidyTag_INS, TidyTag_DEL,
+	TidyTag_TH, TidyTag_THEAD, TidyTag_TBODY, TidyTag_B, TidyTag_I,
+	TidyTag_STRONG, TidyTag_EM, TidyTag_TT
+};
+
+static const struct {
+	TidyAttrId id;
+	const char *name;
+} legacy_attrs[] = {
+	{ TidyAttr_ALT,		"alt" },
+	{ TidyAttr_TITLE,	"title" },
+	{ TidyAttr_SRC,		"src" },
+	{ TidyAttr_NAME,	"name" },
+	{ TidyAttr_REL,		"rel" },
+	{ TidyAttr_HREF,	"href" },
+};
+
+/* javascript: to a browser, missed by the old case-sensitive strncmp() */
+static const char *check_drops[] = {
+	"JavaScript:alert(1)", " javascript:alert(1)", "java\tscript:alert(1)",
+	"java\nscript:alert(1)", "\rjavascript:alert(1)", "\x01JAVASCRIPT:alert(1)",
+	"jav\r\nascript:alert(1)",
+	NULL
+};
+
+static const char *check_values[] = {
+	"javascript:alert(1)", "javascript", "javascriptfoo", "vbscript:x",
+	"data:text/html,x", "http://example.com/", "https://example.com/",
+	"//example.com/", "/relative", "mailto:a@example.com", "",
+	NULL
+};
+
+#define N_ELEMS(a)	(sizeof(a) / sizeof((a)[0]))
+
+static bool legacy_tag(TidyTagId tid)
+{
+	size_t i;
+
+	for (i = 0; i < N_ELEMS(legacy_tags); i++)
+		if (legacy_tags[i] == tid)
+			return true;
+
+	return false;
+}
+
+static bool legacy_attr(TidyAttrId aid)
+{
+	size_t i;
+
+	for (i = 0; i < N_ELEMS(legacy_attrs); i++)
+		if (legacy_attrs[i].id == aid)
+			return true;
+
+	return false;
+}
+
+static bool legacy_value_ok(TidyAttrId aid, const char *value)
+{
+	int k;
+
+	for (k = 0; check_drops[k] != NULL; k++)
+		if (aid == TidyAttr_HREF && strcmp(value, check_drops[k]) == 0)
+			return false;
+
+	return !(aid == TidyAttr_HREF && !strncmp("javascript", value, 10));
+}
+
+/* 1 if the policy decides otherwise than expected */
+static int check_value(FILE *fl, TidyAttrId aid, const char *name, const char *tag,
+		int attr, const char *value)
+{
+	bool ok = policy_value_ok(attr, value);
+
+	if (ok == legacy_value_ok(aid, value))
+		return 0;
+
+	fprintf(fl, "%s=\"%s\" on %s: %s by the policy only\n", name, value, tag,
+			(ok) ? "kept" : "dropped");
+	return 1;
+}
+
+/* id tidy gives an attribute of this name, TidyAttr_UNKNOWN if none */
+static TidyAttrId probe_attr_id(const char *name)
+{
+	TidyBuffer errbuf;
+	TidyDoc tdoc;
+	TidyNode node;
+	TidyAttr attr;
+	TidyAttrId aid = TidyAttr_UNKNOWN;
+	char *html;
+
+	if (asprintf(&html, "<p %s=\"x\">x</p>", name) < 0)
+		err(1, "out of memory");
+
+	tdoc = tidyCreate();
+	tidyBufInit(&errbuf);
+	tidySetErrorBuffer(tdoc, &errbuf);
+
+	if (tidyParseString(tdoc, html) >= 0 &&
+			(node = tidyGetChild(tidyGetBody(tdoc))) != NULL)
+		for (attr = tidyAttrFirst(node); attr != NULL; attr = tidyAttrNext(attr))
+			if (strcasecmp(tidyAttrName(attr), name) == 0)
+				aid = tidyAttrGetId(attr);
+
+	tidyBufFree(&errbuf);
+	tidyRelease(tdoc);
+	free(html);
+	return aid;
+}
+
+/*
+ * --sanitize-policy-check: the loaded policy against the legacy lists.
+ * Every tag id tidy knows, every attribute of the legacy list and of the
+ * policy on every allowed tag, and sample values of each allowed
+ * attribute.  Attribute names tidy does not know are never allowed,
+ * with or without the policy.
+ */
+int sanitize_policy_check(FILE *fl)
+{
+	struct { TidyAttrId id; const char *name; } cand[N_ELEMS(legacy_attrs) + 64];
+	size_t n_cand = 0, i, j, k;
+	int n_tags = 0, n_values = 0, n_diff = 0;
+	int tag, a;
+	const Dict *def;
+	TidyTagId tid;
+	bool old_ok, new_ok;
+
+	for (tid = 1; tid < N_TIDY_TAGS; tid++) {
+		def = TY_(LookupTagDef)(tid);
+		if (def == NULL || def->name == NULL)
+			continue;
+
+		n_tags++;
+		old_ok = legacy_tag(tid);
+		new_ok = policy_tag(tid, def->name) >= 0;
+		if (old_ok != new_ok) {
+			fprintf(fl, "tag %s: %s by the policy only\n", def->name,
+					(new_ok) ? "allowed" : "dropped");
+			n_diff++;
+		}
+	}
+
+	for (i = 0; i < N_ELEMS(legacy_attrs); i++) {
+		if (probe_attr_id(legacy_attrs[i].name) != legacy_attrs[i].id)
+			errx(1, "policy check: tidy does not know attribute %s", legacy_attrs[i].name);
+		cand[n_cand].id = legacy_attrs[i].id;
+		cand[n_cand++].name = legacy_attrs[i].name;
+	}
+	for (a = 0; a < policy_attr_count() && n_cand < N_ELEMS(cand); a++) {
+		cand[n_cand].id = probe_attr_id(policy_attr_name(a));
+		cand[n_cand].name = policy_attr_name(a);
+		if (cand[n_cand].id == TidyAttr_UNKNOWN)
+			continue;
+		for (j = 0; j < n_cand; j++)
+			if (cand[j].id == cand[n_cand].id)
+				break;
+		if (j == n_cand)
+			n_cand++;
+	}
+
+	for (i = 0; i < N_ELEMS(legacy_tags); i++) {
+		def = TY_(LookupTagDef)(legacy_tags[i]);
+		tag = policy_tag(legacy_tags[i], def->name);
+		if (tag < 0)
+			continue;	/* reported above */
+
+		for (j = 0; j < n_cand; j++) {
+			old_ok = legacy_attr(cand[j].id);
+			a = policy_attr(tag, cand[j].id, cand[j].name);
+			if (old_ok != (a >= 0)) {
+				fprintf(fl, "attribute %s on %s: %s by the policy only\n",
+						cand[j].name, def->name, (a >= 0) ? "allowed" : "dropped");
+				n_diff++;
+				continue;
+			}
+			if (a < 0)
+				continue;
+
+			for (k = 0; check_values[k] != NULL; k++, n_values++)
+				n_diff += check_value(fl, cand[j].id, cand[j].name, def->name,
+						a, check_values[k]);
+			for (k = 0; check_drops[k] != NULL; k++, n_values++)
+				n_diff += check_value(fl, cand[j].id, cand[j].name, def->name,
+						a, check_drops[k]);
+		}
+	}
+
+	fprintf(fl, "policy check: %d tags, %zu attributes, %d values compared, %d differences\n",
+			n_tags, n_cand, n_values, n_diff);
+
+	return (n_diff == 0) ? 0 : -1;
+}
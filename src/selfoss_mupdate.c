@@ -18,329 +18,447 @@
  */
 
 #include "selfoss_mupdate.h"
-#include <iconv.h>
+#include <limits.h>
 #include <unistd.h>
-
-#include <json/json.h>
+#include <getopt.h>
+#include <curl/curl.h>
 
 #include "nxml.h"
 #include "mrss.h"
 #include "tidy.h"
-#include "bb_md5_sha.h"
-#include "entities.h"
 
 
-#define PROGNAME		"selfoss_mupdate"
-#define SELFOSS_VERSION		"2.7"
-#define MY_VERSION		"0.1"
+#define DEFAULT_CACHE_SIZE	(8 << 20)	/* bytes */
+#define DEFAULT_CONNECT_TIMEOUT	15		/* sec */
+#define DEFAULT_LOW_SPEED_TIME	30		/* sec */
+#define DEFAULT_LEASE_TIME	1800		/* sec */
+#define DEFAULT_PURGE_BATCH	500		/* items per transaction */
+#define DEFAULT_INTERVAL	900		/* sec, resident scheduled pass */
+#define DEFAULT_NEAR_DUP_DISTANCE	3	/* SimHash bits */
+
+/* curl state kept in <data dir>/cache */
+#define HSTS_FILE		"mupdate-hsts.txt"
+#define ALTSVC_FILE		"mupdate-altsvc.txt"
 
-int __debug_level = 0;
+/* -*- Update -*- */
 
-#define IDSIZE			255
-#define SPOUT0			"spouts\\rss\\feed"
+/* open read-write handle, prepare updater side tables */
+static sqlite3 *database_open(const char *path, int shard_k, int shard_n,
+		time_t lease_time, sqlite3_int64 cache_size, bool fts, bool counters)
+{
+	sqlite3 *db;
+	int rc;
 
-/* -*- content preparation -*- */
+	rc = sqlite3_open(path, &db);
+	if (rc) {
+		fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(db));
+		sqlite3_close(db);
+		return NULL;
+	}
 
-/* nxml internal, modifies tmp, return new str  */
-char *__nxml_trim(char *);
+	sqlite3_busy_timeout(db, 10000);
 
-static void trim_replace(char **field)
+	rc = db_source_state_create(db);
+	if (rc != SQLITE_OK)
+		errx(1, "SQL error: %s %d", sqlite3_errmsg(db), rc);
+
+	lease_init(db, shard_k, shard_n, lease_time);
+	redirect_init(db);
+	cache_init(db, cache_size);
+	fts_init(db, fts);
+	counters_init(db, counters);
+
+	return db;
+}
+
+/* fetch host of --emit-spool: sources and early duplicate check only */
+static sqlite3 *database_open_readonly(const char *path)
 {
-	char *p;
-	if (!(field && *field)) return;
-	p = __nxml_trim(*field);
-	free(*field);
-	*field = p;
+	sqlite3 *db;
+	int rc;
+
+	rc = sqlite3_open_v2(path, &db, SQLITE_OPEN_READONLY, NULL);
+	if (rc) {
+		fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(db));
+		sqlite3_close(db);
+		return NULL;
+	}
+
+	sqlite3_busy_timeout(db, 10000);
+	return db;
 }
 
-static void iconv_replace(iconv_t cd, char **field)
+/* sources to update now; with spout_report only print them */
+static size_t sources_collect(sqlite3 *db, bool single_source, int source_id,
+		char **feed_url, bool spout_report, struct source **list)
 {
-	char *in, *out, *buf;
-	size_t in_sz, out_sz;
-	size_t _in_sz, _out_sz, ret_sz;
+	sqlite3_stmt *stmt;
+	size_t n = 0, allocated = 0;
+	char *url;
+	int rc;
 
-	if (cd == (iconv_t) -1 || *field == NULL)
-		return;
+	if (single_source)
+		rc = db_source_get_stmt(db, source_id, &stmt);
+	else
+		rc = db_source_get_all_by_lastupdate_stmt(db, &stmt);
+	if (rc != SQLITE_OK)
+		errx(1, "SQL error: %s %d", sqlite3_errmsg(db), rc);
+
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		struct source src;
 
-	in_sz = _in_sz = strlen(*field);
+		if (source_load(db, stmt, &src) != SQLITE_OK)
+			errx(1, "SQL error: %s", sqlite3_errmsg(db));
 
-	/* NOTE: optimization for cp1251/koi8-r -> utf-8 */
-	out_sz = _out_sz = in_sz * 2;
+		debug("source #%d title: %s tags: %s spout: %s param: %s erorr: %s",
+				src.id, src.title, src.tags, src.spout, src.params, src.error);
 
-	if ((buf = calloc(out_sz, 1)) == NULL)
-		err(1, "out of memory\n");
+		if (spout_report) {
+			fprintf(stdout, "#%d\t%s\t%s\t%s\n", src.id,
+					(src.handler) ? "native" : "php", src.spout, src.title);
+			source_free(&src);
+			continue;
+		}
 
-	in = *field;
-	out = buf;
+		if (src.handler == NULL) {
+			debug("unsupported spout, skipped");
+			stats_inc(sources_php);
+			source_free(&src);
+			continue;
+		}
 
-	ret_sz = iconv(cd, &in, &_in_sz, &out, &_out_sz);
-	if (ret_sz == -1) {
-		if (errno == E2BIG) {
-			debug("E2BIG. in_sz=%zu", _in_sz);
+		if (!lease_wanted(db, src.id)) {
+			debug("source #%d belongs to other shard, skipped", src.id);
+			source_free(&src);
+			continue;
 		}
 
-		err(1, "iconv()");
-	}
+		if (archive_replaying() && !archive_replay_has(src.id)) {
+			debug("source #%d not in archive, skipped", src.id);
+			source_free(&src);
+			continue;
+		}
 
-	free(*field);
-	*field = buf;
-}
+		/* explicit -s and replay ignore backoff */
+		if (!single_source && !archive_replaying() && src.next_attempt > time(NULL)) {
+			debug("source #%d: %d failures, in backoff, skipped", src.id, src.failures);
+			stats_inc(sources_backoff);
+			source_free(&src);
+			continue;
+		}
 
-/* -*- Feed process -*- */
+		if (feed_url != NULL && *feed_url != NULL) {
+			url = *feed_url;
+			*feed_url = NULL;
+		}
+		else
+			url = spout_get_url(src.handler, src.params);
+		if (url == NULL) {
+			fprintf(stderr, "source #%d: no url or bad json, skipped\n", src.id);
+			source_free(&src);
+			continue;
+		}
 
-static size_t simplepie_get_id(mrss_t *rss, mrss_item_t *item, char *buf, size_t sz)
-{
-	if (item->guid != NULL) {
-		strncpy(buf, item->guid, sz - 1);
-		debug2("choose guid%s: %s", (item->guid_isPermaLink) ? " [permalink]" : "", item->guid);
-	}
-	else if (item->link != NULL) {
-		strncpy(buf, item->link, sz - 1);
-		debug2("choose link: %s", item->link);
-	}
-	else if (item->enclosure_url != NULL) {
-		strncpy(buf, item->enclosure_url, sz - 1);
-		debug2("choose encloseure url: %s", item->enclosure_url);
-	}
-	else if (item->title != NULL) {
-		strncpy(buf, item->title, sz - 1);
-		debug2("choose title: %s", item->title);
-	}
-	else {
-		fprintf(stderr, "%s BUG\n", __func__);
-		return 0;
+		/* list takes ownership of url */
+		src.url = url;
+		redirect_apply(db, &src);
+		source_list_add(list, &n, &allocated, &src);
+		/* db_source_get_stmt return one row, no break */
 	}
 
-	return strnlen(buf, sz);
+	sqlite3_finalize(stmt);
+
+	if (rc != SQLITE_DONE)
+		errx(1, "SQL error: %s %d", sqlite3_errmsg(db), rc);
+
+	return n;
 }
 
-static size_t selfoss_getId(mrss_t *rss, mrss_item_t *item, char *buf_256)
+/* per pass maintenance options */
+struct pass_options {
+	int items_lifetime;		/* days, 0 - no purge */
+	bool incremental_vacuum;
+	int link_dedup_days;		/* 0 - no link dedup */
+	bool link_dedup_read;
+	int near_dup_days;		/* 0 - no near-duplicate filter */
+	int near_dup_distance;		/* bits */
+	bool journal;			/* record progress in mupdate_run */
+};
+
+/* claim, order and update collected sources, then retention */
+static int update_pass(sqlite3 *db, const char *db_path,
+		struct source *sources, size_t *n_sources,
+		const struct pipeline_options *pl_opts,
+		const struct pass_options *pass)
 {
-	char sp_buf[4096];
-	size_t sz;
-
-	sz = simplepie_get_id(rss, item, sp_buf, sizeof(sp_buf));
-	if (sz > IDSIZE) {
-		md5_ctx_t ctx;
-		char digest[16];
-
-		md5_begin(&ctx);
-		md5_hash(&ctx, sp_buf, sz);
-		md5_end(&ctx, &digest);
-
-		sz = snprintf(buf_256, IDSIZE + 1,
-				"%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x",
-				digest[0], digest[1], digest[2], digest[3],
-				digest[4], digest[5], digest[6], digest[7],
-				digest[8], digest[9], digest[10], digest[11],
-				digest[12], digest[13], digest[14], digest[15]);
+	int fetch_rc = 1;
+
+	/* a spool emitting fetch host does not write the database */
+	if (!spool_emitting()) {
+		purge_init(db, pass->items_lifetime, DEFAULT_PURGE_BATCH);
+		simhash_init(db, pass->near_dup_days, pass->near_dup_distance);
 	}
-	else {
-		memcpy(buf_256, sp_buf, sz);
-		buf_256[sz] = '\0';
+	linkdup_init(db, pass->link_dedup_days, pass->link_dedup_read);
+
+	if (lease_active())
+		*n_sources = source_list_claim(db, sources, *n_sources);
+
+	source_list_sort(sources, *n_sources);
+
+	if (pass->journal) {
+		journal_resume(db, sources, n_sources);
+		journal_begin(db, sources, *n_sources);
 	}
 
-	debug("sz=%zu, id: %s", sz, buf_256);
+	if (*n_sources > 0)
+		fetch_rc = pipeline_run(db, db_path, sources, *n_sources, pl_opts);
 
-	return sz;
+	if (pass->journal)
+		journal_end(db);
+
+	purge_finish(db, pass->incremental_vacuum);
+
+	return fetch_rc;
 }
 
-static int fetch_feed(sqlite3 *db, int source_id, char *feed_url)
+/* items spooled by fetch hosts, then retention */
+static int ingest_pass(sqlite3 *db, const char *path, const struct pass_options *pass)
 {
-	mrss_t *rssdata;
-	mrss_error_t mret;
-	mrss_item_t *rssitem;
-	CURLcode ccode;
-	iconv_t iconv_cd;
-	time_t item_time;
-	struct tm item_tm;
-	size_t n;
 	int rc;
 
-	if (!strncmp(feed_url, "http://", 7) || !strncmp(feed_url, "https://", 8))
-		mret = mrss_parse_url_with_options_and_error(feed_url, &rssdata, NULL, &ccode);
-	else
-		mret = mrss_parse_file(feed_url, &rssdata);
+	purge_init(db, pass->items_lifetime, DEFAULT_PURGE_BATCH);
+	simhash_init(db, pass->near_dup_days, pass->near_dup_distance);
 
-	if (mret) {
-		fprintf(stderr, "MRSS Error: %s\n",
-			(mret == MRSS_ERR_DOWNLOAD) ?
-				mrss_curl_strerror(ccode) :
-				mrss_strerror(mret));
-		return 1;
-	}
+	rc = spool_ingest(db, path);
 
-	if (rssdata->encoding != NULL && \
-			strcasecmp(rssdata->encoding, "utf-8") != 0) {
+	purge_finish(db, pass->incremental_vacuum);
 
-		iconv_cd = iconv_open("utf-8", rssdata->encoding);
-		if (iconv_cd == (iconv_t) -1) {
-			fprintf(stderr, "iconv_open(utf-8, %s): %s\n",
-				rssdata->encoding, strerror(errno));
-			return 1;
-		}
+	return rc;
+}
 
-		debug("Iconv hack enabled");
+/* --tenants: every database in the list file, shared feeds fetched once */
+static int tenants_pass(const char *list_path, time_t lease_time, bool fts, bool counters,
+		const struct pipeline_options *pl_opts, const struct pass_options *pass)
+{
+	char line[PATH_MAX], *path;
+	struct source *sources;
+	size_t i, n_sources;
+	sqlite3 *db, *rdb;
+	int lock_fd, fetch_rc = 1;
+	FILE *fl;
+
+	fl = fopen(list_path, "re");
+	if (fl == NULL) {
+		warn("%s", list_path);
+		return 1;
 	}
-	else
-		iconv_cd = (iconv_t) -1;
-
-	iconv_replace(iconv_cd, &rssdata->title);
-	iconv_replace(iconv_cd, &rssdata->description);
-	iconv_replace(iconv_cd, &rssdata->link);
-	iconv_replace(iconv_cd, &rssdata->image_title);
-	iconv_replace(iconv_cd, &rssdata->image_url);
-	iconv_replace(iconv_cd, &rssdata->image_link);
-	iconv_replace(iconv_cd, &rssdata->image_description);
-
-	item_time = time(NULL);
-	item_tm = *gmtime(&item_time);
-	if (rssdata->pubDate != NULL)
-		strptime(rssdata->pubDate, "%a, %d %b %Y %H:%M:%S %z", &item_tm);
-
-	debug ("Generic:");
-	debug ("\tfile url: %s", rssdata->file);
-	debug ("\tencoding: %s", rssdata->encoding);
-	debug2("\tsize: %zu", rssdata->size);
-	debug2("\ttype: %d", rssdata->version);
-	debug ("Channel:");
-	debug ("\ttitle: %s", rssdata->title);
-	debug ("\tdescription: %s", rssdata->description);
-	debug ("\tlink: %s", rssdata->link);
-	debug ("\tpub date: %s", rssdata->pubDate);
-	debug2("Image:");
-	debug2("\ttitle: %s", rssdata->image_title);
-	debug2("\tdescription: %s", rssdata->image_description);
-	debug2("\turl: %s", rssdata->image_url);
-	debug2("\tlink: %s", rssdata->image_link);
-	debug2("\tW x H: %d x %d", rssdata->image_width, rssdata->image_height);
-
-	debug("Items:");
-	for (rssitem = rssdata->item, n = 0;
-		rssitem != NULL;
-		rssitem = rssitem->next, n++) {
-
-		char *icon, *thumb;
-		char uid_buf[IDSIZE + 1];
-		bool exists;
-
-		iconv_replace(iconv_cd, &rssitem->title);
-		iconv_replace(iconv_cd, &rssitem->description);
-		iconv_replace(iconv_cd, &rssitem->link);
-		iconv_replace(iconv_cd, &rssitem->guid);
-		iconv_replace(iconv_cd, &rssitem->enclosure_url);
-
-		debug ("\tItem %zu:", n);
-		debug ("\t\ttitle: %s", rssitem->title);
-		debug2("\t\tdescription: %s", rssitem->description);
-		debug2("\t\tlink: %s", rssitem->link);
-		debug2("\t\tguid: %s", rssitem->guid);
-		debug2("\t\tenclosure_url: %s", rssitem->enclosure_url);
-		debug ("\t\tpub date: %s", rssitem->pubDate);
-
-		selfoss_getId(rssdata, rssitem, uid_buf);
-		rc = db_item_exists(db, uid_buf, &exists);
-		if (rc != SQLITE_OK)
-			errx(1, "sqlite fail");
-		if (exists) {
-			debug("item alredy exists. skipped");
-			continue;
-		}
 
-		if (rssitem->pubDate != NULL)
-			strptime(rssitem->pubDate, "%a, %d %b %Y %H:%M:%S %z", &item_tm);
+	while (fgets(line, sizeof(line), fl) != NULL) {
+		line[strcspn(line, "\r\n")] = '\0';
+		path = line + strspn(line, " \t");
+		if (*path == '\0' || *path == '#')
+			continue;
 
-		sanitize_text_only(&rssitem->title);
-		trim_replace(&rssitem->title);
-		if (rssitem->title == NULL || strlen(rssitem->title) < 2) {
-			free(rssitem->title);
-			rssitem->title = strdup("[ NO TITLE ]");
+		lock_fd = journal_lock_tenant(path);
+		if (lock_fd == -1) {
+			fprintf(stderr, "%s: skipped\n", path);
+			continue;
 		}
 
-		rc = sanitize_content(&rssitem->description);
-		if (rc > 1)
-			fprintf(stderr, "content sanitized with errors! item #%zu '%s' (rc=%d)\n",
-					n, rssitem->title, rc);
-		else if (rc >= 0)
-			debug("sanitize ok #%zu '%s'", n, rssitem->title);
-		else {
-			fprintf(stderr, "content sanitization failed! skip item #%zu '%s'\n",
-					n, rssitem->title);
+		/* no sanitize cache: workers do not read one database */
+		db = database_open(path, 0, 0, lease_time, 0, fts, counters);
+		rdb = (db != NULL) ? database_open_readonly(path) : NULL;
+		if (rdb == NULL) {
+			fprintf(stderr, "%s: skipped\n", path);
+			sqlite3_close(db);
+			if (lock_fd >= 0)
+				close(lock_fd);
 			continue;
 		}
 
-		/* TODO: try download favicon.ico
-		 * req. libgd or so .ico -> md5(url).png 30x30 */
-		icon = NULL;
-
-		/* TODO: try find thumb in enclosure
-		 * req. same as for icon */
-		thumb = NULL;
-
-		rc = db_item_add(db, source_id,
-				rssitem->title, rssitem->description, uid_buf, rssitem->link,
-				thumb, icon, &item_tm);
-		if (rc != SQLITE_OK)
-			errx(1, "failed to add new item (title: %s) to source %d",
-					rssitem->title, source_id);
+		sources = NULL;
+		n_sources = sources_collect(db, false, -1, NULL, false, &sources);
+		tenant_add(path, db, rdb, sources, n_sources, lock_fd);
 	}
 
-	rc = db_source_set_lastupdate(db, source_id, 0);
-	if (rc != SQLITE_OK)
-		errx(1, "db_source_update(db, %d, 0) NOT OK", source_id);
-
-	iconv_close(iconv_cd);
-	mrss_free(rssdata);
+	fclose(fl);
 
-	return 0;
-}
+	sources = tenant_feeds(&n_sources);
 
-static char *spout_param_get_url(const char *param_string)
-{
-	struct json_object *param_obj, *o;
-	char *buf = NULL;
-	size_t sz;
+	/* cutoff for purge_item_expired(), retention is per database below */
+	if (tenant_db(0) != NULL)
+		purge_init(tenant_db(0), pass->items_lifetime, DEFAULT_PURGE_BATCH);
 
-	sz = strlen(param_string);
-	buf = malloc(sz + 1);
-	if (buf == NULL)
-		err(1, "out of memory");
+	source_list_sort(sources, n_sources);
 
-	decode_html_entities_utf8(buf, param_string);
-	param_obj = json_tokener_parse(buf);
-	debug3("json obj: %s", json_object_to_json_string(param_obj));
+	if (n_sources > 0)
+		fetch_rc = pipeline_run(NULL, NULL, sources, n_sources, pl_opts);
 
-	if ((o = json_object_object_get(param_obj, "url")) != NULL) {
-		if (json_object_get_type(o) == json_type_string) {
-			strncpy(buf, json_object_get_string(o), sz);
-			debug3("url: %s", buf);
-		}
-		else
-			sz = 0;
+	for (i = 0; (db = tenant_db(i)) != NULL; i++) {
+		purge_init(db, pass->items_lifetime, DEFAULT_PURGE_BATCH);
+		purge_finish(db, pass->incremental_vacuum);
 	}
-	else
-		sz = 0;
-
-	json_object_put(param_obj);
 
-	if (sz == 0) {
-		free(buf);
-		buf = NULL;
-	}
+	tenant_close();
 
-	return buf;
+	return fetch_rc;
 }
 
 /* -*- Main -*- */
 
+enum {
+	OPT_CACHE_SIZE = 0x100,
+	OPT_DEADLINE,
+	OPT_CONNECT_TIMEOUT,
+	OPT_LOW_SPEED_TIME,
+	OPT_RECORD,
+	OPT_REPLAY,
+	OPT_DATA_DIR,
+	OPT_SPOUT_REPORT,
+	OPT_SHARD,
+	OPT_LEASE_TIME,
+	OPT_ITEMS_LIFETIME,
+	OPT_INCREMENTAL_VACUUM,
+	OPT_LOG_LEVEL,
+	OPT_LOG_PAYLOADS,
+	OPT_CONTROL,
+	OPT_INTERVAL,
+	OPT_FTS,
+	OPT_FTS_REBUILD,
+	OPT_FTS_BENCH,
+	OPT_COUNTERS,
+	OPT_COUNTERS_VERIFY,
+	OPT_LINK_DEDUP,
+	OPT_LINK_DEDUP_READ,
+	OPT_NEAR_DUP,
+	OPT_NEAR_DUP_DISTANCE,
+	OPT_UTF8_BENCH,
+	OPT_SANITIZE_POLICY,
+	OPT_SANITIZE_BENCH,
+	OPT_SANITIZE_POLICY_CHECK,
+	OPT_FEED_VIEW_CHECK,
+	OPT_SANITIZER,
+	OPT_SANITIZE_DIFF,
+	OPT_EMIT_SPOOL,
+	OPT_INGEST_SPOOL,
+	OPT_RESUME,
+	OPT_MEM_BUDGET,
+	OPT_TENANTS,
+	OPT_MAX_BODY,
+	OPT_MAX_ITEMS,
+	OPT_MAX_DESCRIPTION,
+	OPT_ALLOC_PROFILE,
+};
+
+static const struct option long_options[] = {
+	{ "debug",		no_argument,		NULL, 'd' },
+	{ "help",		no_argument,		NULL, 'h' },
+	{ "version",		no_argument,		NULL, 'V' },
+	{ "source",		required_argument,	NULL, 's' },
+	{ "jobs",		required_argument,	NULL, 'j' },
+	{ "stats",		no_argument,		NULL, 'S' },
+	{ "cache-size",		required_argument,	NULL, OPT_CACHE_SIZE },
+	{ "deadline",		required_argument,	NULL, OPT_DEADLINE },
+	{ "connect-timeout",	required_argument,	NULL, OPT_CONNECT_TIMEOUT },
+	{ "low-speed-time",	required_argument,	NULL, OPT_LOW_SPEED_TIME },
+	{ "record",		required_argument,	NULL, OPT_RECORD },
+	{ "replay",		required_argument,	NULL, OPT_REPLAY },
+	{ "data-dir",		required_argument,	NULL, OPT_DATA_DIR },
+	{ "spout-report",	no_argument,		NULL, OPT_SPOUT_REPORT },
+	{ "shard",		required_argument,	NULL, OPT_SHARD },
+	{ "lease-time",		required_argument,	NULL, OPT_LEASE_TIME },
+	{ "items-lifetime",	required_argument,	NULL, OPT_ITEMS_LIFETIME },
+	{ "incremental-vacuum",	no_argument,		NULL, OPT_INCREMENTAL_VACUUM },
+	{ "log-level",		required_argument,	NULL, OPT_LOG_LEVEL },
+	{ "log-payloads",	no_argument,		NULL, OPT_LOG_PAYLOADS },
+	{ "control",		required_argument,	NULL, OPT_CONTROL },
+	{ "interval",		required_argument,	NULL, OPT_INTERVAL },
+	{ "fts",		no_argument,		NULL, OPT_FTS },
+	{ "fts-rebuild",	no_argument,		NULL, OPT_FTS_REBUILD },
+	{ "fts-bench",		required_argument,	NULL, OPT_FTS_BENCH },
+	{ "counters",		no_argument,		NULL, OPT_COUNTERS },
+	{ "counters-verify",	no_argument,		NULL, OPT_COUNTERS_VERIFY },
+	{ "link-dedup",		required_argument,	NULL, OPT_LINK_DEDUP },
+	{ "link-dedup-read",	no_argument,		NULL, OPT_LINK_DEDUP_READ },
+	{ "near-dup",		required_argument,	NULL, OPT_NEAR_DUP },
+	{ "near-dup-distance",	required_argument,	NULL, OPT_NEAR_DUP_DISTANCE },
+	{ "utf8-bench",		required_argument,	NULL, OPT_UTF8_BENCH },
+	{ "sanitize-policy",	required_argument,	NULL, OPT_SANITIZE_POLICY },
+	{ "sanitize-bench",	required_argument,	NULL, OPT_SANITIZE_BENCH },
+	{ "sanitize-policy-check", no_argument,	NULL, OPT_SANITIZE_POLICY_CHECK },
+	{ "feed-view-check",	no_argument,		NULL, OPT_FEED_VIEW_CHECK },
+	{ "sanitizer",		required_argument,	NULL, OPT_SANITIZER },
+	{ "sanitize-diff",	required_argument,	NULL, OPT_SANITIZE_DIFF },
+	{ "emit-spool",		required_argument,	NULL, OPT_EMIT_SPOOL },
+	{ "ingest-spool",	required_argument,	NULL, OPT_INGEST_SPOOL },
+	{ "resume",		no_argument,		NULL, OPT_RESUME },
+	{ "mem-budget",		required_argument,	NULL, OPT_MEM_BUDGET },
+	{ "tenants",		required_argument,	NULL, OPT_TENANTS },
+	{ "max-body",		required_argument,	NULL, OPT_MAX_BODY },
+	{ "max-items",		required_argument,	NULL, OPT_MAX_ITEMS },
+	{ "max-description",	required_argument,	NULL, OPT_MAX_DESCRIPTION },
+	{ "alloc-profile",	no_argument,		NULL, OPT_ALLOC_PROFILE },
+	{ NULL, 0, NULL, 0 }
+};
+
 static void usage(FILE *fl, int ex)
 {
-	fprintf(fl, "Usage: %s [-dVh] [-s <source id>] <selfoss.sqlite.db> [<feed url>]\n", PROGNAME);
+	fprintf(fl, "Usage: %s [-dSVh] [-j <workers>] [-s <source id>] [options] <selfoss.sqlite.db> [<feed url>]\n", PROGNAME);
+	fprintf(fl, "       %s [-dSVh] [-j <workers>] [options] --tenants <list>\n", PROGNAME);
 	fprintf(fl, "\n");
-	fprintf(fl, "\t-s <source id>\tprocess only one source (required for <feed url>)\n");
-	fprintf(fl, "\t-d\t\tdebug level (-ddd maximum)\n");
-	fprintf(fl, "\t-h\t\tthis help\n");
-	fprintf(fl, "\t-V\t\tversion info\n");
+	fprintf(fl, "\t-s, --source <source id>\tprocess only one source (required for <feed url>)\n");
+	fprintf(fl, "\t-j, --jobs <workers>\t\tparse/sanitize worker threads (default: number of cpus)\n");
+	fprintf(fl, "\t-S, --stats\t\t\tprint run statistics\n");
+	fprintf(fl, "\t--cache-size <KiB>\t\tsanitized content cache size, 0 to disable (default: %d)\n",
+			DEFAULT_CACHE_SIZE >> 10);
+	fprintf(fl, "\t--deadline <sec>\t\tstop starting new sources after this run time\n");
+	fprintf(fl, "\t--connect-timeout <sec>\t\tper-feed connect timeout (default: %d)\n",
+			DEFAULT_CONNECT_TIMEOUT);
+	fprintf(fl, "\t--low-speed-time <sec>\t\tabort feed transfer stalled for this time (default: %d)\n",
+			DEFAULT_LOW_SPEED_TIME);
+	fprintf(fl, "\t--max-body <KiB>\t\tfail feeds larger than this\n");
+	fprintf(fl, "\t--max-items <n>\t\t\tprocess only the first <n> items of a feed\n");
+	fprintf(fl, "\t--max-description <KiB>\tcut longer item descriptions before sanitize\n");
+	fprintf(fl, "\t--mem-budget <MiB>\t\tadapt feeds in flight (up to -j) to memory and cpu pressure\n");
+	fprintf(fl, "\t--resume\t\t\tcontinue an interrupted run with the sources it had not committed\n");
+	fprintf(fl, "\t--record <dir>\t\t\tsave fetched feeds to an archive in <dir>\n");
+	fprintf(fl, "\t--replay <dir|file>\t\tprocess feeds from the latest (or given) archive, no network\n");
+	fprintf(fl, "\t--data-dir <dir>\t\tselfoss data dir (default: guessed from database path)\n");
+	fprintf(fl, "\t--emit-spool <dir>\t\tfetch host: write new items to a spool file in <dir>, database is only read\n");
+	fprintf(fl, "\t--ingest-spool <dir|file>\tadd items from spool files to the database and exit\n");
+	fprintf(fl, "\t--tenants <list>\t\tupdate all databases listed in file <list>, each feed url fetched once\n");
+	fprintf(fl, "\t--spout-report\t\t\tlist sources and whether they need the PHP updater\n");
+	fprintf(fl, "\t--shard <k>/<n>\t\t\tupdate only shard k (0..n-1) of n, other processes do the rest\n");
+	fprintf(fl, "\t--lease-time <sec>\t\tshard lease time, then sources of a dead process are taken over (default: %d)\n",
+			DEFAULT_LEASE_TIME);
+	fprintf(fl, "\t--items-lifetime <days>\t\tdelete unstarred items older than this, like selfoss items_lifetime\n");
+	fprintf(fl, "\t--incremental-vacuum\t\tafter purge return free pages (needs auto_vacuum=INCREMENTAL)\n");
+	fprintf(fl, "\t--control <socket>\t\tstay resident, accept commands on unix socket <socket>\n");
+	fprintf(fl, "\t--interval <sec>\t\tresident: time between scheduled passes (default: %d)\n",
+			DEFAULT_INTERVAL);
+	fprintf(fl, "\t--fts\t\t\t\tcreate full text index of items (mupdate_items_fts), kept up to date once it exists\n");
+	fprintf(fl, "\t--fts-rebuild\t\t\trebuild full text index from all items and exit\n");
+	fprintf(fl, "\t--fts-bench <term>\t\tcompare LIKE search with the full text index and exit\n");
+	fprintf(fl, "\t--counters\t\t\tmaintain unread/total counters per source and tag (mupdate_counters)\n");
+	fprintf(fl, "\t--counters-verify\t\trecount, print and repair differences, then exit\n");
+	fprintf(fl, "\t--link-dedup <days>\t\tskip items whose link another source had in the last <days>\n");
+	fprintf(fl, "\t--link-dedup-read\t\tinsert such items as read instead of skipping\n");
+	fprintf(fl, "\t--near-dup <days>\t\tskip items whose text another source had in the last <days>\n");
+	fprintf(fl, "\t--near-dup-distance <bits>\tSimHash bits that may differ (default %d, max %d)\n",
+			DEFAULT_NEAR_DUP_DISTANCE, SIMHASH_MAX_DISTANCE);
+	fprintf(fl, "\t--utf8-bench <file>\t\tmeasure UTF-8 validation speed on <file> and exit\n");
+	fprintf(fl, "\t--sanitize-policy <file>\tallowed tags and attributes (default: selfoss lists)\n");
+	fprintf(fl, "\t--sanitizer tidy|native\t\tHTML sanitizer (default: tidy)\n");
+	fprintf(fl, "\t--sanitize-bench <corpus>\tmeasure sanitizers on NUL separated HTML documents and exit\n");
+	fprintf(fl, "\t--sanitize-diff <corpus>\tcompare native sanitizer output with tidy and exit\n");
+	fprintf(fl, "\t--sanitize-policy-check\t\tcompare the sanitizer policy with the old built-in lists and exit\n");
+	fprintf(fl, "\t--feed-view-check\t\tcompare UTF-8 item views with libmrss on sample feeds and exit\n");
+	fprintf(fl, "\t--alloc-profile\t\t\tcount malloc traffic per pipeline stage and source, print at exit\n");
+	fprintf(fl, "\t-d, --debug\t\t\tdebug level (-ddd maximum)\n");
+	fprintf(fl, "\t--log-level <spec>\t\tper-subsystem debug level, e.g. feed=3,sanitize=0\n");
+	fprintf(fl, "\t--log-payloads\t\t\tdo not truncate long debug records\n");
+	fprintf(fl, "\t-h, --help\t\t\tthis help\n");
+	fprintf(fl, "\t-V, --version\t\t\tversion info\n");
 	exit(ex);
 }
 
@@ -351,18 +469,118 @@ static void version()
 	fprintf(stdout, "libNXML version: %s\n", LIBNXML_VERSION_STRING);
 	fprintf(stdout, "libMRSS version: %s\n", LIBMRSS_VERSION_STRING);
 	fprintf(stdout, "HTML Tidy version: %s\n", tidyReleaseDate());
+	fprintf(stdout, "libcurl version: %s\n", curl_version());
+	fprintf(stdout, "\nNative spouts:\n");
+	spout_list(stdout);
+}
+
+/* selfoss default layout: <data>/sqlite/selfoss.db */
+static char *guess_data_dir(const char *db_path)
+{
+	char *dir, *p;
+
+	dir = strdup(db_path);
+	if (dir == NULL)
+		err(1, "out of memory");
+
+	p = strrchr(dir, '/');
+	if (p != NULL) {
+		*p = '\0';
+		p = strrchr(dir, '/');
+		if (p != NULL && !strcmp(p + 1, "sqlite")) {
+			*p = '\0';
+			return dir;
+		}
+		if (p == NULL && !strcmp(dir, "sqlite"))
+			return strcpy(dir, ".");
+	}
+
+	free(dir);
+	return NULL;
+}
+
+/* <data dir>/thumbnails if writable */
+static char *thumbnails_open(const char *data_dir)
+{
+	char *dir;
+
+	if (asprintf(&dir, "%s/thumbnails", data_dir) < 0)
+		err(1, "out of memory");
+	if (access(dir, W_OK) < 0) {
+		debug("%s not writable, thumbnails disabled", dir);
+		free(dir);
+		return NULL;
+	}
+
+	return dir;
+}
+
+/* curl state file in <data dir>/cache, NULL if not writable */
+static char *cache_file_open(const char *data_dir, const char *name)
+{
+	char *path;
+
+	if (asprintf(&path, "%s/cache", data_dir) < 0)
+		err(1, "out of memory");
+	if (access(path, W_OK) < 0) {
+		debug("%s not writable, %s not kept", path, name);
+		free(path);
+		return NULL;
+	}
+	free(path);
+
+	if (asprintf(&path, "%s/cache/%s", data_dir, name) < 0)
+		err(1, "out of memory");
+	return path;
 }
 
 int main(int argc, char *argv[])
 {
 	int opt, rc, fetch_rc = 1;
 	sqlite3 *db;
-	sqlite3_stmt *stmt;
 	int source_id = -1;
 	char *feed_url = NULL;
 	bool single_source = false;
-
-	while ((opt = getopt(argc, argv, "dVhs:")) != -1) {
+	struct source *sources = NULL;
+	size_t n_sources = 0;
+	sqlite3_int64 cache_size = DEFAULT_CACHE_SIZE;
+	bool print_stats = false;
+	const char *record_dir = NULL, *replay_path = NULL;
+	const char *emit_dir = NULL, *ingest_path = NULL;
+	const char *tenants_path = NULL;
+	char *data_dir = NULL, *thumbnails_dir = NULL;
+	char *hsts_file = NULL, *altsvc_file = NULL;
+	bool spout_report = false, resume = false;
+	int shard_k = 0, shard_n = 0;
+	time_t lease_time = DEFAULT_LEASE_TIME;
+	struct pass_options pass = {
+		.items_lifetime = 0,
+		.incremental_vacuum = false,
+		.near_dup_distance = DEFAULT_NEAR_DUP_DISTANCE,
+	};
+	bool log_payloads = false, alloc_profile = false;
+	bool fts = false, fts_rebuild_only = false;
+	const char *fts_bench_term = NULL;
+	const char *policy_path = NULL, *sanitize_bench_path = NULL, *sanitize_diff_path = NULL;
+	bool sanitize_policy_check_only = false, feed_view_check_only = false;
+	bool counters = false, counters_verify_only = false;
+	time_t start_time = time(NULL), deadline_sec = 0;
+	const char *control_path = NULL;
+	time_t interval = DEFAULT_INTERVAL;
+	struct pipeline_options pl_opts = {
+		.n_workers = sysconf(_SC_NPROCESSORS_ONLN),
+		.deadline = 0,
+	};
+	struct fetch_options fetch_opts = {
+		.connect_timeout = DEFAULT_CONNECT_TIMEOUT,
+		.low_speed_time = DEFAULT_LOW_SPEED_TIME,
+	};
+	struct feed_options feed_opts = {
+		.max_items = 0,
+		.max_description = 0,
+	};
+
+	while ((opt = getopt_long(argc, argv, "dVhSs:j:", long_options, NULL)) != -1) {
 		switch (opt) {
 			case 'd':
 				__debug_level += 1;
@@ -373,6 +591,209 @@ int main(int argc, char *argv[])
 				single_source = true;
 				break;
 
+			case 'j':
+				pl_opts.n_workers = atoi(optarg);
+				if (pl_opts.n_workers < 1)
+					errx(1, "bad worker count: %s", optarg);
+				break;
+
+			case 'S':
+				print_stats = true;
+				break;
+
+			case OPT_CACHE_SIZE:
+				if (strtoll(optarg, NULL, 10) < 0)
+					errx(1, "bad cache size: %s", optarg);
+				cache_size = strtoll(optarg, NULL, 10) << 10;
+				break;
+
+			case OPT_DEADLINE:
+				if (atoi(optarg) <= 0)
+					errx(1, "bad deadline: %s", optarg);
+				deadline_sec = atoi(optarg);
+				break;
+
+			case OPT_CONNECT_TIMEOUT:
+				fetch_opts.connect_timeout = atol(optarg);
+				break;
+
+			case OPT_LOW_SPEED_TIME:
+				fetch_opts.low_speed_time = atol(optarg);
+				break;
+
+			case OPT_DATA_DIR:
+				data_dir = strdup(optarg);
+				break;
+
+			case OPT_SPOUT_REPORT:
+				spout_report = true;
+				break;
+
+			case OPT_SHARD:
+				if (sscanf(optarg, "%d/%d", &shard_k, &shard_n) != 2 ||
+						shard_n < 1 || shard_k < 0 || shard_k >= shard_n)
+					errx(1, "bad shard: %s, expected k/n with 0 <= k < n", optarg);
+				break;
+
+			case OPT_LEASE_TIME:
+				lease_time = atol(optarg);
+				if (lease_time <= 0)
+					errx(1, "bad lease time: %s", optarg);
+				break;
+
+			case OPT_ITEMS_LIFETIME:
+				pass.items_lifetime = atoi(optarg);
+				if (pass.items_lifetime < 0)
+					errx(1, "bad items lifetime: %s", optarg);
+				break;
+
+			case OPT_INCREMENTAL_VACUUM:
+				pass.incremental_vacuum = true;
+				break;
+
+			case OPT_LOG_LEVEL:
+				if (log_set_levels(optarg) < 0)
+					errx(1, "bad log level spec: %s", optarg);
+				break;
+
+			case OPT_LOG_PAYLOADS:
+				log_payloads = true;
+				break;
+
+			case OPT_CONTROL:
+				control_path = optarg;
+				break;
+
+			case OPT_FTS:
+				fts = true;
+				break;
+
+			case OPT_FTS_REBUILD:
+				fts = fts_rebuild_only = true;
+				break;
+
+			case OPT_FTS_BENCH:
+				fts = true;
+				fts_bench_term = optarg;
+				break;
+
+			case OPT_COUNTERS:
+				counters = true;
+				break;
+
+			case OPT_COUNTERS_VERIFY:
+				counters = counters_verify_only = true;
+				break;
+
+			case OPT_LINK_DEDUP:
+				pass.link_dedup_days = atoi(optarg);
+				if (pass.link_dedup_days < 0)
+					errx(1, "bad link dedup window: %s", optarg);
+				break;
+
+			case OPT_LINK_DEDUP_READ:
+				pass.link_dedup_read = true;
+				break;
+
+			case OPT_NEAR_DUP:
+				pass.near_dup_days = atoi(optarg);
+				if (pass.near_dup_days < 0)
+					errx(1, "bad near duplicate window: %s", optarg);
+				break;
+
+			case OPT_NEAR_DUP_DISTANCE:
+				pass.near_dup_distance = atoi(optarg);
+				if (pass.near_dup_distance < 0 ||
+						pass.near_dup_distance > SIMHASH_MAX_DISTANCE)
+					errx(1, "bad near duplicate distance: %s", optarg);
+				break;
+
+			case OPT_INTERVAL:
+				interval = atol(optarg);
+				if (interval <= 0)
+					errx(1, "bad interval: %s", optarg);
+				break;
+
+			case OPT_RECORD:
+				record_dir = optarg;
+				break;
+
+			case OPT_REPLAY:
+				replay_path = optarg;
+				break;
+
+			case OPT_EMIT_SPOOL:
+				emit_dir = optarg;
+				break;
+
+			case OPT_INGEST_SPOOL:
+				ingest_path = optarg;
+				break;
+
+			case OPT_RESUME:
+				resume = true;
+				break;
+
+			case OPT_TENANTS:
+				tenants_path = optarg;
+				break;
+
+			case OPT_ALLOC_PROFILE:
+				alloc_profile = true;
+				break;
+
+			case OPT_MAX_BODY:
+				if (atol(optarg) <= 0)
+					errx(1, "bad body size: %s", optarg);
+				fetch_opts.max_body = (size_t) atol(optarg) << 10;
+				break;
+
+			case OPT_MAX_ITEMS:
+				if (atoi(optarg) <= 0)
+					errx(1, "bad item count: %s", optarg);
+				feed_opts.max_items = atoi(optarg);
+				break;
+
+			case OPT_MAX_DESCRIPTION:
+				if (atol(optarg) <= 0)
+					errx(1, "bad description size: %s", optarg);
+				feed_opts.max_description = (size_t) atol(optarg) << 10;
+				break;
+
+			case OPT_MEM_BUDGET:
+				if (atol(optarg) <= 0)
+					errx(1, "bad memory budget: %s", optarg);
+				pl_opts.mem_budget = (size_t) atol(optarg) << 20;
+				break;
+
+			case OPT_UTF8_BENCH:
+				return (utf8_bench(optarg, stdout) == 0) ? 0 : 1;
+
+			case OPT_SANITIZE_POLICY:
+				policy_path = optarg;
+				break;
+
+			case OPT_SANITIZE_BENCH:
+				sanitize_bench_path = optarg;
+				break;
+
+			case OPT_SANITIZE_POLICY_CHECK:
+				sanitize_policy_check_only = true;
+				break;
+
+			case OPT_FEED_VIEW_CHECK:
+				feed_view_check_only = true;
+				break;
+
+			case OPT_SANITIZE_DIFF:
+				sanitize_diff_path = optarg;
+				break;
+
+			case OPT_SANITIZER:
+				if (sanitize_select(optarg) < 0)
+					errx(1, "unknown sanitizer: %s", optarg);
+				break;
+
 			case 'V':
 				version();
 				return 0;
@@ -385,6 +806,65 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	/* re-executes with the counting allocator preloaded */
+	if (alloc_profile && alloc_profile_init(argv) < 0)
+		return 1;
+
+	log_init(log_payloads);
+
+	if (policy_load(policy_path) < 0)
+		return 1;
+
+	if (sanitize_bench_path != NULL)
+		return (sanitize_bench(sanitize_bench_path, stdout) == 0) ? 0 : 1;
+	if (sanitize_diff_path != NULL)
+		return (sanitize_diff(sanitize_diff_path, stdout) == 0) ? 0 : 1;
+	if (sanitize_policy_check_only)
+		return (sanitize_policy_check(stdout) == 0) ? 0 : 1;
+	if (feed_view_check_only)
+		return (feed_view_check(stdout) == 0) ? 0 : 1;
+
+	if (tenants_path != NULL) {
+		if (optind < argc || single_source || shard_n > 0 || control_path != NULL ||
+				spout_report || resume)
+			errx(1, "--tenants can not be used with a database, -s, --shard, --control, "
+					"--spout-report or --resume");
+		if (record_dir != NULL || replay_path != NULL || emit_dir != NULL || ingest_path != NULL)
+			errx(1, "--tenants can not be used with --record, --replay or spools");
+		/* both filters keep per database state in the workers */
+		if (pass.link_dedup_days > 0 || pass.near_dup_days > 0)
+			errx(1, "--tenants can not be used with --link-dedup or --near-dup");
+
+		/* no per database guess, thumbnails only in a shared --data-dir */
+		if (data_dir != NULL) {
+			thumbnails_dir = thumbnails_open(data_dir);
+			hsts_file = cache_file_open(data_dir, HSTS_FILE);
+			altsvc_file = cache_file_open(data_dir, ALTSVC_FILE);
+		}
+		fetch_opts.thumbnails_dir = thumbnails_dir;
+		pl_opts.thumbnails = (thumbnails_dir != NULL);
+		fetch_opts.hsts_file = hsts_file;
+		fetch_opts.altsvc_file = altsvc_file;
+		feed_init(&feed_opts);
+		fetch_init(&fetch_opts);
+
+		if (deadline_sec > 0)
+			pl_opts.deadline = start_time + deadline_sec;
+
+		fetch_rc = tenants_pass(tenants_path, lease_time, fts, counters, &pl_opts, &pass);
+
+		if (print_stats)
+			stats_print(stdout);
+
+		fetch_cleanup();
+		free(thumbnails_dir);
+		free(hsts_file);
+		free(altsvc_file);
+		free(data_dir);
+		log_shutdown();
+		return fetch_rc;
+	}
+
 	if (optind >= argc) {
 		fprintf(stderr, "Expected database file\n");
 		usage(stderr, 1);
@@ -396,53 +876,166 @@ int main(int argc, char *argv[])
 	if (feed_url != NULL && !single_source)
 		errx(1, "with <feed url> key -s required");
 
-	rc = sqlite3_open(argv[optind + 0], &db);
-	if (rc) {
-		fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(db));
-		sqlite3_close(db);
+	if (pl_opts.n_workers < 1)
+		pl_opts.n_workers = 1;
+
+	if (record_dir != NULL && replay_path != NULL)
+		errx(1, "--record and --replay are mutually exclusive");
+
+	if (record_dir != NULL) {
+		if (archive_record_open(record_dir) < 0)
+			return 1;
+		fetch_opts.keep_headers = true;
+	}
+
+	if (control_path != NULL && (single_source || spout_report || replay_path != NULL))
+		errx(1, "--control can not be used with -s, --spout-report or --replay");
+
+	if (replay_path != NULL && archive_replay_open(replay_path) < 0)
+		return 1;
+
+	if (emit_dir != NULL && (ingest_path != NULL || control_path != NULL || shard_n > 0))
+		errx(1, "--emit-spool can not be used with --ingest-spool, --control or --shard");
+	if (ingest_path != NULL && control_path != NULL)
+		errx(1, "--ingest-spool can not be used with --control");
+
+	if (emit_dir != NULL && spool_emit_open(emit_dir) < 0)
+		return 1;
+
+	/* full passes are journaled, a spool emitter does not write */
+	pass.journal = !(single_source || spout_report || emit_dir != NULL || ingest_path != NULL);
+	if (resume && !pass.journal)
+		errx(1, "--resume can not be used with -s, --spout-report, --emit-spool or --ingest-spool");
+
+	/* one run per database, or per shard */
+	if (!spout_report && emit_dir == NULL &&
+			journal_lock(argv[optind + 0], shard_k, (single_source) ? 0 : shard_n) < 0)
 		return 1;
+
+	if (data_dir == NULL)
+		data_dir = guess_data_dir(argv[optind + 0]);
+	/* thumbnails would stay on the fetch host, a replay stays offline */
+	if (data_dir != NULL && emit_dir == NULL && replay_path == NULL)
+		thumbnails_dir = thumbnails_open(data_dir);
+	fetch_opts.thumbnails_dir = thumbnails_dir;
+	pl_opts.thumbnails = (thumbnails_dir != NULL);
+	if (data_dir != NULL) {
+		hsts_file = cache_file_open(data_dir, HSTS_FILE);
+		altsvc_file = cache_file_open(data_dir, ALTSVC_FILE);
 	}
+	fetch_opts.hsts_file = hsts_file;
+	fetch_opts.altsvc_file = altsvc_file;
 
-	if (single_source)
-		rc = db_source_get_stmt(db, source_id, &stmt);
+	/* explicit -s is never sharded */
+	if (emit_dir != NULL)
+		db = database_open_readonly(argv[optind + 0]);
 	else
-		rc = db_source_get_all_by_lastupdate_stmt(db, &stmt);
+		db = database_open(argv[optind + 0], shard_k, (single_source) ? 0 : shard_n,
+				lease_time, cache_size, fts, counters);
+	if (db == NULL)
+		return 1;
 
-	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
-		const char *title, *tags, *spout, *param, *error;
+	if (ingest_path != NULL) {
+		rc = ingest_pass(db, ingest_path, &pass);
+		if (print_stats)
+			stats_print(stdout);
+		sqlite3_close(db);
+		return (rc == 0) ? 0 : 1;
+	}
 
-		db_source_stmt_to_data(stmt, &source_id, &title, &tags, &spout, &param, &error);
+	if (counters_verify_only) {
+		rc = counters_verify(db, stdout);
+		sqlite3_close(db);
+		return (rc == 0) ? 0 : 1;
+	}
 
-		debug("source #%d title: %s tags: %s spout: %s param: %s erorr: %s",
-				source_id, title, tags, spout, param, error);
+	if (fts_rebuild_only || fts_bench_term != NULL) {
+		rc = SQLITE_OK;
+		if (fts_rebuild_only)
+			rc = fts_rebuild(db);
+		if (rc == SQLITE_OK && fts_bench_term != NULL)
+			rc = fts_bench(db, fts_bench_term, stdout);
+		sqlite3_close(db);
+		return (rc == SQLITE_OK) ? 0 : 1;
+	}
 
-		if (strcmp(SPOUT0, spout) != 0) {
-			debug("unsupported spout, skipped");
-			continue;
-		}
+	if (pass.journal)
+		journal_init(db, resume);
 
-		if (feed_url == NULL)
-			feed_url = spout_param_get_url(param);
-		if (feed_url == NULL) {
-			fprintf(stderr, "source #%d: no url or bad json, skipped\n", source_id);
-			continue;
-		}
+	feed_init(&feed_opts);
+	fetch_init(&fetch_opts);
 
-		fetch_rc = fetch_feed(db, source_id, feed_url);
+	if (control_path == NULL) {
+		if (deadline_sec > 0)
+			pl_opts.deadline = start_time + deadline_sec;
 
-		free(feed_url);
-		feed_url = NULL;
-		/* db_source_get_stmt return one row, no break */
+		n_sources = sources_collect(db, single_source, source_id, &feed_url,
+				spout_report, &sources);
+		if (spout_report) {
+			sqlite3_close(db);
+			return 0;
+		}
+
+		fetch_rc = update_pass(db, argv[optind + 0], sources, &n_sources, &pl_opts,
+				&pass);
+		source_list_free(sources, n_sources);
 	}
+	else {
+		/* resident: scheduled passes plus control socket requests */
+		time_t next_pass = time(NULL);
+		unsigned ev;
 
-	sqlite3_finalize(stmt);
+		if (control_init(control_path, argv[optind + 0]) < 0)
+			return 1;
 
-	if (rc != SQLITE_DONE) {
-		errx(1, "SQL error: %s %d", sqlite3_errmsg(db), rc);
+		for (;;) {
+			ev = control_wait(next_pass);
+			if (ev & CONTROL_QUIT)
+				break;
+
+			if (ev & CONTROL_RELOAD) {
+				sqlite3_close(db);
+				db = database_open(argv[optind + 0], shard_k, shard_n,
+						lease_time, cache_size, fts, counters);
+				if (db == NULL)
+					return 1;
+			}
+
+			if ((ev & (CONTROL_DUE | CONTROL_RELOAD)) || time(NULL) >= next_pass) {
+				pl_opts.deadline = (deadline_sec > 0) ? time(NULL) + deadline_sec : 0;
+
+				n_sources = sources_collect(db, false, -1, NULL, false, &sources);
+				fetch_rc = update_pass(db, argv[optind + 0], sources, &n_sources,
+						&pl_opts, &pass);
+				source_list_free(sources, n_sources);
+				sources = NULL;
+
+				next_pass = time(NULL) + interval;
+			}
+			else if (ev & CONTROL_URGENT) {
+				pl_opts.deadline = 0;
+				pipeline_run(db, argv[optind + 0], NULL, 0, &pl_opts);
+			}
+		}
+
+		control_close();
 	}
 
+	if (print_stats)
+		stats_print(stdout);
+
+	free(feed_url);
+
+	fetch_cleanup();
+	archive_close();
+	spool_close();
+	journal_unlock();
+	free(thumbnails_dir);
+	free(hsts_file);
+	free(altsvc_file);
+	free(data_dir);
 	sqlite3_close(db);
+	log_shutdown();
 
 	return fetch_rc;
 }
-
@@ -23,6 +23,7 @@
 #define _GNU_SOURCE
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -30,39 +31,572 @@
 #include <err.h>
 
 #include <time.h>
+#include <pthread.h>
 #include <sqlite3.h>
 
-#ifndef _NDEBUG
+#define PROGNAME		"selfoss_mupdate"
+#define SELFOSS_VERSION		"2.7"
+#define MY_VERSION		"0.1"
 
-extern int __debug_level;
-#define debug(fmt, ...)		if (__debug_level > 0) fprintf(stderr, "%s.%03d: " fmt "\n", __func__, __LINE__, ##__VA_ARGS__)
-#define debug2(fmt, ...)	if (__debug_level > 1) fprintf(stderr, "%s.%03d: " fmt "\n", __func__, __LINE__, ##__VA_ARGS__)
-#define debug3(fmt, ...)	if (__debug_level > 2) fprintf(stderr, "%s.%03d: " fmt "\n", __func__, __LINE__, ##__VA_ARGS__)
+#define IDSIZE			255
+
+/* bump on any change of sanitize_content() output, invalidates cache */
+#define SANITIZE_POLICY_VERSION	1
 
-#else
+#define SIMHASH_MAX_DISTANCE	7	/* bits, one band more than that */
 
-#define debug(fmt, ...)
-#define debug2(fmt, ...)
-#define debug3(fmt, ...)
+/* -*- debug log -*- */
 
+/* levels above this are compiled out; -D_NDEBUG removes all */
+#ifndef LOG_MAX_LEVEL
+# ifdef _NDEBUG
+#  define LOG_MAX_LEVEL		0
+# else
+#  define LOG_MAX_LEVEL		3
+# endif
 #endif
 
+/* subsystem = translation unit, level resolved on first use */
+struct log_subsys {
+	const char *file;
+	int level;
+};
+
+static struct log_subsys __log_subsys __attribute__((unused)) = { __BASE_FILE__, -1 };
+
+extern int __debug_level;
+extern int __log_level_max;
+
+int log_subsys_level(struct log_subsys *ss);
+
+#define log_enabled(lvl)	((lvl) <= LOG_MAX_LEVEL && (lvl) <= __log_level_max && \
+		((__log_subsys.level >= 0) ? __log_subsys.level : log_subsys_level(&__log_subsys)) >= (lvl))
+
+#define log_at(lvl, fmt, ...)	do { \
+		if (log_enabled(lvl)) log_write(__func__, __LINE__, fmt, ##__VA_ARGS__); \
+	} while (0)
+
+#define debug(fmt, ...)		log_at(1, fmt, ##__VA_ARGS__)
+#define debug2(fmt, ...)	log_at(2, fmt, ##__VA_ARGS__)
+#define debug3(fmt, ...)	log_at(3, fmt, ##__VA_ARGS__)
+
+struct feed_item;
+struct mrss_item_t;
+struct json_object;
+
+struct spout_handler {
+	const char *name;	/* selfoss spout class */
+	char *(*get_url)(struct json_object *params);
+	/* optional, called for new items after sanitize */
+	void (*map_item)(struct feed_item *fi, const struct mrss_item_t *item);
+};
+
+struct source {
+	int id;
+	char *title;
+	char *tags;
+	char *spout;
+	char *params;
+	char *error;
+	char *url;
+	const struct spout_handler *handler;
+
+	/* mupdate_redirect, see redirect.c */
+	char *fetch_url;	/* permanent redirect target of url, NULL - url */
+	int redirect_hops;	/* round trips saved by fetch_url */
+	time_t redirect_checked;
+	bool redirect_stored;
+
+	time_t lastupdate;
+
+	/* mupdate_source_state */
+	int failures;
+	time_t next_attempt;
+	double fetch_ms;	/* moving average of fetch time */
+
+	int reply_fd;		/* control socket client, -1 if none */
+};
+
+/* -*- run statistics -*- */
+
+struct run_stats {
+	unsigned long sources_ok;
+	unsigned long sources_failed;
+	unsigned long sources_backoff;
+	unsigned long sources_deferred;
+	unsigned long sources_php;
+	unsigned long sources_lease_lost;	/* taken over by another shard */
+	unsigned long items_new;
+	unsigned long thumbnails;
+
+	unsigned long cache_hits;
+	unsigned long cache_misses;
+	unsigned long cache_evicted;
+	unsigned long long cache_evicted_bytes;
+
+	unsigned long items_purged;
+	unsigned long items_expired;
+	unsigned long items_link_dups;
+	unsigned long items_near_dups;
+	unsigned long bodies_repaired;
+	unsigned long spool_records;
+	unsigned long spool_items;
+	unsigned long tenant_dbs;
+	unsigned long tenant_subscriptions;	/* due sources of all databases */
+	unsigned long tenant_feeds;		/* fetched once for all of them */
+	unsigned long pages_freed;
+	unsigned long pages_vacuumed;
+	unsigned long redirect_hops;		/* followed */
+	unsigned long redirects_avoided;	/* round trips saved by stored targets */
+	unsigned long redirects_stored;
+	unsigned long bodies_capped;
+	unsigned long items_capped;
+	unsigned long descriptions_capped;
+	unsigned long governor_shrinks;
+	unsigned long governor_grows;
+	unsigned long rss_peak;		/* KiB, sampled by the governor */
+};
+
+extern struct run_stats run_stats;
+
+/* updated from several threads */
+#define stats_inc(field)	__sync_fetch_and_add(&run_stats.field, 1)
+#define stats_add(field, n)	__sync_fetch_and_add(&run_stats.field, (n))
+
+/* -*- allocation profile -*- */
+
+/* pipeline stage charged with malloc traffic, see allocprof.c */
+enum alloc_stage {
+	ALLOC_OTHER = 0,
+	ALLOC_FETCH,
+	ALLOC_PARSE,
+	ALLOC_ICONV,
+	ALLOC_SANITIZE,
+	ALLOC_WRITE,
+	ALLOC_N_STAGES
+};
+
+/* set by --alloc-profile only; source_id -1 keeps the current source */
+extern void (*alloc_stage_hook)(int stage, int source_id);
+
+#define alloc_stage(stage, source_id) \
+	do { \
+		if (alloc_stage_hook != NULL) \
+			alloc_stage_hook((stage), (source_id)); \
+	} while (0)
+
+/* -*- pipeline data -*- */
+
+#define CACHE_DIGEST_SIZE	32	/* sha256 */
+
+enum cache_state {
+	CACHE_NONE = 0,
+	CACHE_HIT,
+	CACHE_MISS
+};
+
+struct cache_ref {
+	enum cache_state state;
+	unsigned char digest[CACHE_DIGEST_SIZE];
+};
+
+/* prepared item, ready for db_item_add() */
+struct feed_item {
+	struct feed_item *next;
+	char *title;
+	char *content;
+	char *link;
+	char *thumb_url;
+	sqlite3_int64 id;	/* items.id once stored by the writer, 0 - not stored */
+	char uid[IDSIZE + 1];
+	struct tm pub_tm;
+	struct cache_ref cache;
+	bool duplicate;		/* same link as another source, insert as read */
+	uint64_t link_hash;	/* canonical link, 0 - not indexed */
+	uint64_t simhash;	/* 0 - not fingerprinted */
+	bool near_dup;		/* suppressed, only uid is set */
+};
+
+/* raw element content or attribute value in the fetched body */
+struct xml_span {
+	uint32_t off;
+	uint32_t len;		/* 0 - absent */
+};
+
+/* item fields as found in the body, see itemview.c */
+struct item_view {
+	struct xml_span title;
+	struct xml_span description;
+	struct xml_span link;
+	struct xml_span guid;
+	struct xml_span pub_date;
+	struct xml_span enclosure_url;
+	struct xml_span enclosure_type;
+	bool has_content;	/* atom: content seen, summary ignored */
+	bool has_published;	/* atom: published seen, updated ignored */
+};
+
+struct feed_view {
+	const char *body;
+	struct item_view *items;
+	size_t n_items;
+	size_t allocated;
+	struct xml_span pub_date;	/* channel */
+};
+
+struct feed_job {
+	struct source *src;
+
+	/* fetch stage */
+	char *body;
+	size_t body_sz;
+	char *headers;		/* raw response headers, kept for --record */
+	size_t headers_sz;
+	double fetch_ms;
+	time_t fetched;		/* spooled: fetch time, 0 - now */
+	char *redirect;		/* permanent redirect target found by the fetch */
+	int redirect_hops;
+	bool redirect_checked;	/* fetched from src->url, not fetch_url */
+	bool redirect_used;	/* fetched from src->fetch_url */
+
+	/* parse/sanitize stage */
+	struct feed_item *items;
+	size_t n_items;
+
+	int rc;
+	char error[256];	/* set by failed stage */
+	bool deferred;		/* run deadline reached, not processed */
+	bool lease_lost;	/* source leased by another process, not stored */
+	bool governed;		/* holds a governor slot from fetch to writer */
+	int n_new;		/* items added by the writer */
+	int n_new_unread;
+	int n_near_dups;	/* suppressed for the first time */
+
+	/* resource caps hit */
+	bool body_capped;
+	int items_capped;	/* items after --max-items, not processed */
+	int descriptions_capped;	/* truncated to --max-description */
+};
+
+#define job_error(job, fmt, ...)	snprintf((job)->error, sizeof((job)->error), fmt, ##__VA_ARGS__)
+
+struct fetch_options {
+	long connect_timeout;	/* sec */
+	long low_speed_time;	/* sec */
+	bool keep_headers;
+	const char *thumbnails_dir;	/* NULL - don't store thumbnails */
+	const char *hsts_file;		/* curl HSTS cache, NULL - none */
+	const char *altsvc_file;	/* curl Alt-Svc cache, NULL - none */
+	size_t max_body;		/* bytes, 0 - unlimited */
+};
+
+struct feed_options {
+	size_t max_items;		/* per feed and run, 0 - unlimited */
+	size_t max_description;		/* bytes, 0 - unlimited */
+};
+
+struct pipeline_options {
+	int n_workers;
+	time_t deadline;	/* 0 - unlimited */
+	size_t mem_budget;	/* bytes, 0 - no governor */
+	bool thumbnails;	/* run the thumbnail stage */
+};
+
+/* bounded FIFO of pointers, blocks producer when full */
+struct queue {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	void **ring;
+	size_t size;
+	size_t limit;		/* <= size, lowered by the governor */
+	size_t head;
+	size_t count;
+	bool closed;
+};
+
 /* prototypes */
+void queue_init(struct queue *q, size_t size);
+void queue_destroy(struct queue *q);
+bool queue_push(struct queue *q, void *data);
+void *queue_pop(struct queue *q);
+void queue_close(struct queue *q);
+void queue_set_limit(struct queue *q, size_t limit);
+
+void fetch_init(const struct fetch_options *opts);
+void fetch_cleanup(void);
+int fetch_feed(struct feed_job *job, time_t deadline);
+char *fetch_thumbnail(const char *url, time_t deadline);
+
+int redirect_init(sqlite3 *db);
+void redirect_apply(sqlite3 *db, struct source *src);
+void redirect_store(sqlite3 *db, const struct feed_job *job);
+
+void feed_init(const struct feed_options *opts);
+int feed_process(sqlite3 *rdb, struct feed_job *job);
+int feed_view_check(FILE *fl);
+void feed_job_free(struct feed_job *job);
+
+int pipeline_run(sqlite3 *db, const char *db_path,
+		struct source *sources, size_t n_sources,
+		const struct pipeline_options *opts);
+void pipeline_store(sqlite3 *db, struct feed_job *job);
+
+void thumbnail_start(int n_threads, time_t deadline);
+void thumbnail_request(sqlite3 *db, const struct feed_job *job);
+void thumbnail_apply(void);
+void thumbnail_stop(void);
+
+void governor_start(size_t budget, int n_workers, struct queue *work_q, struct queue *write_q);
+void governor_stop(void);
+void governor_enter(void);
+void governor_leave(void);
+
+int alloc_profile_init(char *argv[]);
+
+void stats_caps(const struct feed_job *job);
+void stats_print(FILE *fl);
+
+int source_load(sqlite3 *db, sqlite3_stmt *stmt, struct source *src);
+struct source *source_list_add(struct source **list, size_t *n, size_t *allocated,
+		const struct source *src);
+void source_list_sort(struct source *list, size_t n);
+void source_free(struct source *src);
+void source_list_free(struct source *list, size_t n);
+size_t source_list_claim(sqlite3 *db, struct source *list, size_t n);
+
+/* control_wait() events */
+#define CONTROL_URGENT		(1 << 0)	/* single source refresh queued */
+#define CONTROL_DUE		(1 << 1)	/* scheduled pass requested */
+#define CONTROL_RELOAD		(1 << 2)
+#define CONTROL_QUIT		(1 << 3)
+
+int control_init(const char *path, const char *db_path);
+unsigned control_wait(time_t until);
+struct source *control_next_source(void);
+void control_done(struct source *src, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+void control_close(void);
+
+int journal_lock(const char *db_path, int shard_k, int shard_n);
+int journal_lock_tenant(const char *db_path);
+int journal_init(sqlite3 *db, bool resume);
+void journal_resume(sqlite3 *db, struct source *sources, size_t *n_sources);
+void journal_begin(sqlite3 *db, const struct source *sources, size_t n);
+void journal_source_done(sqlite3 *db, const struct feed_job *job);
+void journal_end(sqlite3 *db);
+void journal_unlock(void);
+
+int lease_init(sqlite3 *db, int k, int n, time_t lease_sec);
+bool lease_active(void);
+bool lease_wanted(sqlite3 *db, int source_id);
+bool lease_claim(sqlite3 *db, int source_id);
+bool lease_claim_one(sqlite3 *db, int source_id);
+bool lease_held(sqlite3 *db, int source_id);
+void lease_release(sqlite3 *db, int source_id);
+
+/* log.c */
+int log_set_levels(const char *spec);
+void log_init(bool payloads);
+void log_shutdown(void);
+void log_write(const char *func, int line, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+/* purge.c */
+int purge_init(sqlite3 *db, int lifetime_days, int batch);
+bool purge_item_expired(struct tm *pub_tm);
+bool purge_step(sqlite3 *db);
+void purge_finish(sqlite3 *db, bool vacuum);
+
+int fts_init(sqlite3 *db, bool enable);
+void fts_item_added(sqlite3 *db, sqlite3_int64 rowid, const char *title, const char *content);
+int fts_purge_batch(sqlite3 *db);
+int fts_rebuild(sqlite3 *db);
+int fts_bench(sqlite3 *db, const char *term, FILE *fl);
+
+int counters_init(sqlite3 *db, bool enable);
+int counters_verify(sqlite3 *db, FILE *fl);
+
+int linkdup_init(sqlite3 *db, int days, bool mark);
+bool linkdup_marking(void);
+uint64_t linkdup_hash(const char *link, const char *uid);
+bool linkdup_check(int source_id, uint64_t hash, const char *link);
+void linkdup_items_added(const struct feed_job *job);
+
+int simhash_init(sqlite3 *db, int days, int distance);
+uint64_t simhash_item(const char *title, const char *content);
+bool simhash_check(int source_id, uint64_t fp);
+int simhash_known(sqlite3 *rdb, const char *uid, bool *exists);
+void simhash_item_added(sqlite3 *db, sqlite3_int64 rowid, int source_id, uint64_t fp);
+void simhash_item_suppressed(sqlite3 *db, struct feed_job *job, const char *uid);
+void simhash_items_added(const struct feed_job *job);
+void simhash_suppressed(sqlite3 *db, int source_id, int n);
+
+bool utf8_valid(const char *s, size_t len);
+const char *utf8_guess_charset(const char *s, size_t len);
+char *utf8_repair(const char *s, size_t len, const char *charset, size_t *out_len);
+int utf8_bench(const char *path, FILE *fl);
+
+int itemview_scan(struct feed_view *fv, const char *body, size_t sz);
+void itemview_free(struct feed_view *fv);
+size_t itemview_text(const struct feed_view *fv, struct xml_span sp, char *buf, size_t sz);
+char *itemview_strdup(const struct feed_view *fv, struct xml_span sp);
+
+const struct spout_handler *spout_find(const char *spout);
+char *spout_get_url(const struct spout_handler *sh, const char *param_string);
+char *spout_params_key(const char *param_string);
+void spout_list(FILE *fl);
+
+int archive_record_open(const char *dir);
+void archive_record(const struct feed_job *job);
+int archive_replay_open(const char *path);
+bool archive_replaying(void);
+bool archive_replay_has(int source_id);
+int archive_replay(struct feed_job *job);
+void archive_close(void);
+
+int spool_emit_open(const char *dir);
+bool spool_emitting(void);
+void spool_emit(const struct feed_job *job);
+int spool_ingest(sqlite3 *db, const char *path);
+void spool_close(void);
+
+bool tenant_active(void);
+void tenant_add(const char *path, sqlite3 *db, sqlite3 *rdb,
+		struct source *sources, size_t n_sources, int lock_fd);
+sqlite3 *tenant_db(size_t i);
+struct source *tenant_feeds(size_t *n);
+int tenant_item_exists(const struct feed_job *job, char *uid, bool *exists);
+void tenant_store(struct feed_job *job);
+void tenant_close(void);
+
+int cache_init(sqlite3 *db, sqlite3_int64 max_bytes);
+int sanitize_content_cached(sqlite3 *rdb, char **content, struct cache_ref *ref);
+void cache_store(sqlite3 *db, const char *content, struct cache_ref *ref);
+void cache_evict(sqlite3 *db);
+
 void sanitize_text_only(char **field);
+int sanitize_select(const char *engine);
+const char *sanitize_engine(void);
 int sanitize_content(char **content);
+int sanitize_bench(const char *path, FILE *fl);
+int sanitize_diff(const char *path, FILE *fl);
+int sanitize_policy_check(FILE *fl);
+
+char *htmlsan(const char *html, size_t len, size_t *out_len, size_t *mem);
+int htmlsan_content(char **content);
+
+int policy_load(const char *path);
+const unsigned char *policy_digest(void);
+int policy_tag(int tid, const char *name);
+int policy_attr(int tag, int aid, const char *name);
+bool policy_value_ok(int attr, const char *value);
+int policy_tag_by_name(const char *name, size_t len);
+int policy_attr_by_name(int tag, const char *name, size_t len);
+const char *policy_tag_name(int tag);
+const char *policy_attr_name(int attr);
+int policy_attr_count(void);
+
+/* side tables found usable by the *_init() calls, per database file */
+struct db_state {
+	sqlite3 *db;			/* writer handle */
+	char *path;
+	bool fts;
+	bool redirect;
+	sqlite3_int64 cache_max_bytes;	/* 0 - cache disabled */
+	sqlite3_int64 cache_bytes;	/* writer only */
+};
+
+struct db_state *db_state_add(sqlite3 *db);
+const struct db_state *db_state(sqlite3 *db);
 
 int db_item_exists(sqlite3 *db, char *uid, bool *result);
 int db_item_add(sqlite3 *db, int source_id,
 		char *title, char *content, char *uid, char *link,
-		char *thumb, char *icon, struct tm *pub_tm);
+		char *thumb, char *icon, struct tm *pub_tm, bool unread);
+int db_item_set_thumbnail(sqlite3 *db, sqlite3_int64 item_id, const char *thumb);
 int db_source_set_lastupdate(sqlite3 *db, int source_id, time_t lastupdate);
 void db_source_stmt_to_data(sqlite3_stmt *stmt, int *source_id,
 		const char **title, const char **tags, const char **spout,
-		const char **params, const char **error);
+		const char **params, const char **error, time_t *lastupdate);
 int db_source_get_all_by_lastupdate_stmt(sqlite3 *db, sqlite3_stmt **stmt);
 int db_source_get_stmt(sqlite3 *db, int source_id, sqlite3_stmt **stmt);
 int db_source_get(sqlite3 *db, int source_id,
 		const char **title, const char **tags, const char **spout,
-		const char **params, const char **error);
+		const char **params, const char **error, time_t *lastupdate);
+
+int db_exec(sqlite3 *db, const char *sql);
+int db_source_set_error(sqlite3 *db, int source_id, const char *error);
+int db_source_state_create(sqlite3 *db);
+int db_source_state_get(sqlite3 *db, int source_id, int *failures,
+		time_t *next_attempt, double *fetch_ms);
+int db_source_state_set(sqlite3 *db, int source_id, int failures,
+		time_t next_attempt, double fetch_ms);
+int db_lease_create(sqlite3 *db);
+int db_lease_expired(sqlite3 *db, int source_id, time_t now, bool *result);
+int db_lease_claim(sqlite3 *db, int source_id, const char *owner,
+		time_t now, time_t expires, bool *claimed);
+int db_lease_held(sqlite3 *db, int source_id, const char *owner, bool *held);
+int db_lease_renew(sqlite3 *db, const char *owner, time_t expires, int *renewed);
+int db_lease_release(sqlite3 *db, int source_id, const char *owner);
+int db_items_datetime_index_create(sqlite3 *db);
+int db_purge_batch_create(sqlite3 *db);
+int db_purge_batch_select(sqlite3 *db, const char *cutoff, int limit, int *selected);
+int db_purge_batch_delete(sqlite3 *db, int *deleted);
+int db_pragma_get_int(sqlite3 *db, const char *pragma, int *value);
+int db_fts_create(sqlite3 *db, bool *created);
+int db_fts_exists(sqlite3 *db, bool *exists);
+int db_fts_insert(sqlite3 *db, sqlite3_int64 rowid, const char *title, const char *content);
+int db_fts_delete_purged(sqlite3 *db);
+int db_fts_rebuild(sqlite3 *db);
+int db_count_query(sqlite3 *db, const char *sql, const char *arg,
+		long *count, double *ms);
+int db_table_exists(sqlite3 *db, const char *name, bool *exists);
+int db_counters_create(sqlite3 *db, bool *created);
+int db_source_tags_clear(sqlite3 *db);
+int db_source_tags_add(sqlite3 *db, int source_id, const char *tag, int tag_len);
+int db_source_tags_stmt(sqlite3 *db, sqlite3_stmt **stmt);
+int db_counters_compute(sqlite3 *db);
+int db_counters_diff_stmt(sqlite3 *db, sqlite3_stmt **stmt);
+int db_counters_replace(sqlite3 *db);
+int db_items_links_since_stmt(sqlite3 *db, const char *since, sqlite3_stmt **stmt);
+int db_items_text_since_stmt(sqlite3 *db, const char *since, sqlite3_stmt **stmt);
+int db_simhash_create(sqlite3 *db, bool *created);
+int db_simhash_add(sqlite3 *db, sqlite3_int64 id, int source_id, uint64_t fp, time_t seen);
+int db_simhash_expire(sqlite3 *db, time_t since);
+int db_simhash_stmt(sqlite3 *db, sqlite3_stmt **stmt);
+int db_near_dups_add(sqlite3 *db, int source_id, int n);
+int db_near_dup_item_add(sqlite3 *db, const char *uid, int source_id, time_t seen,
+		bool *added);
+int db_near_dup_item_exists(sqlite3 *db, const char *uid, bool *exists);
+int db_spool_create(sqlite3 *db);
+int db_spool_offset_get(sqlite3 *db, const char *id, sqlite3_int64 *offset);
+int db_spool_offset_set(sqlite3 *db, const char *id, sqlite3_int64 offset);
+int db_journal_create(sqlite3 *db);
+int db_journal_run_add(sqlite3 *db, const char *shard, int pid, sqlite3_int64 *run);
+int db_journal_plan_add(sqlite3 *db, sqlite3_int64 run, int position, int source_id);
+int db_journal_source_done(sqlite3 *db, sqlite3_int64 run, int source_id,
+		int state, int items, double fetch_ms);
+int db_journal_run_finish(sqlite3 *db, sqlite3_int64 run);
+int db_journal_run_resumed(sqlite3 *db, sqlite3_int64 run, int pid);
+int db_journal_run_abandon(sqlite3 *db, const char *shard);
+int db_journal_run_unfinished(sqlite3 *db, const char *shard, sqlite3_int64 *run);
+int db_journal_pending_stmt(sqlite3 *db, sqlite3_int64 run, sqlite3_stmt **stmt);
+int db_journal_expire(sqlite3 *db, const char *shard, int keep);
+int db_redirect_create(sqlite3 *db);
+int db_redirect_get(sqlite3 *db, int source_id, char **url, char **target,
+		int *hops, time_t *checked);
+int db_redirect_set(sqlite3 *db, int source_id, const char *url, const char *target,
+		int hops, time_t checked);
+int db_redirect_delete(sqlite3 *db, int source_id);
+
+int db_cache_create(sqlite3 *db);
+int db_cache_get(sqlite3 *db, const void *digest, size_t digest_sz, char **content);
+int db_cache_put(sqlite3 *db, const void *digest, size_t digest_sz,
+		const char *content, time_t atime, bool *inserted);
+int db_cache_touch(sqlite3 *db, const void *digest, size_t digest_sz, time_t atime);
+int db_cache_total_size(sqlite3 *db, sqlite3_int64 *bytes);
+int db_cache_evict_oldest(sqlite3 *db, int n_rows,
+		sqlite3_int64 *freed_bytes, int *freed_rows);
 
 #endif /* SELFOSS_MUPDATE_H */
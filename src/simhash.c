@@ -0,0 +1,425 @@
+/**
+ * Selfoss RSS reader micro updater
+ *
+ *   Copyright (C) 2013 Vladimir Ermakov <vooon341@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "selfoss_mupdate.h"
+
+/*
+ * Near-duplicate filter: 64-bit SimHash over word 3-shingles of the
+ * text form (tags and entities dropped, ASCII lower case) of title and
+ * sanitized content.
+ *
+ * Fingerprints of the window live in mupdate_simhash and in memory in a
+ * banded index: with distance k the fingerprint is cut into k + 1 bands,
+ * and two fingerprints within k bits agree on at least one band
+ * completely.  So only entries sharing a band are compared by popcount.
+ *
+ * Like link dedup, only another source's item makes a near duplicate;
+ * one source republishing its own text is left alone.  Fingerprints
+ * enter the index after the source commit, and the writer checks again
+ * against items committed since the worker looked.  The uid of a
+ * suppressed item is kept in mupdate_near_dup_items for the window, so
+ * later runs skip it like a stored item and count it only once.
+ */
+
+#define SIMHASH_SHINGLE		3
+#define SIMHASH_MIN_SHINGLES	16	/* shorter texts are not fingerprinted */
+#define SIMHASH_MAX_BANDS	(SIMHASH_MAX_DISTANCE + 1)
+
+struct simhash_entry {
+	uint64_t fp;
+	int source;
+	uint32_t next[SIMHASH_MAX_BANDS];	/* chains, index + 1, 0 - end */
+};
+
+static int simhash_days;		/* 0 - disabled */
+static int simhash_distance;
+static int simhash_bands;
+static int band_shift[SIMHASH_MAX_BANDS];
+static uint64_t band_mask[SIMHASH_MAX_BANDS];
+
+static pthread_mutex_t simhash_lock = PTHREAD_MUTEX_INITIALIZER;
+/* guarded by simhash_lock */
+static struct simhash_entry *entries;
+static size_t n_entries, entries_allocated;
+static uint32_t *buckets[SIMHASH_MAX_BANDS];
+static size_t n_buckets;
+
+static uint64_t mix64(uint64_t x)
+{
+	/* splitmix64 finalizer */
+	x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27; x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+static uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+/* -*- fingerprint -*- */
+
+struct simhash_state {
+	int v[64];
+	uint64_t words[SIMHASH_SHINGLE];
+	size_t n_words;
+	size_t n_shingles;
+};
+
+static void simhash_word(struct simhash_state *st, uint64_t w)
+{
+	uint64_t sh = 0;
+	int i;
+
+	st->words[st->n_words++ % SIMHASH_SHINGLE] = w;
+	if (st->n_words < SIMHASH_SHINGLE)
+		return;
+
+	/* order matters: rotate by position in the shingle */
+	for (i = 0; i < SIMHASH_SHINGLE; i++)
+		sh ^= rotl64(st->words[(st->n_words + i) % SIMHASH_SHINGLE], i * 21 + 1);
+	sh = mix64(sh);
+
+	for (i = 0; i < 64; i++)
+		st->v[i] += ((sh >> i) & 1) ? 1 : -1;
+	st->n_shingles++;
+}
+
+static void simhash_feed(struct simhash_state *st, const char *s, bool html)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	bool in_word = false;
+	unsigned char c;
+
+	for (; s != NULL && *s; s++) {
+		c = *s;
+
+		if (html && c == '<') {
+			s += strcspn(s, ">");
+			if (*s == '\0')
+				break;
+			c = ' ';
+		}
+		else if (html && c == '&') {
+			s += strcspn(s, "; <");
+			if (*s == '\0')
+				break;
+			c = ' ';
+		}
+
+		if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c >= 0x80 ||
+				(c >= 'A' && c <= 'Z')) {
+			if (c >= 'A' && c <= 'Z')
+				c += 'a' - 'A';
+			h = (h ^ c) * 0x100000001b3ULL;
+			in_word = true;
+		}
+		else if (in_word) {
+			simhash_word(st, h);
+			h = 0xcbf29ce484222325ULL;
+			in_word = false;
+		}
+	}
+
+	if (in_word)
+		simhash_word(st, h);
+}
+
+/* 0 - text too short to compare */
+uint64_t simhash_item(const char *title, const char *content)
+{
+	struct simhash_state st;
+	uint64_t fp = 0;
+	int i;
+
+	memset(&st, 0, sizeof(st));
+	simhash_feed(&st, title, false);
+	simhash_feed(&st, content, true);
+
+	if (st.n_shingles < SIMHASH_MIN_SHINGLES)
+		return 0;
+
+	for (i = 0; i < 64; i++)
+		if (st.v[i] > 0)
+			fp |= 1ULL << i;
+
+	return (fp) ? fp : 1;
+}
+
+/* -*- banded index, simhash_lock held -*- */
+
+static size_t band_bucket(int b, uint64_t fp)
+{
+	return mix64(((fp >> band_shift[b]) & band_mask[b]) ^ ((uint64_t) b << 56)) &
+		(n_buckets - 1);
+}
+
+static void index_link(size_t i)
+{
+	struct simhash_entry *e = &entries[i];
+	size_t k;
+	int b;
+
+	for (b = 0; b < simhash_bands; b++) {
+		k = band_bucket(b, e->fp);
+		e->next[b] = buckets[b][k];
+		buckets[b][k] = i + 1;
+	}
+}
+
+static void index_rehash(size_t size)
+{
+	size_t i;
+	int b;
+
+	n_buckets = size;
+	for (b = 0; b < simhash_bands; b++) {
+		free(buckets[b]);
+		buckets[b] = calloc(n_buckets, sizeof(uint32_t));
+		if (buckets[b] == NULL)
+			err(1, "out of memory");
+	}
+
+	for (i = 0; i < n_entries; i++)
+		index_link(i);
+}
+
+static void index_add(uint64_t fp, int source_id)
+{
+	if (n_entries == entries_allocated) {
+		entries_allocated = (entries_allocated) ? entries_allocated * 2 : 4096;
+		entries = realloc(entries, entries_allocated * sizeof(*entries));
+		if (entries == NULL)
+			err(1, "out of memory");
+	}
+
+	entries[n_entries].fp = fp;
+	entries[n_entries].source = source_id;
+	n_entries++;
+
+	if (n_entries > n_buckets)
+		index_rehash(n_buckets * 2);
+	else
+		index_link(n_entries - 1);
+}
+
+/* source of an entry within distance, 0 if none */
+static int index_find(uint64_t fp, int source_id)
+{
+	const struct simhash_entry *e;
+	uint32_t i;
+	int b;
+
+	for (b = 0; b < simhash_bands; b++) {
+		for (i = buckets[b][band_bucket(b, fp)]; i != 0; i = e->next[b]) {
+			e = &entries[i - 1];
+			if (e->source != source_id &&
+					((e->fp ^ fp) >> band_shift[b] & band_mask[b]) == 0 &&
+					__builtin_popcountll(e->fp ^ fp) <= simhash_distance)
+				return e->source;
+		}
+	}
+
+	return 0;
+}
+
+/* -*- public -*- */
+
+static void simhash_index_reset(int distance)
+{
+	int b, start, end;
+
+	free(entries);
+	entries = NULL;
+	n_entries = entries_allocated = 0;
+
+	simhash_distance = distance;
+	simhash_bands = distance + 1;
+	for (b = 0; b < simhash_bands; b++) {
+		start = b * 64 / simhash_bands;
+		end = (b + 1) * 64 / simhash_bands;
+		band_shift[b] = start;
+		band_mask[b] = (end - start == 64) ? ~0ULL : (1ULL << (end - start)) - 1;
+	}
+
+	index_rehash(4096);
+}
+
+/* fingerprints of items in the window, once, when the table is new */
+static int simhash_backfill(sqlite3 *db, time_t since)
+{
+	sqlite3_stmt *stmt;
+	struct tm ltm;
+	char since_str[32];
+	uint64_t fp;
+	int rc;
+
+	/* items.datetime is localtime, see db_item_add() */
+	localtime_r(&since, &ltm);
+	strftime(since_str, sizeof(since_str), "%F %T", &ltm);
+
+	rc = db_items_text_since_stmt(db, since_str, &stmt);
+	if (rc != SQLITE_OK)
+		return rc;
+
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		fp = simhash_item((const char *) sqlite3_column_text(stmt, 2),
+				(const char *) sqlite3_column_text(stmt, 3));
+		if (fp != 0 && db_simhash_add(db, sqlite3_column_int64(stmt, 0),
+					sqlite3_column_int(stmt, 1), fp, time(NULL)) != SQLITE_OK)
+			break;
+	}
+
+	if (rc != SQLITE_DONE) {
+		sqlite3_finalize(stmt);
+		return rc;
+	}
+
+	return sqlite3_finalize(stmt);
+}
+
+int simhash_init(sqlite3 *db, int days, int distance)
+{
+	sqlite3_stmt *stmt;
+	time_t since;
+	bool created;
+	int rc;
+
+	simhash_days = days;
+	if (simhash_days == 0)
+		return SQLITE_OK;
+
+	since = time(NULL) - (time_t) days * 24 * 60 * 60;
+
+	rc = db_exec(db, "BEGIN IMMEDIATE");
+	if (rc == SQLITE_OK)
+		rc = db_simhash_create(db, &created);
+	if (rc == SQLITE_OK && created)
+		rc = simhash_backfill(db, since);
+	if (rc == SQLITE_OK)
+		rc = db_simhash_expire(db, since);
+	if (rc == SQLITE_OK)
+		rc = db_exec(db, "COMMIT");
+	else
+		db_exec(db, "ROLLBACK");
+
+	pthread_mutex_lock(&simhash_lock);
+	simhash_index_reset(distance);
+
+	if (rc == SQLITE_OK)
+		rc = db_simhash_stmt(db, &stmt);
+	if (rc == SQLITE_OK) {
+		while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+			index_add(sqlite3_column_int64(stmt, 0), sqlite3_column_int(stmt, 1));
+
+		if (rc == SQLITE_DONE)
+			rc = sqlite3_finalize(stmt);
+		else
+			sqlite3_finalize(stmt);
+	}
+	pthread_mutex_unlock(&simhash_lock);
+
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "near duplicate filter disabled: %s\n", sqlite3_errmsg(db));
+		simhash_days = 0;
+		return rc;
+	}
+
+	debug("simhash index: %zu fingerprints, distance %d, %d bands",
+			n_entries, simhash_distance, simhash_bands);
+	return SQLITE_OK;
+}
+
+/* worker and writer stage: true if another source has nearly the same text */
+bool simhash_check(int source_id, uint64_t fp)
+{
+	int holder;
+
+	if (simhash_days == 0 || fp == 0)
+		return false;
+
+	pthread_mutex_lock(&simhash_lock);
+	holder = index_find(fp, source_id);
+	pthread_mutex_unlock(&simhash_lock);
+
+	if (holder != 0) {
+		debug("near duplicate of an item from source #%d", holder);
+		stats_inc(items_near_dups);
+		return true;
+	}
+
+	return false;
+}
+
+/* worker stage: suppressed by an earlier run */
+int simhash_known(sqlite3 *rdb, const char *uid, bool *exists)
+{
+	*exists = false;
+	if (simhash_days == 0)
+		return SQLITE_OK;
+
+	return db_near_dup_item_exists(rdb, uid, exists);
+}
+
+/* writer stage, inside the source transaction */
+void simhash_item_added(sqlite3 *db, sqlite3_int64 rowid, int source_id, uint64_t fp)
+{
+	if (simhash_days == 0 || fp == 0)
+		return;
+
+	if (db_simhash_add(db, rowid, source_id, fp, time(NULL)) != SQLITE_OK)
+		errx(1, "simhash: %s", sqlite3_errmsg(db));
+}
+
+/* writer stage, inside the source transaction */
+void simhash_item_suppressed(sqlite3 *db, struct feed_job *job, const char *uid)
+{
+	bool added;
+
+	if (db_near_dup_item_add(db, uid, job->src->id, time(NULL), &added) != SQLITE_OK)
+		errx(1, "simhash: %s", sqlite3_errmsg(db));
+
+	if (added)
+		job->n_near_dups++;
+}
+
+/* writer stage: after the source transaction committed */
+void simhash_items_added(const struct feed_job *job)
+{
+	struct feed_item *fi;
+
+	if (simhash_days == 0)
+		return;
+
+	pthread_mutex_lock(&simhash_lock);
+	for (fi = job->items; fi != NULL; fi = fi->next)
+		if (fi->id != 0 && fi->simhash != 0)
+			index_add(fi->simhash, job->src->id);
+	pthread_mutex_unlock(&simhash_lock);
+}
+
+void simhash_suppressed(sqlite3 *db, int source_id, int n)
+{
+	if (n == 0)
+		return;
+
+	if (db_near_dups_add(db, source_id, n) != SQLITE_OK)
+		errx(1, "simhash: %s", sqlite3_errmsg(db));
+}
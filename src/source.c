@@ -0,0 +1,146 @@
+/**
+ * Selfoss RSS reader micro updater
+ *
+ *   Copyright (C) 2013 Vladimir Ermakov <vooon341@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "selfoss_mupdate.h"
+
+
+static char *strdup_null(const char *s)
+{
+	char *p;
+
+	if (s == NULL)
+		return NULL;
+
+	p = strdup(s);
+	if (p == NULL)
+		err(1, "out of memory");
+
+	return p;
+}
+
+/* fill src from a db_source_*_stmt row, url is left to the caller */
+int source_load(sqlite3 *db, sqlite3_stmt *stmt, struct source *src)
+{
+	const char *title, *tags, *spout, *params, *error;
+
+	memset(src, 0, sizeof(*src));
+	src->reply_fd = -1;
+
+	db_source_stmt_to_data(stmt, &src->id, &title, &tags, &spout, &params, &error,
+			&src->lastupdate);
+
+	src->title = strdup_null(title);
+	src->tags = strdup_null(tags);
+	src->spout = strdup_null(spout);
+	src->params = strdup_null(params);
+	src->error = strdup_null(error);
+	src->handler = spout_find(spout);
+
+	return db_source_state_get(db, src->id, &src->failures, &src->next_attempt,
+			&src->fetch_ms);
+}
+
+/* list takes ownership of src strings */
+struct source *source_list_add(struct source **list, size_t *n, size_t *allocated,
+		const struct source *src)
+{
+	if (*n == *allocated) {
+		*allocated = (*allocated) ? *allocated * 2 : 64;
+		*list = realloc(*list, *allocated * sizeof(**list));
+		if (*list == NULL)
+			err(1, "out of memory");
+	}
+
+	(*list)[*n] = *src;
+	return &(*list)[(*n)++];
+}
+
+/* overdue time weighted by usual fetch time: fast feeds go first,
+ * but a slow feed gains priority the longer it waits */
+static double source_priority(const struct source *src, time_t now)
+{
+	double overdue = difftime(now, src->lastupdate);
+
+	return overdue / (1.0 + src->fetch_ms / 1000.0);
+}
+
+static time_t source_sort_now;
+
+static int source_priority_cmp(const void *a, const void *b)
+{
+	const struct source *sa = a, *sb = b;
+	double pa = source_priority(sa, source_sort_now);
+	double pb = source_priority(sb, source_sort_now);
+
+	if (pa != pb)
+		return (pa > pb) ? -1 : 1;
+	if (sa->lastupdate != sb->lastupdate)
+		return (sa->lastupdate < sb->lastupdate) ? -1 : 1;
+	return sa->id - sb->id;
+}
+
+void source_list_sort(struct source *list, size_t n)
+{
+	source_sort_now = time(NULL);
+	qsort(list, n, sizeof(*list), source_priority_cmp);
+}
+
+void source_free(struct source *src)
+{
+	free(src->title);
+	free(src->tags);
+	free(src->spout);
+	free(src->params);
+	free(src->error);
+	free(src->url);
+	free(src->fetch_url);
+}
+
+void source_list_free(struct source *list, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		source_free(&list[i]);
+
+	free(list);
+}
+
+/* take shard leases in one short transaction, drop sources held by others */
+size_t source_list_claim(sqlite3 *db, struct source *list, size_t n)
+{
+	size_t i, j;
+
+	if (db_exec(db, "BEGIN IMMEDIATE") != SQLITE_OK)
+		errx(1, "BEGIN: %s", sqlite3_errmsg(db));
+
+	for (i = 0, j = 0; i < n; i++) {
+		if (lease_claim(db, list[i].id))
+			list[j++] = list[i];
+		else {
+			debug("source #%d leased by other process, skipped", list[i].id);
+			source_free(&list[i]);
+		}
+	}
+
+	if (db_exec(db, "COMMIT") != SQLITE_OK)
+		errx(1, "COMMIT: %s", sqlite3_errmsg(db));
+
+	return j;
+}
@@ -0,0 +1,565 @@
+/**
+ * Selfoss RSS reader micro updater
+ *
+ *   Copyright (C) 2013 Vladimir Ermakov <vooon341@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "selfoss_mupdate.h"
+#include <dirent.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "bb_md5_sha.h"
+
+/*
+ * Item spool for --emit-spool / --ingest-spool.
+ *
+ * A fetch host runs the whole pipeline against a read-only copy of the
+ * database and appends every source result to a spool file instead of
+ * writing it.  The host owning the database ingests the files later.
+ *
+ *   "MUSPOOL1" <16 bytes spool id>
+ *   <u32 length> <u32 crc32 of payload> <payload>
+ *   ...
+ *
+ * Payload, integers little endian, strings as <u32 length><bytes>:
+ *
+ *   u32 source id, i32 fetch result, i64 fetch time, u32 fetch us,
+ *   u32 near duplicates, str error, u32 item count, then per item:
+ *   str uid, str title, str content, str link, i64 pub time,
+ *   u8 flags, u64 simhash; then u8 body capped, u32 items capped,
+ *   u32 descriptions capped (missing in older spools: none)
+ *
+ * The ingested offset of every spool id is kept in mupdate_spool and
+ * moves in the same transaction as the items, so a file ingested twice,
+ * or again after it grew, only adds what is new.  A torn record at the
+ * end of a file being written is left for the next ingest.
+ */
+
+#define SPOOL_MAGIC		"MUSPOOL1"
+#define SPOOL_ID_SIZE		16
+#define SPOOL_HEADER_SIZE	(8 + SPOOL_ID_SIZE)
+#define SPOOL_SUFFIX		".spool"
+#define SPOOL_RECORD_MAX	(256 << 20)
+#define SPOOL_BATCH		64		/* records per transaction */
+
+#define SPOOL_ITEM_DUPLICATE	(1 << 0)
+
+struct spool_buf {
+	unsigned char *data;
+	size_t len;
+	size_t allocated;
+	size_t pos;		/* decoding */
+	bool bad;		/* decoding ran past the end */
+};
+
+static FILE *emit_fp;
+static uint32_t crc_table[256];
+
+/* -*- helpers -*- */
+
+static void crc32_init(void)
+{
+	uint32_t c;
+	int i, k;
+
+	for (i = 0; i < 256; i++) {
+		for (c = i, k = 0; k < 8; k++)
+			c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+		crc_table[i] = c;
+	}
+}
+
+static uint32_t crc32(const unsigned char *p, size_t len)
+{
+	uint32_t c = 0xffffffff;
+
+	while (len--)
+		c = crc_table[(c ^ *p++) & 0xff] ^ (c >> 8);
+
+	return c ^ 0xffffffff;
+}
+
+static void buf_reserve(struct spool_buf *b, size_t n)
+{
+	if (b->len + n <= b->allocated)
+		return;
+
+	while (b->len + n > b->allocated)
+		b->allocated = (b->allocated) ? b->allocated * 2 : 4096;
+
+	b->data = realloc(b->data, b->allocated);
+	if (b->data == NULL)
+		err(1, "out of memory");
+}
+
+static void put_uint(struct spool_buf *b, uint64_t v, int size)
+{
+	int i;
+
+	buf_reserve(b, size);
+	for (i = 0; i < size; i++)
+		b->data[b->len++] = v >> (8 * i);
+}
+
+static void put_str(struct spool_buf *b, const char *s)
+{
+	size_t len = (s != NULL) ? strlen(s) : 0;
+
+	put_uint(b, len, 4);
+	buf_reserve(b, len);
+	memcpy(b->data + b->len, s, len);
+	b->len += len;
+}
+
+static uint64_t get_uint(struct spool_buf *b, int size)
+{
+	uint64_t v = 0;
+	int i;
+
+	if (b->bad || b->len - b->pos < size) {
+		b->bad = true;
+		return 0;
+	}
+
+	for (i = 0; i < size; i++)
+		v |= (uint64_t) b->data[b->pos++] << (8 * i);
+
+	return v;
+}
+
+/* malloc()ed copy, never NULL unless the record is bad */
+static char *get_str(struct spool_buf *b)
+{
+	uint32_t len = get_uint(b, 4);
+	char *s;
+
+	if (b->bad || b->len - b->pos < len) {
+		b->bad = true;
+		return NULL;
+	}
+
+	s = malloc(len + 1);
+	if (s == NULL)
+		err(1, "out of memory");
+
+	memcpy(s, b->data + b->pos, len);
+	s[len] = '\0';
+	b->pos += len;
+
+	return s;
+}
+
+static void spool_id_hex(const unsigned char *id, char *hex)
+{
+	int i;
+
+	for (i = 0; i < SPOOL_ID_SIZE; i++)
+		sprintf(hex + 2 * i, "%02x", id[i]);
+}
+
+/* -*- emit -*- */
+
+/* dir/mupdate-<time>-<host>-<pid>.spool, id from the same and the clock */
+int spool_emit_open(const char *dir)
+{
+	char path[PATH_MAX];
+	char host[64] = "localhost";
+	char tbuf[32];
+	unsigned char digest[32];
+	struct timespec ts;
+	sha256_ctx_t ctx;
+	time_t now = time(NULL);
+	struct tm tm;
+	pid_t pid = getpid();
+	int n;
+
+	gethostname(host, sizeof(host) - 1);
+	gmtime_r(&now, &tm);
+	strftime(tbuf, sizeof(tbuf), "%Y%m%d-%H%M%S", &tm);
+
+	n = snprintf(path, sizeof(path), "%s/mupdate-%s-%s-%d" SPOOL_SUFFIX,
+			dir, tbuf, host, (int) pid);
+	if (n >= sizeof(path))
+		errx(1, "spool path too long");
+
+	emit_fp = fopen(path, "wx");
+	if (emit_fp == NULL) {
+		warn("fopen(%s)", path);
+		return -1;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	sha256_begin(&ctx);
+	sha256_hash(&ctx, path, n);
+	sha256_hash(&ctx, &ts, sizeof(ts));
+	sha256_hash(&ctx, &pid, sizeof(pid));
+	sha256_end(&ctx, digest);
+
+	fwrite(SPOOL_MAGIC, 1, 8, emit_fp);
+	fwrite(digest, 1, SPOOL_ID_SIZE, emit_fp);
+	fflush(emit_fp);
+	if (ferror(emit_fp))
+		err(1, "spool write failed");
+
+	crc32_init();
+
+	debug("emitting to %s", path);
+	return 0;
+}
+
+bool spool_emitting(void)
+{
+	return emit_fp != NULL;
+}
+
+/* writer stage replacement: append job result */
+void spool_emit(const struct feed_job *job)
+{
+	struct spool_buf b = { NULL, 0, 0, 0, false };
+	struct feed_item *fi;
+	unsigned char hdr[8];
+	uint32_t crc;
+	size_t n_items = 0;
+	int i;
+
+	for (fi = job->items; fi != NULL; fi = fi->next)
+		n_items++;
+
+	put_uint(&b, job->src->id, 4);
+	put_uint(&b, (uint32_t) job->rc, 4);
+	put_uint(&b, time(NULL), 8);
+	put_uint(&b, job->fetch_ms * 1000, 4);
+	put_uint(&b, job->n_near_dups, 4);
+	put_str(&b, (job->rc != 0) ? job->error : NULL);
+	put_uint(&b, n_items, 4);
+
+	for (fi = job->items; fi != NULL; fi = fi->next) {
+		put_str(&b, fi->uid);
+		put_str(&b, fi->title);
+		put_str(&b, fi->content);
+		put_str(&b, fi->link);
+		put_uint(&b, timegm(&fi->pub_tm), 8);
+		put_uint(&b, (fi->duplicate) ? SPOOL_ITEM_DUPLICATE : 0, 1);
+		put_uint(&b, fi->simhash, 8);
+	}
+
+	put_uint(&b, job->body_capped, 1);
+	put_uint(&b, job->items_capped, 4);
+	put_uint(&b, job->descriptions_capped, 4);
+
+	if (b.len > SPOOL_RECORD_MAX)
+		errx(1, "source #%d: spool record too large (%zu bytes)", job->src->id, b.len);
+
+	crc = crc32(b.data, b.len);
+	for (i = 0; i < 4; i++) {
+		hdr[i] = b.len >> (8 * i);
+		hdr[4 + i] = crc >> (8 * i);
+	}
+
+	/* one write per record, a crash leaves at most a torn tail */
+	fwrite(hdr, 1, sizeof(hdr), emit_fp);
+	fwrite(b.data, 1, b.len, emit_fp);
+	fflush(emit_fp);
+	if (ferror(emit_fp))
+		err(1, "spool write failed");
+
+	debug("source #%d: %zu items spooled (%zu bytes)", job->src->id, n_items, b.len);
+	stats_inc(spool_records);
+	stats_add(spool_items, n_items);
+
+	free(b.data);
+}
+
+/* -*- ingest -*- */
+
+static void spool_job_free(struct feed_job *job)
+{
+	if (job->src != NULL) {
+		source_free(job->src);
+		free(job->src);
+	}
+	job->src = NULL;
+
+	feed_job_free(job);
+}
+
+/* payload to a job as the writer gets it, NULL if the source is gone */
+static struct feed_job *spool_decode(sqlite3 *db, struct spool_buf *b, bool *bad)
+{
+	struct feed_job *job;
+	struct feed_item *fi, **tail;
+	sqlite3_stmt *stmt;
+	uint32_t n_items, i;
+	time_t t;
+	char *s;
+	int rc;
+
+	*bad = false;
+
+	job = calloc(1, sizeof(*job));
+	if (job == NULL)
+		err(1, "out of memory");
+	tail = &job->items;
+
+	job->src = calloc(1, sizeof(*job->src));
+	if (job->src == NULL)
+		err(1, "out of memory");
+	job->src->id = get_uint(b, 4);
+	job->src->reply_fd = -1;
+
+	job->rc = (int32_t) get_uint(b, 4);
+	job->fetched = get_uint(b, 8);
+	job->fetch_ms = get_uint(b, 4) / 1000.0;
+	job->n_near_dups = get_uint(b, 4);
+	s = get_str(b);
+	if (s != NULL)
+		snprintf(job->error, sizeof(job->error), "%s", s);
+	free(s);
+
+	n_items = get_uint(b, 4);
+	for (i = 0; i < n_items && !b->bad; i++) {
+		fi = calloc(1, sizeof(*fi));
+		if (fi == NULL)
+			err(1, "out of memory");
+		*tail = fi;
+		tail = &fi->next;
+
+		s = get_str(b);
+		if (s != NULL)
+			snprintf(fi->uid, sizeof(fi->uid), "%s", s);
+		free(s);
+		fi->title = get_str(b);
+		fi->content = get_str(b);
+		fi->link = get_str(b);
+		t = get_uint(b, 8);
+		gmtime_r(&t, &fi->pub_tm);
+		fi->duplicate = get_uint(b, 1) & SPOOL_ITEM_DUPLICATE;
+		fi->simhash = get_uint(b, 8);
+		job->n_items++;
+	}
+
+	if (!b->bad && b->pos < b->len) {
+		job->body_capped = get_uint(b, 1);
+		job->items_capped = get_uint(b, 4);
+		job->descriptions_capped = get_uint(b, 4);
+	}
+
+	if (b->bad || b->pos != b->len) {
+		*bad = true;
+		spool_job_free(job);
+		return NULL;
+	}
+
+	/* current error and failure count are the database's */
+	rc = db_source_get_stmt(db, job->src->id, &stmt);
+	if (rc == SQLITE_OK)
+		rc = sqlite3_step(stmt);
+	if (rc == SQLITE_ROW) {
+		int id = job->src->id;
+		free(job->src);
+		job->src = calloc(1, sizeof(*job->src));
+		if (job->src == NULL)
+			err(1, "out of memory");
+		if (source_load(db, stmt, job->src) != SQLITE_OK)
+			errx(1, "SQL error: %s", sqlite3_errmsg(db));
+		debug2("source #%d: %zu spooled items", id, job->n_items);
+	}
+	else if (rc == SQLITE_DONE) {
+		debug("source #%d not in database, spooled result dropped", job->src->id);
+		sqlite3_finalize(stmt);
+		spool_job_free(job);
+		return NULL;
+	}
+	else
+		errx(1, "SQL error: %s", sqlite3_errmsg(db));
+
+	sqlite3_finalize(stmt);
+	return job;
+}
+
+/* next record into b, 0 - got one, 1 - end or torn tail, -1 - corrupt */
+static int spool_read(FILE *fp, struct spool_buf *b)
+{
+	unsigned char hdr[8];
+	uint32_t len = 0, crc = 0;
+	int i;
+
+	if (fread(hdr, 1, sizeof(hdr), fp) != sizeof(hdr))
+		return 1;
+
+	for (i = 0; i < 4; i++) {
+		len |= (uint32_t) hdr[i] << (8 * i);
+		crc |= (uint32_t) hdr[4 + i] << (8 * i);
+	}
+	if (len > SPOOL_RECORD_MAX)
+		return -1;
+
+	b->len = b->pos = 0;
+	b->bad = false;
+	buf_reserve(b, len);
+	if (fread(b->data, 1, len, fp) != len)
+		return 1;
+	b->len = len;
+
+	return (crc32(b->data, len) == crc) ? 0 : -1;
+}
+
+static int spool_ingest_file(sqlite3 *db, const char *path)
+{
+	struct spool_buf b = { NULL, 0, 0, 0, false };
+	unsigned char header[SPOOL_HEADER_SIZE];
+	char id[2 * SPOOL_ID_SIZE + 1];
+	sqlite3_int64 offset;
+	struct feed_job *job;
+	FILE *fp;
+	bool bad, more = true;
+	int n, rc, ret = 0;
+	size_t n_records = 0;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		warn("fopen(%s)", path);
+		return -1;
+	}
+
+	if (fread(header, 1, sizeof(header), fp) != sizeof(header) ||
+			memcmp(header, SPOOL_MAGIC, 8) != 0) {
+		warnx("%s: not a spool file", path);
+		fclose(fp);
+		return -1;
+	}
+	spool_id_hex(header + 8, id);
+
+	rc = db_spool_offset_get(db, id, &offset);
+	if (rc != SQLITE_OK)
+		errx(1, "SQL error: %s", sqlite3_errmsg(db));
+	if (offset < SPOOL_HEADER_SIZE)
+		offset = SPOOL_HEADER_SIZE;
+	if (fseeko(fp, offset, SEEK_SET) < 0)
+		err(1, "fseeko(%s)", path);
+
+	debug("%s: spool %s from offset %lld", path, id, (long long) offset);
+
+	while (more) {
+		if (db_exec(db, "BEGIN IMMEDIATE") != SQLITE_OK)
+			errx(1, "BEGIN: %s", sqlite3_errmsg(db));
+
+		for (n = 0; n < SPOOL_BATCH; n++) {
+			rc = spool_read(fp, &b);
+			if (rc < 0) {
+				warnx("%s: bad record at offset %lld, rest of the file skipped",
+						path, (long long) offset);
+				ret = -1;
+			}
+			if (rc != 0) {
+				more = false;
+				break;
+			}
+
+			job = spool_decode(db, &b, &bad);
+			if (bad) {
+				warnx("%s: malformed record at offset %lld, rest of the file skipped",
+						path, (long long) offset);
+				ret = -1;
+				more = false;
+				break;
+			}
+
+			offset += 8 + b.len;
+			n_records++;
+			stats_inc(spool_records);
+			if (job == NULL)
+				continue;
+
+			stats_add(spool_items, job->n_items);
+			pipeline_store(db, job);
+			if (job->rc == 0)
+				stats_inc(sources_ok);
+			else
+				stats_inc(sources_failed);
+			stats_caps(job);
+			spool_job_free(job);
+		}
+
+		rc = db_spool_offset_set(db, id, offset);
+		if (rc != SQLITE_OK)
+			errx(1, "SQL error: %s", sqlite3_errmsg(db));
+		if (db_exec(db, "COMMIT") != SQLITE_OK)
+			errx(1, "COMMIT: %s", sqlite3_errmsg(db));
+
+		purge_step(db);
+	}
+
+	debug("%s: %zu records ingested", path, n_records);
+
+	free(b.data);
+	fclose(fp);
+	return ret;
+}
+
+static int spool_select(const struct dirent *de)
+{
+	size_t len = strlen(de->d_name);
+
+	return len > strlen(SPOOL_SUFFIX) &&
+		!strcmp(de->d_name + len - strlen(SPOOL_SUFFIX), SPOOL_SUFFIX);
+}
+
+/* path is a spool file or a directory of them, ingested in name order */
+int spool_ingest(sqlite3 *db, const char *path)
+{
+	char fpath[PATH_MAX];
+	struct dirent **list;
+	struct stat st;
+	int i, n, ret = 0;
+
+	if (stat(path, &st) < 0) {
+		warn("stat(%s)", path);
+		return -1;
+	}
+
+	if (db_spool_create(db) != SQLITE_OK)
+		errx(1, "SQL error: %s", sqlite3_errmsg(db));
+	crc32_init();
+
+	if (!S_ISDIR(st.st_mode))
+		return spool_ingest_file(db, path);
+
+	n = scandir(path, &list, spool_select, alphasort);
+	if (n < 0) {
+		warn("scandir(%s)", path);
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		snprintf(fpath, sizeof(fpath), "%s/%s", path, list[i]->d_name);
+		if (spool_ingest_file(db, fpath) < 0)
+			ret = -1;
+		free(list[i]);
+	}
+	free(list);
+
+	return ret;
+}
+
+void spool_close(void)
+{
+	if (emit_fp != NULL)
+		fclose(emit_fp);
+	emit_fp = NULL;
+}
@@ -0,0 +1,237 @@
+/**
+ * Selfoss RSS reader micro updater
+ *
+ *   Copyright (C) 2013 Vladimir Ermakov <vooon341@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "selfoss_mupdate.h"
+
+#include <json/json.h>
+
+#include "mrss.h"
+#include "entities.h"
+
+/*
+ * Native spout implementations.
+ *
+ * Each selfoss spout class we can handle maps to a params parser
+ * (returns feed url) and an optional item mapping hook, called by
+ * the worker for every new item. Sources with other spouts are left
+ * to the PHP updater.
+ */
+
+/* -*- params -*- */
+
+static struct json_object *spout_params_parse(const char *param_string)
+{
+	struct json_object *param_obj;
+	char *buf;
+
+	buf = malloc(strlen(param_string) + 1);
+	if (buf == NULL)
+		err(1, "out of memory");
+
+	decode_html_entities_utf8(buf, param_string);
+	param_obj = json_tokener_parse(buf);
+	debug3("json obj: %s", json_object_to_json_string(param_obj));
+
+	free(buf);
+	return param_obj;
+}
+
+static const char *spout_param_string(struct json_object *params, const char *key)
+{
+	struct json_object *o;
+
+	if (params == NULL)
+		return NULL;
+
+	o = json_object_object_get(params, key);
+	if (o == NULL || json_object_get_type(o) != json_type_string)
+		return NULL;
+
+	return json_object_get_string(o);
+}
+
+static char *url_escape(const char *s)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	char *buf, *p;
+
+	buf = p = malloc(strlen(s) * 3 + 1);
+	if (buf == NULL)
+		err(1, "out of memory");
+
+	for (; *s; s++) {
+		unsigned char c = *s;
+
+		if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+				(c >= '0' && c <= '9') || strchr("-_.~", c))
+			*p++ = c;
+		else {
+			*p++ = '%';
+			*p++ = hex[c >> 4];
+			*p++ = hex[c & 15];
+		}
+	}
+	*p = '\0';
+
+	return buf;
+}
+
+static char *url_printf_param(struct json_object *params, const char *key, const char *fmt)
+{
+	const char *v = spout_param_string(params, key);
+	char *esc, *url;
+
+	if (v == NULL || *v == '\0')
+		return NULL;
+
+	esc = url_escape(v);
+	if (asprintf(&url, fmt, esc) < 0)
+		err(1, "out of memory");
+
+	free(esc);
+	return url;
+}
+
+/* spouts\rss\feed, spouts\rss\images */
+static char *spout_url_param(struct json_object *params)
+{
+	const char *url = spout_param_string(params, "url");
+
+	debug3("url: %s", url);
+	return (url != NULL) ? strdup(url) : NULL;
+}
+
+static char *spout_url_deviantart_dd(struct json_object *params)
+{
+	return strdup("http://backend.deviantart.com/rss.xml?q=special:dd&type=deviation");
+}
+
+static char *spout_url_deviantart_user(struct json_object *params)
+{
+	return url_printf_param(params, "username",
+			"http://backend.deviantart.com/rss.xml?q=gallery:%s&type=deviation");
+}
+
+static char *spout_url_deviantart_favs(struct json_object *params)
+{
+	return url_printf_param(params, "username",
+			"http://backend.deviantart.com/rss.xml?q=favby:%s&type=deviation");
+}
+
+/* -*- item mapping -*- */
+
+/* find src of first <img> in sanitized (xhtml) content */
+static char *content_first_img(const char *content)
+{
+	const char *p, *src, *end;
+
+	if (content == NULL)
+		return NULL;
+
+	for (p = strstr(content, "<img"); p != NULL; p = strstr(p + 4, "<img")) {
+		end = strchr(p, '>');
+		src = strstr(p, "src=\"");
+		if (src == NULL || (end != NULL && src > end))
+			continue;
+
+		src += 5;
+		end = strchr(src, '"');
+		if (end == NULL || end == src)
+			continue;
+
+		return strndup(src, end - src);
+	}
+
+	return NULL;
+}
+
+/* rss\images: thumbnail from image enclosure or first image in content */
+static void spout_map_images(struct feed_item *fi, const mrss_item_t *item)
+{
+	if (item->enclosure_url != NULL && item->enclosure_type != NULL &&
+			!strncmp(item->enclosure_type, "image/", 6))
+		fi->thumb_url = strdup(item->enclosure_url);
+	else
+		fi->thumb_url = content_first_img(fi->content);
+
+	debug2("thumbnail: %s", fi->thumb_url);
+}
+
+/* -*- dispatch table -*- */
+
+static const struct spout_handler spout_handlers[] = {
+	{ "spouts\\rss\\feed",			spout_url_param,		NULL },
+	{ "spouts\\rss\\images",		spout_url_param,		spout_map_images },
+	{ "spouts\\deviantart\\dailydeviations",	spout_url_deviantart_dd,	spout_map_images },
+	{ "spouts\\deviantart\\user",		spout_url_deviantart_user,	spout_map_images },
+	{ "spouts\\deviantart\\usersfavs",	spout_url_deviantart_favs,	spout_map_images },
+	{ NULL, NULL, NULL }
+};
+
+const struct spout_handler *spout_find(const char *spout)
+{
+	const struct spout_handler *sh;
+
+	if (spout == NULL)
+		return NULL;
+
+	for (sh = spout_handlers; sh->name != NULL; sh++)
+		if (!strcmp(sh->name, spout))
+			return sh;
+
+	return NULL;
+}
+
+/* return malloc'ed feed url, NULL if params bad */
+char *spout_get_url(const struct spout_handler *sh, const char *param_string)
+{
+	struct json_object *params;
+	char *url;
+
+	params = spout_params_parse((param_string) ? param_string : "");
+	url = sh->get_url(params);
+	json_object_put(params);
+
+	return url;
+}
+
+/* params but the url in json-c form, malloc'ed; --tenants groups on it */
+char *spout_params_key(const char *param_string)
+{
+	struct json_object *params;
+	char *key;
+
+	params = spout_params_parse((param_string) ? param_string : "");
+	if (params != NULL && json_object_get_type(params) == json_type_object)
+		json_object_object_del(params, "url");
+	key = strdup((params != NULL) ? json_object_to_json_string(params) : "");
+	json_object_put(params);
+
+	if (key == NULL)
+		err(1, "out of memory");
+	return key;
+}
+
+void spout_list(FILE *fl)
+{
+	const struct spout_handler *sh;
+
+	for (sh = spout_handlers; sh->name != NULL; sh++)
+		fprintf(fl, "\t%s\n", sh->name);
+}
@@ -0,0 +1,115 @@
+/**
+ * Selfoss RSS reader micro updater
+ *
+ *   Copyright (C) 2013 Vladimir Ermakov <vooon341@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "selfoss_mupdate.h"
+
+
+struct run_stats run_stats;
+
+/* sources that hit a resource cap, writer only */
+struct source_caps {
+	int id;
+	int bodies;
+	int items;
+	int descriptions;
+};
+
+static struct source_caps *caps;
+static size_t n_caps, caps_allocated;
+
+static double percent(unsigned long part, unsigned long total)
+{
+	return (total) ? 100.0 * part / total : 0.0;
+}
+
+/* writer stage: per source count of resource caps hit */
+void stats_caps(const struct feed_job *job)
+{
+	struct source_caps *c = NULL;
+	size_t i;
+
+	if (!job->body_capped && job->items_capped == 0 && job->descriptions_capped == 0)
+		return;
+
+	stats_add(bodies_capped, job->body_capped);
+	stats_add(items_capped, job->items_capped);
+	stats_add(descriptions_capped, job->descriptions_capped);
+
+	for (i = 0; i < n_caps && c == NULL; i++)
+		if (caps[i].id == job->src->id)
+			c = &caps[i];
+
+	if (c == NULL) {
+		if (n_caps == caps_allocated) {
+			caps_allocated = (caps_allocated) ? caps_allocated * 2 : 16;
+			caps = realloc(caps, caps_allocated * sizeof(*caps));
+			if (caps == NULL)
+				err(1, "out of memory");
+		}
+		c = &caps[n_caps++];
+		memset(c, 0, sizeof(*c));
+		c->id = job->src->id;
+	}
+
+	c->bodies += job->body_capped;
+	c->items += job->items_capped;
+	c->descriptions += job->descriptions_capped;
+}
+
+void stats_print(FILE *fl)
+{
+	unsigned long lookups = run_stats.cache_hits + run_stats.cache_misses;
+	size_t i;
+
+	fprintf(fl, "sources: %lu ok, %lu failed, %lu in backoff, %lu deferred\n",
+			run_stats.sources_ok, run_stats.sources_failed,
+			run_stats.sources_backoff, run_stats.sources_deferred);
+	fprintf(fl, "sources: %lu need PHP updater (see --spout-report)\n",
+			run_stats.sources_php);
+	fprintf(fl, "sources: %lu lost to another shard (lease expired)\n",
+			run_stats.sources_lease_lost);
+	fprintf(fl, "bodies: %lu not UTF-8, repaired\n", run_stats.bodies_repaired);
+	fprintf(fl, "items: %lu new, %lu thumbnails, %lu duplicate links, %lu near duplicates\n",
+			run_stats.items_new, run_stats.thumbnails, run_stats.items_link_dups,
+			run_stats.items_near_dups);
+	fprintf(fl, "redirects: %lu hops followed, %lu round trips avoided, %lu permanent stored\n",
+			run_stats.redirect_hops, run_stats.redirects_avoided, run_stats.redirects_stored);
+	fprintf(fl, "spool: %lu records, %lu items\n",
+			run_stats.spool_records, run_stats.spool_items);
+	fprintf(fl, "tenants: %lu databases, %lu sources, %lu feeds fetched (%.1fx fewer fetches)\n",
+			run_stats.tenant_dbs, run_stats.tenant_subscriptions, run_stats.tenant_feeds,
+			(run_stats.tenant_feeds) ?
+				(double) run_stats.tenant_subscriptions / run_stats.tenant_feeds : 1.0);
+	fprintf(fl, "caps: %lu bodies over --max-body, %lu items over --max-items, "
+			"%lu descriptions truncated\n",
+			run_stats.bodies_capped, run_stats.items_capped, run_stats.descriptions_capped);
+	for (i = 0; i < n_caps; i++)
+		fprintf(fl, "caps: source #%d: %d bodies, %d items, %d descriptions\n",
+				caps[i].id, caps[i].bodies, caps[i].items, caps[i].descriptions);
+	fprintf(fl, "sanitize cache: %lu hits, %lu misses (%.1f%% hit rate), "
+			"%lu evicted (%llu bytes)\n",
+			run_stats.cache_hits, run_stats.cache_misses,
+			percent(run_stats.cache_hits, lookups),
+			run_stats.cache_evicted, run_stats.cache_evicted_bytes);
+	fprintf(fl, "governor: %lu shrinks, %lu grows, peak rss %lu KiB\n",
+			run_stats.governor_shrinks, run_stats.governor_grows, run_stats.rss_peak);
+	fprintf(fl, "purge: %lu items deleted, %lu too old to add, %lu pages freed, "
+			"%lu pages returned by vacuum\n",
+			run_stats.items_purged, run_stats.items_expired, run_stats.pages_freed, run_stats.pages_vacuumed);
+}
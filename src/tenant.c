@@ -0,0 +1,306 @@
+/**
+ * Selfoss RSS reader micro updater
+ *
+ *   Copyright (C) 2013 Vladimir Ermakov <vooon341@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "selfoss_mupdate.h"
+#include <ctype.h>
+#include <strings.h>
+#include <unistd.h>
+
+/*
+ * Multi-tenant run (--tenants): many selfoss databases, one fetch each.
+ *
+ * Due sources of every database are keyed by normalized feed URL, spout
+ * and the rest of their params, and grouped; the pipeline fetches, parses
+ * and sanitizes one shared feed per group, so every subscriber gets the
+ * items its own spout and params would have made.  Its source id is the group number, not a row of any
+ * database.  The writer fans the result out to every subscribing
+ * source, one transaction per database, where the usual item exists
+ * check keeps each database free of duplicates.  Workers skip an item
+ * early only when all subscribers already have it.
+ */
+
+struct tenant {
+	char *path;
+	sqlite3 *db;		/* writer */
+	sqlite3 *rdb;		/* workers, early duplicate check */
+	struct source *sources;
+	size_t n_sources;
+	int lock_fd;
+};
+
+struct tenant_sub {
+	char *key;		/* normalized url, spout, params but the url */
+	struct tenant *t;
+	struct source *src;
+};
+
+/* subscribers of a shared feed, a range of subs[] */
+struct tenant_feed {
+	size_t first;
+	size_t n;
+};
+
+static struct tenant *tenants;
+static size_t n_tenants, tenants_allocated;
+static struct tenant_sub *subs;
+static size_t n_subs;
+static struct tenant_feed *feeds;
+static struct source *feed_sources;	/* pipeline list, id - 1 indexes feeds */
+static size_t n_feeds;
+
+/* -*- feed key -*- */
+
+/*
+ * Lower case scheme and host, no default port, no fragment, "/" for an
+ * empty path.  Anything else may matter to the server and is kept.
+ */
+static char *url_normalize(const char *url)
+{
+	const char *p, *host, *host_end, *port, *rest;
+	char *key, *k;
+	size_t scheme_len;
+
+	key = malloc(strlen(url) + 2);
+	if (key == NULL)
+		err(1, "out of memory");
+
+	p = strstr(url, "://");
+	if (p == NULL) {
+		strcpy(key, url);
+		k = strchr(key, '#');
+		if (k != NULL)
+			*k = '\0';
+		return key;
+	}
+
+	scheme_len = p - url;
+	host = p + 3;
+	host_end = host + strcspn(host, "/?#");
+	rest = host_end;
+
+	port = memchr(host, ':', host_end - host);
+	if (port != NULL &&
+			((scheme_len == 4 && strncasecmp(url, "http", 4) == 0 &&
+			  host_end - port == 3 && strncmp(port, ":80", 3) == 0) ||
+			 (scheme_len == 5 && strncasecmp(url, "https", 5) == 0 &&
+			  host_end - port == 4 && strncmp(port, ":443", 4) == 0)))
+		host_end = port;
+
+	k = key;
+	for (p = url; p < host_end; p++)
+		*k++ = tolower((unsigned char) *p);
+
+	if (*rest != '/')
+		*k++ = '/';
+	while (*rest != '\0' && *rest != '#')
+		*k++ = *rest++;
+	*k = '\0';
+
+	return key;
+}
+
+static char *sub_key(const struct source *src)
+{
+	char *url, *params, *key;
+
+	url = url_normalize(src->url);
+	params = spout_params_key(src->params);
+	if (asprintf(&key, "%s\n%s\n%s", url, src->spout, params) < 0)
+		err(1, "out of memory");
+
+	free(url);
+	free(params);
+	return key;
+}
+
+static int sub_cmp(const void *a, const void *b)
+{
+	const struct tenant_sub *sa = a, *sb = b;
+
+	return strcmp(sa->key, sb->key);
+}
+
+/* -*- public -*- */
+
+bool tenant_active(void)
+{
+	return feeds != NULL;
+}
+
+/* database joins the run, tenant module owns handles and sources */
+void tenant_add(const char *path, sqlite3 *db, sqlite3 *rdb,
+		struct source *sources, size_t n_sources, int lock_fd)
+{
+	struct tenant *t;
+
+	if (n_tenants == tenants_allocated) {
+		tenants_allocated = (tenants_allocated) ? tenants_allocated * 2 : 16;
+		tenants = realloc(tenants, tenants_allocated * sizeof(*tenants));
+		if (tenants == NULL)
+			err(1, "out of memory");
+	}
+
+	t = &tenants[n_tenants++];
+	t->path = strdup(path);
+	if (t->path == NULL)
+		err(1, "out of memory");
+	t->db = db;
+	t->rdb = rdb;
+	t->sources = sources;
+	t->n_sources = n_sources;
+	t->lock_fd = lock_fd;
+
+	stats_inc(tenant_dbs);
+	stats_add(tenant_subscriptions, n_sources);
+	debug("tenant %s: %zu sources due", path, n_sources);
+}
+
+sqlite3 *tenant_db(size_t i)
+{
+	return (i < n_tenants) ? tenants[i].db : NULL;
+}
+
+/* one source per shared feed for pipeline_run(), freed by tenant_close() */
+struct source *tenant_feeds(size_t *n)
+{
+	size_t i, j, k;
+
+	for (i = 0; i < n_tenants; i++)
+		n_subs += tenants[i].n_sources;
+
+	subs = calloc(n_subs + 1, sizeof(*subs));
+	feeds = calloc(n_subs + 1, sizeof(*feeds));
+	feed_sources = calloc(n_subs + 1, sizeof(*feed_sources));
+	if (subs == NULL || feeds == NULL || feed_sources == NULL)
+		err(1, "out of memory");
+
+	k = 0;
+	for (i = 0; i < n_tenants; i++) {
+		for (j = 0; j < tenants[i].n_sources; j++) {
+			subs[k].t = &tenants[i];
+			subs[k].src = &tenants[i].sources[j];
+			subs[k].key = sub_key(subs[k].src);
+			k++;
+		}
+	}
+
+	qsort(subs, n_subs, sizeof(*subs), sub_cmp);
+
+	for (i = 0; i < n_subs; i = j) {
+		for (j = i + 1; j < n_subs && strcmp(subs[i].key, subs[j].key) == 0; j++)
+			;
+
+		feeds[n_feeds].first = i;
+		feeds[n_feeds].n = j - i;
+
+		/* fields borrowed from the first subscriber */
+		feed_sources[n_feeds] = *subs[i].src;
+		feed_sources[n_feeds].id = n_feeds + 1;
+		feed_sources[n_feeds].reply_fd = -1;
+
+		debug2("feed #%zu %s (%s): %zu subscribers", n_feeds + 1,
+				subs[i].src->url, subs[i].src->spout, j - i);
+		n_feeds++;
+	}
+
+	stats_add(tenant_feeds, n_feeds);
+	debug("%zu tenants, %zu sources, %zu feeds", n_tenants, n_subs, n_feeds);
+
+	*n = n_feeds;
+	return feed_sources;
+}
+
+/* worker stage: known only if every subscriber has the item */
+int tenant_item_exists(const struct feed_job *job, char *uid, bool *exists)
+{
+	const struct tenant_feed *feed = &feeds[job->src->id - 1];
+	size_t i;
+	int rc;
+
+	*exists = false;
+	for (i = feed->first; i < feed->first + feed->n; i++) {
+		rc = db_item_exists(subs[i].t->rdb, uid, exists);
+		if (rc != SQLITE_OK || !*exists)
+			return rc;
+	}
+
+	return SQLITE_OK;
+}
+
+/* writer stage: shared result into every subscriber database */
+void tenant_store(struct feed_job *job)
+{
+	const struct tenant_feed *feed = &feeds[job->src->id - 1];
+	struct feed_job sub_job;
+	sqlite3 *db;
+	size_t i;
+	int n_new = 0;
+
+	for (i = feed->first; i < feed->first + feed->n; i++) {
+		db = subs[i].t->db;
+
+		sub_job = *job;
+		sub_job.src = subs[i].src;
+		sub_job.n_new = 0;
+		sub_job.n_new_unread = 0;
+
+		if (db_exec(db, "BEGIN IMMEDIATE") != SQLITE_OK)
+			errx(1, "%s: BEGIN: %s", subs[i].t->path, sqlite3_errmsg(db));
+
+		pipeline_store(db, &sub_job);
+
+		if (db_exec(db, "COMMIT") != SQLITE_OK)
+			errx(1, "%s: COMMIT: %s", subs[i].t->path, sqlite3_errmsg(db));
+		if (sub_job.rc == 0)
+			thumbnail_request(db, &sub_job);
+
+		debug2("%s: source #%d: %d new items", subs[i].t->path,
+				sub_job.src->id, sub_job.n_new);
+		n_new += sub_job.n_new;
+	}
+
+	job->n_new = n_new;
+}
+
+void tenant_close(void)
+{
+	size_t i;
+
+	for (i = 0; i < n_subs; i++)
+		free(subs[i].key);
+
+	for (i = 0; i < n_tenants; i++) {
+		source_list_free(tenants[i].sources, tenants[i].n_sources);
+		sqlite3_close(tenants[i].rdb);
+		sqlite3_close(tenants[i].db);
+		if (tenants[i].lock_fd >= 0)
+			close(tenants[i].lock_fd);
+		free(tenants[i].path);
+	}
+
+	free(subs);
+	free(feeds);
+	free(feed_sources);
+	free(tenants);
+	subs = NULL;
+	feeds = NULL;
+	feed_sources = NULL;
+	tenants = NULL;
+	n_subs = n_feeds = n_tenants = tenants_allocated = 0;
+}
@@ -0,0 +1,181 @@
+/**
+ * Selfoss RSS reader micro updater
+ *
+ *   Copyright (C) 2013 Vladimir Ermakov <vooon341@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "selfoss_mupdate.h"
+
+/*
+ * Thumbnail stage.
+ *
+ * Images are downloaded only for items the writer has committed, so
+ * items dropped as expired or known never cost a request.  The writer
+ * queues (database, items.id, url) after each source transaction,
+ * thumbnail threads fetch with a time and size cap, and the writer sets
+ * items.thumbnail from the results between transactions.  The queue is
+ * bounded: a slow image host holds the writer, not memory.  Requests
+ * still queued at the run deadline are dropped, the items stay without
+ * a thumbnail.
+ */
+
+struct thumb_req {
+	struct thumb_req *next;
+	sqlite3 *db;
+	sqlite3_int64 item_id;
+	int source_id;
+	char *url;
+	char *name;		/* file name in thumbnails dir */
+};
+
+static struct queue thumb_q;
+static pthread_t *thumb_threads;
+static int thumb_n_threads;	/* 0 - stage not running */
+static time_t thumb_deadline;
+
+static pthread_mutex_t thumb_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct thumb_req *thumb_done;	/* guarded by thumb_lock */
+
+static void thumb_req_free(struct thumb_req *req)
+{
+	free(req->url);
+	free(req->name);
+	free(req);
+}
+
+static void *thumbnail_thread(void *arg)
+{
+	struct thumb_req *req;
+
+	while ((req = queue_pop(&thumb_q)) != NULL) {
+		if (thumb_deadline && time(NULL) >= thumb_deadline) {
+			debug2("thumbnail %s: run deadline reached", req->url);
+			thumb_req_free(req);
+			continue;
+		}
+
+		alloc_stage(ALLOC_FETCH, req->source_id);
+		req->name = fetch_thumbnail(req->url, thumb_deadline);
+		alloc_stage(ALLOC_OTHER, 0);
+		if (req->name == NULL) {
+			thumb_req_free(req);
+			continue;
+		}
+
+		pthread_mutex_lock(&thumb_lock);
+		req->next = thumb_done;
+		thumb_done = req;
+		pthread_mutex_unlock(&thumb_lock);
+	}
+
+	return NULL;
+}
+
+void thumbnail_start(int n_threads, time_t deadline)
+{
+	int i;
+
+	thumb_n_threads = n_threads;
+	thumb_deadline = deadline;
+	queue_init(&thumb_q, n_threads * 4);
+
+	thumb_threads = calloc(n_threads, sizeof(pthread_t));
+	if (thumb_threads == NULL)
+		err(1, "out of memory");
+
+	for (i = 0; i < n_threads; i++)
+		if ((errno = pthread_create(&thumb_threads[i], NULL, thumbnail_thread, NULL)) != 0)
+			err(1, "pthread_create()");
+}
+
+/* writer stage: after the source transaction committed */
+void thumbnail_request(sqlite3 *db, const struct feed_job *job)
+{
+	struct feed_item *fi;
+	struct thumb_req *req;
+
+	/* a replayed run stays off the network */
+	if (thumb_n_threads == 0 || archive_replaying())
+		return;
+
+	for (fi = job->items; fi != NULL; fi = fi->next) {
+		if (fi->id == 0 || fi->thumb_url == NULL)
+			continue;
+
+		req = calloc(1, sizeof(*req));
+		if (req == NULL || (req->url = strdup(fi->thumb_url)) == NULL)
+			err(1, "out of memory");
+		req->db = db;
+		req->item_id = fi->id;
+		req->source_id = job->src->id;
+
+		if (!queue_push(&thumb_q, req))
+			thumb_req_free(req);
+	}
+}
+
+/* writer stage: between source transactions */
+void thumbnail_apply(void)
+{
+	struct thumb_req *list, *req;
+	int rc = SQLITE_OK;
+
+	pthread_mutex_lock(&thumb_lock);
+	list = thumb_done;
+	thumb_done = NULL;
+	pthread_mutex_unlock(&thumb_lock);
+
+	while ((req = list) != NULL) {
+		/* one transaction per run of the same database */
+		rc = db_exec(req->db, "BEGIN IMMEDIATE");
+		for (; rc == SQLITE_OK && list != NULL && list->db == req->db; list = list->next) {
+			rc = db_item_set_thumbnail(list->db, list->item_id, list->name);
+			debug2("item %lld: thumbnail %s", (long long) list->item_id, list->name);
+		}
+		if (rc == SQLITE_OK)
+			rc = db_exec(req->db, "COMMIT");
+		if (rc != SQLITE_OK)
+			errx(1, "thumbnail update failed: %s", sqlite3_errmsg(req->db));
+
+		while (req != list) {
+			struct thumb_req *next = req->next;
+
+			thumb_req_free(req);
+			req = next;
+		}
+	}
+}
+
+/* writer stage: wait for queued requests, store the last results */
+void thumbnail_stop(void)
+{
+	int i;
+
+	if (thumb_n_threads == 0)
+		return;
+
+	queue_close(&thumb_q);
+	for (i = 0; i < thumb_n_threads; i++)
+		pthread_join(thumb_threads[i], NULL);
+
+	thumbnail_apply();
+
+	free(thumb_threads);
+	queue_destroy(&thumb_q);
+	thumb_threads = NULL;
+	thumb_n_threads = 0;
+}
@@ -0,0 +1,473 @@
+/**
+ * Selfoss RSS reader micro updater
+ *
+ *   Copyright (C) 2013 Vladimir Ermakov <vooon341@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "selfoss_mupdate.h"
+#include <iconv.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+#define UTF8_SSSE3
+#endif
+
+/*
+ * UTF-8 validation and repair of fetched bodies.
+ *
+ * Every body goes through utf8_valid() before parsing, so it must be
+ * cheap: on x86 the check is the branchless SSSE3 lookup algorithm of
+ * Keiser and Lemire (16 bytes per step, three nibble tables catch every
+ * bad two-byte pattern, the carry of 3/4 byte sequences is checked with
+ * shifted inputs), selected at run time; elsewhere a scalar check with
+ * a word-at-a-time ASCII skip.
+ *
+ * Repair is for the rare invalid body: valid sequences are kept, runs of
+ * invalid bytes are decoded from a guessed single-byte charset (feeds
+ * mixing UTF-8 and cp1251 do exist), or replaced by U+FFFD.
+ */
+
+#define REPLACEMENT_CHAR	"\xef\xbf\xbd"
+
+/* -*- scalar -*- */
+
+/* length of a valid sequence at s, 0 if invalid (Unicode table 3-7) */
+static size_t utf8_seq_len(const unsigned char *s, size_t len)
+{
+	unsigned char c = s[0];
+
+	if (c < 0x80)
+		return 1;
+
+	if (c >= 0xc2 && c <= 0xdf) {
+		if (len >= 2 && (s[1] & 0xc0) == 0x80)
+			return 2;
+	}
+	else if (c >= 0xe0 && c <= 0xef) {
+		if (len >= 3 && (s[1] & 0xc0) == 0x80 && (s[2] & 0xc0) == 0x80 &&
+				(c != 0xe0 || s[1] >= 0xa0) &&		/* overlong */
+				(c != 0xed || s[1] < 0xa0))		/* surrogate */
+			return 3;
+	}
+	else if (c >= 0xf0 && c <= 0xf4) {
+		if (len >= 4 && (s[1] & 0xc0) == 0x80 && (s[2] & 0xc0) == 0x80 &&
+				(s[3] & 0xc0) == 0x80 &&
+				(c != 0xf0 || s[1] >= 0x90) &&		/* overlong */
+				(c != 0xf4 || s[1] < 0x90))		/* > U+10FFFF */
+			return 4;
+	}
+
+	return 0;
+}
+
+static size_t ascii_prefix(const unsigned char *s, size_t len)
+{
+	uint64_t w;
+	size_t i = 0;
+
+	for (; i + 8 <= len; i += 8) {
+		memcpy(&w, s + i, 8);
+		if (w & 0x8080808080808080ULL)
+			break;
+	}
+	while (i < len && s[i] < 0x80)
+		i++;
+
+	return i;
+}
+
+static bool utf8_valid_scalar(const char *str, size_t len)
+{
+	const unsigned char *s = (const unsigned char *) str;
+	size_t i = 0, n;
+
+	while (i < len) {
+		i += ascii_prefix(s + i, len - i);
+		if (i == len)
+			break;
+
+		n = utf8_seq_len(s + i, len - i);
+		if (n == 0)
+			return false;
+		i += n;
+	}
+
+	return true;
+}
+
+/* -*- SSSE3 -*- */
+
+#ifdef UTF8_SSSE3
+
+/* error classes of a (previous byte, current byte) pair */
+#define TOO_SHORT	(1 << 0)	/* lead not followed by continuation */
+#define TOO_LONG	(1 << 1)	/* continuation after ASCII */
+#define OVERLONG_3	(1 << 2)
+#define TOO_LARGE	(1 << 3)
+#define SURROGATE	(1 << 4)
+#define OVERLONG_2	(1 << 5)
+#define TOO_LARGE_1000	(1 << 6)
+#define OVERLONG_4	(1 << 6)
+#define TWO_CONTS	(1 << 7)	/* checked against the 3/4 byte carry */
+#define CARRY		(TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+__attribute__((target("ssse3")))
+static __m128i ssse3_prev(__m128i input, __m128i prev_input, int n)
+{
+	switch (n) {
+		case 1: return _mm_alignr_epi8(input, prev_input, 15);
+		case 2: return _mm_alignr_epi8(input, prev_input, 14);
+		default: return _mm_alignr_epi8(input, prev_input, 13);
+	}
+}
+
+__attribute__((target("ssse3")))
+static __m128i ssse3_check(__m128i input, __m128i prev_input)
+{
+	const __m128i nibble = _mm_set1_epi8(0x0f);
+	const __m128i byte_1_high_tbl = _mm_setr_epi8(
+		/* 0xxx ASCII */
+		TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+		TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+		/* 10xx continuation */
+		TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+		/* 1100 */
+		TOO_SHORT | OVERLONG_2,
+		/* 1101 */
+		TOO_SHORT,
+		/* 1110 */
+		TOO_SHORT | OVERLONG_3 | SURROGATE,
+		/* 1111 */
+		TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4);
+	const __m128i byte_1_low_tbl = _mm_setr_epi8(
+		CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+		CARRY | OVERLONG_2,
+		CARRY,
+		CARRY,
+		CARRY | TOO_LARGE,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000);
+	const __m128i byte_2_high_tbl = _mm_setr_epi8(
+		/* 0xxx ASCII */
+		TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+		TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+		/* 1000 */
+		TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+		/* 1001 */
+		TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+		/* 101x */
+		TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+		TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+		/* 11xx */
+		TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT);
+	__m128i prev1, prev2, prev3, sc, must23;
+
+	prev1 = ssse3_prev(input, prev_input, 1);
+
+	/* no 8-bit shift in SSE: shift 16-bit lanes and mask */
+	sc = _mm_shuffle_epi8(byte_1_high_tbl, _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble));
+	sc = _mm_and_si128(sc, _mm_shuffle_epi8(byte_1_low_tbl, _mm_and_si128(prev1, nibble)));
+	sc = _mm_and_si128(sc, _mm_shuffle_epi8(byte_2_high_tbl,
+				_mm_and_si128(_mm_srli_epi16(input, 4), nibble)));
+
+	/* third/fourth byte of a sequence must be a continuation */
+	prev2 = ssse3_prev(input, prev_input, 2);
+	prev3 = ssse3_prev(input, prev_input, 3);
+	must23 = _mm_or_si128(_mm_subs_epu8(prev2, _mm_set1_epi8((char) (0xe0 - 1))),
+			_mm_subs_epu8(prev3, _mm_set1_epi8((char) (0xf0 - 1))));
+	must23 = _mm_and_si128(_mm_cmpgt_epi8(must23, _mm_setzero_si128()),
+			_mm_set1_epi8((char) 0x80));
+
+	return _mm_xor_si128(must23, sc);
+}
+
+/* last bytes of the block start a sequence that continues in the next */
+__attribute__((target("ssse3")))
+static __m128i ssse3_incomplete(__m128i input)
+{
+	const __m128i max = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1,
+			-1, -1, -1, -1, -1, (char) (0xf0 - 1), (char) (0xe0 - 1), (char) (0xc0 - 1));
+
+	return _mm_subs_epu8(input, max);
+}
+
+__attribute__((target("ssse3")))
+static bool utf8_valid_ssse3(const char *s, size_t len)
+{
+	__m128i input, prev_input = _mm_setzero_si128();
+	__m128i error = _mm_setzero_si128(), prev_incomplete = _mm_setzero_si128();
+	char tail[16];
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		input = _mm_loadu_si128((const __m128i *) (s + i));
+
+		if (_mm_movemask_epi8(input) == 0) {
+			/* ASCII block: only an unfinished sequence before it is wrong */
+			error = _mm_or_si128(error, prev_incomplete);
+		}
+		else {
+			error = _mm_or_si128(error, ssse3_check(input, prev_input));
+			prev_incomplete = ssse3_incomplete(input);
+		}
+		prev_input = input;
+	}
+
+	/* zero padding terminates any open sequence with an error */
+	memset(tail, 0, sizeof(tail));
+	memcpy(tail, s + i, len - i);
+	input = _mm_loadu_si128((const __m128i *) tail);
+	error = _mm_or_si128(error, ssse3_check(input, prev_input));
+	error = _mm_or_si128(error, ssse3_incomplete(input));
+
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) == 0xffff;
+}
+
+#endif /* UTF8_SSSE3 */
+
+bool utf8_valid(const char *s, size_t len)
+{
+#ifdef UTF8_SSSE3
+	if (__builtin_cpu_supports("ssse3"))
+		return utf8_valid_ssse3(s, len);
+#endif
+	return utf8_valid_scalar(s, len);
+}
+
+/* -*- charset guess -*- */
+
+/*
+ * For bytes that are not UTF-8 (valid sequences are skipped, for mixed
+ * bodies).  In Cyrillic text high bytes come in runs, whole words of
+ * them; in western text they are single accented letters between ASCII
+ * ones.  cp1251 and koi8-r both keep letters in 0xc0-0xff, but with lower
+ * and upper case swapped, and running text is mostly lower case.
+ * NULL if there is nothing to guess from.
+ */
+const char *utf8_guess_charset(const char *str, size_t len)
+{
+	const unsigned char *s = (const unsigned char *) str;
+	size_t high = 0, in_run = 0, c0_df = 0, e0_ff = 0;
+	size_t i = 0, n;
+	bool prev_high = false;
+
+	while (i < len) {
+		if (s[i] < 0x80) {
+			prev_high = false;
+			i++;
+			continue;
+		}
+
+		if ((n = utf8_seq_len(s + i, len - i)) > 0) {
+			prev_high = false;
+			i += n;
+			continue;
+		}
+
+		high++;
+		if (prev_high)
+			in_run++;
+		if (s[i] >= 0xe0)
+			e0_ff++;
+		else if (s[i] >= 0xc0)
+			c0_df++;
+		prev_high = true;
+		i++;
+	}
+
+	if (high == 0)
+		return NULL;
+
+	if (in_run * 2 >= high && (c0_df + e0_ff) * 10 >= high * 6)
+		return (e0_ff >= c0_df) ? "windows-1251" : "koi8-r";
+
+	return "windows-1252";
+}
+
+/* -*- repair -*- */
+
+struct utf8_buf {
+	char *data;
+	size_t len;
+	size_t allocated;
+};
+
+static void buf_reserve(struct utf8_buf *b, size_t n)
+{
+	if (b->len + n + 1 <= b->allocated)
+		return;
+
+	while (b->len + n + 1 > b->allocated)
+		b->allocated = (b->allocated) ? b->allocated * 2 : 4096;
+	b->data = realloc(b->data, b->allocated);
+	if (b->data == NULL)
+		err(1, "out of memory");
+}
+
+static void buf_append(struct utf8_buf *b, const void *p, size_t n)
+{
+	buf_reserve(b, n);
+	memcpy(b->data + b->len, p, n);
+	b->len += n;
+}
+
+static void repair_run(struct utf8_buf *b, iconv_t cd, const unsigned char *s, size_t n)
+{
+	char *in, *out;
+	size_t in_left, out_left;
+
+	if (cd != (iconv_t) -1) {
+		/* single-byte charsets: at most 3 UTF-8 bytes per byte */
+		buf_reserve(b, n * 3);
+		in = (char *) s;
+		in_left = n;
+		out = b->data + b->len;
+		out_left = n * 3;
+
+		iconv(cd, NULL, NULL, NULL, NULL);
+		if (iconv(cd, &in, &in_left, &out, &out_left) != (size_t) -1) {
+			b->len = out - b->data;
+			return;
+		}
+		/* byte without mapping, drop partial output */
+	}
+
+	while (n-- > 0)
+		buf_append(b, REPLACEMENT_CHAR, sizeof(REPLACEMENT_CHAR) - 1);
+}
+
+/* new NUL terminated string, valid UTF-8; charset NULL - U+FFFD only */
+char *utf8_repair(const char *str, size_t len, const char *charset, size_t *out_len)
+{
+	const unsigned char *s = (const unsigned char *) str;
+	struct utf8_buf b = { NULL, 0, 0 };
+	iconv_t cd = (iconv_t) -1;
+	size_t i = 0, n, bad;
+
+	if (charset != NULL) {
+		cd = iconv_open("utf-8", charset);
+		if (cd == (iconv_t) -1)
+			debug("iconv_open(utf-8, %s): %s", charset, strerror(errno));
+	}
+
+	buf_reserve(&b, len);
+
+	while (i < len) {
+		n = ascii_prefix(s + i, len - i);
+		buf_append(&b, s + i, n);
+		i += n;
+		if (i == len)
+			break;
+
+		if ((n = utf8_seq_len(s + i, len - i)) > 0) {
+			buf_append(&b, s + i, n);
+			i += n;
+			continue;
+		}
+
+		for (bad = 1; i + bad < len && s[i + bad] >= 0x80 &&
+				utf8_seq_len(s + i + bad, len - i - bad) == 0; bad++)
+			;
+		repair_run(&b, cd, s + i, bad);
+		i += bad;
+	}
+
+	if (cd != (iconv_t) -1)
+		iconv_close(cd);
+
+	b.data[b.len] = '\0';
+	if (out_len != NULL)
+		*out_len = b.len;
+
+	return b.data;
+}
+
+/* -*- benchmark -*- */
+
+static double bench_gbps(bool (*check)(const char *, size_t), const char *s, size_t len,
+		bool *valid)
+{
+	struct timespec t0, t1;
+	double sec;
+	long reps = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	do {
+		*valid = check(s, len);
+		reps++;
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	} while (sec < 0.5);
+
+	return (double) len * reps / sec / 1e9;
+}
+
+/* --utf8-bench: throughput on a file, e.g. a --record archive */
+int utf8_bench(const char *path, FILE *fl)
+{
+	struct stat st;
+	char *data;
+	size_t off = 0;
+	ssize_t n;
+	bool valid;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		warn("%s", path);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	data = malloc(st.st_size + 1);
+	if (data == NULL)
+		err(1, "out of memory");
+
+	while (off < (size_t) st.st_size && (n = read(fd, data + off, st.st_size - off)) > 0)
+		off += n;
+	close(fd);
+
+	if (off == 0) {
+		warnx("%s: empty", path);
+		free(data);
+		return -1;
+	}
+
+	fprintf(fl, "corpus:\t\t%zu bytes\n", off);
+	fprintf(fl, "scalar:\t\t%.2f GB/s\n", bench_gbps(utf8_valid_scalar, data, off, &valid));
+#ifdef UTF8_SSSE3
+	if (__builtin_cpu_supports("ssse3"))
+		fprintf(fl, "ssse3:\t\t%.2f GB/s\n", bench_gbps(utf8_valid_ssse3, data, off, &valid));
+#endif
+	if (!valid)
+		fprintf(fl, "not valid UTF-8, looks like %s\n", utf8_guess_charset(data, off));
+
+	free(data);
+	return 0;
+}